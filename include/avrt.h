@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * avrt.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __AVRT_H__
+#define __AVRT_H__
+
+#include <stdint.h>
+
+typedef enum _AVRT_PRIORITY {
+	AVRT_PRIORITY_VERYLOW = -2,
+	AVRT_PRIORITY_LOW,
+	AVRT_PRIORITY_NORMAL,
+	AVRT_PRIORITY_HIGH,
+	AVRT_PRIORITY_CRITICAL
+} AVRT_PRIORITY, *PAVRT_PRIORITY;
+
+#ifndef ERROR_INVALID_TASK_NAME
+#define ERROR_INVALID_TASK_NAME		1550
+#define ERROR_INVALID_TASK_INDEX	1551
+#endif
+
+// _createmutexex flag: the mutex uses priority inheritance (PTHREAD_PRIO_INHERIT),
+// a real-time thread waiting for it boosts the owner
+#define CREATE_MUTEX_PRIORITY_INHERIT	0x80000000
+
+#endif //__AVRT_H__
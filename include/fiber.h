@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * fiber.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __FIBER_H__
+#define __FIBER_H__
+
+#define FIBER_FLAG_FLOAT_SWITCH		0x1		//the floating point state is always switched
+
+#define FLS_MAXIMUM_AVAILABLE		128
+#define FLS_OUT_OF_INDEXES			((unsigned)0xFFFFFFFF)
+
+#ifndef ERROR_ALREADY_FIBER
+#define ERROR_ALREADY_FIBER			1280
+#define ERROR_ALREADY_THREAD		1281
+#endif
+
+typedef void (*LPFIBER_START_ROUTINE)( void *param );
+typedef void (*PFLS_CALLBACK_FUNCTION)( void *data );
+
+#endif //__FIBER_H__
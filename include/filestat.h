@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * filestat.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __FILESTAT_H__
+#define __FILESTAT_H__
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// the modification time with nanoseconds, st_mtim is not on Darwin
+static inline
+struct timespec _getstatmtime (const struct stat *st)
+{
+#if defined __MACH__ && !defined _POSIX_C_SOURCE
+	return st->st_mtimespec;
+#elif defined __MACH__
+	struct timespec ts = { st->st_mtime, st->st_mtimensec };
+	return ts;
+#else
+	return st->st_mtim;
+#endif
+}
+
+static inline
+bool _samestatmtime (const struct stat *st, const struct timespec *mtime)
+{
+	struct timespec ts = _getstatmtime (st);
+
+	return ts.tv_sec == mtime->tv_sec && ts.tv_nsec == mtime->tv_nsec;
+}
+
+#endif //__FILESTAT_H__
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * futex.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __FUTEX_H__
+#define __FUTEX_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#if defined __linux__
+# include <unistd.h>
+# include <syscall.h>
+# include <linux/futex.h>
+#elif defined __MACH__
+// private Darwin interface, also used by libc++
+extern int __ulock_wait( uint32_t operation, void *addr, uint64_t value, uint32_t timeout_us );
+extern int __ulock_wake( uint32_t operation, void *addr, uint64_t wake_value );
+# define UL_COMPARE_AND_WAIT	1
+# define UL_COMPARE_AND_WAIT_SHARED	3
+# define ULF_WAKE_ALL			0x00000100
+#endif
+
+// spin-wait hint
+static inline
+void cpu_relax( void )
+{
+#if defined __x86_64__ || defined __i386__
+	__asm__ __volatile__ ("pause" ::: "memory");
+#elif defined __aarch64__
+	__asm__ __volatile__ ("yield" ::: "memory");
+#else
+	__asm__ __volatile__ ("" ::: "memory");
+#endif
+}
+
+// wait while *addr == val, the timeout is relative; returns 0, or -1 with errno (ETIMEDOUT, EAGAIN, EINTR)
+static inline
+int futex_wait( volatile int *addr, int val, const struct timespec *timeout )
+{
+#if defined __linux__
+	return (int) syscall (SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+#elif defined __MACH__
+	uint32_t us = (timeout ? (uint32_t)(timeout->tv_sec * 1000000 + timeout->tv_nsec / 1000) : 0);
+	int rc;
+
+	if (timeout && us == 0) us = 1;
+	rc = __ulock_wait (UL_COMPARE_AND_WAIT, (void*)addr, (uint64_t)val, us);
+	return (rc < 0 ? -1 : 0);
+#else
+# error futex_wait not implemented for your platform
+#endif
+}
+
+// wake up to n waiters, INT32_MAX wakes all
+static inline
+int futex_wake( volatile int *addr, int n )
+{
+#if defined __linux__
+	return (int) syscall (SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#elif defined __MACH__
+	return __ulock_wake (UL_COMPARE_AND_WAIT | (n > 1 ? ULF_WAKE_ALL : 0), (void*)addr, 0);
+#else
+# error futex_wake not implemented for your platform
+#endif
+}
+
+// the same for a futex in memory shared between processes
+static inline
+int futex_wait_shared( volatile int *addr, int val, const struct timespec *timeout )
+{
+#if defined __linux__
+	return (int) syscall (SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+#elif defined __MACH__
+	uint32_t us = (timeout ? (uint32_t)(timeout->tv_sec * 1000000 + timeout->tv_nsec / 1000) : 0);
+	int rc;
+
+	if (timeout && us == 0) us = 1;
+	rc = __ulock_wait (UL_COMPARE_AND_WAIT_SHARED, (void*)addr, (uint64_t)val, us);
+	return (rc < 0 ? -1 : 0);
+#else
+# error futex_wait_shared not implemented for your platform
+#endif
+}
+
+static inline
+int futex_wake_shared( volatile int *addr, int n )
+{
+#if defined __linux__
+	return (int) syscall (SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+#elif defined __MACH__
+	return __ulock_wake (UL_COMPARE_AND_WAIT_SHARED | (n > 1 ? ULF_WAKE_ALL : 0), (void*)addr, 0);
+#else
+# error futex_wake_shared not implemented for your platform
+#endif
+}
+
+#endif //__FUTEX_H__
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * libloader.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __LIBLOADER_H__
+#define __LIBLOADER_H__
+
+// _loadlibraryex flags
+#ifndef DONT_RESOLVE_DLL_REFERENCES
+#define DONT_RESOLVE_DLL_REFERENCES			0x00000001
+#define LOAD_LIBRARY_AS_DATAFILE			0x00000002
+#define LOAD_WITH_ALTERED_SEARCH_PATH		0x00000008
+#define LOAD_IGNORE_CODE_AUTHZ_LEVEL		0x00000010
+#define LOAD_LIBRARY_AS_IMAGE_RESOURCE		0x00000020
+#define LOAD_LIBRARY_AS_DATAFILE_EXCLUSIVE	0x00000040
+#define LOAD_LIBRARY_REQUIRE_SIGNED_TARGET	0x00000080
+#define LOAD_LIBRARY_SEARCH_DLL_LOAD_DIR	0x00000100
+#define LOAD_LIBRARY_SEARCH_APPLICATION_DIR	0x00000200
+#define LOAD_LIBRARY_SEARCH_USER_DIRS		0x00000400
+#define LOAD_LIBRARY_SEARCH_SYSTEM32		0x00000800
+#define LOAD_LIBRARY_SEARCH_DEFAULT_DIRS	0x00001000
+#define LOAD_LIBRARY_SAFE_CURRENT_DIRS		0x00002000
+#endif
+#define LOAD_LIBRARY_LAZY_BINDING			0x01000000	//4nix: RTLD_LAZY instead of RTLD_NOW
+
+// the low bits of a module handle mapped as a file
+#define LDR_IS_DATAFILE(h)		(((uintptr_t)(h)) & (uintptr_t)1)
+#define LDR_IS_IMAGEMAPPING(h)	(((uintptr_t)(h)) & (uintptr_t)2)
+#define LDR_IS_RESOURCE(h)		(LDR_IS_IMAGEMAPPING(h) || LDR_IS_DATAFILE(h))
+
+// _getmodulehandleex flags
+#ifndef GET_MODULE_HANDLE_EX_FLAG_PIN
+#define GET_MODULE_HANDLE_EX_FLAG_PIN					0x00000001
+#define GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT	0x00000002
+#define GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS			0x00000004
+#endif
+
+// _enumprocessmodulesex filters
+#ifndef LIST_MODULES_DEFAULT
+#define LIST_MODULES_DEFAULT		0x00
+#define LIST_MODULES_32BIT			0x01
+#define LIST_MODULES_64BIT			0x02
+#define LIST_MODULES_ALL			0x03
+#endif
+
+// _getprocaddresses flags
+#define BIND_PROC_USE_CACHE			0x00000001	//keep the bound table in the user cache directory
+
+#ifndef ERROR_BAD_EXE_FORMAT
+#define ERROR_BAD_EXE_FORMAT		193
+#endif
+
+#endif //__LIBLOADER_H__
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * namedpipe.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __NAMEDPIPE_H__
+#define __NAMEDPIPE_H__
+
+#include <stdint.h>
+
+// open mode
+#define PIPE_ACCESS_INBOUND			0x00000001
+#define PIPE_ACCESS_OUTBOUND		0x00000002
+#define PIPE_ACCESS_DUPLEX			0x00000003
+#define FILE_FLAG_FIRST_PIPE_INSTANCE	0x00080000
+#ifndef GENERIC_READ
+#define GENERIC_READ				0x80000000
+#define GENERIC_WRITE				0x40000000
+#endif
+#ifndef FILE_FLAG_OVERLAPPED
+#define FILE_FLAG_OVERLAPPED		0x40000000
+#endif
+
+// pipe mode
+#define PIPE_WAIT					0x00000000
+#define PIPE_NOWAIT					0x00000001
+#define PIPE_READMODE_BYTE			0x00000000
+#define PIPE_READMODE_MESSAGE		0x00000002
+#define PIPE_TYPE_BYTE				0x00000000
+#define PIPE_TYPE_MESSAGE			0x00000004
+#define PIPE_ACCEPT_REMOTE_CLIENTS	0x00000000
+#define PIPE_REJECT_REMOTE_CLIENTS	0x00000008
+
+#define PIPE_UNLIMITED_INSTANCES	255
+
+#define NMPWAIT_USE_DEFAULT_WAIT	0x00000000
+#define NMPWAIT_NOWAIT				0x00000001
+#define NMPWAIT_WAIT_FOREVER		0xFFFFFFFF
+
+#ifndef ERROR_BROKEN_PIPE
+#define ERROR_BROKEN_PIPE	109
+#endif
+#ifndef ERROR_SEM_TIMEOUT
+#define ERROR_SEM_TIMEOUT	121
+#endif
+#ifndef ERROR_BUSY
+#define ERROR_BUSY			170
+#endif
+#ifndef ERROR_BAD_PATHNAME
+#define ERROR_BAD_PATHNAME	161
+#endif
+#ifndef ERROR_BAD_PIPE
+#define ERROR_BAD_PIPE		230
+#endif
+#ifndef ERROR_PIPE_BUSY
+#define ERROR_PIPE_BUSY		231
+#endif
+#ifndef ERROR_NO_DATA
+#define ERROR_NO_DATA		232
+#endif
+#ifndef ERROR_PIPE_NOT_CONNECTED
+#define ERROR_PIPE_NOT_CONNECTED	233
+#endif
+#ifndef ERROR_MORE_DATA
+#define ERROR_MORE_DATA		234
+#endif
+#ifndef ERROR_PIPE_CONNECTED
+#define ERROR_PIPE_CONNECTED	535
+#endif
+#ifndef ERROR_PIPE_LISTENING
+#define ERROR_PIPE_LISTENING	536
+#endif
+#ifndef ERROR_IO_PENDING
+#define ERROR_IO_PENDING			997
+#endif
+#ifndef ERROR_IO_INCOMPLETE
+#define ERROR_IO_INCOMPLETE			996
+#endif
+
+#ifndef HasOverlappedIoCompleted
+#define STATUS_PENDING				0x00000103
+
+typedef struct _OVERLAPPED {
+	uintptr_t Internal;			//STATUS_PENDING, then the error code
+	uintptr_t InternalHigh;		//bytes transferred
+	unsigned Offset;
+	unsigned OffsetHigh;
+	uintptr_t hEvent;
+} OVERLAPPED, *LPOVERLAPPED;
+
+#define HasOverlappedIoCompleted(ov)	((ov)->Internal != STATUS_PENDING)
+#endif
+
+#endif //__NAMEDPIPE_H__
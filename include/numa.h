@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * numa.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <stdint.h>
+
+#define NUMA_NO_PREFERRED_NODE	((unsigned)-1)
+
+#define LTP_PC_SMT				0x1
+
+typedef struct _GROUP_AFFINITY {
+	uintptr_t Mask;			//KAFFINITY
+	unsigned short Group;
+	unsigned short Reserved[3];
+} GROUP_AFFINITY, *PGROUP_AFFINITY;
+
+typedef enum _LOGICAL_PROCESSOR_RELATIONSHIP {
+	RelationProcessorCore,
+	RelationNumaNode,
+	RelationCache,
+	RelationProcessorPackage,
+	RelationGroup,
+	RelationAll = 0xffff
+} LOGICAL_PROCESSOR_RELATIONSHIP;
+
+typedef struct _PROCESSOR_RELATIONSHIP {
+	unsigned char Flags;
+	unsigned char EfficiencyClass;
+	unsigned char Reserved[20];
+	unsigned short GroupCount;
+	GROUP_AFFINITY GroupMask[1];
+} PROCESSOR_RELATIONSHIP, *PPROCESSOR_RELATIONSHIP;
+
+typedef struct _NUMA_NODE_RELATIONSHIP {
+	unsigned NodeNumber;
+	unsigned char Reserved[20];
+	GROUP_AFFINITY GroupMask;
+} NUMA_NODE_RELATIONSHIP, *PNUMA_NODE_RELATIONSHIP;
+
+typedef struct _PROCESSOR_GROUP_INFO {
+	unsigned char MaximumProcessorCount;
+	unsigned char ActiveProcessorCount;
+	unsigned char Reserved[38];
+	uintptr_t ActiveProcessorMask;
+} PROCESSOR_GROUP_INFO, *PPROCESSOR_GROUP_INFO;
+
+typedef struct _GROUP_RELATIONSHIP {
+	unsigned short MaximumGroupCount;
+	unsigned short ActiveGroupCount;
+	unsigned char Reserved[20];
+	PROCESSOR_GROUP_INFO GroupInfo[1];
+} GROUP_RELATIONSHIP, *PGROUP_RELATIONSHIP;
+
+typedef struct _SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX {
+	LOGICAL_PROCESSOR_RELATIONSHIP Relationship;
+	unsigned Size;
+	union {
+		PROCESSOR_RELATIONSHIP Processor;
+		NUMA_NODE_RELATIONSHIP NumaNode;
+		GROUP_RELATIONSHIP Group;
+	};
+} SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX, *PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX;
+
+#endif //__NUMA_H__
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * pathname.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __PATHNAME_H__
+#define __PATHNAME_H__
+
+// _getfullpathnameex flags (4nix)
+#define FULL_PATH_NAME_LEXICAL			0x00000000	//as GetFullPathName, the file system is not asked
+#define FULL_PATH_NAME_RESOLVE_LINKS	0x00000001	//the symbolic links are resolved, as realpath
+
+// _setpathnametranslation flags (4nix)
+#define PATH_NAME_TRANSLATE_NONE		0x00000000	//the names are POSIX ones
+#define PATH_NAME_TRANSLATE_WINDOWS		0x00000001	//names with a drive letter or a backslash, the default
+#define PATH_NAME_TRANSLATE_ALL			0x00000002	//every name is matched ignoring the case
+
+// _checknamelegalbatch flags (4nix)
+#define CHECK_NAME_DOS8DOT3				0x00000001	//count the legal 8.3 names, the default
+#define CHECK_NAME_LONG					0x00000002	//count the legal long names
+#define CHECK_NAME_ALLOW_SPACES			0x00000004	//8.3 names may hold spaces
+#define CHECK_NAME_QUERY_FILE_SYSTEM	0x00000008	//each name is looked up
+
+// _checknamelegalbatch classes (4nix)
+#define NAME_LEGAL_DOS8DOT3				0x01
+#define NAME_LEGAL_LONG					0x02
+#define NAME_CONTAINS_SPACES			0x04
+#define NAME_EXISTS						0x08		//CHECK_NAME_QUERY_FILE_SYSTEM only
+#define NAME_IS_DIRECTORY				0x10		//CHECK_NAME_QUERY_FILE_SYSTEM only
+
+#ifndef ERROR_FILENAME_EXCED_RANGE
+#define ERROR_FILENAME_EXCED_RANGE		206
+#endif
+#ifndef ERROR_CANT_RESOLVE_FILENAME
+#define ERROR_CANT_RESOLVE_FILENAME		1921
+#endif
+
+#endif //__PATHNAME_H__
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * processthreads.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __PROCESSTHREADS_H__
+#define __PROCESSTHREADS_H__
+
+#include <stdint.h>
+
+// process creation flags
+#define DEBUG_PROCESS				0x00000001
+#define DEBUG_ONLY_THIS_PROCESS		0x00000002
+#ifndef CREATE_SUSPENDED
+#define CREATE_SUSPENDED			0x00000004
+#endif
+#define DETACHED_PROCESS			0x00000008
+#define CREATE_NEW_CONSOLE			0x00000010
+#define CREATE_NEW_PROCESS_GROUP	0x00000200
+#define CREATE_UNICODE_ENVIRONMENT	0x00000400
+#define CREATE_NO_WINDOW			0x08000000
+
+#ifndef STARTF_USESTDHANDLES
+#define STARTF_USESHOWWINDOW		0x00000001
+#define STARTF_USESTDHANDLES		0x00000100
+
+typedef struct _STARTUPINFOA {
+	unsigned cb;
+	char *lpReserved;
+	char *lpDesktop;
+	char *lpTitle;
+	unsigned dwX;
+	unsigned dwY;
+	unsigned dwXSize;
+	unsigned dwYSize;
+	unsigned dwXCountChars;
+	unsigned dwYCountChars;
+	unsigned dwFillAttribute;
+	unsigned dwFlags;
+	unsigned short wShowWindow;
+	unsigned short cbReserved2;
+	unsigned char *lpReserved2;
+	uintptr_t hStdInput;
+	uintptr_t hStdOutput;
+	uintptr_t hStdError;
+} STARTUPINFOA, *LPSTARTUPINFOA;
+
+typedef struct _PROCESS_INFORMATION {
+	uintptr_t hProcess;
+	uintptr_t hThread;
+	unsigned dwProcessId;
+	unsigned dwThreadId;
+} PROCESS_INFORMATION, *LPPROCESS_INFORMATION;
+#endif
+
+#define PROCESS_TERMINATE			0x0001
+#define PROCESS_QUERY_INFORMATION	0x0400
+#define PROCESS_QUERY_LIMITED_INFORMATION	0x1000
+#define SYNCHRONIZE					0x00100000
+
+#endif //__PROCESSTHREADS_H__
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * symbols.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __SYMBOLS_H__
+#define __SYMBOLS_H__
+
+#include <stdint.h>
+
+#ifndef MAX_SYM_NAME
+#define MAX_SYM_NAME		2000
+
+typedef struct _SYMBOL_INFO {
+	unsigned SizeOfStruct;
+	unsigned TypeIndex;
+	uint64_t Reserved[2];
+	unsigned Index;
+	unsigned Size;
+	uint64_t ModBase;			//the module handle
+	unsigned Flags;
+	uint64_t Value;
+	uint64_t Address;
+	unsigned Register;
+	unsigned Scope;
+	unsigned Tag;
+	unsigned NameLen;
+	unsigned MaxNameLen;
+	char Name[1];
+} SYMBOL_INFO, *PSYMBOL_INFO;
+#endif
+
+#ifndef SymTagFunction
+#define SymTagFunction		5
+#endif
+
+// 4nix: an address resolved without copying, valid while its module is loaded
+typedef struct _SYMBOL_ADDRESS {
+	uintptr_t hModule;
+	const char *ModuleName;		//the base name of the module file
+	const char *SymbolName;		//NULL outside of any known symbol
+	uintptr_t SymbolAddress;
+	uintptr_t Offset;			//from the symbol, or from the module base
+} SYMBOL_ADDRESS, *PSYMBOL_ADDRESS;
+
+#endif //__SYMBOLS_H__
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * toolhelp.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __TOOLHELP_H__
+#define __TOOLHELP_H__
+
+#define TH32CS_SNAPHEAPLIST		0x00000001
+#define TH32CS_SNAPPROCESS		0x00000002
+#define TH32CS_SNAPTHREAD		0x00000004
+#define TH32CS_SNAPMODULE		0x00000008
+#define TH32CS_SNAPMODULE32		0x00000010
+#define TH32CS_SNAPALL			(TH32CS_SNAPHEAPLIST|TH32CS_SNAPPROCESS|TH32CS_SNAPTHREAD|TH32CS_SNAPMODULE)
+#define TH32CS_INHERIT			0x80000000
+
+typedef struct tagTHREADENTRY32 {
+	unsigned dwSize;
+	unsigned cntUsage;
+	unsigned th32ThreadID;
+	unsigned th32OwnerProcessID;
+	int tpBasePri;
+	int tpDeltaPri;
+	unsigned dwFlags;
+} THREADENTRY32, *PTHREADENTRY32, *LPTHREADENTRY32;
+
+#endif //__TOOLHELP_H__
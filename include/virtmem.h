@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * virtmem.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __VIRTMEM_H__
+#define __VIRTMEM_H__
+
+#include <stddef.h>
+
+// allocation types
+#ifndef MEM_COMMIT
+#define MEM_COMMIT              0x00001000
+#define MEM_RESERVE             0x00002000
+#define MEM_DECOMMIT            0x00004000
+#define MEM_RELEASE             0x00008000
+#define MEM_FREE                0x00010000
+#define MEM_PRIVATE             0x00020000
+#define MEM_RESET               0x00080000
+#define MEM_TOP_DOWN            0x00100000
+#define MEM_LARGE_PAGES         0x20000000
+#endif
+
+// memory protection constants
+#ifndef PAGE_NOACCESS
+#define PAGE_NOACCESS           0x001
+#define PAGE_READONLY           0x002
+#define PAGE_READWRITE          0x004
+#define PAGE_WRITECOPY          0x008
+#define PAGE_EXECUTE            0x010
+#define PAGE_EXECUTE_READ       0x020
+#define PAGE_EXECUTE_READWRITE  0x040
+#define PAGE_EXECUTE_WRITECOPY  0x080
+#define PAGE_GUARD              0x100
+#define PAGE_NOCACHE            0x200
+#define PAGE_WRITECOMBINE       0x400
+#endif
+
+typedef struct _MEMORY_BASIC_INFORMATION {
+	void *BaseAddress;
+	void *AllocationBase;
+	unsigned AllocationProtect;
+	size_t RegionSize;
+	unsigned State;
+	unsigned Protect;
+	unsigned Type;
+} MEMORY_BASIC_INFORMATION, *PMEMORY_BASIC_INFORMATION;
+
+#endif //__VIRTMEM_H__
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * waitpool.h is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifndef __WAITPOOL_H__
+#define __WAITPOOL_H__
+
+#define WT_EXECUTEDEFAULT			0x00000000
+#define WT_EXECUTEINIOTHREAD		0x00000001
+#define WT_EXECUTEINWAITTHREAD		0x00000004
+#define WT_EXECUTEONLYONCE			0x00000008
+#define WT_EXECUTELONGFUNCTION		0x00000010
+#define WT_EXECUTEINPERSISTENTTHREAD	0x00000080
+
+#ifndef MAXIMUM_WAIT_OBJECTS
+#define MAXIMUM_WAIT_OBJECTS		64
+#endif
+
+#ifndef ERROR_IO_PENDING
+#define ERROR_IO_PENDING			997
+#endif
+
+typedef void (*WAITORTIMERCALLBACK)( void *context, bool timedout );
+
+#endif //__WAITPOOL_H__
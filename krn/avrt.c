@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * avrt.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#ifdef __linux__
+# ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+# endif
+#endif
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+//#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+//#endif	//HAVE_UNISTD_H
+#include <sys/types.h>
+#ifdef __linux__
+# include <syscall.h>
+#endif
+
+#include "windows.h"
+#include "avrt.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern unsigned get_win_error( int err );
+
+
+#ifndef SCHED_DEADLINE
+# define SCHED_DEADLINE		6
+#endif
+#ifndef SCHED_FLAG_RESET_ON_FORK
+# define SCHED_FLAG_RESET_ON_FORK	0x01
+#endif
+
+#define AVRTPRIORITYSTEP	5		//sched_priority per AVRT_PRIORITY level
+
+// sched_setattr(2) argument, not exported by glibc
+struct sched_attr_ {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t  sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;		//nanoseconds
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+// multimedia task classes and their SCHED_FIFO priorities
+static const struct {
+	const char *name;
+	int priority;
+} avrttasks[] = {
+	{ "Pro Audio",      80 },
+	{ "Audio",          70 },
+	{ "Games",          60 },
+	{ "Capture",        60 },
+	{ "Low Latency",    60 },
+	{ "Playback",       50 },
+	{ "Distribution",   50 },
+	{ "Window Manager", 50 },
+};
+
+// a thread in a task class, the handle of the Av* functions
+typedef struct AVRTTASK_ {
+	pthread_t thread;
+	int tid;
+	unsigned task;			//index to avrttasks
+	int priority;			//AVRT_PRIORITY
+	bool deadline;			//SCHED_DEADLINE instead of SCHED_FIFO
+
+	// scheduling state restored by _avrevertmmthreadcharacteristics
+	int policy;
+	struct sched_param param;
+} AVRTTASK;
+
+static volatile unsigned lasttaskindex = 0;
+
+
+static
+int lookuptask (const char *name)
+{
+	unsigned i;
+
+	for (i = 0; name && i < sizeof(avrttasks)/sizeof(avrttasks[0]); i++) {
+		if ( strcasecmp (avrttasks[i].name, name) == 0 )
+			return (int)i;
+	}
+	return -1;
+}
+
+static
+int setschedattr (int tid, const struct sched_attr_ *attr)
+{
+#if defined __linux__ && defined SYS_sched_setattr
+	if (syscall (SYS_sched_setattr, tid, attr, 0) == -1)
+		return errno;
+	return 0;
+#else
+	return ENOSYS;
+#endif
+}
+
+static
+int fifopriority (const AVRTTASK *task)
+{
+	int prio, min, max;
+
+	min = sched_get_priority_min (SCHED_FIFO);
+	max = sched_get_priority_max (SCHED_FIFO);
+
+	prio = avrttasks[task->task].priority + task->priority * AVRTPRIORITYSTEP;
+	if (prio < min) prio = min;
+	if (prio > max) prio = max;
+
+	return prio;
+}
+
+static
+int applyfifo (AVRTTASK *task)
+{
+	struct sched_param param;
+
+	memset (&param, 0, sizeof(param));
+	param.sched_priority = fifopriority (task);
+
+	// through pthread, libc caches the policy of its threads
+	return pthread_setschedparam (task->thread, SCHED_FIFO, &param);
+}
+
+static
+AVRTTASK* getavrttask (uintptr_t hndl)
+{
+	AVRTTASK *task = (AVRTTASK*)hndl;
+
+	// the characteristics belong to the calling thread
+	if (!task || !pthread_equal (task->thread, pthread_self ())) {
+		_setlasterror( ERROR_INVALID_HANDLE );
+		return NULL;
+	}
+	return task;
+}
+
+
+uintptr_t _avsetmmthreadcharacteristics( const char *taskname, unsigned *taskindex )
+{
+	int rc, i;
+	AVRTTASK *task;
+
+	if ( !taskname || !taskindex ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return (uintptr_t)NULL;
+	}
+
+	i = lookuptask (taskname);
+	if ( i < 0 ) {
+		_setlasterror( ERROR_INVALID_TASK_NAME );
+		return (uintptr_t)NULL;
+	}
+
+	task = (AVRTTASK*) calloc (1, sizeof(AVRTTASK));
+	if ( !task ) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return (uintptr_t)NULL;
+	}
+	task->thread   = pthread_self ();
+#ifdef __linux__
+	task->tid      = (int) syscall (SYS_gettid);
+#endif
+	task->task     = i;
+	task->priority = AVRT_PRIORITY_NORMAL;
+
+	rc = pthread_getschedparam (task->thread, &task->policy, &task->param);
+	if ( rc == 0 )
+		rc = applyfifo (task);
+	if ( rc != 0 ) {
+		// EPERM without CAP_SYS_NICE or RLIMIT_RTPRIO
+		_setlasterror( get_win_error (rc) );
+		free (task);
+		return (uintptr_t)NULL;
+	}
+
+	if ( *taskindex == 0 )
+		*taskindex = __sync_add_and_fetch (&lasttaskindex, 1);
+
+	return (uintptr_t)task;
+}
+
+uintptr_t _avsetmmmaxthreadcharacteristics( const char *firsttask, const char *secondtask, unsigned *taskindex )
+{
+	int first, second;
+
+	first = lookuptask (firsttask);
+	second = lookuptask (secondtask);
+	if ( first < 0 || second < 0 ) {
+		_setlasterror( ERROR_INVALID_TASK_NAME );
+		return (uintptr_t)NULL;
+	}
+
+	// the thread joins the class with the higher priority
+	if ( avrttasks[second].priority > avrttasks[first].priority )
+		return _avsetmmthreadcharacteristics( secondtask, taskindex );
+	return _avsetmmthreadcharacteristics( firsttask, taskindex );
+}
+
+bool _avsetmmthreadpriority( uintptr_t hndl, AVRT_PRIORITY priority )
+{
+	int rc;
+	AVRTTASK *task;
+
+	if ( !(task = getavrttask (hndl)) )
+		return false;
+
+	if ( priority < AVRT_PRIORITY_VERYLOW || priority > AVRT_PRIORITY_CRITICAL ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	task->priority = priority;
+	if ( task->deadline )		// the budget, not the priority, rules a deadline thread
+		return true;
+
+	rc = applyfifo (task);
+	if ( rc != 0 ) {
+		_setlasterror( get_win_error (rc) );
+		return false;
+	}
+
+	return true;
+}
+
+// moves the thread from SCHED_FIFO to SCHED_DEADLINE, it gets runtime nanoseconds
+// of CPU time in every period with the deadline relative to the period start;
+// period 0 means the deadline, runtime 0 returns to SCHED_FIFO
+bool _avsetmmthreaddeadline( uintptr_t hndl, uint64_t runtime, uint64_t deadline, uint64_t period )
+{
+	int rc;
+	AVRTTASK *task;
+	struct sched_attr_ attr;
+
+	if ( !(task = getavrttask (hndl)) )
+		return false;
+
+	if ( runtime == 0 ) {
+		rc = applyfifo (task);
+		if ( rc != 0 ) {
+			_setlasterror( get_win_error (rc) );
+			return false;
+		}
+		task->deadline = false;
+		return true;
+	}
+
+	if ( period == 0 ) period = deadline;
+	if ( runtime > deadline || deadline > period ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	memset (&attr, 0, sizeof(attr));
+	attr.size           = sizeof(attr);
+	attr.sched_policy   = SCHED_DEADLINE;
+	attr.sched_flags    = SCHED_FLAG_RESET_ON_FORK;
+	attr.sched_runtime  = runtime;
+	attr.sched_deadline = deadline;
+	attr.sched_period   = period;
+
+	// EBUSY when the admission control refuses the budget
+	rc = setschedattr (task->tid, &attr);
+	if ( rc != 0 ) {
+		_setlasterror( rc == ENOSYS ? ERROR_CALL_NOT_IMPLEMENTED : get_win_error (rc) );
+		return false;
+	}
+
+	task->deadline = true;
+	return true;
+}
+
+bool _avrevertmmthreadcharacteristics( uintptr_t hndl )
+{
+	int rc;
+	AVRTTASK *task;
+
+	if ( !(task = getavrttask (hndl)) )
+		return false;
+
+	// also leaves SCHED_DEADLINE, the nice value is kept
+	rc = pthread_setschedparam (task->thread, task->policy, &task->param);
+
+	if ( rc != 0 ) {
+		_setlasterror( get_win_error (rc) );
+		return false;
+	}
+
+	free (task);
+	return true;
+}
@@ -0,0 +1,567 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * dircache.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#if (defined __linux__ || defined __CYGWIN__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+# include <sys/inotify.h>
+#endif
+
+#include "windows.h"
+#include "filestat.h"
+
+
+/*
+ * Names written by Windows code are matched against the directory entries
+ * ignoring the case, as NTFS does. The entries of a directory are read once,
+ * with getdents64 where there is one, and kept in a hash of their folded names,
+ * so a lookup costs no system call. A directory is watched by inotify, a
+ * thread reading the events marks its entry stale and the next lookup reads it
+ * again. Without inotify, or past the watch limit, the modification time of
+ * the directory is compared on each lookup instead. The changes made by other
+ * processes are seen once their events are read, ours by _invalidatedircache,
+ * and a miss in a watched directory compares the modification time first.
+ * Only ASCII letters are folded, the rest of a UTF-8 name has to match.
+ */
+
+#define DIRCACHESLOTS		1024		//power of two
+#define DIRCACHECHAIN		4			//directories kept per slot
+#define DIRNAMEEND			0xFFFFFFFFu
+#define DIRREADSIZE			32768
+
+typedef struct DIRNAME_ {
+	unsigned hash;				//of the folded name
+	unsigned next;				//in its bucket
+	unsigned offset;			//in names
+	unsigned length;
+} DIRNAME;
+
+typedef struct DIRCACHE_ {
+	struct DIRCACHE_ *next;		//in the slot
+	unsigned hash;
+	int wd;						//-1 when checked by mtime
+	volatile int stale;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	unsigned count;
+	unsigned mask;				//of the buckets
+	unsigned *buckets;
+	DIRNAME *entries;
+	char *names;
+	size_t length;
+	char path[];
+} DIRCACHE;
+
+static DIRCACHE *dircaches[DIRCACHESLOTS];
+static pthread_rwlock_t dircachelock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t dirwatchonce = PTHREAD_ONCE_INIT;
+static int dirwatchfd = -1;
+
+
+static inline
+unsigned char foldchar (unsigned char c)
+{
+	return (unsigned)(c - 'A') < 26u ? c + ('a' - 'A') : c;
+}
+
+static inline
+unsigned hashfoldedname (const char *s, size_t length)
+{
+	unsigned h = 2166136261u;		//FNV-1a
+
+	while (length--)
+		h = (h ^ foldchar ((unsigned char)*s++)) * 16777619u;
+	return h;
+}
+
+static inline
+unsigned hashdirpath (const char *s, size_t length)
+{
+	unsigned h = 2166136261u;
+
+	while (length--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static inline
+bool equalfolded (const char *a, const char *b, size_t length)
+{
+	while (length--)
+		if (foldchar ((unsigned char)*a++) != foldchar ((unsigned char)*b++))
+			return false;
+	return true;
+}
+
+#ifdef __linux__
+static
+void* dirwatchthread (void *param)
+{
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	DIRCACHE *dc;
+	ssize_t len;
+	char *p;
+	unsigned i;
+
+	for (;;) {
+		len = read (dirwatchfd, buffer, sizeof(buffer));
+		if (len <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		// the events are rare, the directories are searched for their watch
+		pthread_rwlock_rdlock (&dircachelock);
+		for (p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event*)p;
+			for (i = 0; i < DIRCACHESLOTS; i++)
+				for (dc = dircaches[i]; dc; dc = dc->next)
+					if (dc->wd == ev->wd)
+						__atomic_store_n (&dc->stale, 1, __ATOMIC_RELEASE);
+		}
+		pthread_rwlock_unlock (&dircachelock);
+	}
+	return NULL;
+}
+#endif
+
+static
+void dirwatchinit (void)
+{
+#ifdef __linux__
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fd;
+
+	fd = inotify_init1 (IN_CLOEXEC);
+	if (fd == -1)
+		return;
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize (&attr, 65536);
+	dirwatchfd = fd;
+	if (pthread_create (&thread, &attr, dirwatchthread, NULL) != 0) {
+		dirwatchfd = -1;
+		close (fd);
+	}
+	pthread_attr_destroy (&attr);
+#endif
+}
+
+// with the write lock, a watch is shared by the paths of one directory
+static
+void freedircache (DIRCACHE *dc, DIRCACHE *replacement)
+{
+#ifdef __linux__
+	DIRCACHE *other;
+	unsigned i;
+
+	if (dc->wd != -1 && !(replacement && replacement->wd == dc->wd)) {
+		for (i = 0; i < DIRCACHESLOTS; i++)
+			for (other = dircaches[i]; other; other = other->next)
+				if (other != dc && other->wd == dc->wd)
+					goto shared;
+		inotify_rm_watch (dirwatchfd, dc->wd);
+	}
+shared:
+#endif
+	free (dc);
+}
+
+#ifdef SYS_getdents64
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+// appends the entry names, each one with its terminating zero
+static
+bool readdirnames (int fd, char **names, size_t *size, unsigned *count)
+{
+	size_t used = 0, capacity = 0, len;
+	char *buf = NULL, *p;
+	const char *name;
+#ifdef SYS_getdents64
+	char *block;
+	long n, pos;
+
+	block = (char*) malloc (DIRREADSIZE);
+	if (!block)
+		return false;
+	while ((n = syscall (SYS_getdents64, fd, block, DIRREADSIZE)) > 0) {
+		for (pos = 0; pos < n; pos += ((struct linux_dirent64*)(block + pos))->d_reclen) {
+			name = ((struct linux_dirent64*)(block + pos))->d_name;
+#else
+	DIR *dir;
+	struct dirent *de;
+
+	dir = fdopendir (dup (fd));
+	if (!dir)
+		return false;
+	{
+		while ((de = readdir (dir)) != NULL) {
+			name = de->d_name;
+#endif
+			if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+				continue;
+			len = strlen (name) + 1;
+			if (used + len > capacity) {
+				capacity = capacity ? capacity * 2 : 4096;
+				while (used + len > capacity)
+					capacity *= 2;
+				p = (char*) realloc (buf, capacity);
+				if (!p)
+					goto failed;
+				buf = p;
+			}
+			memcpy (buf + used, name, len);
+			used += len;
+			(*count)++;
+		}
+	}
+#ifdef SYS_getdents64
+	free (block);
+	if (n < 0)
+		goto failed;
+#else
+	closedir (dir);
+#endif
+	*names = buf;
+	*size = used;
+	return true;
+
+failed:
+#ifdef SYS_getdents64
+	free (block);
+#endif
+	free (buf);
+	return false;
+}
+
+static
+DIRCACHE* readdircache (const char *path, size_t length, unsigned hash)
+{
+	DIRCACHE *dc;
+	struct stat st;
+	char *names = NULL, *name;
+	size_t size = 0, entriesoffset, namesoffset;
+	unsigned count = 0, buckets, i, *bucket;
+	int fd, wd = -1;
+
+	pthread_once (&dirwatchonce, dirwatchinit);
+
+	fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+#ifdef __linux__
+	// watched before it is read, a change made meanwhile is not lost
+	if (dirwatchfd != -1)
+		wd = inotify_add_watch (dirwatchfd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+											IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+#endif
+	if (fstat (fd, &st) == -1 || !readdirnames (fd, &names, &size, &count)) {
+		close (fd);
+		goto failed;
+	}
+	close (fd);
+
+	for (buckets = 16; buckets < count * 2; buckets *= 2)
+		;
+	entriesoffset = (sizeof(DIRCACHE) + length + 1 + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+	namesoffset = entriesoffset + buckets * sizeof(unsigned) + count * sizeof(DIRNAME);
+	dc = (DIRCACHE*) malloc (namesoffset + size);
+	if (!dc)
+		goto failed;
+
+	dc->next    = NULL;
+	dc->hash    = hash;
+	dc->wd      = wd;
+	dc->stale   = 0;
+	dc->dev     = st.st_dev;
+	dc->ino     = st.st_ino;
+	dc->mtime   = _getstatmtime (&st);
+	dc->count   = count;
+	dc->mask    = buckets - 1;
+	dc->buckets = (unsigned*)((char*)dc + entriesoffset);
+	dc->entries = (DIRNAME*)(dc->buckets + buckets);
+	dc->names   = (char*)dc + namesoffset;
+	dc->length  = length;
+	memcpy (dc->path, path, length + 1);
+	memcpy (dc->names, names, size);
+	free (names);
+
+	memset (dc->buckets, 0xFF, buckets * sizeof(unsigned));
+	for (i = 0, name = dc->names; i < count; i++) {
+		dc->entries[i].offset = (unsigned)(name - dc->names);
+		dc->entries[i].length = (unsigned)strlen (name);
+		dc->entries[i].hash   = hashfoldedname (name, dc->entries[i].length);
+		bucket = &dc->buckets[dc->entries[i].hash & dc->mask];
+		dc->entries[i].next = *bucket;
+		*bucket = i;
+		name += dc->entries[i].length + 1;
+	}
+	return dc;
+
+failed:
+#ifdef __linux__
+	if (wd != -1)
+		inotify_rm_watch (dirwatchfd, wd);
+#endif
+	free (names);
+	return NULL;
+}
+
+static
+bool isdircachevalid (DIRCACHE *dc)
+{
+	struct stat st;
+
+	if (__atomic_load_n (&dc->stale, __ATOMIC_ACQUIRE))
+		return false;
+	if (dc->wd != -1)
+		return true;
+	return stat (dc->path, &st) == 0 && st.st_dev == dc->dev && st.st_ino == dc->ino &&
+		   _samestatmtime (&st, &dc->mtime);
+}
+
+/*
+ * A watched directory is trusted until the watcher thread reads the event,
+ * so a name created an instant ago may not be there yet. A miss in it checks
+ * the modification time before the name is reported missing, and marks the
+ * entry stale when the directory changed.
+ */
+static
+bool isdirmisscurrent (DIRCACHE *dc)
+{
+	struct stat st;
+
+	if (dc->wd == -1)
+		return true;		//checked by isdircachevalid
+	if (stat (dc->path, &st) == 0 && st.st_dev == dc->dev && st.st_ino == dc->ino &&
+		_samestatmtime (&st, &dc->mtime))
+		return true;
+	__atomic_store_n (&dc->stale, 1, __ATOMIC_RELEASE);
+	return false;
+}
+
+// the name of the entry matching the component, the exact one first
+static
+const char* finddirname (DIRCACHE *dc, const char *name, size_t length)
+{
+	const DIRNAME *entry;
+	const char *found = NULL, *s;
+	unsigned hash, i;
+
+	hash = hashfoldedname (name, length);
+	for (i = dc->buckets[hash & dc->mask]; i != DIRNAMEEND; i = entry->next) {
+		entry = &dc->entries[i];
+		if (entry->hash != hash || entry->length != length)
+			continue;
+		s = dc->names + entry->offset;
+		if (!memcmp (s, name, length))
+			return s;
+		if (!found && equalfolded (s, name, length))
+			found = s;
+	}
+	return found;
+}
+
+static
+DIRCACHE* getdircache (const char *path, size_t length, unsigned hash)
+{
+	DIRCACHE *dc, *old, **pdc;
+	unsigned slot = hash & (DIRCACHESLOTS - 1), chain;
+
+	// called with the read lock, returns holding it
+	for (dc = dircaches[slot]; dc; dc = dc->next)
+		if (dc->hash == hash && dc->length == length && !memcmp (dc->path, path, length))
+			break;
+	if (dc && isdircachevalid (dc))
+		return dc;
+	pthread_rwlock_unlock (&dircachelock);
+
+	dc = readdircache (path, length, hash);
+
+	pthread_rwlock_wrlock (&dircachelock);
+	for (pdc = &dircaches[slot], chain = 0; *pdc; ) {
+		old = *pdc;
+		if ((old->hash == hash && old->length == length && !memcmp (old->path, path, length)) ||
+			(++chain >= DIRCACHECHAIN && !old->next))		//the oldest one goes
+		{
+			*pdc = old->next;
+			freedircache (old, dc);
+			continue;
+		}
+		pdc = &old->next;
+	}
+	if (dc) {
+		dc->next = dircaches[slot];
+		dircaches[slot] = dc;
+	}
+	pthread_rwlock_unlock (&dircachelock);
+
+	pthread_rwlock_rdlock (&dircachelock);
+	for (dc = dircaches[slot]; dc; dc = dc->next)
+		if (dc->hash == hash && dc->length == length && !memcmp (dc->path, path, length))
+			return dc;
+	return NULL;
+}
+
+/*
+ * Rewrites the components of an absolute path after start with the case of
+ * the existing entries, in place as the folding keeps the lengths. Stops at
+ * the first component not found, the rest of the path is new, and at "..".
+ * Returns the length of the part that exists, length when all of it does.
+ */
+size_t _matchpathcase( char *path, size_t length, size_t start )
+{
+	DIRCACHE *dc;
+	const char *found;
+	char *p, *q, saved;
+	size_t dirlength, matched;
+	unsigned hash;
+
+	if (start >= length)
+		return length;
+	p = path + start;
+	if (*p == '/')
+		p++;
+	dirlength = p - path > 1 ? (size_t)(p - path - 1) : 1;
+	matched = dirlength;
+	hash = hashdirpath (path, dirlength);
+
+	pthread_rwlock_rdlock (&dircachelock);
+	while (p < path + length) {
+		q = memchr (p, '/', path + length - p);
+		if (!q)
+			q = path + length;
+		if (p[0] == '.' && (q - p == 1 || (p[1] == '.' && q - p == 2)))
+			break;
+
+		saved = path[dirlength];
+		path[dirlength] = '\0';
+		dc = getdircache (path, dirlength, hash);
+		found = dc ? finddirname (dc, p, q - p) : NULL;
+		if (!found && dc && !isdirmisscurrent (dc)) {
+			dc = getdircache (path, dirlength, hash);
+			found = dc ? finddirname (dc, p, q - p) : NULL;
+		}
+		path[dirlength] = saved;
+		if (!found)
+			break;
+		memcpy (p, found, q - p);
+		matched = q - path;
+
+		// the hash of the next directory goes on from this one
+		if (dirlength > 1)
+			hash = (hash ^ '/') * 16777619u;
+		for (; p < q; p++)
+			hash = (hash ^ (unsigned char)*p) * 16777619u;
+		dirlength = q - path;
+		p = q + 1;
+	}
+	pthread_rwlock_unlock (&dircachelock);
+	if (matched + 1 == length && path[matched] == '/')
+		matched = length;		//the trailing separator
+	return matched;
+}
+
+// whether an absolute directory holds the name, ignoring the case
+bool _direntryexists( const char *dir, size_t dirlength, const char *name, size_t length )
+{
+	DIRCACHE *dc;
+	unsigned hash = hashdirpath (dir, dirlength);
+	bool found = false;
+
+	pthread_rwlock_rdlock (&dircachelock);
+	dc = getdircache (dir, dirlength, hash);
+	if (dc)
+		found = finddirname (dc, name, length) != NULL;
+	if (!found && dc && !isdirmisscurrent (dc)) {
+		dc = getdircache (dir, dirlength, hash);
+		found = dc && finddirname (dc, name, length) != NULL;
+	}
+	pthread_rwlock_unlock (&dircachelock);
+	return found;
+}
+
+// a copy of the entry names of an absolute directory, each one with its terminating zero
+char* _readdirectorynames( const char *dir, size_t dirlength, unsigned *count, size_t *size )
+{
+	DIRCACHE *dc;
+	char *names = NULL;
+	size_t used;
+
+	pthread_rwlock_rdlock (&dircachelock);
+	dc = getdircache (dir, dirlength, hashdirpath (dir, dirlength));
+	if (dc) {
+		used = dc->count ? dc->entries[dc->count-1].offset + dc->entries[dc->count-1].length + 1 : 0;
+		names = (char*) malloc (used + 1);
+		if (names) {
+			memcpy (names, dc->names, used);
+			*count = dc->count;
+			*size = used;
+		}
+	}
+	pthread_rwlock_unlock (&dircachelock);
+	return names;
+}
+
+static
+void staledircache (const char *path, size_t length)
+{
+	unsigned hash = hashdirpath (path, length);
+	DIRCACHE *dc;
+
+	for (dc = dircaches[hash & (DIRCACHESLOTS - 1)]; dc; dc = dc->next)
+		if (dc->hash == hash && dc->length == length && !memcmp (dc->path, path, length))
+			__atomic_store_n (&dc->stale, 1, __ATOMIC_RELEASE);
+}
+
+// drops the cached entries of an absolute path and of the directory holding it, after our own changes
+void _invalidatedircache( const char *path )
+{
+	size_t length, dirlength;
+
+	length = strlen (path);
+	while (length > 1 && path[length-1] == '/')
+		length--;
+	for (dirlength = length; dirlength > 0 && path[dirlength-1] != '/'; dirlength--)
+		;
+	if (!dirlength)
+		return;
+	if (dirlength > 1)
+		dirlength--;
+
+	pthread_rwlock_rdlock (&dircachelock);
+	staledircache (path, length);
+	staledircache (path, dirlength);
+	pthread_rwlock_unlock (&dircachelock);
+}
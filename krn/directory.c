@@ -14,24 +14,46 @@
 #include <sys/types.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 //#ifndef HAVE_UNISTD_H
 # include <unistd.h>
 //#endif
 
 #include "windows.h"
+#include "pathname.h"
 
 
 // depends on these functions:
 extern void _setlasterror( unsigned err );
 extern unsigned get_win_error( int err );
+extern void _refreshcurrentdirectory( void );
+extern void _flushfullpathnamecache( void );
+extern void _invalidatedircache( const char *path );
+extern const char* _translatepathname( const char *name, char *buffer, unsigned size );
+extern unsigned _getfullpathname( const char *name, unsigned len, char *buffer, char **lastpart );
 
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// our own changes reach the directory cache at once, not with the next inotify event
+static
+void directorychanged (const char *path)
+{
+	char full[PATH_MAX];
+
+	if (path[0] != '/') {
+		if (!_getfullpathname (path, sizeof(full), full, NULL) || full[0] != '/')
+			return;
+		path = full;
+	}
+	_invalidatedircache (path);
+}
+
 bool _createdirectoryex( const char *template, const char* path, LPSECURITY_ATTRIBUTES sa )
 {
+	char translated[PATH_MAX];
 	int rc;
 	mode_t mode;
 
@@ -39,6 +61,9 @@ bool _createdirectoryex( const char *template, const char* path, LPSECURITY_ATTR
 		_setlasterror( ERROR_PATH_NOT_FOUND );
 		return false;
 	}
+	path = _translatepathname (path, translated, sizeof(translated));
+	if (!path)
+		return false;
 
 	if ( sa == NULL )	// the default
 		mode = S_IRWXU | S_IRGRP|S_IXGRP | S_IROTH|S_IXOTH;
@@ -56,14 +81,24 @@ bool _createdirectoryex( const char *template, const char* path, LPSECURITY_ATTR
 		return false;
 	}
 
+	directorychanged (path);
 	return true;
 }
 
 bool _removedirectory( const char* path )
 {
+	char translated[PATH_MAX];
 	int rc;
 	struct stat st;
 
+	if (!path) {
+		_setlasterror( ERROR_PATH_NOT_FOUND );
+		return false;
+	}
+	path = _translatepathname (path, translated, sizeof(translated));
+	if (!path)
+		return false;
+
 	if ( lstat (path, &st) == 0 && S_ISLNK(st.st_mode) )		//TODO: update the check (whether it points to a directory or a file)
 		rc = unlink (path);	//remove a link pointing to the directory
 	else
@@ -78,6 +113,8 @@ bool _removedirectory( const char* path )
 		return false;
 	}
 
+	directorychanged (path);
+	_flushfullpathnamecache ();		//the directory may have been in a resolved path
 	return true;
 }
 
@@ -117,12 +154,16 @@ unsigned _getcurrentdirectory( unsigned buflen, char* buf )
 
 bool _setcurrentdirectory( const char* dir )
 {
+	char translated[PATH_MAX];
 	int rc;
 
 	if (!dir) {
 		_setlasterror( ERROR_INVALID_NAME );
 		return false;
 	}
+	dir = _translatepathname (dir, translated, sizeof(translated));
+	if (!dir)
+		return false;
 
 	rc = chdir (dir);
 	if (rc == -1) {
@@ -134,6 +175,7 @@ bool _setcurrentdirectory( const char* dir )
 		return false;
 	}
 
+	_refreshcurrentdirectory ();	//for _getfullpathname
 	return true;
 }
 
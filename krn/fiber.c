@@ -0,0 +1,532 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * fiber.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#if defined __linux__ && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+//#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+//#endif	//HAVE_UNISTD_H
+
+#include "windows.h"
+#include "fiber.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern unsigned get_win_error( int err );
+extern void _exitthread( uintptr_t hndl, unsigned code );
+
+// fibercontext.S
+extern void _fiberswitchcontext( void **oldsp, void *newsp );
+extern void _fiberstartcontext( void );
+
+
+#define FIBERSTACKDEFAULT	(1024*1024)
+#define FIBERSTACKPOOLMAX	64			//cached stacks
+
+#ifndef MAP_STACK
+# define MAP_STACK	0
+#endif
+
+
+typedef struct FLSDATA_ {
+	struct FLSDATA_ *prev, *next;		//all FLS blocks, for FlsFree
+	void *slots[FLS_MAXIMUM_AVAILABLE];
+} FLSDATA;
+
+typedef struct FIBER_ {
+	void *sp;					//saved stack pointer
+	void *param;
+	LPFIBER_START_ROUTINE start;
+	char *stack;				//mapping including the guard page, NULL for a converted thread
+	size_t stacksize;
+	FLSDATA *fls;
+} FIBER;
+
+// fiber state of a thread, released when the thread exits
+typedef struct FIBERTHREAD_ {
+	FIBER *current;
+	FIBER *primary;				//fiber created by ConvertThreadToFiber
+	FIBER *deleted;				//current fiber deleted by itself, released at thread exit
+	FLSDATA *fls;				//FLS of a thread that is not a fiber
+} FIBERTHREAD;
+
+// a cached stack, the node is stored in the stack itself
+typedef struct FIBERSTACK_ {
+	struct FIBERSTACK_ *next;
+	size_t size;
+} FIBERSTACK;
+
+static __thread FIBERTHREAD *fiberthread = NULL;
+static pthread_key_t fiberthreadkey;
+static pthread_once_t fiberonce = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t stackpoollock = PTHREAD_MUTEX_INITIALIZER;
+static FIBERSTACK *stackpool = NULL;
+static unsigned stackpoolcount = 0;
+
+static pthread_mutex_t flslock = PTHREAD_MUTEX_INITIALIZER;
+static PFLS_CALLBACK_FUNCTION flscallbacks[FLS_MAXIMUM_AVAILABLE];
+static bool flsused[FLS_MAXIMUM_AVAILABLE];
+static FLSDATA *flslist = NULL;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static void releasefiber (FIBER *fiber);
+static void freefls (FLSDATA *fls);
+
+static
+void fiberthreadexit (void *arg)
+{
+	FIBERTHREAD *ft = (FIBERTHREAD*)arg;
+
+	// runs on the thread's own stack, the deleted fiber's stack can be released now
+	if (ft->deleted) releasefiber (ft->deleted);
+	if (ft->primary) releasefiber (ft->primary);
+	if (ft->fls) freefls (ft->fls);
+	free (ft);
+}
+
+static
+void fiberinit (void)
+{
+	pthread_key_create (&fiberthreadkey, fiberthreadexit);
+}
+
+static
+FIBERTHREAD* getfiberthread (bool create)
+{
+	if (!fiberthread && create) {
+		pthread_once (&fiberonce, fiberinit);
+
+		fiberthread = (FIBERTHREAD*) calloc (1, sizeof(FIBERTHREAD));
+		if (!fiberthread) {
+			_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+			return NULL;
+		}
+		pthread_setspecific (fiberthreadkey, fiberthread);
+	}
+	return fiberthread;
+}
+
+/* fiber stacks */
+
+static
+char* allocstack (size_t size, size_t commit)
+{
+	FIBERSTACK *st, **pst;
+	size_t pagesize = getpagesize ();
+	char *stack;
+
+	pthread_mutex_lock (&stackpoollock);
+	for (pst = &stackpool; *pst; pst = &(*pst)->next) {
+		if ((*pst)->size == size) {
+			st = *pst;
+			*pst = st->next;
+			stackpoolcount--;
+			pthread_mutex_unlock (&stackpoollock);
+			return (char*)st - pagesize;
+		}
+	}
+	pthread_mutex_unlock (&stackpoollock);
+
+	stack = (char*) mmap (NULL, size, PROT_READ|PROT_WRITE,
+	                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED)
+		return NULL;
+
+	// guard page at the low end, an overflow faults instead of corrupting memory
+	if (mprotect (stack, pagesize, PROT_NONE) == -1) {
+		munmap (stack, size);
+		return NULL;
+	}
+
+	// pre-fault the committed part at the top of the stack
+	if (commit > size - pagesize) commit = size - pagesize;
+	for (char *p = stack + size - pagesize; p >= stack + size - commit; p -= pagesize)
+		*(volatile char*)p = 0;
+
+	return stack;
+}
+
+static
+void freestack (char *stack, size_t size)
+{
+	size_t pagesize = getpagesize ();
+	FIBERSTACK *st = (FIBERSTACK*)(stack + pagesize);
+
+	pthread_mutex_lock (&stackpoollock);
+	if (stackpoolcount < FIBERSTACKPOOLMAX) {
+		st->size = size;
+		st->next = stackpool;
+		stackpool = st;
+		stackpoolcount++;
+		stack = NULL;
+	}
+	pthread_mutex_unlock (&stackpoollock);
+
+	if (stack)
+		munmap (stack, size);
+}
+
+/* fiber local storage */
+
+static
+void freefls (FLSDATA *fls)
+{
+	PFLS_CALLBACK_FUNCTION callbacks[FLS_MAXIMUM_AVAILABLE];
+	unsigned i;
+
+	pthread_mutex_lock (&flslock);
+	if (fls->prev) fls->prev->next = fls->next;
+	else flslist = fls->next;
+	if (fls->next) fls->next->prev = fls->prev;
+	memcpy (callbacks, flscallbacks, sizeof(callbacks));
+	pthread_mutex_unlock (&flslock);
+
+	for (i = 0; i < FLS_MAXIMUM_AVAILABLE; i++)
+		if (fls->slots[i] && callbacks[i])
+			callbacks[i]( fls->slots[i] );
+
+	free (fls);
+}
+
+static
+FLSDATA** getflsslot (bool create)
+{
+	FIBERTHREAD *ft = getfiberthread (create);
+	FLSDATA **pfls;
+
+	if (!ft) return NULL;
+	pfls = (ft->current ? &ft->current->fls : &ft->fls);
+
+	if (!*pfls && create) {
+		FLSDATA *fls = (FLSDATA*) calloc (1, sizeof(FLSDATA));
+		if (!fls) {
+			_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+			return NULL;
+		}
+
+		pthread_mutex_lock (&flslock);
+		fls->next = flslist;
+		if (flslist) flslist->prev = fls;
+		flslist = fls;
+		pthread_mutex_unlock (&flslock);
+
+		*pfls = fls;
+	}
+
+	return pfls;
+}
+
+unsigned _flsalloc( PFLS_CALLBACK_FUNCTION callback )
+{
+	unsigned i;
+
+	pthread_mutex_lock (&flslock);
+	for (i = 0; i < FLS_MAXIMUM_AVAILABLE && flsused[i]; i++)
+		;
+	if (i < FLS_MAXIMUM_AVAILABLE) {
+		flsused[i] = true;
+		flscallbacks[i] = callback;
+	}
+	pthread_mutex_unlock (&flslock);
+
+	if (i == FLS_MAXIMUM_AVAILABLE) {
+		_setlasterror( ERROR_NO_MORE_ITEMS );
+		return FLS_OUT_OF_INDEXES;
+	}
+
+	return i;
+}
+
+bool _flsfree( unsigned index )
+{
+	PFLS_CALLBACK_FUNCTION callback;
+	FLSDATA *fls;
+	void **values = NULL;
+	unsigned i, count = 0;
+
+	if (index >= FLS_MAXIMUM_AVAILABLE) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	pthread_mutex_lock (&flslock);
+	if (!flsused[index]) {
+		pthread_mutex_unlock (&flslock);
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	// clear the slot in every fiber and thread, callbacks run outside the lock
+	callback = flscallbacks[index];
+	for (fls = flslist; fls; fls = fls->next)
+		if (fls->slots[index]) count++;
+	if (callback && count)
+		values = (void**) malloc (count * sizeof(void*));
+	for (i = 0, fls = flslist; fls; fls = fls->next) {
+		if (fls->slots[index]) {
+			if (values) values[i++] = fls->slots[index];
+			fls->slots[index] = NULL;
+		}
+	}
+	flsused[index] = false;
+	flscallbacks[index] = NULL;
+	pthread_mutex_unlock (&flslock);
+
+	if (values) {
+		for (i = 0; i < count; i++) callback( values[i] );
+		free (values);
+	}
+
+	return true;
+}
+
+void* _flsgetvalue( unsigned index )
+{
+	FLSDATA **pfls;
+
+	if (index >= FLS_MAXIMUM_AVAILABLE) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return NULL;
+	}
+
+	pfls = getflsslot (false);
+	_setlasterror( NO_ERROR );
+	return (pfls && *pfls ? (*pfls)->slots[index] : NULL);
+}
+
+bool _flssetvalue( unsigned index, void *value )
+{
+	FLSDATA **pfls;
+
+	if (index >= FLS_MAXIMUM_AVAILABLE || !flsused[index]) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	pfls = getflsslot (true);
+	if (!pfls)
+		return false;
+
+	(*pfls)->slots[index] = value;
+	return true;
+}
+
+/* fibers */
+
+static
+void releasefiber (FIBER *fiber)
+{
+	if (fiber->fls) freefls (fiber->fls);
+	if (fiber->stack) freestack (fiber->stack, fiber->stacksize);
+	free (fiber);
+}
+
+static
+void fiberentry (FIBER *fiber)
+{
+	fiber->start( fiber->param );
+
+	// returning from the fiber routine exits the thread
+	_exitthread( (uintptr_t)CURRENT_THREAD_HANDLE, 0 );
+}
+
+static
+void initcontext (FIBER *fiber)
+{
+	uintptr_t *sp, top;
+
+	top = (uintptr_t)(fiber->stack + fiber->stacksize) & ~(uintptr_t)15;
+
+#if defined __x86_64__
+	// frame popped by _fiberswitchcontext
+	sp = (uintptr_t*)top;
+	*--sp = (uintptr_t)_fiberstartcontext;	//return address
+	*--sp = 0;								//rbp
+	*--sp = 0;								//rbx
+	*--sp = (uintptr_t)fiber;				//r12
+	*--sp = (uintptr_t)fiberentry;			//r13
+	*--sp = 0;								//r14
+	*--sp = 0;								//r15
+	*--sp = 0x1F80 | (0x037FULL << 32);		//default MXCSR and x87 control word
+#elif defined __aarch64__
+	sp = (uintptr_t*)(top - 160);
+	memset (sp, 0, 160);
+	sp[0]  = (uintptr_t)fiber;				//x19
+	sp[1]  = (uintptr_t)fiberentry;			//x20
+	sp[11] = (uintptr_t)_fiberstartcontext;	//x30
+#else
+# error fiber context not implemented for your platform
+#endif
+
+	fiber->sp = sp;
+}
+
+void* _convertthreadtofiberex( void *param, unsigned flags )
+{
+	FIBERTHREAD *ft;
+	FIBER *fiber;
+
+	ft = getfiberthread (true);
+	if (!ft)
+		return NULL;
+	if (ft->current) {
+		_setlasterror( ERROR_ALREADY_FIBER );
+		return NULL;
+	}
+
+	fiber = (FIBER*) calloc (1, sizeof(FIBER));
+	if (!fiber) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return NULL;
+	}
+	fiber->param = param;
+	fiber->fls = ft->fls;		//the thread's FLS values move to the fiber
+	ft->fls = NULL;
+
+	ft->primary = fiber;
+	ft->current = fiber;
+	return fiber;
+}
+
+void* _convertthreadtofiber( void *param )
+{
+	return _convertthreadtofiberex( param, 0 );
+}
+
+bool _convertfibertothread( void )
+{
+	FIBERTHREAD *ft = getfiberthread (false);
+
+	if (!ft || !ft->current || ft->current != ft->primary) {
+		_setlasterror( ERROR_ALREADY_THREAD );
+		return false;
+	}
+
+	ft->fls = ft->primary->fls;
+	ft->primary->fls = NULL;
+	free (ft->primary);
+	ft->primary = NULL;
+	ft->current = NULL;
+	return true;
+}
+
+void* _createfiberex( size_t commit, size_t reserve, unsigned flags,
+                      LPFIBER_START_ROUTINE start, void *param )
+{
+	//NOTE: the floating point state is always switched, FIBER_FLAG_FLOAT_SWITCH is implied
+
+	FIBER *fiber;
+	size_t pagesize = getpagesize ();
+
+	if (!start) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return NULL;
+	}
+
+	if (!reserve) reserve = FIBERSTACKDEFAULT;
+	if (reserve < commit) reserve = commit;
+	reserve = (reserve + pagesize - 1) & ~(pagesize - 1);
+	reserve += pagesize;	//guard page
+
+	fiber = (FIBER*) calloc (1, sizeof(FIBER));
+	if (!fiber) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return NULL;
+	}
+
+	fiber->stack = allocstack (reserve, (commit ? commit : pagesize));
+	if (!fiber->stack) {
+		_setlasterror( get_win_error (errno) );
+		free (fiber);
+		return NULL;
+	}
+	fiber->stacksize = reserve;
+	fiber->start = start;
+	fiber->param = param;
+
+	initcontext (fiber);
+	return fiber;
+}
+
+void* _createfiber( size_t stacksize, LPFIBER_START_ROUTINE start, void *param )
+{
+	return _createfiberex( stacksize, 0, 0, start, param );
+}
+
+void _switchtofiber( void *fiber )
+{
+	FIBERTHREAD *ft = fiberthread;
+	FIBER *prev;
+
+	if (!ft || !ft->current || !fiber)	//the thread is not a fiber
+		return;
+
+	prev = ft->current;
+	if (prev == (FIBER*)fiber)
+		return;
+
+	ft->current = (FIBER*)fiber;
+	_fiberswitchcontext( &prev->sp, ((FIBER*)fiber)->sp );
+}
+
+void _deletefiber( void *fiber )
+{
+	FIBERTHREAD *ft = fiberthread;
+	FIBER *f = (FIBER*)fiber;
+
+	if (!f)
+		return;
+
+	if (ft && ft->current == f) {
+		// deleting the running fiber exits the thread, the stack is released afterwards
+		if (ft->primary == f) ft->primary = NULL;
+		ft->deleted = f;
+		ft->current = NULL;
+		_exitthread( (uintptr_t)CURRENT_THREAD_HANDLE, 0 );
+	}
+
+	if (ft && ft->primary == f)
+		ft->primary = NULL;
+	releasefiber (f);
+}
+
+void* _getcurrentfiber( void )
+{
+	return (fiberthread ? fiberthread->current : NULL);
+}
+
+void* _getfiberdata( void )
+{
+	return (fiberthread && fiberthread->current ? fiberthread->current->param : NULL);
+}
+
+bool _isthreadafiber( void )
+{
+	return (fiberthread && fiberthread->current);
+}
+
+#ifdef __cplusplus
+}
+#endif
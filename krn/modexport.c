@@ -0,0 +1,689 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * modexport.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#if (defined __linux__ || defined __CYGWIN__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <limits.h>
+#if defined(__linux__) || defined(__bsd__)
+# include <link.h>
+# include <elf.h>
+# define HAVE_ELF_EXPORTS	1
+#endif
+
+#include "windows.h"
+#include "libloader.h"
+#include "filestat.h"
+
+
+/*
+ * The exports of a module are looked up in its own .gnu.hash (or .hash) and
+ * .dynsym, found through the dynamic section of its link_map, and the results
+ * are cached per module in an open addressing table filled with CAS, so the
+ * lookups take no lock. Symbols the dynamic linker resolves in a special way
+ * (versioned, IFUNC, TLS, unique) and names not defined by the module itself
+ * are left to dlsym, whose result is cached as well.
+ */
+
+#define EXPORTCACHEMIN		256
+#define EXPORTCACHEMAX		(1 << 16)
+#define MODULEINDEXSLOTS	1024		//power of two
+
+#define EXPORTSLOTEMPTY		0
+#define EXPORTSLOTBUSY		((const char*)1)	//claimed, not yet published
+
+typedef struct EXPORTSLOT_ {
+	volatile uint32_t hash;		//EXPORTSLOTEMPTY or the hash with the top bit set
+	const char * volatile name;	//published last
+	void *addr;
+	int owned;					//the name was duplicated for a dlsym result
+} EXPORTSLOT;
+
+typedef struct MODULEEXPORTS_ {
+	void *lib;
+#ifdef HAVE_ELF_EXPORTS
+	ElfW(Addr) base;
+	const ElfW(Sym) *symtab;
+	const char *strtab;
+	const uint32_t *gnuhash;
+	const ElfW(Word) *sysvhash;
+	const ElfW(Half) *versym;
+#endif
+	unsigned mask;				//cache size - 1
+	volatile unsigned count;
+	EXPORTSLOT cache[];
+} MODULEEXPORTS;
+
+// the index of the modules, keyed by the dlopen handle
+static MODULEEXPORTS * volatile moduleindex[MODULEINDEXSLOTS];
+static void * volatile moduleindexkeys[MODULEINDEXSLOTS];
+static pthread_mutex_t moduleindexlock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static inline
+uint32_t gnuhashname (const char *name)
+{
+	uint32_t h = 5381;
+
+	for (; *name; name++)
+		h = h * 33 + (unsigned char)*name;
+	return h;
+}
+
+static inline
+unsigned moduleslot (void *lib)
+{
+	uintptr_t h = (uintptr_t)lib;
+
+	h ^= h >> 12;
+	return (unsigned)(h * 0x9E3779B1u) >> 22 & (MODULEINDEXSLOTS - 1);
+}
+
+#ifdef HAVE_ELF_EXPORTS
+// the dynamic linker relocates the pointers of the dynamic section on most platforms
+static inline
+const void* dynptr (ElfW(Addr) base, ElfW(Addr) ptr)
+{
+	return (const void*)(ptr < base ? ptr + base : ptr);
+}
+
+static
+unsigned countsymbols (MODULEEXPORTS *m)
+{
+	const uint32_t *buckets, *chain;
+	uint32_t nbuckets, symoffset, bloomsize, i, last = 0;
+
+	if (m->sysvhash)
+		return m->sysvhash[1];		//nchain
+	if (!m->gnuhash)
+		return 0;
+
+	nbuckets  = m->gnuhash[0];
+	symoffset = m->gnuhash[1];
+	bloomsize = m->gnuhash[2];
+	buckets   = (const uint32_t*)((const ElfW(Addr)*)&m->gnuhash[4] + bloomsize);
+	chain     = buckets + nbuckets;
+
+	for (i = 0; i < nbuckets; i++)
+		if (buckets[i] > last)
+			last = buckets[i];
+	if (last < symoffset)
+		return symoffset;
+	while (!(chain[last - symoffset] & 1))
+		last++;
+	return last + 1;
+}
+
+static
+const ElfW(Sym)* findsymbol (MODULEEXPORTS *m, const char *name, uint32_t hash)
+{
+	const ElfW(Sym) *sym;
+	uint32_t idx;
+
+	if (m->gnuhash) {
+		const uint32_t *buckets, *chain;
+		const ElfW(Addr) *bloom;
+		uint32_t nbuckets, symoffset, bloomsize, bloomshift, ch;
+		ElfW(Addr) word, bits;
+
+		nbuckets   = m->gnuhash[0];
+		symoffset  = m->gnuhash[1];
+		bloomsize  = m->gnuhash[2];
+		bloomshift = m->gnuhash[3];
+		bloom      = (const ElfW(Addr)*)&m->gnuhash[4];
+		buckets    = (const uint32_t*)(bloom + bloomsize);
+		chain      = buckets + nbuckets;
+
+		// the bloom filter rejects most names of other modules
+		word = bloom[(hash / __ELF_NATIVE_CLASS) & (bloomsize - 1)];
+		bits = ((ElfW(Addr))1 << (hash % __ELF_NATIVE_CLASS)) |
+		       ((ElfW(Addr))1 << ((hash >> bloomshift) % __ELF_NATIVE_CLASS));
+		if ((word & bits) != bits)
+			return NULL;
+
+		idx = buckets[hash % nbuckets];
+		if (idx < symoffset)
+			return NULL;
+		for (;; idx++) {
+			ch = chain[idx - symoffset];
+			if ((ch | 1) == (hash | 1)) {
+				sym = &m->symtab[idx];
+				if (strcmp (name, m->strtab + sym->st_name) == 0)
+					return sym;
+			}
+			if (ch & 1)
+				return NULL;
+		}
+	}
+
+	if (m->sysvhash) {
+		const ElfW(Word) *buckets, *chain;
+		uint32_t h = 0, g;
+		const unsigned char *p;
+
+		for (p = (const unsigned char*)name; *p; p++) {
+			h = (h << 4) + *p;
+			g = h & 0xF0000000;
+			h ^= g >> 24;
+			h &= ~g;
+		}
+		buckets = &m->sysvhash[2];
+		chain   = buckets + m->sysvhash[0];
+		for (idx = buckets[h % m->sysvhash[0]]; idx != STN_UNDEF; idx = chain[idx]) {
+			sym = &m->symtab[idx];
+			if (strcmp (name, m->strtab + sym->st_name) == 0)
+				return sym;
+		}
+	}
+
+	return NULL;
+}
+
+// the address of a plain export, NULL when dlsym has to decide
+static
+void* resolveexport (MODULEEXPORTS *m, const char *name, uint32_t hash, const char **stablename)
+{
+	const ElfW(Sym) *sym;
+
+	if (!m->symtab || !m->strtab)
+		return NULL;
+
+	sym = findsymbol (m, name, hash);
+	if (!sym || sym->st_shndx == SHN_UNDEF)
+		return NULL;
+	if (m->versym && m->versym[sym - m->symtab] > 1)
+		return NULL;		//a versioned symbol
+	if (ELF32_ST_BIND(sym->st_info) != STB_GLOBAL && ELF32_ST_BIND(sym->st_info) != STB_WEAK)
+		return NULL;		//STB_GNU_UNIQUE
+	switch (ELF32_ST_TYPE(sym->st_info)) {
+	case STT_FUNC:
+	case STT_OBJECT:
+	case STT_NOTYPE:
+	case STT_COMMON:
+		break;
+	default:				//STT_GNU_IFUNC, STT_TLS
+		return NULL;
+	}
+
+	*stablename = m->strtab + sym->st_name;
+	return (void*)(m->base + sym->st_value);
+}
+#endif
+
+static
+MODULEEXPORTS* createmoduleexports (void *lib)
+{
+	MODULEEXPORTS *m;
+	unsigned nsyms = 0, size;
+#ifdef HAVE_ELF_EXPORTS
+	MODULEEXPORTS probe;
+	struct link_map *map = (struct link_map*)lib;
+	const ElfW(Dyn) *dyn;
+
+	memset (&probe, 0, sizeof(probe));
+	probe.base = map->l_addr;
+	for (dyn = map->l_ld; dyn && dyn->d_tag != DT_NULL; dyn++) {
+		switch (dyn->d_tag) {
+		case DT_SYMTAB:		probe.symtab   = dynptr (map->l_addr, dyn->d_un.d_ptr); break;
+		case DT_STRTAB:		probe.strtab   = dynptr (map->l_addr, dyn->d_un.d_ptr); break;
+		case DT_GNU_HASH:	probe.gnuhash  = dynptr (map->l_addr, dyn->d_un.d_ptr); break;
+		case DT_HASH:		probe.sysvhash = dynptr (map->l_addr, dyn->d_un.d_ptr); break;
+		case DT_VERSYM:		probe.versym   = dynptr (map->l_addr, dyn->d_un.d_ptr); break;
+		}
+	}
+	nsyms = countsymbols (&probe);
+#endif
+
+	// twice the exports keeps the probe sequences short
+	for (size = EXPORTCACHEMIN; size < 2 * nsyms && size < EXPORTCACHEMAX; size <<= 1) ;
+
+	m = (MODULEEXPORTS*) calloc (1, sizeof(MODULEEXPORTS) + size * sizeof(EXPORTSLOT));
+	if (!m)
+		return NULL;
+#ifdef HAVE_ELF_EXPORTS
+	*m = probe;
+#endif
+	m->lib  = lib;
+	m->mask = size - 1;
+	return m;
+}
+
+static
+MODULEEXPORTS* getmoduleexports (void *lib)
+{
+	MODULEEXPORTS *m;
+	unsigned slot, i, s, reuse;
+
+	slot = moduleslot (lib);
+	for (i = 0; i < MODULEINDEXSLOTS; i++) {
+		s = (slot + i) & (MODULEINDEXSLOTS - 1);
+		if (moduleindexkeys[s] == lib) {
+			m = moduleindex[s];
+			// the slot of a dropped module may have been taken by another one since
+			// the key was read, the key is stored before the exports are published
+			__atomic_thread_fence (__ATOMIC_ACQUIRE);
+			if (m && moduleindexkeys[s] == lib)
+				return m;
+			break;
+		}
+		if (!moduleindexkeys[s])
+			break;
+	}
+
+	// built once per module, the writers are serialized
+	pthread_mutex_lock (&moduleindexlock);
+	m = NULL;
+	reuse = MODULEINDEXSLOTS;
+	for (i = 0; i < MODULEINDEXSLOTS; i++) {
+		s = (slot + i) & (MODULEINDEXSLOTS - 1);
+		if (!moduleindexkeys[s]) {
+			if (reuse == MODULEINDEXSLOTS)
+				reuse = s;
+			break;
+		}
+		if (moduleindexkeys[s] == lib && moduleindex[s]) {
+			m = moduleindex[s];
+			break;
+		}
+		// the first tombstone of a dropped module takes the new one, so that
+		// modules loaded and unloaded again and again do not fill the index
+		if (!moduleindex[s] && reuse == MODULEINDEXSLOTS)
+			reuse = s;
+	}
+	if (!m && reuse != MODULEINDEXSLOTS) {
+		m = createmoduleexports (lib);
+		if (m) {
+			// a lookup of the old key that reads these exports finds the key changed
+			moduleindexkeys[reuse] = lib;
+			__sync_synchronize ();
+			moduleindex[reuse] = m;
+		}
+	}
+	pthread_mutex_unlock (&moduleindexlock);
+
+	return m;		//NULL when full, dlsym only
+}
+
+static
+bool cacheexport (MODULEEXPORTS *m, const char *name, uint32_t key, void *addr, int owned)
+{
+	EXPORTSLOT *slot;
+	unsigned i;
+
+	if (m->count >= (m->mask + 1) / 4 * 3)
+		return false;	//full enough, lookups stay correct without the cache
+
+	for (i = key & m->mask; ; i = (i + 1) & m->mask) {
+		slot = &m->cache[i];
+		if (slot->hash == EXPORTSLOTEMPTY) {
+			if (!__sync_bool_compare_and_swap (&slot->hash, EXPORTSLOTEMPTY, key))
+				continue;
+			slot->name = EXPORTSLOTBUSY;
+			slot->addr = addr;
+			slot->owned = owned;
+			__sync_synchronize ();
+			slot->name = name;
+			__sync_add_and_fetch (&m->count, 1);
+			return true;
+		}
+		if (slot->hash == key) {
+			const char *cached = slot->name;
+			if (cached == EXPORTSLOTBUSY || (cached && strcmp (cached, name) == 0))
+				return false;	//cached by another thread
+		}
+	}
+}
+
+static
+void* findexport (MODULEEXPORTS *m, const char *name, bool *local, bool cache)
+{
+	EXPORTSLOT *slot;
+	const char *cached, *stablename = NULL;
+	uint32_t hash, key;
+	unsigned i;
+	void *addr = NULL;
+
+	hash = gnuhashname (name);
+	key  = hash | 0x80000000u;
+
+	for (i = key & m->mask; ; i = (i + 1) & m->mask) {
+		slot = &m->cache[i];
+		if (slot->hash == EXPORTSLOTEMPTY)
+			break;
+		if (slot->hash == key) {
+			cached = slot->name;
+			__sync_synchronize ();
+			if (cached != EXPORTSLOTBUSY && cached && strcmp (cached, name) == 0) {
+				*local = !slot->owned;
+				return slot->addr;
+			}
+		}
+	}
+
+#ifdef HAVE_ELF_EXPORTS
+	addr = resolveexport (m, name, hash, &stablename);
+	if ( addr ) {
+		if ( cache )
+			cacheexport (m, stablename, key, addr, 0);
+		*local = true;
+		return addr;
+	}
+#endif
+	*local = false;
+	addr = dlsym (m->lib, name);
+	if ( addr && cache && (stablename = strdup (name)) )		//kept while the module is loaded
+		if ( !cacheexport (m, stablename, key, addr, 1) )
+			free ((void*)stablename);
+	return addr;
+}
+
+// finds an exported symbol of a module loaded by dlopen
+void* _getmoduleexport( void *lib, const char *name )
+{
+	MODULEEXPORTS *m;
+	bool local;
+
+	if ( !lib || lib == RTLD_DEFAULT || lib == RTLD_NEXT )
+		return dlsym (lib, name);
+
+	m = getmoduleexports (lib);
+	if ( !m )
+		return dlsym (lib, name);
+
+	return findexport (m, name, &local, true);
+}
+
+#ifdef HAVE_ELF_EXPORTS
+/*
+ * A bound import table is stored as the offsets of the symbols from the module
+ * base, under a name made of the build-id of the module and the hash of the
+ * name table. The mtime and the size of the module file are checked as well,
+ * so a warm start only reads one file and adds the base.
+ */
+
+#define BINDCACHEMAGIC		0x444E4942		//"BIND"
+#define BINDCACHEVERSION	1
+#define BINDNOTLOCAL		((int64_t)-1)	//resolved by dlsym at every start
+#define BUILDIDMAX			32
+
+typedef struct BINDCACHEHEADER_ {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t buildidlen;
+	uint64_t namehash;
+	uint8_t buildid[BUILDIDMAX];
+	int64_t mtime;
+	int64_t mtimensec;
+	int64_t size;
+} BINDCACHEHEADER;
+
+typedef struct BUILDIDSEARCH_ {
+	const char *path;
+	ElfW(Addr) base;
+	BINDCACHEHEADER *hdr;
+} BUILDIDSEARCH;
+
+static
+int findbuildid (struct dl_phdr_info *info, size_t size, void *param)
+{
+	BUILDIDSEARCH *search = (BUILDIDSEARCH*)param;
+	const ElfW(Phdr) *ph;
+	const char *p, *end;
+	unsigned i, align;
+
+	if (info->dlpi_addr != search->base || strcmp (info->dlpi_name ? info->dlpi_name : "", search->path) != 0)
+		return 0;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		ph = &info->dlpi_phdr[i];
+		if (ph->p_type != PT_NOTE)
+			continue;
+		align = ph->p_align == 8 ? 8 : 4;
+		p   = (const char*)(info->dlpi_addr + ph->p_vaddr);
+		end = p + ph->p_memsz;
+		while (p + sizeof(ElfW(Nhdr)) <= end) {
+			const ElfW(Nhdr) *note = (const ElfW(Nhdr)*)p;
+			const char *name = p + sizeof(ElfW(Nhdr));
+			const char *desc = name + ((note->n_namesz + align - 1) & ~(align - 1));
+
+			if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp (name, "GNU", 4) == 0 &&
+				note->n_descsz <= BUILDIDMAX) {
+				search->hdr->buildidlen = note->n_descsz;
+				memcpy (search->hdr->buildid, desc, note->n_descsz);
+				return 1;
+			}
+			p = desc + ((note->n_descsz + align - 1) & ~(align - 1));
+		}
+	}
+	return 1;		//a module without a build-id
+}
+
+// appends to the path at *n, false when it does not fit
+static
+bool appendpath (char *path, size_t pathlen, size_t *n, const char *format, ...)
+{
+	va_list args;
+	int r;
+
+	va_start (args, format);
+	r = vsnprintf (path + *n, pathlen - *n, format, args);
+	va_end (args);
+	if (r < 0 || (size_t)r >= pathlen - *n)
+		return false;
+	*n += r;
+	return true;
+}
+
+static
+bool getbindcachepath (MODULEEXPORTS *m, const char * const *names, unsigned count, BINDCACHEHEADER *hdr, char *path, size_t pathlen)
+{
+	struct link_map *map = (struct link_map*)m->lib;
+	BUILDIDSEARCH search;
+	struct stat st;
+	const char *dir, *modpath;
+	uint64_t h = 0xcbf29ce484222325ull;
+	unsigned i;
+	size_t n;
+	const unsigned char *p;
+	bool ok;
+
+	memset (hdr, 0, sizeof(BINDCACHEHEADER));
+	hdr->magic   = BINDCACHEMAGIC;
+	hdr->version = BINDCACHEVERSION;
+	hdr->count   = count;
+
+	modpath = map->l_name && *map->l_name ? map->l_name : "/proc/self/exe";
+	if (stat (modpath, &st) != 0)
+		return false;
+	hdr->mtime     = _getstatmtime (&st).tv_sec;
+	hdr->mtimensec = _getstatmtime (&st).tv_nsec;
+	hdr->size      = st.st_size;
+
+	search.path = map->l_name ? map->l_name : "";
+	search.base = map->l_addr;
+	search.hdr  = hdr;
+	dl_iterate_phdr (findbuildid, &search);
+
+	for (i = 0; i < count; i++)
+		for (p = (const unsigned char*)names[i]; ; p++) {
+			h = (h ^ *p) * 0x100000001b3ull;
+			if (!*p)
+				break;
+		}
+	hdr->namehash = h;
+
+	n = 0;
+	if ((dir = getenv ("XDG_CACHE_HOME")) && *dir)
+		ok = appendpath (path, pathlen, &n, "%s/4nix/bind/", dir);
+	else if ((dir = getenv ("HOME")) && *dir)
+		ok = appendpath (path, pathlen, &n, "%s/.cache/4nix/bind/", dir);
+	else
+		return false;
+	if (hdr->buildidlen)
+		for (i = 0; ok && i < hdr->buildidlen; i++)
+			ok = appendpath (path, pathlen, &n, "%02x", hdr->buildid[i]);
+	else
+		ok = ok && appendpath (path, pathlen, &n, "%llx-%llx", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+	return ok && appendpath (path, pathlen, &n, "-%016llx.bind", (unsigned long long)h);
+}
+
+// reads the header and the offsets at once, the buffer holds both
+static
+bool readbindcache (const char *path, const BINDCACHEHEADER *hdr, void *buffer)
+{
+	size_t len = sizeof(BINDCACHEHEADER) + hdr->count * sizeof(int64_t);
+	bool ok;
+	int fd;
+
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	ok = read (fd, buffer, len) == (ssize_t)len && memcmp (buffer, hdr, sizeof(BINDCACHEHEADER)) == 0;
+	close (fd);
+	return ok;
+}
+
+static
+void writebindcache (const char *path, const BINDCACHEHEADER *hdr, const int64_t *offsets)
+{
+	char tmp[PATH_MAX + 32];
+	size_t len = hdr->count * sizeof(int64_t);
+	int fd;
+
+	// renamed into place, the readers never see a partial table
+	snprintf (tmp, sizeof(tmp), "%s.%d", path, (int)getpid ());
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0 && errno == ENOENT) {
+		char *sep = strrchr (tmp, '/'), *parent;
+
+		// the cache directory and its parent are created on the first write
+		*sep = '\0';
+		parent = strrchr (tmp, '/');
+		*parent = '\0';
+		mkdir (tmp, 0700);
+		*parent = '/';
+		mkdir (tmp, 0700);
+		*sep = '/';
+		fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	}
+	if (fd < 0)
+		return;
+	if (write (fd, hdr, sizeof(BINDCACHEHEADER)) == sizeof(BINDCACHEHEADER) &&
+		write (fd, offsets, len) == (ssize_t)len &&
+		close (fd) == 0) {
+		if (rename (tmp, path) != 0)
+			unlink (tmp);
+		return;
+	}
+	close (fd);
+	unlink (tmp);
+}
+#endif
+
+// resolves a table of exports in one pass, returns the number of missing names
+unsigned _bindmoduleexports( void *lib, const char * const *names, unsigned count, void **table, unsigned flags )
+{
+	MODULEEXPORTS *m;
+	unsigned i, missing = 0;
+	bool local;
+#ifdef HAVE_ELF_EXPORTS
+	BINDCACHEHEADER hdr;
+	char path[PATH_MAX];
+	void *buffer = NULL;
+	int64_t *offsets = NULL;
+	bool cached = false;
+#endif
+
+	if ( !lib || lib == RTLD_DEFAULT || lib == RTLD_NEXT || !(m = getmoduleexports (lib)) ) {
+		for (i = 0; i < count; i++)
+			if ( !(table[i] = dlsym (lib, names[i])) )
+				missing++;
+		return missing;
+	}
+
+#ifdef HAVE_ELF_EXPORTS
+	if ( (flags & BIND_PROC_USE_CACHE) && count &&
+		getbindcachepath (m, names, count, &hdr, path, sizeof(path)) &&
+		(buffer = malloc (sizeof(BINDCACHEHEADER) + count * sizeof(int64_t))) ) {
+		offsets = (int64_t*)((BINDCACHEHEADER*)buffer + 1);
+		if ( readbindcache (path, &hdr, buffer) ) {
+			for (i = 0; i < count; i++) {
+				if ( offsets[i] != BINDNOTLOCAL )
+					table[i] = (void*)(m->base + (ElfW(Addr))offsets[i]);
+				else if ( !(table[i] = findexport (m, names[i], &local, false)) )
+					missing++;
+			}
+			free (buffer);
+			return missing;
+		}
+		cached = true;
+	}
+#endif
+
+	for (i = 0; i < count; i++) {
+		table[i] = findexport (m, names[i], &local, false);
+		if ( !table[i] )
+			missing++;
+#ifdef HAVE_ELF_EXPORTS
+		if ( cached )
+			offsets[i] = table[i] && local ? (int64_t)((ElfW(Addr))table[i] - m->base) : BINDNOTLOCAL;
+#endif
+	}
+
+#ifdef HAVE_ELF_EXPORTS
+	if ( cached )
+		writebindcache (path, &hdr, offsets);
+	free (buffer);
+#endif
+	return missing;
+}
+
+// forgets the index of a module passed to dlclose
+void _dropmoduleexports( void *lib )
+{
+	MODULEEXPORTS *m = NULL;
+	unsigned slot, i, s;
+
+	slot = moduleslot (lib);
+	pthread_mutex_lock (&moduleindexlock);
+	for (i = 0; i < MODULEINDEXSLOTS; i++) {
+		s = (slot + i) & (MODULEINDEXSLOTS - 1);
+		if (!moduleindexkeys[s])
+			break;
+		if (moduleindexkeys[s] == lib) {
+			// the key stays as a tombstone, the next module indexed may take the slot
+			m = moduleindex[s];
+			moduleindex[s] = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock (&moduleindexlock);
+
+	if (m) {
+		for (i = 0; i <= m->mask; i++)
+			if (m->cache[i].owned && m->cache[i].name != EXPORTSLOTBUSY)
+				free ((void*)m->cache[i].name);
+		free (m);
+	}
+}
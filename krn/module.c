@@ -15,6 +15,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdio.h>
+#include <errno.h>
 #include <dlfcn.h>
 #if defined(__linux__) || defined(__bsd__)
 # include <link.h>
@@ -27,116 +29,548 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "windows.h"
+#include "libloader.h"
 
 
 // depends on these functions:
 extern void _setlasterror( unsigned err );
 extern unsigned get_win_error( int err );
 extern uintptr_t _getcurrentprocess( );
+extern unsigned _getprocessid( uintptr_t hndl );
+extern void* _getmoduleexport( void *lib, const char *name );
+extern void _dropmoduleexports( void *lib );
+extern unsigned _bindmoduleexports( void *lib, const char * const *names, unsigned count, void **table, unsigned flags );
 
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-//NOTE: a global variable initialized when starting
-static const char *_pgmptr = NULL;
+//NOTE: computed once by the library constructor
+typedef struct PROGPATH_ {
+	unsigned length;
+	unsigned basename;		//the offset of the base name
+	char path[];
+} PROGPATH;
 
-static const char* get_progpath ()
+static PROGPATH * volatile _pgmptr = NULL;
+
+#if defined __linux__ || defined __CYGWIN__
+// reads a symbolic link of any length
+static char* readlinkalloc (const char *link)
 {
-	static char buf[PATH_MAX];	//TODO: dynamic buffer for _pgmptr variable
+	char *buf = NULL, *tmp;
+	size_t size = 256;
+	ssize_t rc;
+
+	for (;;) {
+		tmp = (char*) realloc (buf, size);
+		if (!tmp) {
+			free (buf);
+			return NULL;
+		}
+		buf = tmp;
+		rc = readlink (link, buf, size);
+		if (rc == -1) {
+			free (buf);
+			return NULL;
+		}
+		if ((size_t)rc < size) {
+			buf[rc] = '\0';
+			return buf;
+		}
+		size *= 2;		//truncated
+	}
+}
+#endif
 
+static const PROGPATH* get_progpath ()
+{
 	if (!_pgmptr) {
-		ssize_t rc;
+		PROGPATH *pgm;
+		char *epath = NULL, *path, *sep;
+		size_t len;
 
 		#if defined __linux__ || defined __CYGWIN__
-		char epathbuf[512];
-		const char *epath;
-		rc = readlink ("/proc/self/exe", epathbuf, sizeof(epathbuf));
-		if (rc != -1) {
-			epathbuf[rc] = '\0';
-			epath = epathbuf;
-		}
+		epath = readlinkalloc ("/proc/self/exe");
 		#ifndef __CYGWIN__
-		else {
+		if (!epath) {
 			Dl_info info;
-			rc = dladdr (get_progpath, &info);
-			if (rc == 0) { /*printf ("error\n");*/ return NULL; }
-			epath = info.dli_fname;
+			if (dladdr (get_progpath, &info) == 0 || !info.dli_fname) { /*printf ("error\n");*/ return NULL; }
+			epath = strdup (info.dli_fname);
 		}
 		#endif
 
 		#elif defined __MACH__
-		char epath[512];
-		uint32_t size = sizeof(epath);
-		rc = _NSGetExecutablePath (epath, &size);
-		if (rc != 0) { /*printf ("error\n");*/ return NULL; }
+		uint32_t size = 0;
+		_NSGetExecutablePath (NULL, &size);
+		epath = (char*) malloc (size);
+		if (epath && _NSGetExecutablePath (epath, &size) != 0) { free (epath); /*printf ("error\n");*/ return NULL; }
 
 		#elif defined __freebsd__
 		int mib[4];
+		size_t cb = 0;
 		mib[0] = CTL_KERN;
 		mib[1] = KERN_PROC;
 		mib[2] = KERN_PROC_PATHNAME;
 		mib[3] = -1;
-		//char buf[1024];
-		char epath[512];
-		size_t cb = sizeof(epath);
-		sysctl (mib, 4, epath, &cb, NULL, 0);
+		sysctl (mib, 4, NULL, &cb, NULL, 0);
+		epath = (char*) malloc (cb + 1);
+		if (epath && sysctl (mib, 4, epath, &cb, NULL, 0) != 0) { free (epath); return NULL; }
 
 		#else
 		#error get_progpath function not implemented for your platform
 
 		#endif
 
-		buf[0] = '\0';
-		realpath (epath, buf);
-		buf[sizeof(buf)-1] = '\0';
+		if (!epath)
+			return NULL;
+
+		// a deleted executable keeps the text of the link
+		path = realpath (epath, NULL);
+		if (path)
+			free (epath);
+		else
+			path = epath;
 
-		__sync_val_compare_and_swap (&_pgmptr, NULL, buf);
+		len = strlen (path);
+		pgm = (PROGPATH*) malloc (sizeof(PROGPATH) + len + 1);
+		if (!pgm) {
+			free (path);
+			return NULL;
+		}
+		memcpy (pgm->path, path, len + 1);
+		free (path);
+		pgm->length = (unsigned)len;
+		sep = strrchr (pgm->path, '/');
+		pgm->basename = sep ? (unsigned)(sep + 1 - pgm->path) : 0;
+
+		if (!__sync_bool_compare_and_swap (&_pgmptr, NULL, pgm))
+			free (pgm);
 	}
 
 	return _pgmptr;
 }
 
+static void __attribute__((constructor)) initprogpath ()
+{
+	get_progpath ();
+}
+
+/*
+ * The modules loaded by _loadlibraryex live in a table of slots. A handle holds
+ * the index of the slot and its generation above the two low bits, which mark
+ * the mappings of data files as on Windows, so a stale or a random handle is
+ * rejected without a lock. The names a module was loaded by are indexed, and
+ * loading it again by the same name only takes a reference.
+ */
+
+#define MODULESLOTS			4096		//power of two
+#define MODULEHASHSIZE		1024		//power of two
+#define MODULEHANDLE(index, gen)	(((uintptr_t)(gen) << 12 | (index)) << 2)
+#define MODULEINDEX(h)		((unsigned)((h) >> 2) & (MODULESLOTS - 1))
+
+#define LOADSEARCHFLAGS		(LOAD_LIBRARY_SEARCH_DLL_LOAD_DIR | LOAD_LIBRARY_SEARCH_APPLICATION_DIR | \
+							 LOAD_LIBRARY_SEARCH_USER_DIRS | LOAD_LIBRARY_SEARCH_SYSTEM32 | LOAD_LIBRARY_SEARCH_DEFAULT_DIRS)
+#define LOADDATAFLAGS		(LOAD_LIBRARY_AS_DATAFILE | LOAD_LIBRARY_AS_DATAFILE_EXCLUSIVE | LOAD_LIBRARY_AS_IMAGE_RESOURCE)
+#define LOADBINDFLAGS		LOAD_LIBRARY_LAZY_BINDING
+#define LOADLIBRARYFLAGS	(LOADSEARCHFLAGS | LOADDATAFLAGS | LOADBINDFLAGS | DONT_RESOLVE_DLL_REFERENCES | LOAD_WITH_ALTERED_SEARCH_PATH | \
+							 LOAD_IGNORE_CODE_AUTHZ_LEVEL | LOAD_LIBRARY_REQUIRE_SIGNED_TARGET | LOAD_LIBRARY_SAFE_CURRENT_DIRS)
+
+typedef struct MODULENAME_ {
+	struct MODULENAME_ *next;		//the hash chain
+	struct MODULENAME_ *nextalias;	//the names of the same module
+	struct MODULEOBJ_ *module;
+	unsigned flags;					//the search and binding flags of the load
+	uint32_t hash;
+	char name[];
+} MODULENAME;
+
+typedef struct MODULEOBJ_ {
+	uintptr_t handle;
+	void *lib;						//the dlopen handle, NULL for a data file
+	void *view;						//the mapping of a data file
+	size_t viewsize;
+	char *path;						//the path of a data file
+	const char *filename;			//the path of the module, computed once
+	unsigned filenamelength;
+	unsigned basename;				//the offset of the base name
+	unsigned refcount;				//0 for a module found by the registry only
+	unsigned seen;					//the last registry refresh that found the module
+	uintptr_t libaddr;				//the link_map when inserted, a freed one may be reused
+	const char *libname;
+	uint32_t libnamehash;
+	MODULENAME *names;
+	struct MODULEOBJ_ *nextlib;
+} MODULEOBJ;
+
+static MODULEOBJ * volatile moduletable[MODULESLOTS];
+static unsigned short modulegeneration[MODULESLOTS];
+static unsigned modulenextslot = 0;
+static MODULENAME *modulenames[MODULEHASHSIZE];
+static MODULEOBJ *modulelibs[MODULEHASHSIZE];
+static char *dlldirectory = NULL;
+static pthread_mutex_t moduletablelock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline
+uint32_t hashmodulename (const char *name, unsigned flags)
+{
+	uint32_t h = 2166136261u ^ flags;
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	return h;
+}
+
+static inline
+unsigned hashmodulelib (void *lib)
+{
+	uintptr_t h = (uintptr_t)lib;
+	return (unsigned)((h ^ h >> 12) * 0x9E3779B1u) >> 22 & (MODULEHASHSIZE - 1);
+}
+
+static inline
+MODULEOBJ* getmodule (uintptr_t hModule)
+{
+	MODULEOBJ *m = moduletable[MODULEINDEX(hModule)];
+
+	return m && m->handle == hModule ? m : NULL;
+}
+
+// takes a free slot, the caller holds moduletablelock
 static
-unsigned _getmodulefilename( uintptr_t hModule, char* filename, unsigned size )
+bool insertmodule (MODULEOBJ *m, unsigned filebits)
 {
-	// NOTES:
-	// This function always returns the long path of hModule
-	// The function doesn't write a terminating '\0' if the buffer is too small.
+	unsigned i, slot;
 
-	const char *modulename;
-	size_t len;
-	unsigned rc;
+	for (i = 0; i < MODULESLOTS; i++) {
+		slot = (modulenextslot + i) & (MODULESLOTS - 1);
+		if (!moduletable[slot])
+			break;
+	}
+	if (i == MODULESLOTS)
+		return false;
+
+	if (m->lib) {
+		m->libaddr = ((struct link_map*)m->lib)->l_addr;
+		m->libname = ((struct link_map*)m->lib)->l_name;
+		m->libnamehash = hashmodulename (m->libname ? m->libname : "", 0);
+		m->filename = ((struct link_map*)m->lib)->l_name;
+		if (!m->filename || !*m->filename) {
+			// the main program
+			const PROGPATH *pgm = get_progpath ();
+			m->filename = pgm ? pgm->path : "";
+		}
+	} else
+		m->filename = m->path;
+	m->filenamelength = (unsigned)strlen (m->filename);
+	m->basename = strrchr (m->filename, '/') ? (unsigned)(strrchr (m->filename, '/') + 1 - m->filename) : 0;
+
+	modulenextslot = slot + 1;
+	if (++modulegeneration[slot] == 0)
+		modulegeneration[slot] = 1;		//a handle is never NULL
+	m->handle = MODULEHANDLE(slot, modulegeneration[slot]) | filebits;
+	if (m->lib) {
+		m->nextlib = modulelibs[hashmodulelib (m->lib)];
+		modulelibs[hashmodulelib (m->lib)] = m;
+	}
+	__sync_synchronize ();
+	moduletable[slot] = m;
+	return true;
+}
+
+// the caller holds moduletablelock
+static
+void addmodulename (MODULEOBJ *m, const char *name, unsigned flags, uint32_t hash)
+{
+	MODULENAME *entry;
+
+	for (entry = modulenames[hash & (MODULEHASHSIZE - 1)]; entry; entry = entry->next)
+		if (entry->hash == hash && entry->flags == flags && strcmp (entry->name, name) == 0)
+			return;
+
+	entry = (MODULENAME*) malloc (sizeof(MODULENAME) + strlen (name) + 1);
+	if (!entry)
+		return;		//only the index is lost
+	entry->module = m;
+	entry->flags  = flags;
+	entry->hash   = hash;
+	strcpy (entry->name, name);
+	entry->next = modulenames[hash & (MODULEHASHSIZE - 1)];
+	modulenames[hash & (MODULEHASHSIZE - 1)] = entry;
+	entry->nextalias = m->names;
+	m->names = entry;
+}
+
+// the caller holds moduletablelock
+static
+void removemodulenames (MODULEOBJ *m)
+{
+	MODULENAME *entry, *next, **link;
+
+	for (entry = m->names; entry; entry = next) {
+		next = entry->nextalias;
+		for (link = &modulenames[entry->hash & (MODULEHASHSIZE - 1)]; *link; link = &(*link)->next)
+			if (*link == entry) {
+				*link = entry->next;
+				break;
+			}
+		free (entry);
+	}
+	m->names = NULL;
+}
+
+// unlinks a module no longer mapped, the caller holds moduletablelock
+static
+void removemodule (MODULEOBJ *m)
+{
+	MODULEOBJ **lib;
+
+	removemodulenames (m);
+	if (m->lib) {
+		for (lib = &modulelibs[hashmodulelib (m->lib)]; *lib; lib = &(*lib)->nextlib)
+			if (*lib == m) {
+				*lib = m->nextlib;
+				break;
+			}
+	}
+	moduletable[MODULEINDEX(m->handle)] = NULL;
+}
+
+static
+void freemodule (MODULEOBJ *m)
+{
+	free (m->path);
+	free (m);
+}
+
+// whether the link_map of a module is still the one it was inserted with
+static
+bool ismodulelibcurrent (MODULEOBJ *m)
+{
+	struct link_map *map = (struct link_map*)m->lib;
+
+	return map->l_addr == m->libaddr && map->l_name == m->libname &&
+		   hashmodulename (map->l_name ? map->l_name : "", 0) == m->libnamehash;
+}
+
+// finds a bare name in the directories of the search flags
+static
+bool searchlibrary (const char *name, unsigned dwFlags, char *path, size_t size)
+{
+	const char *progpath, *sep;
+
+	if (dwFlags & (LOAD_LIBRARY_SEARCH_APPLICATION_DIR | LOAD_LIBRARY_SEARCH_DEFAULT_DIRS)) {
+		const PROGPATH *pgm = get_progpath ();
+		progpath = pgm ? pgm->path : NULL;
+		sep = pgm && pgm->basename ? progpath + pgm->basename - 1 : NULL;
+		if (sep && (size_t)snprintf (path, size, "%.*s/%s", (int)(sep - progpath), progpath, name) < size &&
+			access (path, F_OK) == 0)
+			return true;
+	}
+
+	if (dwFlags & (LOAD_LIBRARY_SEARCH_USER_DIRS | LOAD_LIBRARY_SEARCH_DEFAULT_DIRS)) {
+		bool found = false;
+
+		pthread_mutex_lock (&moduletablelock);
+		if (dlldirectory && (size_t)snprintf (path, size, "%s/%s", dlldirectory, name) < size)
+			found = access (path, F_OK) == 0;
+		pthread_mutex_unlock (&moduletablelock);
+		if (found)
+			return true;
+	}
+
+	return false;
+}
+
+// the dynamic linker reports its errors only as text
+static
+unsigned getloadererror ()
+{
+	const char *msg = dlerror ();
+
+	if (!msg)
+		return ERROR_MOD_NOT_FOUND;
+	if (strstr (msg, "undefined symbol"))
+		return ERROR_PROC_NOT_FOUND;
+	if (strstr (msg, "Permission denied"))
+		return ERROR_ACCESS_DENIED;
+	if (strstr (msg, "Cannot allocate memory") || strstr (msg, "out of memory"))
+		return ERROR_NOT_ENOUGH_MEMORY;
+	if (strstr (msg, "ELF") || strstr (msg, "file too short") || strstr (msg, "position-independent executable"))
+		return ERROR_BAD_EXE_FORMAT;
+	return ERROR_MOD_NOT_FOUND;
+}
+
+// maps a module as a read only view, nothing in it runs; a module that must not resolve
+// its references is an image mapping, dlopen would run its constructors
+static
+uintptr_t loaddatafile (const char *libname, unsigned dwFlags)
+{
+	MODULEOBJ *m;
+	struct stat st;
+	char path[PATH_MAX];
+	const char *target = libname;
+	void *view;
+	int fd;
+
+	if (!strchr (libname, '/') && (dwFlags & LOADSEARCHFLAGS) && searchlibrary (libname, dwFlags, path, sizeof(path)))
+		target = path;
+
+	fd = open (target, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		_setlasterror( errno == ENOENT ? ERROR_MOD_NOT_FOUND : get_win_error (errno) );
+		return (uintptr_t)NULL;
+	}
+	if (fstat (fd, &st) != 0 || st.st_size < 4 || !S_ISREG(st.st_mode)) {
+		close (fd);
+		_setlasterror( ERROR_BAD_EXE_FORMAT );
+		return (uintptr_t)NULL;
+	}
+	view = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (view == MAP_FAILED) {
+		_setlasterror( get_win_error (errno) );
+		return (uintptr_t)NULL;
+	}
+	if (memcmp (view, "\177ELF", 4) != 0) {
+		munmap (view, st.st_size);
+		_setlasterror( ERROR_BAD_EXE_FORMAT );
+		return (uintptr_t)NULL;
+	}
+
+	m = (MODULEOBJ*) calloc (1, sizeof(MODULEOBJ));
+	if (m)
+		m->path = realpath (target, NULL);
+	if (!m || !m->path) {
+		free (m);
+		munmap (view, st.st_size);
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return (uintptr_t)NULL;
+	}
+	m->view     = view;
+	m->viewsize = st.st_size;
+	m->refcount = 1;
+
+	// every data file load is a mapping of its own
+	pthread_mutex_lock (&moduletablelock);
+	if (!insertmodule (m, (dwFlags & LOAD_LIBRARY_AS_IMAGE_RESOURCE) || !(dwFlags & LOADDATAFLAGS) ? 2 : 1)) {
+		pthread_mutex_unlock (&moduletablelock);
+		munmap (view, st.st_size);
+		freemodule (m);
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return (uintptr_t)NULL;
+	}
+	pthread_mutex_unlock (&moduletablelock);
+	return m->handle;
+}
+
+bool _setdlldirectory( const char *path )
+{
+	// the directory searched for LOAD_LIBRARY_SEARCH_USER_DIRS
+	char *dir = NULL;
+
+	if ( path && !(dir = strdup (path)) ) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return false;
+	}
+
+	pthread_mutex_lock (&moduletablelock);
+	free (dlldirectory);
+	dlldirectory = dir;
+	pthread_mutex_unlock (&moduletablelock);
+	return true;
+}
+
+// the cached path of a module and the offset of its base name, nothing is copied
+static
+const char* getmodulepath( uintptr_t hModule, unsigned *length, unsigned *basename )
+{
+	const PROGPATH *pgm;
+	MODULEOBJ *m;
 
 #if !defined __MACH__ && !defined __CYGWIN__
-	if ( hModule == (uintptr_t)NULL ) {
-#endif
-		modulename = get_progpath ();
-#if !defined __MACH__ && !defined __CYGWIN__
-	} else {
+	if ( hModule != (uintptr_t)NULL ) {
 		// get path to a library requested by hModule
-		void *addr = (void*)hModule;
-		modulename = ((struct link_map*)addr)->l_name;
+		m = getmodule (hModule);
+		if ( !m ) {
+			_setlasterror( ERROR_MOD_NOT_FOUND );
+			return NULL;
+		}
+		*length = m->filenamelength;
+		*basename = m->basename;
+		return m->filename;
 	}
 #endif
 
-	if ( modulename == NULL || modulename[0] == '\0' ) {
+	pgm = get_progpath ();
+	if ( !pgm || !pgm->length ) {
 		_setlasterror( ERROR_INVALID_DATA );
+		return NULL;
+	}
+	*length = pgm->length;
+	*basename = pgm->basename;
+	return pgm->path;
+}
+
+const char* _getmodulefilenameptr( uintptr_t hModule, unsigned *length )
+{
+	// the path of a module in the current process, valid while it is loaded
+	const char *path;
+	unsigned len, base;
+
+	path = getmodulepath (hModule, &len, &base);
+	if ( path && length )
+		*length = len;
+	return path;
+}
+
+const char* _getmodulebasenameptr( uintptr_t hModule, unsigned *length )
+{
+	// the base name of a module in the current process, valid while it is loaded
+	const char *path;
+	unsigned len, base;
+
+	path = getmodulepath (hModule, &len, &base);
+	if ( !path )
+		return NULL;
+	if ( length )
+		*length = len - base;
+	return path + base;
+}
+
+static
+unsigned _getmodulefilename( uintptr_t hModule, char* filename, unsigned size )
+{
+	// NOTES:
+	// This function always returns the long path of hModule
+	// The function doesn't write a terminating '\0' if the buffer is too small.
+
+	const char *modulename;
+	unsigned len, base, rc;
+
+	modulename = getmodulepath (hModule, &len, &base);
+	if ( modulename == NULL || len == 0 ) {
+		if ( modulename )
+			_setlasterror( ERROR_INVALID_DATA );
 		return 0;
 	}
 
-	len = strlen (modulename);
 	if ( len >= size ) {
 		_setlasterror( ERROR_INSUFFICIENT_BUFFER );
+		if ( size == 0 )
+			return 0;
 		rc = size;
 		len = size - 1;
 	} else
-		rc = (unsigned)len;
+		rc = len;
 
-	if (filename) { strncpy (filename, modulename, len); filename[len] = '\0'; }
+	if (filename) { memcpy (filename, modulename, len); filename[len] = '\0'; }
 	return rc;
 }
 
@@ -146,33 +580,44 @@ unsigned _getmodulefilenameex( uintptr_t hProcess, uintptr_t hModule, char* file
 
 	if ( hProcess == _getcurrentprocess( ) )		//todo: check this
 		cnt = _getmodulefilename( hModule, filename, size );
-	else
+	else if ( hModule == (uintptr_t)NULL )
 	{
-		/*PROCTAB *proct;
-		proc_t *proc_info;
-		pid_t pid;
-
-		pid = getpid ();		//TODO: extract from hProcess
-		//NOTE: I don't know how to get opened shared library name when using 'procps'
+		// the executable of another process
+		unsigned pid;
+		char procpath[32], *path;
+		size_t len;
 
-		proct = openproc (PROC_FILLCOM);
-		if (proct == NULL) {
-			_setlasterror( get_win_error (errno) );
+		pid = _getprocessid( hProcess );
+		if ( pid == 0 )
 			return 0;
-		}
 
-		while ( (proc_info = readproc (proct, NULL)) ) {
-			if (proc_info->tid == pid) {
-				strncpy (lpFilename, proc_info->cmdline[0], nSize); lpFilename[nSize-1] = '\0';
-				break;
-			}
+#if defined __linux__ || defined __CYGWIN__
+		snprintf (procpath, sizeof(procpath), "/proc/%u/exe", pid);
+		path = readlinkalloc (procpath);
+#else
+		//TODO: proc_pidpath on Mach
+		errno = ENOSYS;
+		path = NULL;
+#endif
+		if ( !path ) {
+			_setlasterror( errno == ENOENT ? ERROR_INVALID_HANDLE : get_win_error (errno) );
+			return 0;
 		}
+		len = strlen (path);
 
-		closeproc (proct);
-
-		cnt = strlen (lpFilename);*/
+		if ( len >= size ) {
+			_setlasterror( ERROR_INSUFFICIENT_BUFFER );
+			cnt = size;
+			len = size ? size - 1 : 0;
+		} else
+			cnt = (unsigned)len;
 
-		//TODO: enable this function
+		if (filename && size) { memcpy (filename, path, len); filename[len] = '\0'; }
+		free (path);
+	}
+	else
+	{
+		//TODO: the modules of another process from /proc/<pid>/maps
 		_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
 		cnt = 0;
 	}
@@ -183,82 +628,670 @@ unsigned _getmodulefilenameex( uintptr_t hProcess, uintptr_t hModule, char* file
 unsigned _getmodulebasename( uintptr_t hProcess, uintptr_t hModule, char* basename, unsigned size )
 {
 	unsigned cnt;
-	char szFilename[PATH_MAX];
+	const char *path;
+	unsigned len, base;
 
-	cnt = _getmodulefilenameex( hProcess, hModule, szFilename, sizeof(szFilename) );
-	if (cnt > 0) {
-		size_t len;
+	if ( hProcess != _getcurrentprocess( ) ) {
+		// the executable of another process
+		char *filename = NULL, *tmp, *lptr;
+		unsigned bufsize = 256;
+
+		// grown while the path is truncated
+		for (;; bufsize *= 2) {
+			tmp = (char*) realloc (filename, bufsize);
+			if ( !tmp ) {
+				free (filename);
+				_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+				return 0;
+			}
+			filename = tmp;
+			cnt = _getmodulefilenameex( hProcess, hModule, filename, bufsize );
+			if ( cnt < bufsize )
+				break;
+		}
+		if ( cnt > 0 ) {
+			lptr = strrchr (filename, '/');
+			lptr = (lptr ? lptr+1 : filename);
+			len = (unsigned)strlen (lptr);
+			if ( len >= size ) {
+				_setlasterror( ERROR_INSUFFICIENT_BUFFER );
+				cnt = 0;
+			} else {
+				memcpy (basename, lptr, len + 1);
+				cnt = len;
+			}
+		}
+		free (filename);
+		return cnt;
+	}
 
-		char *lptr = strrchr (szFilename, '/');
-		lptr = (lptr ? lptr+1 : szFilename);
+	path = getmodulepath (hModule, &len, &base);
+	if ( !path || len == 0 )
+		return 0;
+	len -= base;
+	if ( len >= size ) {
+		_setlasterror( ERROR_INSUFFICIENT_BUFFER );
+		return 0;
+	}
+	memcpy (basename, path + base, len + 1);
+	return len;
+}
 
-		len = strlen (lptr);
-		if ( len >= size ) {
-			_setlasterror( ERROR_INSUFFICIENT_BUFFER );
-			return 0;
+/*
+ * The registry lists the modules of the process in the order dl_iterate_phdr
+ * reports them, and keeps their PT_LOAD segments sorted by address. It is
+ * rebuilt only when the dlpi_adds or dlpi_subs counters of the dynamic linker
+ * change. Modules not loaded by _loadlibraryex get a module object with no
+ * references, so their handles stay the same for as long as they are mapped.
+ */
+
+typedef struct MODULESEGMENT_ {
+	uintptr_t start;
+	uintptr_t end;
+	MODULEOBJ *module;
+} MODULESEGMENT;
+
+typedef struct MODULESNAPSHOT_ {
+	unsigned long long adds;
+	unsigned long long subs;
+	unsigned count;
+	unsigned nsegments;
+	MODULEOBJ **modules;			//the load order, the main program first
+	MODULESEGMENT *segments;		//sorted by start
+} MODULESNAPSHOT;
+
+typedef struct PHDRMODULE_ {
+	uintptr_t probe;				//an address inside the module
+	unsigned first;					//the first of its segments
+	unsigned nsegments;
+	struct link_map *map;
+} PHDRMODULE;
+
+typedef struct PHDRLIST_ {
+	unsigned long long adds;
+	unsigned long long subs;
+	unsigned count, capacity;
+	unsigned nsegments, segcapacity;
+	PHDRMODULE *modules;
+	MODULESEGMENT *segments;
+	bool failed;
+} PHDRLIST;
+
+static MODULESNAPSHOT *modulesnapshot = NULL;
+static unsigned moduleregistryepoch = 0;
+static pthread_rwlock_t moduleregistrylock = PTHREAD_RWLOCK_INITIALIZER;
+
+static
+int readphdrcounters (struct dl_phdr_info *info, size_t size, void *param)
+{
+	unsigned long long *counters = (unsigned long long*)param;
+
+	counters[0] = info->dlpi_adds;
+	counters[1] = info->dlpi_subs;
+	return 1;
+}
+
+static
+int collectphdrmodule (struct dl_phdr_info *info, size_t size, void *param)
+{
+	PHDRLIST *list = (PHDRLIST*)param;
+	PHDRMODULE *mod;
+	unsigned i;
+
+	if (list->count == 0) {
+		list->adds = info->dlpi_adds;
+		list->subs = info->dlpi_subs;
+	}
+	if (list->count == list->capacity) {
+		unsigned capacity = list->capacity ? list->capacity * 2 : 64;
+		void *modules = realloc (list->modules, capacity * sizeof(PHDRMODULE));
+		if (!modules) {
+			list->failed = true;
+			return 1;
 		}
+		list->modules  = (PHDRMODULE*)modules;
+		list->capacity = capacity;
+	}
 
-		strcpy (basename, lptr);
-		cnt = (unsigned)len;
+	mod = &list->modules[list->count];
+	mod->probe = 0;
+	mod->first = list->nsegments;
+	mod->nsegments = 0;
+	mod->map = NULL;
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+
+		if (ph->p_type != PT_LOAD || ph->p_memsz == 0)
+			continue;
+		if (list->nsegments == list->segcapacity) {
+			unsigned capacity = list->segcapacity ? list->segcapacity * 2 : 256;
+			void *segments = realloc (list->segments, capacity * sizeof(MODULESEGMENT));
+			if (!segments) {
+				list->failed = true;
+				return 1;
+			}
+			list->segments    = (MODULESEGMENT*)segments;
+			list->segcapacity = capacity;
+		}
+		list->segments[list->nsegments].start  = info->dlpi_addr + ph->p_vaddr;
+		list->segments[list->nsegments].end    = info->dlpi_addr + ph->p_vaddr + ph->p_memsz;
+		list->segments[list->nsegments].module = NULL;
+		if (!mod->probe)
+			mod->probe = list->segments[list->nsegments].start;
+		list->nsegments++;
+		mod->nsegments++;
 	}
-	return cnt;
+	if (mod->nsegments)
+		list->count++;
+	return 0;
 }
 
-bool _getmodulehandleex( unsigned flags, const char* name, uintptr_t *module )
+static
+int comparesegments (const void *a, const void *b)
+{
+	const MODULESEGMENT *x = (const MODULESEGMENT*)a, *y = (const MODULESEGMENT*)b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// the caller holds moduleregistrylock for writing
+static
+void dropmodulesnapshot ()
 {
-	//TODO: implement
-	_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
-	if (module) *module = (uintptr_t)NULL;
+	if (modulesnapshot) {
+		free (modulesnapshot->modules);
+		free (modulesnapshot->segments);
+		free (modulesnapshot);
+		modulesnapshot = NULL;
+	}
+}
+
+static inline
+bool ismodulesnapshotcurrent ()
+{
+	unsigned long long counters[2];
+
+	if (!modulesnapshot)
+		return false;
+	dl_iterate_phdr (readphdrcounters, counters);
+	return counters[0] == modulesnapshot->adds && counters[1] == modulesnapshot->subs;
+}
+
+// returns with moduleregistrylock held for reading, or false
+static
+bool lockmoduleregistry ()
+{
+	PHDRLIST list;
+	MODULESNAPSHOT *snapshot;
+	MODULEOBJ *m, *stale = NULL;
+	Dl_info info;
+	unsigned long long counters[2];
+	unsigned i, j, epoch;
+
+	pthread_rwlock_rdlock (&moduleregistrylock);
+	if (ismodulesnapshotcurrent ())
+		return true;
+	pthread_rwlock_unlock (&moduleregistrylock);
+
+collect:
+	// the dynamic linker is not called with our locks held
+	memset (&list, 0, sizeof(list));
+	dl_iterate_phdr (collectphdrmodule, &list);
+	for (i = 0; i < list.count && !list.failed; i++) {
+		void *map = NULL;
+		if (dladdr1 ((void*)list.modules[i].probe, &info, &map, RTLD_DL_LINKMAP))
+			list.modules[i].map = (struct link_map*)map;
+	}
+
+	snapshot = (MODULESNAPSHOT*) calloc (1, sizeof(MODULESNAPSHOT));
+	if (snapshot) {
+		snapshot->modules  = (MODULEOBJ**) malloc ((list.count + 1) * sizeof(MODULEOBJ*));
+		snapshot->segments = list.segments;
+		list.segments = NULL;
+	}
+	if (list.failed || !snapshot || !snapshot->modules) {
+		if (snapshot) {
+			free (snapshot->modules);
+			free (snapshot->segments);
+			free (snapshot);
+		}
+		free (list.modules);
+		free (list.segments);
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return false;
+	}
+	snapshot->adds = list.adds;
+	snapshot->subs = list.subs;
+
+	pthread_rwlock_wrlock (&moduleregistrylock);
+
+	// a dlclose since the collection may have freed one of the link_maps
+	dl_iterate_phdr (readphdrcounters, counters);
+	if (counters[0] != list.adds || counters[1] != list.subs) {
+		pthread_rwlock_unlock (&moduleregistrylock);
+		free (snapshot->modules);
+		free (snapshot->segments);
+		free (snapshot);
+		free (list.modules);
+		goto collect;
+	}
+
+	pthread_mutex_lock (&moduletablelock);
+	epoch = ++moduleregistryepoch;
+	for (i = 0; i < list.count; i++) {
+		struct link_map *map = list.modules[i].map;
+
+		if (!map)
+			continue;
+		for (m = modulelibs[hashmodulelib (map)]; m; m = m->nextlib)
+			if (m->lib == map)
+				break;
+		if (m && m->refcount == 0 && !ismodulelibcurrent (m)) {
+			// dlclosed by the program, the link_map is reused by another module
+			removemodule (m);
+			m->nextlib = stale;
+			stale = m;
+			m = NULL;
+		}
+		if (!m && (m = (MODULEOBJ*) calloc (1, sizeof(MODULEOBJ)))) {
+			m->lib = map;
+			if (!insertmodule (m, 0)) {
+				free (m);
+				m = NULL;
+			}
+		}
+		if (!m)
+			continue;
+		m->seen = epoch;
+		snapshot->modules[snapshot->count++] = m;
+		// compacted in place, the modules without a link_map are left out
+		for (j = 0; j < list.modules[i].nsegments; j++) {
+			MODULESEGMENT segment = snapshot->segments[list.modules[i].first + j];
+			segment.module = m;
+			snapshot->segments[snapshot->nsegments++] = segment;
+		}
+	}
+
+	// the modules unloaded without _freelibrary
+	for (i = 0; i < MODULESLOTS; i++) {
+		m = moduletable[i];
+		if (m && m->lib && m->refcount == 0 && m->seen != epoch) {
+			removemodule (m);
+			m->nextlib = stale;
+			stale = m;
+		}
+	}
+	pthread_mutex_unlock (&moduletablelock);
+
+	qsort (snapshot->segments, snapshot->nsegments, sizeof(MODULESEGMENT), comparesegments);
+	dropmodulesnapshot ();
+	modulesnapshot = snapshot;
+	pthread_rwlock_unlock (&moduleregistrylock);
+
+	free (list.modules);
+	while (stale) {
+		m = stale;
+		stale = m->nextlib;
+		_dropmoduleexports (m->lib);
+		freemodule (m);
+	}
+
+	// the snapshot may already be replaced, the readers never wait for a refresh
+	pthread_rwlock_rdlock (&moduleregistrylock);
+	if (modulesnapshot)
+		return true;
+	pthread_rwlock_unlock (&moduleregistrylock);
+	_setlasterror( ERROR_MOD_NOT_FOUND );
 	return false;
 }
 
+// the caller holds moduleregistrylock
+static
+MODULEOBJ* findmodulebyaddress (uintptr_t addr)
+{
+	MODULESEGMENT *segments = modulesnapshot->segments;
+	unsigned lo = 0, hi = modulesnapshot->nsegments, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (addr < segments[mid].start)
+			hi = mid;
+		else if (addr >= segments[mid].end)
+			lo = mid + 1;
+		else
+			return segments[mid].module;
+	}
+	return NULL;
+}
+
+// the caller holds moduleregistrylock
+static
+MODULEOBJ* findmodulebyname (const char *name)
+{
+	const char *path, *base;
+	bool bare = !strchr (name, '/');
+	unsigned i;
+
+	for (i = 0; i < modulesnapshot->count; i++) {
+		path = ((struct link_map*)modulesnapshot->modules[i]->lib)->l_name;
+		if (!path || !*path)
+			continue;		//the main program is only found by a NULL name
+		base = strrchr (path, '/');
+		base = base ? base + 1 : path;
+		if (strcmp (bare ? base : path, name) == 0)
+			return modulesnapshot->modules[i];
+	}
+	return NULL;
+}
+
+bool _getmodulehandleex( unsigned flags, const char* name, uintptr_t *module )
+{
+	MODULEOBJ *m;
+	char path[PATH_MAX];
+	uintptr_t hModule;
+	void *ref;
+
+	if ( module )
+		*module = (uintptr_t)NULL;
+	if ( !module || (flags & ~(GET_MODULE_HANDLE_EX_FLAG_PIN | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT |
+							   GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS)) ||
+		 ((flags & GET_MODULE_HANDLE_EX_FLAG_PIN) && (flags & GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT)) ||
+		 (!name && (flags & GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS)) ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	if ( !lockmoduleregistry () )
+		return false;
+	if ( flags & GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS )
+		m = findmodulebyaddress ((uintptr_t)name);
+	else if ( name )
+		m = findmodulebyname (name);
+	else
+		m = modulesnapshot->count ? modulesnapshot->modules[0] : NULL;
+	if ( !m ) {
+		pthread_rwlock_unlock (&moduleregistrylock);
+		_setlasterror( ERROR_MOD_NOT_FOUND );
+		return false;
+	}
+	hModule = m->handle;
+	strncpy (path, ((struct link_map*)m->lib)->l_name, sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+	pthread_rwlock_unlock (&moduleregistrylock);
+
+	if ( flags & GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT ) {
+		*module = hModule;
+		return true;
+	}
+
+	// a counted reference holds the module like _loadlibraryex
+	ref = dlopen (path[0] ? path : NULL, RTLD_LAZY | RTLD_NOLOAD |
+				  (flags & GET_MODULE_HANDLE_EX_FLAG_PIN ? RTLD_NODELETE : 0));
+	if ( !ref ) {
+		_setlasterror( ERROR_MOD_NOT_FOUND );
+		return false;
+	}
+	if ( flags & GET_MODULE_HANDLE_EX_FLAG_PIN ) {
+		// the reference is never released
+		*module = hModule;
+		return true;
+	}
+
+	pthread_mutex_lock (&moduletablelock);
+	m = getmodule (hModule);
+	if ( !m || m->lib != ref ) {
+		pthread_mutex_unlock (&moduletablelock);
+		dlclose (ref);
+		_setlasterror( ERROR_MOD_NOT_FOUND );
+		return false;
+	}
+	if ( m->refcount++ == 0 )
+		ref = NULL;		//kept as the dlopen reference of the module
+	pthread_mutex_unlock (&moduletablelock);
+	if ( ref )
+		dlclose (ref);
+	*module = hModule;
+	return true;
+}
+
 bool _enumprocessmodulesex( uintptr_t hProcess, uintptr_t* lphModule, unsigned cb, unsigned *lpcbNeeded, unsigned dwFilterFlag )
 {
-	//TODO: implement the function
-	_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
-	return false;
+	// the same list for every filter, the process has modules of one kind
+	unsigned i, count;
+
+	if ( !lpcbNeeded || (cb && !lphModule) || dwFilterFlag > LIST_MODULES_ALL ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+	if ( hProcess != _getcurrentprocess( ) ) {
+		//TODO: the modules of another process from /proc/<pid>/maps
+		_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
+		return false;
+	}
+
+	if ( !lockmoduleregistry () )
+		return false;
+	count = modulesnapshot->count;
+	for (i = 0; i < count && (i + 1) * sizeof(uintptr_t) <= cb; i++)
+		lphModule[i] = modulesnapshot->modules[i]->handle;
+	pthread_rwlock_unlock (&moduleregistrylock);
+
+	*lpcbNeeded = count * sizeof(uintptr_t);
+	return true;
+}
+
+// frees a module left by a dlclose whose link_map address was given to another one
+static
+void dropstalemodule (void *lib)
+{
+	MODULEOBJ *m;
+
+	pthread_rwlock_wrlock (&moduleregistrylock);
+	pthread_mutex_lock (&moduletablelock);
+	for (m = modulelibs[hashmodulelib (lib)]; m; m = m->nextlib)
+		if ( m->lib == lib )
+			break;
+	if ( m && m->refcount == 0 && !ismodulelibcurrent (m) ) {
+		removemodule (m);
+		dropmodulesnapshot ();
+	} else
+		m = NULL;
+	pthread_mutex_unlock (&moduletablelock);
+	pthread_rwlock_unlock (&moduleregistrylock);
+
+	if ( m ) {
+		_dropmoduleexports (lib);
+		freemodule (m);
+	}
 }
 
 uintptr_t DECLSPEC_HOTPATCH _loadlibraryex( const char* libname, uintptr_t hFile, unsigned dwFlags )
 {
 	// load a dll file into the process address space
+	MODULEOBJ *m;
+	MODULENAME *entry;
+	char path[PATH_MAX];
+	const char *target = libname;
+	unsigned keyflags;
+	uintptr_t hModule;
+	uint32_t hash;
 	void *lib;
 
-	if ( !libname || hFile != 0 ) {
+	if ( !libname || !*libname || hFile != 0 || (dwFlags & ~LOADLIBRARYFLAGS) ||
+		 ((dwFlags & LOAD_WITH_ALTERED_SEARCH_PATH) && (dwFlags & LOADSEARCHFLAGS)) ||
+		 ((dwFlags & LOAD_LIBRARY_SEARCH_DLL_LOAD_DIR) && libname[0] != '/') ) {
 		// hFile is reserved and must be 0
 		_setlasterror( ERROR_INVALID_PARAMETER );
 		return (uintptr_t)NULL;
 	}
 
-	lib = dlopen (libname, RTLD_NOW);
+	if ( dwFlags & (LOADDATAFLAGS | DONT_RESOLVE_DLL_REFERENCES) )
+		return loaddatafile (libname, dwFlags);
+
+	// a module already loaded by this name
+	keyflags = dwFlags & (LOADSEARCHFLAGS | LOADBINDFLAGS);
+	hash = hashmodulename (libname, keyflags);
+	pthread_mutex_lock (&moduletablelock);
+	for (entry = modulenames[hash & (MODULEHASHSIZE - 1)]; entry; entry = entry->next)
+		if ( entry->hash == hash && entry->flags == keyflags && strcmp (entry->name, libname) == 0 ) {
+			entry->module->refcount++;
+			hModule = entry->module->handle;
+			pthread_mutex_unlock (&moduletablelock);
+			return hModule;
+		}
+	pthread_mutex_unlock (&moduletablelock);
+
+	if ( !strchr (libname, '/') && (dwFlags & LOADSEARCHFLAGS) ) {
+		if ( searchlibrary (libname, dwFlags, path, sizeof(path)) )
+			target = path;
+		else if ( !(dwFlags & (LOAD_LIBRARY_SEARCH_SYSTEM32 | LOAD_LIBRARY_SEARCH_DEFAULT_DIRS)) ) {
+			_setlasterror( ERROR_MOD_NOT_FOUND );
+			return (uintptr_t)NULL;
+		}
+	}
+
+	// the constructors may load other modules, the table is not locked here
+	dlerror ();
+	lib = dlopen (target, dwFlags & LOADBINDFLAGS ? RTLD_LAZY : RTLD_NOW);
 	if ( lib == NULL ) {
-		//TODO: implement error codes
-		_setlasterror( ERROR_MOD_NOT_FOUND );
+		_setlasterror( getloadererror () );
 		return (uintptr_t)NULL;
 	}
 
-	//TODO: implemnt library HANDLEs
-	return (uintptr_t)lib;
+	pthread_mutex_lock (&moduletablelock);
+	for (m = modulelibs[hashmodulelib (lib)]; m; m = m->nextlib)
+		if ( m->lib == lib )
+			break;
+	if ( m && m->refcount == 0 && !ismodulelibcurrent (m) ) {
+		// dlclosed by the program or by _freelibrary, its link_map is reused by this load
+		pthread_mutex_unlock (&moduletablelock);
+		dropstalemodule (lib);
+		pthread_mutex_lock (&moduletablelock);
+		for (m = modulelibs[hashmodulelib (lib)]; m; m = m->nextlib)
+			if ( m->lib == lib )
+				break;
+	}
+	if ( m ) {
+		// loaded by another name, by another thread or known to the registry
+		bool referenced = m->refcount > 0;
+
+		m->refcount++;
+		addmodulename (m, libname, keyflags, hash);
+		hModule = m->handle;
+		pthread_mutex_unlock (&moduletablelock);
+		if ( referenced )
+			dlclose (lib);		//one dlopen reference per module
+		return hModule;
+	}
+
+	m = (MODULEOBJ*) calloc (1, sizeof(MODULEOBJ));
+	if ( m ) {
+		m->lib = lib;
+		m->refcount = 1;
+		if ( !insertmodule (m, 0) ) {
+			free (m);
+			m = NULL;
+		}
+	}
+	if ( !m ) {
+		pthread_mutex_unlock (&moduletablelock);
+		dlclose (lib);
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return (uintptr_t)NULL;
+	}
+	addmodulename (m, libname, keyflags, hash);
+	hModule = m->handle;
+	pthread_mutex_unlock (&moduletablelock);
+
+	return hModule;
 }
 
 bool DECLSPEC_HOTPATCH _freelibrary( uintptr_t hModule )
 {
 	// free a dll loaded into the process address space
+	MODULEOBJ *m;
+	char path[PATH_MAX];
+	void *lib, *probe;
 	int rc;
-	void *lib;
 
-	if ( !hModule ) {
+	pthread_mutex_lock (&moduletablelock);
+	m = getmodule (hModule);
+	if ( !m ) {
+		pthread_mutex_unlock (&moduletablelock);
 		_setlasterror( ERROR_INVALID_HANDLE );
 		return false;
 	}
+	if ( m->refcount == 0 || --m->refcount > 0 ) {
+		// the modules loaded by the program itself are not counted
+		pthread_mutex_unlock (&moduletablelock);
+		return true;
+	}
+
+	if ( !m->lib ) {
+		removemodule (m);
+		pthread_mutex_unlock (&moduletablelock);
+		munmap (m->view, m->viewsize);
+		freemodule (m);
+		return true;
+	}
+
+	removemodulenames (m);
+	lib = m->lib;
+	strncpy (path, ((struct link_map*)lib)->l_name, sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+	pthread_mutex_unlock (&moduletablelock);
 
-	lib = (void*) hModule;
+	dlerror ();
 	rc = dlclose (lib);
 	if ( rc != 0 ) {
-		//todo: implent error codes
-		_setlasterror( ERROR_INVALID_PARAMETER );
+		_setlasterror( getloadererror () );
 		return false;
 	}
+
+	// a dependency of other modules stays mapped and keeps its handle
+	probe = path[0] ? dlopen (path, RTLD_LAZY | RTLD_NOLOAD) : NULL;
+	if ( probe ) {
+		dlclose (probe);
+		return true;
+	}
+	_dropmoduleexports (lib);
+
+	pthread_rwlock_wrlock (&moduleregistrylock);
+	pthread_mutex_lock (&moduletablelock);
+	if ( getmodule (hModule) == m && m->refcount == 0 ) {
+		removemodule (m);
+		dropmodulesnapshot ();
+	} else
+		m = NULL;		//loaded again meanwhile
+	pthread_mutex_unlock (&moduletablelock);
+	pthread_rwlock_unlock (&moduleregistrylock);
+	if ( m )
+		freemodule (m);
+	return true;
+}
+
+// the dlopen handle of a module, RTLD_DEFAULT for the process
+static
+bool getmodulelib( uintptr_t hModule, void **lib )
+{
+	MODULEOBJ *m;
+
+	if ( !hModule ) {
+		*lib = RTLD_DEFAULT;
+		return true;
+	}
+
+	m = getmodule (hModule);
+	if ( !m ) {
+		_setlasterror( ERROR_INVALID_HANDLE );
+		return false;
+	}
+	if ( !m->lib ) {
+		// nothing is exported from a data file
+		_setlasterror( ERROR_PROC_NOT_FOUND );
+		return false;
+	}
+	*lib = m->lib;
 	return true;
 }
 
@@ -267,15 +1300,41 @@ FARPROC _getprocaddress( uintptr_t hModule, const char* function )
 	// find the address of an exported symbol in loaded dll
 	void *lib, *fnc;
 
-	lib = (void*) hModule;
-	fnc = dlsym (lib, function);
+	if ( (uintptr_t)function < 0x10000 ) {
+		//no ordinals in elf modules
+		_setlasterror( ERROR_PROC_NOT_FOUND );
+		return (FARPROC)NULL;
+	}
+
+	if ( !getmodulelib (hModule, &lib) )
+		return (FARPROC)NULL;
+	fnc = _getmoduleexport (lib, function);
 	if ( !fnc ) {
-		_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
+		_setlasterror( ERROR_PROC_NOT_FOUND );
 		return (FARPROC)NULL;
 	}
 	return (FARPROC)fnc;
 }
 
+bool _getprocaddresses( uintptr_t hModule, const char * const *functions, unsigned count, FARPROC *table, unsigned flags )
+{
+	// bind a table of exported symbols in one pass, the missing ones stay NULL
+	void *lib;
+
+	if ( !functions || !table ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	if ( !getmodulelib (hModule, &lib) )
+		return false;
+	if ( _bindmoduleexports (lib, functions, count, (void**)table, flags) ) {
+		_setlasterror( ERROR_PROC_NOT_FOUND );
+		return false;
+	}
+	return true;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,6 +9,12 @@
 # include "config.h"
 #endif	//HAVE_CONFIG_H
 
+#ifdef __linux__
+# ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+# endif
+#endif
+
 #include <stdlib.h>
 #include <sys/types.h>
 #include <time.h>
@@ -22,11 +28,14 @@
 
 #include "windows.h"
 #include "object.h"
+#include "avrt.h"
 
 
 // depends on these functions:
 extern void _setlasterror( unsigned err );
 extern unsigned get_win_error( int err );
+extern void _getmonotonicdeadline( unsigned milliseconds, struct timespec *abstime );
+extern void _signalwaitobject( void *key );
 
 
 #ifdef __MACH__
@@ -64,7 +73,7 @@ static bool _closemutexhandle( uintptr_t hndl );
 static bool _duplicatemutexhandle( uintptr_t srchndl, uintptr_t *targethndl, unsigned access, bool inherit, unsigned options );
 /*static bool _gethandleinformation( uintptr_t hndl, unsigned *flags );
 static bool _sethandleinformation( uintptr_t hndl, unsigned mask, unsigned flags );*/
-static unsigned _waitforsinglemutexobject( uintptr_t hndl, unsigned milliseconds );
+unsigned _waitforsinglemutexobject( uintptr_t hndl, unsigned milliseconds );
 
 static TYPEOBJITEM mutexkrnlobj =
 {
@@ -174,7 +183,12 @@ uintptr_t _createmutexex( SECURITY_ATTRIBUTES *sa, const char *name, unsigned fl
 	#else
 	pthread_mutexattr_settype (&mattr, PTHREAD_MUTEX_RECURSIVE);
 	#endif
-	rc = pthread_mutex_init (pm, &mattr);
+	//real-time waiters boost the owner instead of waiting behind lower priority threads
+	rc = 0;
+	if ( flags & CREATE_MUTEX_PRIORITY_INHERIT )
+		rc = pthread_mutexattr_setprotocol (&mattr, PTHREAD_PRIO_INHERIT);
+	if ( rc == 0 )
+		rc = pthread_mutex_init (pm, &mattr);
 	pthread_mutexattr_destroy (&mattr);
 
 	if ( rc != 0 ) {
@@ -302,7 +316,6 @@ uintptr_t _openmutex( unsigned access, bool inherit, const char *name )
 	return hndl;
 }
 
-static
 unsigned _waitforsinglemutexobject( uintptr_t hndl, unsigned milliseconds )
 {
 	int rc;
@@ -322,13 +335,29 @@ unsigned _waitforsinglemutexobject( uintptr_t hndl, unsigned milliseconds )
 		mach_port_deallocate (mach_task_self(), cclock);
 		abstime.tv_sec = mts.tv_sec;
 		abstime.tv_nsec = mts.tv_nsec;
+		abstime.tv_sec += (milliseconds / 1000);
+		abstime.tv_nsec += (milliseconds % 1000) * 1000000;
+		if (abstime.tv_nsec >= 1000000000) {
+			abstime.tv_sec++;
+			abstime.tv_nsec -= 1000000000;
+		}
+
+		rc = pthread_mutex_timedlock (pm, &abstime);
+#elif defined __GLIBC__ && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+		// a wall clock change does not move the deadline
+		_getmonotonicdeadline( milliseconds, &abstime );
+		rc = pthread_mutex_clocklock (pm, CLOCK_MONOTONIC, &abstime);
 #else
 		clock_gettime (CLOCK_REALTIME, &abstime);
-#endif
 		abstime.tv_sec += (milliseconds / 1000);
 		abstime.tv_nsec += (milliseconds % 1000) * 1000000;
+		if (abstime.tv_nsec >= 1000000000) {
+			abstime.tv_sec++;
+			abstime.tv_nsec -= 1000000000;
+		}
 
 		rc = pthread_mutex_timedlock (pm, &abstime);
+#endif
 	} else
 		rc = pthread_mutex_lock (pm);
 
@@ -340,7 +369,6 @@ unsigned _waitforsinglemutexobject( uintptr_t hndl, unsigned milliseconds )
 	return WAIT_OBJECT_0;
 }
 
-static
 bool _releasemutex( uintptr_t hndl )
 {
 	int rc;
@@ -354,6 +382,7 @@ bool _releasemutex( uintptr_t hndl )
 		return false;
 	}
 
+	_signalwaitobject( pm );
 	return true;
 }
 
@@ -0,0 +1,390 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * namecheck.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+# include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+#include "windows.h"
+#include "pathname.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern unsigned _getfileattributes( const char *name );
+
+
+/*
+ * A name is classified in one pass: the bytes are compared a vector at a time,
+ * AVX2, SSE2 or NEON, against the characters a long name may not hold and
+ * against those an 8.3 name may hold, and the dots, the spaces and the end are
+ * collected as bit masks. The loads are aligned so they never cross a page,
+ * the bytes outside of the name are masked off. Where there is no vector unit
+ * a table of the classes of the 256 bytes is used.
+ * The long names follow the Win32 rules: 1 to MAX_PATH - 5 bytes, no control
+ * characters, none of <>:"/\|?*, no trailing space or dot, not a device name.
+ * The 8.3 names hold 1 to 8 bytes, a dot and 1 to 3 bytes, of letters, digits
+ * and !#$%&'()-@^_`{}~; the spaces are taken only when the caller asks.
+ */
+
+#define LONGNAMEMAXIMUM		255
+
+#define CLASSBADLONG		0x01
+#define CLASSBAD8DOT3		0x02
+#define CLASSSPACE			0x04
+#define CLASSDOT			0x08
+
+#if defined(__AVX2__)
+# define NAMECHUNK			32
+# define MASKSHIFT			0			//one mask bit per byte
+#elif defined(__SSE2__)
+# define NAMECHUNK			16
+# define MASKSHIFT			0
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+# define NAMECHUNK			16
+# define MASKSHIFT			2			//four mask bits per byte
+#endif
+
+typedef struct NAMEMASKS_ {
+	uint64_t end;
+	uint64_t dot;
+	uint64_t space;
+	uint64_t badlong;
+	uint64_t bad8dot3;
+} NAMEMASKS;
+
+typedef struct NAMESCAN_ {
+	size_t length;
+	size_t dots;
+	size_t firstdot;
+	size_t lastdot;
+	unsigned classes;			//CLASS* of all the bytes
+} NAMESCAN;
+
+
+#ifdef NAMECHUNK
+# if defined(__AVX2__)
+static inline
+__m256i inrange (__m256i v, char low, char span)
+{
+	const __m256i x = _mm256_sub_epi8 (v, _mm256_set1_epi8 (low));
+
+	return _mm256_cmpeq_epi8 (_mm256_min_epu8 (x, _mm256_set1_epi8 (span)), x);
+}
+
+static inline
+__m256i equal (__m256i v, char c)
+{
+	return _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (c));
+}
+
+static inline
+void chunkmasks (const char *a, NAMEMASKS *m)
+{
+	const __m256i v = _mm256_load_si256 ((const __m256i*)a);
+	__m256i zero, dot, space, bad, good;
+
+	zero  = equal (v, 0);
+	dot   = equal (v, '.');
+	space = equal (v, ' ');
+	bad   = _mm256_or_si256 (_mm256_or_si256 (_mm256_or_si256 (inrange (v, 0x01, 0x1E), equal (v, '"')),
+											 _mm256_or_si256 (equal (v, '*'), equal (v, '/'))),
+								 _mm256_or_si256 (_mm256_or_si256 (equal (v, ':'), equal (v, '<')),
+												  _mm256_or_si256 (_mm256_or_si256 (equal (v, '>'), equal (v, '?')),
+																   _mm256_or_si256 (equal (v, '\\'), equal (v, '|')))));
+	good  = _mm256_or_si256 (_mm256_or_si256 (_mm256_or_si256 (equal (v, '!'), inrange (v, 0x23, 0x06)),
+											  _mm256_or_si256 (equal (v, '-'), inrange (v, '0', 9))),
+							 _mm256_or_si256 (_mm256_or_si256 (inrange (v, '@', 0x1A), inrange (v, '^', 0x1D)),
+											  inrange (v, '}', 1)));
+	m->end      = (uint32_t)_mm256_movemask_epi8 (zero);
+	m->dot      = (uint32_t)_mm256_movemask_epi8 (dot);
+	m->space    = (uint32_t)_mm256_movemask_epi8 (space);
+	m->badlong  = (uint32_t)_mm256_movemask_epi8 (bad);
+	m->bad8dot3 = ~(uint64_t)(uint32_t)_mm256_movemask_epi8 (_mm256_or_si256 (_mm256_or_si256 (good, dot),
+																			  _mm256_or_si256 (space, zero))) & 0xFFFFFFFFull;
+}
+# elif defined(__SSE2__)
+static inline
+__m128i inrange (__m128i v, char low, char span)
+{
+	const __m128i x = _mm_sub_epi8 (v, _mm_set1_epi8 (low));
+
+	return _mm_cmpeq_epi8 (_mm_min_epu8 (x, _mm_set1_epi8 (span)), x);
+}
+
+static inline
+__m128i equal (__m128i v, char c)
+{
+	return _mm_cmpeq_epi8 (v, _mm_set1_epi8 (c));
+}
+
+static inline
+void chunkmasks (const char *a, NAMEMASKS *m)
+{
+	const __m128i v = _mm_load_si128 ((const __m128i*)a);
+	__m128i zero, dot, space, bad, good;
+
+	zero  = equal (v, 0);
+	dot   = equal (v, '.');
+	space = equal (v, ' ');
+	bad   = _mm_or_si128 (_mm_or_si128 (_mm_or_si128 (inrange (v, 0x01, 0x1E), equal (v, '"')),
+										_mm_or_si128 (equal (v, '*'), equal (v, '/'))),
+						  _mm_or_si128 (_mm_or_si128 (equal (v, ':'), equal (v, '<')),
+										_mm_or_si128 (_mm_or_si128 (equal (v, '>'), equal (v, '?')),
+													  _mm_or_si128 (equal (v, '\\'), equal (v, '|')))));
+	good  = _mm_or_si128 (_mm_or_si128 (_mm_or_si128 (equal (v, '!'), inrange (v, 0x23, 0x06)),
+										_mm_or_si128 (equal (v, '-'), inrange (v, '0', 9))),
+						  _mm_or_si128 (_mm_or_si128 (inrange (v, '@', 0x1A), inrange (v, '^', 0x1D)),
+										inrange (v, '}', 1)));
+	m->end      = (unsigned)_mm_movemask_epi8 (zero);
+	m->dot      = (unsigned)_mm_movemask_epi8 (dot);
+	m->space    = (unsigned)_mm_movemask_epi8 (space);
+	m->badlong  = (unsigned)_mm_movemask_epi8 (bad);
+	m->bad8dot3 = ~(unsigned)_mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (good, dot), _mm_or_si128 (space, zero))) & 0xFFFFu;
+}
+# else
+static inline
+uint8x16_t inrange (uint8x16_t v, uint8_t low, uint8_t span)
+{
+	return vcleq_u8 (vsubq_u8 (v, vdupq_n_u8 (low)), vdupq_n_u8 (span));
+}
+
+static inline
+uint8x16_t equal (uint8x16_t v, uint8_t c)
+{
+	return vceqq_u8 (v, vdupq_n_u8 (c));
+}
+
+// NEON has no movemask, the narrowing shift leaves four bits per byte
+static inline
+uint64_t movemask (uint8x16_t v)
+{
+	return vget_lane_u64 (vreinterpret_u64_u8 (vshrn_n_u16 (vreinterpretq_u16_u8 (v), 4)), 0);
+}
+
+static inline
+void chunkmasks (const char *a, NAMEMASKS *m)
+{
+	const uint8x16_t v = vld1q_u8 ((const uint8_t*)__builtin_assume_aligned (a, 16));
+	uint8x16_t zero, dot, space, bad, good;
+
+	zero  = equal (v, 0);
+	dot   = equal (v, '.');
+	space = equal (v, ' ');
+	bad   = vorrq_u8 (vorrq_u8 (vorrq_u8 (inrange (v, 0x01, 0x1E), equal (v, '"')),
+								vorrq_u8 (equal (v, '*'), equal (v, '/'))),
+					  vorrq_u8 (vorrq_u8 (equal (v, ':'), equal (v, '<')),
+								vorrq_u8 (vorrq_u8 (equal (v, '>'), equal (v, '?')),
+										  vorrq_u8 (equal (v, '\\'), equal (v, '|')))));
+	good  = vorrq_u8 (vorrq_u8 (vorrq_u8 (equal (v, '!'), inrange (v, 0x23, 0x06)),
+								vorrq_u8 (equal (v, '-'), inrange (v, '0', 9))),
+					  vorrq_u8 (vorrq_u8 (inrange (v, '@', 0x1A), inrange (v, '^', 0x1D)),
+								inrange (v, '}', 1)));
+	m->end      = movemask (zero);
+	m->dot      = movemask (dot);
+	m->space    = movemask (space);
+	m->badlong  = movemask (bad);
+	m->bad8dot3 = ~movemask (vorrq_u8 (vorrq_u8 (good, dot), vorrq_u8 (space, zero)));
+}
+# endif
+
+static inline
+size_t maskbytes (uint64_t mask)
+{
+	return (size_t)__builtin_popcountll (mask) >> MASKSHIFT;
+}
+
+static
+void scanname (const char *name, size_t limit, NAMESCAN *scan)
+{
+	const char *a = (const char*)((uintptr_t)name & ~(uintptr_t)(NAMECHUNK - 1));
+	ptrdiff_t base = a - name;		//of the chunk, from the name
+	uint64_t keep, valid;
+	NAMEMASKS m;
+
+	scan->dots = 0;
+	scan->classes = 0;
+	keep = ~0ull << ((name - a) << MASKSHIFT);
+	for (;; a += NAMECHUNK, base += NAMECHUNK, keep = ~0ull) {
+		chunkmasks (a, &m);
+		if ((size_t)(base + NAMECHUNK) > limit)
+			m.end |= 1ull << ((limit - base) << MASKSHIFT);
+		m.end &= keep;
+		valid = keep;
+		if (m.end)
+			valid &= (m.end & -m.end) - 1;		//the bytes before the end
+
+		m.dot &= valid;
+		if (m.dot) {
+			if (!scan->dots)
+				scan->firstdot = base + (__builtin_ctzll (m.dot) >> MASKSHIFT);
+			scan->lastdot = base + ((63 - __builtin_clzll (m.dot)) >> MASKSHIFT);
+			scan->dots += maskbytes (m.dot);
+			scan->classes |= CLASSDOT;
+		}
+		if (m.space & valid)
+			scan->classes |= CLASSSPACE;
+		if (m.badlong & valid)
+			scan->classes |= CLASSBADLONG;
+		if (m.bad8dot3 & valid)
+			scan->classes |= CLASSBAD8DOT3;
+		if (m.end) {
+			scan->length = base + (__builtin_ctzll (m.end) >> MASKSHIFT);
+			return;
+		}
+	}
+}
+#else
+static unsigned char nameclasses[256];
+static pthread_once_t nameclassesonce = PTHREAD_ONCE_INIT;
+
+static
+void nameclassesinit (void)
+{
+	const char *p;
+	unsigned c;
+
+	for (c = 1; c < 256; c++) {
+		if (c < 0x20)
+			nameclasses[c] |= CLASSBADLONG;
+		if (!((unsigned)((c | 0x20) - 'a') < 26u || (unsigned)(c - '0') < 10u))
+			nameclasses[c] |= CLASSBAD8DOT3;
+	}
+	for (p = "<>:\"/\\|?*"; *p; p++)
+		nameclasses[(unsigned char)*p] |= CLASSBADLONG;
+	for (p = "!#$%&'()-@^_`{}~"; *p; p++)
+		nameclasses[(unsigned char)*p] &= ~CLASSBAD8DOT3;
+	nameclasses['.'] = CLASSDOT;
+	nameclasses[' '] = CLASSSPACE;
+}
+
+static
+void scanname (const char *name, size_t limit, NAMESCAN *scan)
+{
+	const unsigned char *p = (const unsigned char*)name;
+	unsigned classes = 0, c;
+	size_t i;
+
+	pthread_once (&nameclassesonce, nameclassesinit);
+	scan->dots = 0;
+	for (i = 0; i < limit && p[i]; i++) {
+		c = nameclasses[p[i]];
+		if (c & CLASSDOT) {
+			if (!scan->dots++)
+				scan->firstdot = i;
+			scan->lastdot = i;
+		}
+		classes |= c;
+	}
+	scan->length = i;
+	scan->classes = classes;
+}
+#endif
+
+// CON, PRN, AUX, NUL, COM1 to COM9 and LPT1 to LPT9, with any extension
+static
+bool isdevicename (const char *name, size_t length)
+{
+	char base[4];
+	size_t i;
+
+	while (length && name[length-1] == ' ')
+		length--;
+	if (length < 3 || length > 4)
+		return false;
+	for (i = 0; i < length; i++)
+		base[i] = name[i] & ~0x20;
+	if (length == 3)
+		return !memcmp (base, "CON", 3) || !memcmp (base, "PRN", 3) ||
+			   !memcmp (base, "AUX", 3) || !memcmp (base, "NUL", 3);
+	return (!memcmp (base, "COM", 3) || !memcmp (base, "LPT", 3)) && name[3] >= '1' && name[3] <= '9';
+}
+
+/*
+ * The NAME_* classes of a name of at most limit bytes, SIZE_MAX for a zero
+ * terminated one. With CHECK_NAME_ALLOW_SPACES an 8.3 name may hold spaces,
+ * not at its start and not before its dot.
+ */
+unsigned _classifyfilename( const char *name, size_t limit, unsigned flags, size_t *length )
+{
+	NAMESCAN scan;
+	size_t base, extension;
+	unsigned result = 0;
+
+	scanname (name, limit, &scan);
+	if (length)
+		*length = scan.length;
+	if (!scan.length)
+		return 0;
+	if (scan.classes & CLASSSPACE)
+		result |= NAME_CONTAINS_SPACES;
+
+	if (name[0] == '.' && (scan.length == 1 || (scan.length == 2 && name[1] == '.')))
+		return result | NAME_LEGAL_DOS8DOT3;		//the directory and its parent
+
+	if (!(scan.classes & CLASSBADLONG) && scan.length <= LONGNAMEMAXIMUM &&
+		name[scan.length-1] != ' ' && name[scan.length-1] != '.' &&
+		!isdevicename (name, scan.dots ? scan.firstdot : scan.length))
+		result |= NAME_LEGAL_LONG;
+
+	base = scan.dots ? scan.firstdot : scan.length;
+	extension = scan.dots ? scan.length - scan.firstdot - 1 : 0;
+	if (!(scan.classes & CLASSBAD8DOT3) && scan.dots <= 1 &&
+		base >= 1 && base <= 8 && extension <= 3 && (!scan.dots || extension) &&
+		(!(scan.classes & CLASSSPACE) ||
+		 ((flags & CHECK_NAME_ALLOW_SPACES) && name[0] != ' ' && name[base-1] != ' ')) &&
+		!isdevicename (name, base))
+		result |= NAME_LEGAL_DOS8DOT3;
+
+	return result;
+}
+
+/*
+ * Classifies count names into classes, without touching the file system
+ * unless CHECK_NAME_QUERY_FILE_SYSTEM asks for the existence and the type of
+ * each one. Returns the number of names legal under the rules of flags,
+ * CHECK_NAME_DOS8DOT3 and CHECK_NAME_LONG, 8.3 when none is given.
+ */
+unsigned _checknamelegalbatch( const char * const *names, unsigned count, unsigned flags, unsigned char *classes )
+{
+	unsigned i, legal = 0, wanted = 0, result, attributes;
+
+	if ((count && (!names || !classes))) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return 0;
+	}
+	if (flags & CHECK_NAME_DOS8DOT3)
+		wanted |= NAME_LEGAL_DOS8DOT3;
+	if (flags & CHECK_NAME_LONG)
+		wanted |= NAME_LEGAL_LONG;
+	if (!wanted)
+		wanted = NAME_LEGAL_DOS8DOT3;
+
+	for (i = 0; i < count; i++) {
+		result = names[i] ? _classifyfilename (names[i], SIZE_MAX, flags, NULL) : 0;
+		if ((flags & CHECK_NAME_QUERY_FILE_SYSTEM) && names[i] && *names[i]) {
+			attributes = _getfileattributes (names[i]);
+			if (attributes != INVALID_FILE_ATTRIBUTES)
+				result |= NAME_EXISTS | (attributes & FILE_ATTRIBUTE_DIRECTORY ? NAME_IS_DIRECTORY : 0);
+		}
+		classes[i] = (unsigned char)result;
+		if ((result & wanted) == wanted)
+			legal++;
+	}
+	return legal;
+}
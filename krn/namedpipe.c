@@ -0,0 +1,1191 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * namedpipe.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#if defined __linux__ && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+//#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+//#endif	//HAVE_UNISTD_H
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "windows.h"
+#include "object.h"
+#include "futex.h"
+#include "namedpipe.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern unsigned get_win_error( int err );
+extern bool _closehandle( uintptr_t hndl );
+extern uintptr_t _createthread( SECURITY_ATTRIBUTES *sa, size_t stack,
+                                LPTHREAD_START_ROUTINE start, void *param,
+                                unsigned flags, unsigned *id );
+extern void _getmonotonicdeadline( unsigned milliseconds, struct timespec *abstime );
+extern bool _getmonotonictimeout( const struct timespec *abstime, struct timespec *timeout );
+
+
+/*
+ * A named pipe is a SOCK_STREAM Unix socket, bound in the abstract namespace
+ * on Linux and in PIPESOCKETDIR elsewhere. All instances of a name in this
+ * process share one listening socket and ConnectNamedPipe accepts from it.
+ * The socket would queue any number of clients, so the server publishes the
+ * count of its instances free for a client in a shared memory PIPESTATE. A
+ * client takes one of them before it connects and gets ERROR_PIPE_BUSY when
+ * there is none, WaitNamedPipe sleeps on the count as on a futex.
+ *
+ * Every write is framed by a 32-bit length, so message boundaries survive
+ * whatever the pipe type and a client need not know the type of the server.
+ * A stream socket has no message size limit of SOCK_SEQPACKET, a message
+ * of any size is moved by a single sendmsg through buffers sized from
+ * nOutBufferSize/nInBufferSize. vmsplice is not used: AF_UNIX splices keep
+ * references to the spliced pages, so the caller could change unread data
+ * after WriteFile returned.
+ *
+ * Overlapped operations that cannot complete at once run on pooled
+ * _createthread workers, one read, one write and one connect per handle.
+ */
+
+#define PIPEOBJID			10
+
+#define PIPEPREFIX			"\\\\.\\pipe\\"
+#define PIPEPREFIXLEN		(sizeof(PIPEPREFIX) - 1)
+#define PIPEMAXNAME			256
+#define PIPESOCKETNAME		"4nix/pipe/"
+#ifndef __linux__
+# define PIPESOCKETDIR		"/tmp/.4nix-pipe/"
+#endif
+
+#define PIPEDEFAULTTIMEOUT	50		//ms, NMPWAIT_USE_DEFAULT_WAIT of CreateNamedPipe
+#define PIPEWAITPOLLMAX		50		//ms
+
+typedef uint32_t PIPEHEADER;		//length of a message
+
+#define PIPEOPREAD			0
+#define PIPEOPWRITE			1
+#define PIPEOPCONNECT		2
+
+static bool _closepipehandle( uintptr_t hndl );
+static bool pipeexists (const char *folded);
+
+static TYPEOBJITEM pipekrnlobj =
+{
+	PIPEOBJID, false,
+	_closepipehandle,
+	NULL,   //_duplicatepipehandle,
+	NULL,   //_gethandleinformation,
+	NULL,   //_sethandleinformation,
+	NULL    //not waitable
+};
+
+// shared with the clients of other processes
+typedef struct PIPESTATE_ {
+	volatile int available;		//instances free for a client, futex
+	unsigned timeout;			//ms, the default of WaitNamedPipe
+} PIPESTATE;
+
+typedef struct PIPESERVER_ {
+	struct PIPESERVER_ *next;
+	int listenfd;
+	PIPESTATE *state;
+	unsigned instances;
+	unsigned maxinstances;
+	unsigned timeout;
+	char name[PIPEMAXNAME + 1];		//folded to lower case
+} PIPESERVER;
+
+typedef struct PIPEOBJDATA_ PIPEOBJDATA;
+
+typedef struct PIPEOP_ {
+	PIPEOBJDATA *pipe;
+	OVERLAPPED *ov;
+	void *buf;
+	unsigned len;
+	int kind;
+	volatile int done;		//futex
+} PIPEOP;
+
+struct PIPEOBJDATA_ {
+	int fd;					//connected socket, -1
+	int wakefd[2];			//interrupts a connect of the server
+	PIPESERVER *server;		//NULL for a client
+	unsigned openmode;
+	unsigned pipemode;
+	unsigned outbufsize;
+	unsigned inbufsize;
+	volatile int closing;
+	bool available;			//counted in PIPESTATE, no client accepted since
+	bool inmessage;			//a message is partially read
+	PIPEHEADER msgleft;		//its unread bytes
+	pthread_mutex_t readlock;
+	pthread_mutex_t writelock;
+	PIPEOP ops[3];
+};
+
+static pthread_mutex_t pipeserverslock = PTHREAD_MUTEX_INITIALIZER;
+static PIPESERVER *pipeservers;
+
+
+static inline
+PIPEOBJDATA* getpipedata (uintptr_t hndl)
+{
+	if ( _gethandletypeid( hndl ) != PIPEOBJID ) {
+		_setlasterror( ERROR_INVALID_HANDLE );
+		return NULL;
+	}
+	return *(PIPEOBJDATA**)hndl;
+}
+
+// the name after \\.\pipe\ folded to lower case, pipe names are case-insensitive
+static
+bool getpipename (const char *name, char *folded)
+{
+	size_t i, len;
+
+	if ( !name || strlen (name) <= PIPEPREFIXLEN )
+		return false;
+	for (i = 0; i < PIPEPREFIXLEN; i++)
+		if ( tolower ((unsigned char)name[i]) != PIPEPREFIX[i] &&
+		     !(PIPEPREFIX[i] == '\\' && name[i] == '/') )
+			return false;
+
+	name += PIPEPREFIXLEN;
+	len = strlen (name);
+	if ( len > PIPEMAXNAME )
+		return false;
+	for (i = 0; i < len; i++)
+		folded[i] = (char)tolower ((unsigned char)name[i]);
+	folded[len] = '\0';
+	return true;
+}
+
+static
+socklen_t getpipeaddress (const char *folded, struct sockaddr_un *addr)
+{
+	size_t len, room;
+	uint64_t hash;
+	const char *p;
+
+	memset (addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+#ifdef __linux__
+	// an abstract name starts with a zero byte and is not a file
+	len = 1 + sizeof(PIPESOCKETNAME) - 1;
+	memcpy (addr->sun_path + 1, PIPESOCKETNAME, sizeof(PIPESOCKETNAME) - 1);
+#else
+	len = sizeof(PIPESOCKETDIR) - 1;
+	memcpy (addr->sun_path, PIPESOCKETDIR, len);
+#endif
+	room = sizeof(addr->sun_path) - 1 - len;
+
+	if ( strlen (folded) <= room && !strchr (folded, '/') ) {
+		memcpy (addr->sun_path + len, folded, strlen (folded));
+		len += strlen (folded);
+	} else {
+		// a long name is replaced by its FNV-1a hash
+		hash = 14695981039346656037ULL;
+		for (p = folded; *p; p++)
+			hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+		len += (size_t)snprintf (addr->sun_path + len, room + 1, "#%016llx", (unsigned long long)hash);
+	}
+
+#ifdef __linux__
+	return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+#else
+	return (socklen_t)sizeof(*addr);
+#endif
+}
+
+static
+void getpipestatename (const char *folded, char *shmname, size_t size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	const char *p;
+
+	for (p = folded; *p; p++)
+		hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+	snprintf (shmname, size, "/4nix-pipe-%016llx", (unsigned long long)hash);
+}
+
+// the state of a server, created by it or opened by a client; NULL without a server
+static
+PIPESTATE* mappipestate (const char *folded, bool create)
+{
+	char shmname[32];
+	struct stat st;
+	void *addr;
+	int fd;
+
+	getpipestatename (folded, shmname, sizeof(shmname));
+	fd = shm_open (shmname, create ? O_CREAT|O_RDWR : O_RDWR, S_IRUSR|S_IWUSR);
+	if ( fd == -1 )
+		return NULL;
+	if ( create ? ftruncate (fd, sizeof(PIPESTATE)) == -1 :
+	              fstat (fd, &st) == -1 || st.st_size < (off_t)sizeof(PIPESTATE) ) {
+		close (fd);
+		return NULL;
+	}
+	addr = mmap (NULL, sizeof(PIPESTATE), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	return (addr == MAP_FAILED ? NULL : (PIPESTATE*)addr);
+}
+
+// a server instance takes a client again
+static
+void offerpipeinstance (PIPEOBJDATA *data)
+{
+	PIPESTATE *state = data->server->state;
+
+	data->available = true;
+	__atomic_add_fetch (&state->available, 1, __ATOMIC_RELEASE);
+	futex_wake_shared (&state->available, INT32_MAX);
+}
+
+// a client takes a free instance before it connects
+static
+bool claimpipeinstance (PIPESTATE *state)
+{
+	int n = __atomic_load_n (&state->available, __ATOMIC_ACQUIRE);
+
+	while (n > 0)
+		if ( __atomic_compare_exchange_n (&state->available, &n, n - 1, false,
+		                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
+			return true;
+	return false;
+}
+
+static
+unsigned getpipeerror (int err)
+{
+	switch (err) {
+	case EPIPE:
+	case ECONNRESET:
+	case ENOTCONN:		return ERROR_BROKEN_PIPE;
+	case ECONNREFUSED:
+	case ENOENT:		return ERROR_FILE_NOT_FOUND;
+	case EAGAIN:		return ERROR_PIPE_BUSY;
+	default:			return get_win_error (err);
+	}
+}
+
+static
+void setpipebuffers (int fd, unsigned outbufsize, unsigned inbufsize)
+{
+	int size;
+
+	if (outbufsize) {
+		size = (int)outbufsize;
+		setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	}
+	if (inbufsize) {
+		size = (int)inbufsize;
+		setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+}
+
+// receives exactly len bytes
+static
+unsigned recvall (int fd, void *buf, size_t len)
+{
+	ssize_t rc;
+
+	while (len) {
+		rc = recv (fd, buf, len, MSG_WAITALL);
+		if (rc == 0)
+			return ERROR_BROKEN_PIPE;
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			return getpipeerror (errno);
+		}
+		buf = (char*)buf + rc;
+		len -= (size_t)rc;
+	}
+
+	return 0;
+}
+
+static
+unsigned piperead (PIPEOBJDATA *data, void *buf, unsigned len, unsigned *read)
+{
+	PIPEHEADER header;
+	unsigned err = 0, cnt;
+	struct pollfd pfd;
+
+	*read = 0;
+	if ( data->fd == -1 )
+		return (data->server ? ERROR_PIPE_LISTENING : ERROR_PIPE_NOT_CONNECTED);
+	if ( (data->server && !(data->openmode & PIPE_ACCESS_INBOUND)) ||
+	     (!data->server && !(data->openmode & GENERIC_READ)) )
+		return ERROR_ACCESS_DENIED;
+
+	pthread_mutex_lock (&data->readlock);
+
+	if ( !data->inmessage ) {
+		if ( data->pipemode & PIPE_NOWAIT ) {
+			pfd.fd = data->fd;
+			pfd.events = POLLIN;
+			if ( poll (&pfd, 1, 0) == 0 ) {
+				pthread_mutex_unlock (&data->readlock);
+				return ERROR_NO_DATA;
+			}
+		}
+		err = recvall (data->fd, &header, sizeof(header));
+		if (err) {
+			pthread_mutex_unlock (&data->readlock);
+			return err;
+		}
+		data->msgleft = header;
+		data->inmessage = true;
+	}
+
+	// the writer sends a message at once, the rest of it is on the way
+	cnt = (len < data->msgleft ? len : data->msgleft);
+	err = recvall (data->fd, buf, cnt);
+	if (!err) {
+		*read = cnt;
+		data->msgleft -= cnt;
+		if ( data->msgleft == 0 )
+			data->inmessage = false;
+		else if ( data->pipemode & PIPE_READMODE_MESSAGE )
+			err = ERROR_MORE_DATA;
+	}
+
+	pthread_mutex_unlock (&data->readlock);
+	return err;
+}
+
+static
+unsigned pipewrite (PIPEOBJDATA *data, const void *buf, unsigned len, unsigned *written)
+{
+	PIPEHEADER header = len;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t rc;
+	unsigned err = 0;
+
+	*written = 0;
+	if ( data->fd == -1 )
+		return (data->server ? ERROR_PIPE_LISTENING : ERROR_PIPE_NOT_CONNECTED);
+	if ( (data->server && !(data->openmode & PIPE_ACCESS_OUTBOUND)) ||
+	     (!data->server && !(data->openmode & GENERIC_WRITE)) )
+		return ERROR_ACCESS_DENIED;
+
+	iov[0].iov_base = &header;
+	iov[0].iov_len  = sizeof(header);
+	iov[1].iov_base = (void*)buf;
+	iov[1].iov_len  = len;
+	memset (&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = 2;
+
+	// the header and the message go in one call, a concurrent writer must not split them
+	pthread_mutex_lock (&data->writelock);
+	while (msg.msg_iovlen) {
+		rc = sendmsg (data->fd, &msg, MSG_NOSIGNAL);
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			err = getpipeerror (errno);
+			break;
+		}
+		while (msg.msg_iovlen && (size_t)rc >= msg.msg_iov->iov_len) {
+			rc -= (ssize_t)msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen) {
+			msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + rc;
+			msg.msg_iov->iov_len -= (size_t)rc;
+		}
+	}
+	pthread_mutex_unlock (&data->writelock);
+
+	if (!err)
+		*written = len;
+	return err;
+}
+
+// accepts a client of a server instance
+static
+unsigned pipeaccept (PIPEOBJDATA *data, bool wait)
+{
+	struct pollfd pfd[2];
+	char drain[16];
+	int fd, rc;
+
+	if ( data->fd != -1 )
+		return ERROR_PIPE_CONNECTED;
+
+	pfd[0].fd = data->server->listenfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = data->wakefd[0];
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		// instances share the listening socket, another one may take the client first
+#ifdef __linux__
+		fd = accept4 (data->server->listenfd, NULL, NULL, SOCK_CLOEXEC);
+#else
+		fd = accept (data->server->listenfd, NULL, NULL);
+		if (fd != -1) {
+			fcntl (fd, F_SETFD, FD_CLOEXEC);
+			fcntl (fd, F_SETFL, 0);		//O_NONBLOCK is inherited from the listening socket
+		}
+#endif
+		if (fd != -1)
+			break;
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+			return get_win_error (errno);
+		if ( !wait )
+			return ERROR_PIPE_LISTENING;
+
+		rc = poll (pfd, 2, -1);
+		if (rc > 0 && (pfd[1].revents & POLLIN)) {
+			while (read (data->wakefd[0], drain, sizeof(drain)) > 0) ;
+			if (data->closing)
+				return ERROR_BROKEN_PIPE;
+		}
+	}
+
+	setpipebuffers (fd, data->outbufsize, data->inbufsize);
+	data->available = false;		//the client took it
+	data->inmessage = false;
+	data->msgleft = 0;
+	data->fd = fd;
+	return 0;
+}
+
+static
+void completepipeop (PIPEOP *op, unsigned err, unsigned cnt)
+{
+	op->ov->InternalHigh = cnt;
+	__sync_synchronize ();
+	op->ov->Internal = err;
+	op->done = 1;
+	futex_wake (&op->done, INT32_MAX);
+}
+
+static
+DWORD pipeopworker (void *param)
+{
+	PIPEOP *op = (PIPEOP*)param;
+	unsigned err, cnt = 0;
+
+	switch (op->kind) {
+	case PIPEOPREAD:
+		err = piperead (op->pipe, op->buf, op->len, &cnt);
+		break;
+	case PIPEOPWRITE:
+		err = pipewrite (op->pipe, op->buf, op->len, &cnt);
+		break;
+	default:
+		err = pipeaccept (op->pipe, true);
+		break;
+	}
+
+	completepipeop (op, err, cnt);
+	return 0;
+}
+
+// starts an overlapped operation that could not complete at once
+static
+bool startpipeop (PIPEOBJDATA *data, int kind, OVERLAPPED *ov, void *buf, unsigned len)
+{
+	PIPEOP *op = &data->ops[kind];
+	uintptr_t thread;
+
+	if ( op->ov && !op->done ) {
+		_setlasterror( ERROR_BUSY );
+		return false;
+	}
+
+	op->pipe = data;
+	op->ov   = ov;
+	op->buf  = buf;
+	op->len  = len;
+	op->kind = kind;
+	op->done = 0;
+	ov->Internal = STATUS_PENDING;
+	ov->InternalHigh = 0;
+
+	thread = _createthread( NULL, 0, pipeopworker, op, 0, NULL );
+	if ( !thread ) {
+		op->done = 1;
+		op->ov = NULL;
+		ov->Internal = ERROR_NOT_ENOUGH_MEMORY;
+		return false;
+	}
+	_closehandle( thread );
+
+	_setlasterror( ERROR_IO_PENDING );
+	return false;
+}
+
+static
+bool finishpipecall (OVERLAPPED *ov, unsigned err, unsigned cnt, unsigned *transferred)
+{
+	if (transferred) *transferred = cnt;
+	if (ov) {
+		ov->InternalHigh = cnt;
+		ov->Internal = err;
+	}
+	if (err) {
+		_setlasterror( err );
+		return false;
+	}
+	return true;
+}
+
+static
+bool pipeready (int fd, short events)
+{
+	struct pollfd pfd = { fd, events, 0 };
+	return (poll (&pfd, 1, 0) > 0);
+}
+
+static
+uintptr_t createpipehandle (PIPEOBJDATA *data)
+{
+	uintptr_t hndl;
+	int i;
+
+	pthread_mutex_init (&data->readlock, NULL);
+	pthread_mutex_init (&data->writelock, NULL);
+	for (i = 0; i < 3; i++)
+		data->ops[i].done = 1;
+
+	hndl = _createhandle (-1, 0, &pipekrnlobj, (void*)&data, sizeof(data), NULL, 0);
+	if ( !hndl ) {
+		_setlasterror( get_win_error (errno) );
+		pthread_mutex_destroy (&data->readlock);
+		pthread_mutex_destroy (&data->writelock);
+	}
+	return hndl;
+}
+
+static
+void releasepipeserver (PIPESERVER *server)
+{
+	PIPESERVER **link;
+
+	pthread_mutex_lock (&pipeserverslock);
+	if ( --server->instances == 0 ) {
+		for (link = &pipeservers; *link; link = &(*link)->next)
+			if (*link == server) {
+				*link = server->next;
+				break;
+			}
+		close (server->listenfd);
+		{
+			char shmname[32];
+			getpipestatename (server->name, shmname, sizeof(shmname));
+			shm_unlink (shmname);
+			munmap (server->state, sizeof(PIPESTATE));
+		}
+#ifndef __linux__
+		{
+			struct sockaddr_un addr;
+			getpipeaddress (server->name, &addr);
+			unlink (addr.sun_path);
+		}
+#endif
+		free (server);
+	}
+	pthread_mutex_unlock (&pipeserverslock);
+}
+
+uintptr_t _createnamedpipe( const char *name, unsigned openmode, unsigned pipemode,
+                            unsigned maxinstances, unsigned outbufsize, unsigned inbufsize,
+                            unsigned defaulttimeout, SECURITY_ATTRIBUTES *sa )
+{
+	char folded[PIPEMAXNAME + 1];
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	PIPESERVER *server;
+	PIPEOBJDATA *data;
+	uintptr_t hndl;
+	int fd;
+
+	//TODO: security attributes, PIPE_REJECT_REMOTE_CLIENTS is implied
+	if ( !getpipename (name, folded) ) {
+		_setlasterror( ERROR_INVALID_NAME );
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+	if ( maxinstances == 0 || maxinstances > PIPE_UNLIMITED_INSTANCES ||
+	     !(openmode & PIPE_ACCESS_DUPLEX) ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+
+	data = (PIPEOBJDATA*) calloc (1, sizeof(PIPEOBJDATA));
+	if ( !data ) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+	if ( pipe (data->wakefd) == -1 ) {
+		_setlasterror( get_win_error (errno) );
+		free (data);
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+	fcntl (data->wakefd[0], F_SETFL, O_NONBLOCK);
+	fcntl (data->wakefd[0], F_SETFD, FD_CLOEXEC);
+	fcntl (data->wakefd[1], F_SETFD, FD_CLOEXEC);
+
+	pthread_mutex_lock (&pipeserverslock);
+	for (server = pipeservers; server; server = server->next)
+		if ( strcmp (server->name, folded) == 0 )
+			break;
+
+	if ( server ) {
+		if ( openmode & FILE_FLAG_FIRST_PIPE_INSTANCE ) {
+			_setlasterror( ERROR_ACCESS_DENIED );
+			goto failed;
+		}
+		if ( server->instances >= server->maxinstances ) {
+			_setlasterror( ERROR_PIPE_BUSY );
+			goto failed;
+		}
+	} else {
+		addrlen = getpipeaddress (folded, &addr);
+#ifndef __linux__
+		mkdir (PIPESOCKETDIR, 01777);
+		unlink (addr.sun_path);
+#endif
+		fd = socket (AF_UNIX, SOCK_STREAM, 0);
+		if ( fd == -1 ) {
+			_setlasterror( get_win_error (errno) );
+			goto failed;
+		}
+		fcntl (fd, F_SETFD, FD_CLOEXEC);
+		fcntl (fd, F_SETFL, O_NONBLOCK);
+		if ( bind (fd, (struct sockaddr*)&addr, addrlen) == -1 || listen (fd, SOMAXCONN) == -1 ) {
+			// the name belongs to another process
+			_setlasterror( errno == EADDRINUSE ? ERROR_ACCESS_DENIED : get_win_error (errno) );
+			close (fd);
+			goto failed;
+		}
+
+		server = (PIPESERVER*) calloc (1, sizeof(PIPESERVER));
+		if ( !server ) {
+			_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+			close (fd);
+			goto failed;
+		}
+		// the name is ours once bound, a state left by a dead server is reset
+		server->state = mappipestate (folded, true);
+		if ( !server->state ) {
+			_setlasterror( get_win_error (errno) );
+			close (fd);
+			free (server);
+			goto failed;
+		}
+		server->listenfd = fd;
+		server->maxinstances = maxinstances;
+		server->timeout = (defaulttimeout ? defaulttimeout : PIPEDEFAULTTIMEOUT);
+		server->state->timeout = server->timeout;
+		__atomic_store_n (&server->state->available, 0, __ATOMIC_RELEASE);
+		strcpy (server->name, folded);
+		server->next = pipeservers;
+		pipeservers = server;
+	}
+	server->instances++;
+	pthread_mutex_unlock (&pipeserverslock);
+
+	data->fd = -1;
+	data->server = server;
+	data->openmode = openmode;
+	data->pipemode = pipemode;
+	data->outbufsize = outbufsize;
+	data->inbufsize = inbufsize;
+
+	hndl = createpipehandle (data);
+	if ( !hndl ) {
+		releasepipeserver (server);
+		close (data->wakefd[0]);
+		close (data->wakefd[1]);
+		free (data);
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+	offerpipeinstance (data);		//listening as on Windows, before ConnectNamedPipe
+	return hndl;
+
+failed:
+	pthread_mutex_unlock (&pipeserverslock);
+	close (data->wakefd[0]);
+	close (data->wakefd[1]);
+	free (data);
+	return (uintptr_t)INVALID_HANDLE_VALUE;
+}
+
+// a client connected before the call gives ERROR_PIPE_CONNECTED like on Windows
+bool _connectnamedpipe( uintptr_t hndl, OVERLAPPED *ov )
+{
+	PIPEOBJDATA *data;
+	unsigned err;
+
+	data = getpipedata( hndl );
+	if ( !data )
+		return false;
+	if ( !data->server ) {
+		_setlasterror( ERROR_INVALID_FUNCTION );
+		return false;
+	}
+
+	// a disconnected instance is free again
+	if ( data->fd == -1 && !data->available )
+		offerpipeinstance (data);
+	err = pipeaccept (data, false);
+	if ( err == 0 )
+		err = ERROR_PIPE_CONNECTED;
+	else if ( err == ERROR_PIPE_LISTENING && !(data->pipemode & PIPE_NOWAIT) ) {
+		if ( ov )
+			return startpipeop (data, PIPEOPCONNECT, ov, NULL, 0);
+		err = pipeaccept (data, true);
+	}
+
+	return finishpipecall (ov, err, 0, NULL);
+}
+
+bool _disconnectnamedpipe( uintptr_t hndl )
+{
+	PIPEOBJDATA *data;
+	int fd;
+
+	data = getpipedata( hndl );
+	if ( !data )
+		return false;
+	if ( !data->server ) {
+		_setlasterror( ERROR_INVALID_FUNCTION );
+		return false;
+	}
+
+	// unread data is discarded and the client gets ERROR_BROKEN_PIPE
+	fd = data->fd;
+	if ( fd != -1 ) {
+		shutdown (fd, SHUT_RDWR);
+		pthread_mutex_lock (&data->readlock);
+		pthread_mutex_lock (&data->writelock);
+		data->fd = -1;
+		data->inmessage = false;
+		data->msgleft = 0;
+		pthread_mutex_unlock (&data->writelock);
+		pthread_mutex_unlock (&data->readlock);
+		close (fd);
+	}
+	return true;
+}
+
+// the client side, CreateFile of a \\.\pipe\ name
+uintptr_t _opennamedpipe( const char *name, unsigned access, unsigned flags )
+{
+	char folded[PIPEMAXNAME + 1];
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	PIPESTATE *state;
+	PIPEOBJDATA *data;
+	uintptr_t hndl;
+	int fd, rc;
+
+	if ( !getpipename (name, folded) ) {
+		_setlasterror( ERROR_INVALID_NAME );
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+
+	// the listening socket would queue the client when all instances are busy
+	state = mappipestate (folded, false);
+	if ( !state || !claimpipeinstance (state) ) {
+		_setlasterror( state || pipeexists (folded) ? ERROR_PIPE_BUSY : ERROR_FILE_NOT_FOUND );
+		if (state) munmap (state, sizeof(PIPESTATE));
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if ( fd != -1 ) {
+		fcntl (fd, F_SETFD, FD_CLOEXEC);
+		addrlen = getpipeaddress (folded, &addr);
+		do
+			rc = connect (fd, (struct sockaddr*)&addr, addrlen);
+		while (rc == -1 && errno == EINTR);
+		if ( rc == -1 ) {
+			close (fd);
+			fd = -1;
+		}
+	}
+	if ( fd == -1 ) {
+		_setlasterror( getpipeerror (errno) );
+		__atomic_add_fetch (&state->available, 1, __ATOMIC_RELEASE);	//not taken
+		futex_wake_shared (&state->available, INT32_MAX);
+		munmap (state, sizeof(PIPESTATE));
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+	munmap (state, sizeof(PIPESTATE));
+
+	data = (PIPEOBJDATA*) calloc (1, sizeof(PIPEOBJDATA));
+	if ( !data ) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		close (fd);
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+	data->fd = fd;
+	data->wakefd[0] = data->wakefd[1] = -1;
+	data->openmode = access;
+	data->pipemode = PIPE_READMODE_BYTE;	//as on Windows until SetNamedPipeHandleState
+
+	hndl = createpipehandle (data);
+	if ( !hndl ) {
+		close (fd);
+		free (data);
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+	return hndl;
+}
+
+bool _readpipe( uintptr_t hndl, void *buf, unsigned len, unsigned *read, OVERLAPPED *ov )
+{
+	PIPEOBJDATA *data;
+	unsigned err, cnt = 0;
+
+	data = getpipedata( hndl );
+	if ( !data )
+		return false;
+
+	if ( ov && !data->inmessage && data->fd != -1 && !(data->pipemode & PIPE_NOWAIT) &&
+	     !pipeready (data->fd, POLLIN) ) {
+		if (read) *read = 0;
+		return startpipeop (data, PIPEOPREAD, ov, buf, len);
+	}
+
+	err = piperead (data, buf, len, &cnt);
+	return finishpipecall (ov, err, cnt, read);
+}
+
+bool _writepipe( uintptr_t hndl, const void *buf, unsigned len, unsigned *written, OVERLAPPED *ov )
+{
+	PIPEOBJDATA *data;
+	unsigned err, cnt = 0;
+
+	data = getpipedata( hndl );
+	if ( !data )
+		return false;
+
+	if ( ov && data->fd != -1 && !pipeready (data->fd, POLLOUT) ) {
+		if (written) *written = 0;
+		return startpipeop (data, PIPEOPWRITE, ov, (void*)buf, len);
+	}
+
+	err = pipewrite (data, buf, len, &cnt);
+	return finishpipecall (ov, err, cnt, written);
+}
+
+bool _getoverlappedresult( uintptr_t hndl, OVERLAPPED *ov, unsigned *transferred, bool wait )
+{
+	PIPEOBJDATA *data;
+	PIPEOP *op = NULL;
+	int i;
+
+	data = getpipedata( hndl );
+	if ( !data )
+		return false;
+
+	for (i = 0; i < 3; i++)
+		if ( data->ops[i].ov == ov )
+			op = &data->ops[i];
+
+	if ( op ) {
+		if ( !op->done && !wait ) {
+			_setlasterror( ERROR_IO_INCOMPLETE );
+			return false;
+		}
+		while ( !op->done )
+			futex_wait (&op->done, 0, NULL);
+	} else if ( ov->Internal == STATUS_PENDING ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	__sync_synchronize ();
+	if (transferred) *transferred = (unsigned)ov->InternalHigh;
+	if ( ov->Internal ) {
+		_setlasterror( (unsigned)ov->Internal );
+		return false;
+	}
+	return true;
+}
+
+bool _setnamedpipehandlestate( uintptr_t hndl, unsigned *mode, unsigned *maxcollectioncount, unsigned *collectdatatimeout )
+{
+	PIPEOBJDATA *data;
+
+	data = getpipedata( hndl );
+	if ( !data )
+		return false;
+
+	// the collection settings concern remote pipes only
+	if ( mode ) {
+		if ( *mode & ~(PIPE_NOWAIT | PIPE_READMODE_MESSAGE) ) {
+			_setlasterror( ERROR_INVALID_PARAMETER );
+			return false;
+		}
+		data->pipemode = (data->pipemode & ~(PIPE_NOWAIT | PIPE_READMODE_MESSAGE)) | *mode;
+	}
+	return true;
+}
+
+// the available bytes are exact for the current message only
+bool _peeknamedpipe( uintptr_t hndl, void *buf, unsigned len, unsigned *read,
+                     unsigned *available, unsigned *leftthismessage )
+{
+	PIPEOBJDATA *data;
+	PIPEHEADER header = 0;
+	struct iovec iov[2];
+	struct msghdr msg;
+	unsigned cnt = 0, left = 0;
+	int queued = 0;
+	ssize_t rc;
+
+	data = getpipedata( hndl );
+	if ( !data )
+		return false;
+	if ( data->fd == -1 ) {
+		_setlasterror( data->server ? ERROR_PIPE_LISTENING : ERROR_PIPE_NOT_CONNECTED );
+		return false;
+	}
+
+	pthread_mutex_lock (&data->readlock);
+	ioctl (data->fd, FIONREAD, &queued);
+
+	if ( data->inmessage ) {
+		left = data->msgleft;
+		if ( buf && len && queued ) {
+			rc = recv (data->fd, buf, (len < left ? len : left), MSG_PEEK | MSG_DONTWAIT);
+			cnt = (rc > 0 ? (unsigned)rc : 0);
+		}
+	} else if ( queued >= (int)sizeof(header) ) {
+		iov[0].iov_base = &header;
+		iov[0].iov_len  = sizeof(header);
+		iov[1].iov_base = buf;
+		iov[1].iov_len  = (buf ? len : 0);
+		memset (&msg, 0, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = 2;
+		rc = recvmsg (data->fd, &msg, MSG_PEEK | MSG_DONTWAIT);
+		if ( rc >= (ssize_t)sizeof(header) ) {
+			left = header;
+			cnt = (unsigned)rc - sizeof(header);
+			if ( cnt > left ) cnt = left;
+		}
+		queued -= sizeof(header);
+	} else
+		queued = 0;
+	pthread_mutex_unlock (&data->readlock);
+
+	if ( read ) *read = cnt;
+	if ( available ) *available = (unsigned)queued;
+	if ( leftthismessage ) *leftthismessage = (data->pipemode & PIPE_READMODE_MESSAGE ? left - cnt : 0);
+	return true;
+}
+
+bool _transactnamedpipe( uintptr_t hndl, const void *inbuf, unsigned inlen,
+                         void *outbuf, unsigned outlen, unsigned *read, OVERLAPPED *ov )
+{
+	PIPEOBJDATA *data;
+	unsigned err, cnt = 0;
+
+	data = getpipedata( hndl );
+	if ( !data )
+		return false;
+	if ( !(data->pipemode & PIPE_READMODE_MESSAGE) ) {
+		_setlasterror( ERROR_BAD_PIPE );
+		return false;
+	}
+
+	//TODO: a transaction is always completed synchronously
+	err = pipewrite (data, inbuf, inlen, &cnt);
+	if ( !err )
+		err = piperead (data, outbuf, outlen, &cnt);
+	else
+		cnt = 0;
+
+	return finishpipecall (ov, err, cnt, read);
+}
+
+// the servers of this process are known, other ones are looked up in /proc/net/unix
+static
+bool pipeexists (const char *folded)
+{
+	struct sockaddr_un addr;
+	PIPESERVER *server;
+	bool found = false;
+
+	pthread_mutex_lock (&pipeserverslock);
+	for (server = pipeservers; server && !found; server = server->next)
+		found = (strcmp (server->name, folded) == 0);
+	pthread_mutex_unlock (&pipeserverslock);
+	if (found)
+		return true;
+
+	getpipeaddress (folded, &addr);
+#ifdef __linux__
+	{
+		char line[512], *path;
+		FILE *fp;
+
+		fp = fopen ("/proc/net/unix", "r");
+		if (!fp)
+			return false;
+		while (!found && fgets (line, sizeof(line), fp)) {
+			path = strchr (line, '@');		//an abstract name
+			if (path) {
+				path[strcspn (path, "\n")] = '\0';
+				found = (strcmp (path + 1, addr.sun_path + 1) == 0);
+			}
+		}
+		fclose (fp);
+	}
+#else
+	{
+		struct stat st;
+		found = (stat (addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode));
+	}
+#endif
+	return found;
+}
+
+// waits for a free instance, it is not taken: CreateFile may still find the pipe busy
+bool _waitnamedpipe( const char *name, unsigned timeout )
+{
+	char folded[PIPEMAXNAME + 1];
+	struct timespec deadline, remaining;
+	PIPESTATE *state;
+	int n;
+
+	if ( !getpipename (name, folded) ) {
+		_setlasterror( ERROR_INVALID_NAME );
+		return false;
+	}
+	state = mappipestate (folded, false);
+	if ( !state ) {
+		_setlasterror( pipeexists (folded) ? ERROR_SEM_TIMEOUT : ERROR_FILE_NOT_FOUND );
+		return false;
+	}
+
+	if ( timeout == NMPWAIT_USE_DEFAULT_WAIT )
+		timeout = state->timeout;
+	if ( timeout != NMPWAIT_WAIT_FOREVER )
+		_getmonotonicdeadline( timeout, &deadline );
+
+	while ( (n = __atomic_load_n (&state->available, __ATOMIC_ACQUIRE)) <= 0 ) {
+		if ( timeout != NMPWAIT_WAIT_FOREVER && !_getmonotonictimeout( &deadline, &remaining ) ) {
+			munmap (state, sizeof(PIPESTATE));
+			_setlasterror( ERROR_SEM_TIMEOUT );
+			return false;
+		}
+		futex_wait_shared (&state->available, n, timeout != NMPWAIT_WAIT_FOREVER ? &remaining : NULL);
+	}
+	munmap (state, sizeof(PIPESTATE));
+	return true;
+}
+
+bool _callnamedpipe( const char *name, const void *inbuf, unsigned inlen,
+                     void *outbuf, unsigned outlen, unsigned *read, unsigned timeout )
+{
+	struct timespec deadline, remaining, ts;
+	unsigned mode = PIPE_READMODE_MESSAGE;
+	unsigned pollms = 1;
+	uintptr_t hndl;
+	bool rc;
+
+	if ( timeout == NMPWAIT_USE_DEFAULT_WAIT )
+		timeout = PIPEDEFAULTTIMEOUT;
+	if ( timeout != NMPWAIT_WAIT_FOREVER )
+		_getmonotonicdeadline( timeout, &deadline );
+
+	// a server between two instances is waited for
+	for (;;) {
+		hndl = _opennamedpipe( name, GENERIC_READ | GENERIC_WRITE, 0 );
+		if ( hndl != (uintptr_t)INVALID_HANDLE_VALUE )
+			break;
+		if ( timeout == NMPWAIT_NOWAIT ||
+		     (timeout != NMPWAIT_WAIT_FOREVER && !_getmonotonictimeout( &deadline, &remaining )) )
+			return false;
+
+		ts.tv_sec  = 0;
+		ts.tv_nsec = (long)pollms * 1000000;
+		nanosleep (&ts, NULL);
+		if (pollms < PIPEWAITPOLLMAX) pollms *= 2;
+	}
+
+	rc = _setnamedpipehandlestate( hndl, &mode, NULL, NULL ) &&
+	     _transactnamedpipe( hndl, inbuf, inlen, outbuf, outlen, read, NULL );
+	_closehandle( hndl );
+	return rc;
+}
+
+static
+bool _closepipehandle( uintptr_t hndl )
+{
+	PIPEOBJDATA *data;
+	unsigned int *refcount;
+	char wake = 0;
+	ssize_t rc;
+	int i;
+
+	_gethandledata (hndl, &refcount);
+	if (*refcount <= 1) {
+		data = *(PIPEOBJDATA**)hndl;
+
+		// pending operations fail with ERROR_BROKEN_PIPE
+		data->closing = 1;
+		if ( data->fd != -1 )
+			shutdown (data->fd, SHUT_RDWR);
+		if ( data->wakefd[1] != -1 ) {
+			rc = write (data->wakefd[1], &wake, 1);
+			(void)rc;
+		}
+		for (i = 0; i < 3; i++)
+			while ( !data->ops[i].done )
+				futex_wait (&data->ops[i].done, 0, NULL);
+
+		if ( data->fd != -1 )
+			close (data->fd);
+		if ( data->server ) {
+			if ( data->available )
+				claimpipeinstance (data->server->state);	//none left when a client has it queued
+			close (data->wakefd[0]);
+			close (data->wakefd[1]);
+			releasepipeserver (data->server);
+		}
+		pthread_mutex_destroy (&data->readlock);
+		pthread_mutex_destroy (&data->writelock);
+		free (data);
+	}
+
+	return true;
+}
@@ -0,0 +1,652 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * numa.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#ifdef __linux__
+# ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+# endif
+#endif
+
+#include <sched.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+//#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+//#endif	//HAVE_UNISTD_H
+#include <sys/types.h>
+#ifdef __linux__
+# include <syscall.h>
+#endif
+
+#include "windows.h"
+#include "numa.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern unsigned get_win_error( int err );
+
+
+// memory policies of mbind/set_mempolicy, libnuma's numaif.h is not required
+#ifndef MPOL_PREFERRED
+# define MPOL_DEFAULT		0
+# define MPOL_PREFERRED		1
+# define MPOL_BIND			2
+#endif
+#ifndef MPOL_MF_MOVE
+# define MPOL_MF_MOVE		(1<<1)
+#endif
+
+#define MAXNUMANODES		1024
+#define BITSPERLONG			(8*sizeof(unsigned long))
+#define MAXGROUPCPUS		(8*sizeof(uintptr_t))	//bits in KAFFINITY
+#define NOGROUP				0xffff
+
+#ifndef ALL_PROCESSOR_GROUPS
+# define ALL_PROCESSOR_GROUPS	0xffff
+#endif
+
+
+typedef struct CPUTOPOLOGY_ {
+	int node;
+	int package;
+	int core;
+	bool online;
+	unsigned short group;		//processor group
+	unsigned char groupbit;		//bit in the group affinity mask
+} CPUTOPOLOGY;
+
+static pthread_once_t topologyonce = PTHREAD_ONCE_INIT;
+static unsigned topologycpus = 0;		//number of possible logical CPUs
+static unsigned highestnode = 0;
+static CPUTOPOLOGY *topology = NULL;
+static unsigned short groupcount = 0;
+static int *groupcpus = NULL;			//CPU of every group bit, -1 if unused
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __linux__
+static
+int readsysint (const char *path, int defval)
+{
+	FILE *fp;
+	int val;
+
+	fp = fopen (path, "r");
+	if (!fp) return defval;
+	if (fscanf (fp, "%d", &val) != 1) val = defval;
+	fclose (fp);
+
+	return val;
+}
+
+// parse a sysfs list such as "0-3,8-11", returns the highest number or -1
+static
+int parselist (const char *path, void (*fn)(unsigned, void*), void *ctx)
+{
+	FILE *fp;
+	unsigned from, to, i;
+	int c, highest = -1;
+
+	fp = fopen (path, "r");
+	if (!fp) return -1;
+
+	while (fscanf (fp, "%u", &from) == 1) {
+		to = from;
+		c = fgetc (fp);
+		if (c == '-') {
+			if (fscanf (fp, "%u", &to) != 1) break;
+			c = fgetc (fp);
+		}
+
+		if (fn)
+			for (i = from; i <= to; i++) fn (i, ctx);
+		if ((int)to > highest) highest = (int)to;
+
+		if (c != ',') break;
+	}
+	fclose (fp);
+
+	return highest;
+}
+
+static
+void setcpunode (unsigned cpu, void *ctx)
+{
+	if (cpu < topologycpus) topology[cpu].node = *(int*)ctx;
+}
+
+static
+void setcpuonline (unsigned cpu, void *ctx)
+{
+	if (cpu < topologycpus) topology[cpu].online = true;
+}
+#endif	//__linux__
+
+static
+bool buildgroups (void)
+{
+	unsigned cpu, other, used = 0;
+	unsigned short group = 0;
+
+	if (topologycpus <= MAXGROUPCPUS) {
+		// a single group, the masks match the CPU numbers
+		for (cpu = 0; cpu < topologycpus; cpu++) {
+			topology[cpu].group = 0;
+			topology[cpu].groupbit = (unsigned char)cpu;
+		}
+	} else {
+		// pack whole packages into groups, so that a socket never spans two groups
+		for (cpu = 0; cpu < topologycpus; cpu++) topology[cpu].group = NOGROUP;
+
+		for (cpu = 0; cpu < topologycpus; cpu++) {
+			unsigned count = 0;
+
+			if (topology[cpu].group != NOGROUP) continue;
+
+			for (other = cpu; other < topologycpus; other++)
+				if (topology[other].package == topology[cpu].package) count++;
+			if (used && used + count > MAXGROUPCPUS) {
+				group++;
+				used = 0;
+			}
+
+			for (other = cpu; other < topologycpus; other++) {
+				if (topology[other].package != topology[cpu].package) continue;
+				if (used == MAXGROUPCPUS) {		//the package alone does not fit
+					group++;
+					used = 0;
+				}
+				topology[other].group = group;
+				topology[other].groupbit = (unsigned char)used++;
+			}
+		}
+	}
+
+	groupcount = group + 1;
+	groupcpus = (int*) malloc (groupcount * MAXGROUPCPUS * sizeof(int));
+	if (!groupcpus)
+		return false;
+
+	for (other = 0; other < groupcount * MAXGROUPCPUS; other++) groupcpus[other] = -1;
+	for (cpu = 0; cpu < topologycpus; cpu++)
+		groupcpus[topology[cpu].group * MAXGROUPCPUS + topology[cpu].groupbit] = (int)cpu;
+
+	return true;
+}
+
+static
+void loadtopology (void)
+{
+	unsigned cpu;
+	long ncpus;
+
+#ifdef __linux__
+	int highest = parselist ("/sys/devices/system/cpu/possible", NULL, NULL);
+	ncpus = (highest >= 0 ? highest + 1 : sysconf (_SC_NPROCESSORS_CONF));
+#else
+	ncpus = sysconf (_SC_NPROCESSORS_CONF);
+#endif
+	if (ncpus < 1) ncpus = 1;
+
+	topology = (CPUTOPOLOGY*) calloc (ncpus, sizeof(CPUTOPOLOGY));
+	if (!topology)
+		return;
+	topologycpus = (unsigned)ncpus;
+
+	for (cpu = 0; cpu < topologycpus; cpu++) {
+		topology[cpu].node    = 0;
+		topology[cpu].package = 0;
+		topology[cpu].core    = (int)cpu;
+		topology[cpu].online  = true;
+	}
+
+#ifdef __linux__
+	char path[96];
+	int node;
+
+	for (cpu = 0; cpu < topologycpus; cpu++) topology[cpu].online = false;
+	if (parselist ("/sys/devices/system/cpu/online", setcpuonline, NULL) < 0)
+		for (cpu = 0; cpu < topologycpus; cpu++) topology[cpu].online = true;
+
+	for (cpu = 0; cpu < topologycpus; cpu++) {
+		sprintf (path, "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+		topology[cpu].package = readsysint (path, 0);
+		sprintf (path, "/sys/devices/system/cpu/cpu%u/topology/core_id", cpu);
+		topology[cpu].core = readsysint (path, (int)cpu);
+	}
+
+	highest = parselist ("/sys/devices/system/node/online", NULL, NULL);
+	highestnode = (highest > 0 ? (unsigned)highest : 0);
+	if (highestnode >= MAXNUMANODES) highestnode = MAXNUMANODES - 1;
+
+	for (node = 0; node <= (int)highestnode; node++) {
+		sprintf (path, "/sys/devices/system/node/node%d/cpulist", node);
+		parselist (path, setcpunode, &node);
+	}
+#endif
+
+	if (!buildgroups ()) {
+		free (topology);
+		topology = NULL;
+		topologycpus = 0;
+	}
+}
+
+static
+bool gettopology (void)
+{
+	pthread_once (&topologyonce, loadtopology);
+	if (!topology) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return false;
+	}
+	return true;
+}
+
+static
+void cpugroup (unsigned cpu, unsigned short *group, unsigned char *bit)
+{
+	*group = topology[cpu].group;
+	*bit   = topology[cpu].groupbit;
+}
+
+bool _getcpugroup( unsigned cpu, unsigned short *group, unsigned char *bit )
+{
+	if (!gettopology () || cpu >= topologycpus) return false;
+	cpugroup (cpu, group, bit);
+	return true;
+}
+
+int _getgroupcpu( unsigned short group, unsigned char bit )
+{
+	if (!gettopology () || group >= groupcount || bit >= MAXGROUPCPUS) return -1;
+	return groupcpus[group * MAXGROUPCPUS + bit];
+}
+
+unsigned short _getactiveprocessorgroupcount( void )
+{
+	return (gettopology () ? groupcount : 0);
+}
+
+unsigned short _getmaximumprocessorgroupcount( void )
+{
+	return (gettopology () ? groupcount : 0);
+}
+
+unsigned _getactiveprocessorcount( unsigned short group )
+{
+	unsigned cpu, count = 0;
+
+	if (!gettopology ())
+		return 0;
+	if (group != ALL_PROCESSOR_GROUPS && group >= groupcount) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return 0;
+	}
+
+	for (cpu = 0; cpu < topologycpus; cpu++)
+		if (topology[cpu].online && (group == ALL_PROCESSOR_GROUPS || topology[cpu].group == group))
+			count++;
+
+	return count;
+}
+
+unsigned _getmaximumprocessorcount( unsigned short group )
+{
+	unsigned cpu, count = 0;
+
+	if (!gettopology ())
+		return 0;
+	if (group != ALL_PROCESSOR_GROUPS && group >= groupcount) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return 0;
+	}
+
+	for (cpu = 0; cpu < topologycpus; cpu++)
+		if (group == ALL_PROCESSOR_GROUPS || topology[cpu].group == group)
+			count++;
+
+	return count;
+}
+
+unsigned _getcputopologycount( void )
+{
+	return (gettopology () ? topologycpus : 0);
+}
+
+int _getcpunumanode( unsigned cpu )
+{
+	if (!gettopology () || cpu >= topologycpus) return -1;
+	return topology[cpu].node;
+}
+
+#ifdef __linux__
+cpu_set_t* _getnumanodecpuset( unsigned node, size_t *setsize )
+{
+	// the returned set is released by CPU_FREE
+	cpu_set_t *cs;
+	unsigned cpu;
+	bool empty = true;
+
+	if (!gettopology ())
+		return NULL;
+	if (node > highestnode) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return NULL;
+	}
+
+	cs = CPU_ALLOC (topologycpus);
+	if (!cs) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return NULL;
+	}
+	*setsize = CPU_ALLOC_SIZE (topologycpus);
+	CPU_ZERO_S (*setsize, cs);
+
+	for (cpu = 0; cpu < topologycpus; cpu++) {
+		if (topology[cpu].online && topology[cpu].node == (int)node) {
+			CPU_SET_S (cpu, *setsize, cs);
+			empty = false;
+		}
+	}
+
+	if (empty) {	//memory-only node
+		CPU_FREE (cs);
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return NULL;
+	}
+
+	return cs;
+}
+#endif	//__linux__
+
+int _numabindmemory( void *addr, size_t len, unsigned node, bool move )
+{
+#ifdef __linux__
+	unsigned long mask[MAXNUMANODES / BITSPERLONG];
+
+	if (node >= MAXNUMANODES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset (mask, 0, sizeof(mask));
+	mask[node / BITSPERLONG] |= 1UL << (node % BITSPERLONG);
+
+	return (int) syscall (SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+	                      (unsigned long)MAXNUMANODES + 1, (move ? MPOL_MF_MOVE : 0));
+#else
+	return 0;
+#endif
+}
+
+bool _numaplacethread( unsigned node )
+{
+	// prefer the node for the calling thread's future allocations and move its stack there
+#ifdef __linux__
+	unsigned long mask[MAXNUMANODES / BITSPERLONG];
+	pthread_attr_t attr;
+	void *stackaddr;
+	size_t stacksize;
+	long rc;
+
+	if (node >= MAXNUMANODES) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	memset (mask, 0, sizeof(mask));
+	mask[node / BITSPERLONG] |= 1UL << (node % BITSPERLONG);
+
+	rc = syscall (SYS_set_mempolicy, MPOL_PREFERRED, mask, (unsigned long)MAXNUMANODES + 1);
+	if (rc == -1) {
+		_setlasterror( get_win_error (errno) );
+		return false;
+	}
+
+	if (pthread_getattr_np (pthread_self (), &attr) == 0) {
+		if (pthread_attr_getstack (&attr, &stackaddr, &stacksize) == 0)
+			_numabindmemory( stackaddr, stacksize, node, true );
+		pthread_attr_destroy (&attr);
+	}
+#endif
+	return true;
+}
+
+bool _getnumahighestnodenumber( unsigned *highest )
+{
+	if (!highest) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+	if (!gettopology ())
+		return false;
+
+	*highest = highestnode;
+	return true;
+}
+
+bool _getnumanodeprocessormaskex( unsigned short node, GROUP_AFFINITY *affinity )
+{
+	unsigned cpu;
+	unsigned short group;
+	unsigned char bit;
+	bool found = false;
+
+	if (!affinity) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+	if (!gettopology ())
+		return false;
+	if (node > highestnode) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	memset (affinity, 0, sizeof(GROUP_AFFINITY));
+
+	//NOTE: a node is reported in the group of its first processor
+	for (cpu = 0; cpu < topologycpus; cpu++) {
+		if (!topology[cpu].online || topology[cpu].node != (int)node)
+			continue;
+
+		cpugroup (cpu, &group, &bit);
+		if (!found) {
+			affinity->Group = group;
+			found = true;
+		}
+		if (group == affinity->Group)
+			affinity->Mask |= (uintptr_t)1 << bit;
+	}
+
+	return true;
+}
+
+// collect processors matching the filter into group masks, returns the number of groups
+static
+unsigned short collectgroupmasks (int node, int package, int core, GROUP_AFFINITY *masks, unsigned short maxmasks)
+{
+	unsigned cpu, i;
+	unsigned short group, count = 0;
+	unsigned char bit;
+
+	for (cpu = 0; cpu < topologycpus; cpu++) {
+		if (!topology[cpu].online) continue;
+		if (node >= 0 && topology[cpu].node != node) continue;
+		if (package >= 0 && topology[cpu].package != package) continue;
+		if (core >= 0 && topology[cpu].core != core) continue;
+
+		cpugroup (cpu, &group, &bit);
+		for (i = 0; i < count && masks[i].Group != group; i++)
+			;
+		if (i == count) {
+			if (count == maxmasks) continue;
+			memset (&masks[count], 0, sizeof(GROUP_AFFINITY));
+			masks[count].Group = group;
+			count++;
+		}
+		masks[i].Mask |= (uintptr_t)1 << bit;
+	}
+
+	return count;
+}
+
+static
+size_t emitprocessor (LOGICAL_PROCESSOR_RELATIONSHIP rel, int package, int core,
+                      GROUP_AFFINITY *masks, unsigned short maxmasks, char *buf, size_t room)
+{
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *info;
+	unsigned short count, i;
+	unsigned bits = 0;
+	size_t size;
+
+	count = collectgroupmasks (-1, package, core, masks, maxmasks);
+	size = offsetof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX, Processor.GroupMask) + count * sizeof(GROUP_AFFINITY);
+	if (size > room)
+		return size;
+
+	for (i = 0; i < count; i++)
+		bits += __builtin_popcountl (masks[i].Mask);
+
+	info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)buf;
+	memset (info, 0, size);
+	info->Relationship = rel;
+	info->Size = (unsigned)size;
+	info->Processor.Flags = (rel == RelationProcessorCore && bits > 1 ? LTP_PC_SMT : 0);
+	info->Processor.GroupCount = count;
+	memcpy (info->Processor.GroupMask, masks, count * sizeof(GROUP_AFFINITY));
+
+	return size;
+}
+
+bool _getlogicalprocessorinformationex( LOGICAL_PROCESSOR_RELATIONSHIP rel,
+                                        SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *buffer, unsigned *len )
+{
+	//NOTE: RelationCache is not reported
+
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *info;
+	GROUP_AFFINITY *masks;
+	unsigned short ngroups;
+	unsigned cpu, prev, node;
+	size_t size, off = 0, room;
+	char *buf = (char*)buffer;
+
+	if (!len || (*len && !buffer)) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+	if (!gettopology ())
+		return false;
+
+	ngroups = groupcount;
+	masks = (GROUP_AFFINITY*) malloc (ngroups * sizeof(GROUP_AFFINITY));
+	if (!masks) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return false;
+	}
+
+	#define ROOM	(off < *len ? *len - off : 0)
+
+	if (rel == RelationProcessorCore || rel == RelationAll) {
+		for (cpu = 0; cpu < topologycpus; cpu++) {
+			if (!topology[cpu].online) continue;
+			// report every core once, at its first logical processor
+			for (prev = 0; prev < cpu; prev++)
+				if (topology[prev].online &&
+				    topology[prev].package == topology[cpu].package &&
+				    topology[prev].core == topology[cpu].core) break;
+			if (prev < cpu) continue;
+
+			room = ROOM;
+			off += emitprocessor (RelationProcessorCore, topology[cpu].package, topology[cpu].core,
+			                      masks, ngroups, buf + off, room);
+		}
+	}
+
+	if (rel == RelationNumaNode || rel == RelationAll) {
+		for (node = 0; node <= highestnode; node++) {
+			size = sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX);
+			if (size <= ROOM) {
+				info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buf + off);
+				memset (info, 0, size);
+				info->Relationship = RelationNumaNode;
+				info->Size = (unsigned)size;
+				info->NumaNode.NodeNumber = node;
+				if (collectgroupmasks ((int)node, -1, -1, masks, ngroups) > 0)
+					info->NumaNode.GroupMask = masks[0];
+			}
+			off += size;
+		}
+	}
+
+	if (rel == RelationProcessorPackage || rel == RelationAll) {
+		for (cpu = 0; cpu < topologycpus; cpu++) {
+			if (!topology[cpu].online) continue;
+			for (prev = 0; prev < cpu; prev++)
+				if (topology[prev].online && topology[prev].package == topology[cpu].package) break;
+			if (prev < cpu) continue;
+
+			room = ROOM;
+			off += emitprocessor (RelationProcessorPackage, topology[cpu].package, -1,
+			                      masks, ngroups, buf + off, room);
+		}
+	}
+
+	if (rel == RelationGroup || rel == RelationAll) {
+		unsigned short group;
+		unsigned char bit;
+
+		size = offsetof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX, Group.GroupInfo) + ngroups * sizeof(PROCESSOR_GROUP_INFO);
+		if (size <= ROOM) {
+			info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buf + off);
+			memset (info, 0, size);
+			info->Relationship = RelationGroup;
+			info->Size = (unsigned)size;
+			info->Group.MaximumGroupCount = ngroups;
+			info->Group.ActiveGroupCount = ngroups;
+			for (cpu = 0; cpu < topologycpus; cpu++) {
+				cpugroup (cpu, &group, &bit);
+				info->Group.GroupInfo[group].MaximumProcessorCount++;
+				if (topology[cpu].online) {
+					info->Group.GroupInfo[group].ActiveProcessorCount++;
+					info->Group.GroupInfo[group].ActiveProcessorMask |= (uintptr_t)1 << bit;
+				}
+			}
+		}
+		off += size;
+	}
+
+	#undef ROOM
+
+	free (masks);
+
+	if (off > *len) {
+		*len = (unsigned)off;
+		_setlasterror( ERROR_INSUFFICIENT_BUFFER );
+		return false;
+	}
+
+	*len = (unsigned)off;
+	return true;
+}
+
+#ifdef __cplusplus
+}
+#endif
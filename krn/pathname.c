@@ -11,100 +11,741 @@
 
 #include <limits.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/stat.h>
 //#ifndef HAVE_UNISTD_H
  #include <unistd.h>
 //#endif
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 #include "windows.h"
+#include "pathname.h"
 
 
 // depends on these functions
 extern void _setlasterror( unsigned err );
 extern unsigned get_win_error( int err );
-extern unsigned _getfileattributes( const char *name );
+extern unsigned _classifyfilename( const char *name, size_t limit, unsigned flags, size_t *length );
+extern size_t _matchpathcase( char *path, size_t length, size_t start );
+extern size_t _getshortname( const char *dir, size_t dirlength, const char *name, size_t length, char *shortname );
+extern size_t _getlongname( const char *dir, size_t dirlength, const char *shortname, size_t length, char *name, size_t size );
 
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-unsigned _getfullpathname( const char *name, unsigned len, char *buffer, char **lastpart )
+/*
+ * Full path names are built lexically, as on Windows: the name is joined to the
+ * current directory, backslashes are taken as separators, the repeated ones and
+ * the "." components are dropped and ".." removes the previous component. The
+ * file system is not asked, so a file that does not exist yet has a full name
+ * too. The current directory is kept in a copy refreshed by _setcurrentdirectory,
+ * as the one of the Windows process, a chdir made behind our back is noticed by
+ * the device and inode of ".". The result is written into the buffer of the caller,
+ * a stack buffer is used only when that one is too small.
+ * With FULL_PATH_NAME_RESOLVE_LINKS the symbolic links are followed component by
+ * component, as realpath does, and ".." applies to the resolved directory. The
+ * resolved directories are cached, an entry lives for PATHCACHETTL ms or until
+ * _flushfullpathnamecache, the missing components are left as they are.
+ * Windows names, those with a drive letter or a backslash, are translated: the
+ * drive stands for a directory set by _setdriveroot, C: for the root by default,
+ * and the components are matched to the existing entries ignoring the case.
+ * _setpathnametranslation extends the matching to every name, or turns it off.
+ */
+
+#define PATHCACHESIZE		256			//power of two
+#define PATHCACHETTL		1000		//ms
+#define PATHMAXSYMLINKS		40
+#define SHORTNAMESIZE		12			//8.3 without the terminating zero
+
+#ifndef CLOCK_MONOTONIC_COARSE
+# define CLOCK_MONOTONIC_COARSE	CLOCK_MONOTONIC
+#endif
+
+typedef struct PATHCACHEENTRY_ {
+	unsigned hash;
+	unsigned generation;
+	uint64_t stamp;
+	unsigned keylength;
+	unsigned length;
+	char data[];				//the key, then the resolved path
+} PATHCACHEENTRY;
+
+static char cwdpath[PATH_MAX];
+static unsigned cwdlength;
+static dev_t cwddev;				//of "." when cwdpath was read
+static ino_t cwdino;
+static volatile unsigned cwdseq;	//odd while written, 0 until read
+static pthread_mutex_t cwdlock = PTHREAD_MUTEX_INITIALIZER;
+
+// the replaced roots are not freed, a reader may be copying one
+static const char * volatile driveroots[26] = { ['C' - 'A'] = "/" };
+static volatile unsigned pathnametranslation = PATH_NAME_TRANSLATE_WINDOWS;
+
+static PATHCACHEENTRY *pathcache[PATHCACHESIZE];
+static volatile unsigned pathcachegeneration;
+static pthread_mutex_t pathcachelock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static inline
+bool isseparator (char c)
 {
-	//TODO: original function works also when the file does not exist
-	char res_path[PATH_MAX];		//todo: check
-	char *path;
-	size_t pathlen;
+	return c == '/' || c == '\\';
+}
 
-	path = realpath (name, res_path);
-	if (!path) {
-		_setlasterror( get_win_error (errno) );
-		return 0;
+// the first separator or the terminating zero at or after p
+static inline
+const char* nextseparator (const char *p)
+{
+#ifdef __SSE2__
+	// aligned loads never cross a page, the bytes before p are masked off
+	const __m128i slash = _mm_set1_epi8 ('/'), backslash = _mm_set1_epi8 ('\\');
+	const __m128i zero = _mm_setzero_si128 ();
+	const char *a = (const char*)((uintptr_t)p & ~(uintptr_t)15);
+	unsigned mask;
+	__m128i v;
+
+	v = _mm_load_si128 ((const __m128i*)a);
+	mask = _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, slash), _mm_cmpeq_epi8 (v, backslash)),
+											_mm_cmpeq_epi8 (v, zero)));
+	mask &= ~0u << (p - a);
+	while (!mask) {
+		a += 16;
+		v = _mm_load_si128 ((const __m128i*)a);
+		mask = _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, slash), _mm_cmpeq_epi8 (v, backslash)),
+												_mm_cmpeq_epi8 (v, zero)));
 	}
+	return a + __builtin_ctz (mask);
+#else
+	while (*p && !isseparator (*p))
+		p++;
+	return p;
+#endif
+}
 
-	pathlen = strlen (res_path);
-	if (pathlen >= len) {
-		_setlasterror( get_win_error (ERANGE) );
-		return (unsigned)(pathlen+1);
+static inline
+bool hasdriveletter (const char *name)
+{
+	return (unsigned)((name[0] | 0x20) - 'a') < 26u && name[1] == ':';
+}
+
+static inline
+bool iswindowsname (const char *name)
+{
+	return hasdriveletter (name) || strchr (name, '\\') != NULL;
+}
+
+static inline
+uint64_t pathcacheclock (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline
+unsigned hashpathname (const char *s, size_t length)
+{
+	unsigned h = 2166136261u;		//FNV-1a
+
+	while (length--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+void _refreshcurrentdirectory( void )
+{
+	char path[PATH_MAX];
+	struct stat st;
+	unsigned seq;
+
+	if (!getcwd (path, sizeof(path)) || stat (path, &st) != 0)
+		return;		//the last known one stays
+
+	pthread_mutex_lock (&cwdlock);
+	seq = cwdseq;
+	cwdseq = seq + 1;
+	__sync_synchronize ();
+	cwdlength = (unsigned)strlen (path);
+	memcpy (cwdpath, path, cwdlength + 1);
+	cwddev = st.st_dev;
+	cwdino = st.st_ino;
+	__sync_synchronize ();
+	cwdseq = seq + 2;
+	pthread_mutex_unlock (&cwdlock);
+}
+
+// copies the current directory when it fits, returns its length; a chdir made
+// behind our back changes the device or inode of "." and refreshes the copy
+static
+size_t copycurrentdirectory (char *out, size_t size)
+{
+	struct stat st;
+	bool current, refreshed = false;
+	unsigned seq;
+	size_t n;
+
+	if (stat (".", &st) != 0)
+		refreshed = true;	//nothing to compare with, the last known one stays
+
+	for (;;) {
+		seq = __atomic_load_n (&cwdseq, __ATOMIC_ACQUIRE);
+		if (!seq) {
+			_refreshcurrentdirectory ();
+			if (!cwdseq)
+				return 0;
+			refreshed = true;
+			continue;
+		}
+		if (seq & 1) {
+			sched_yield ();
+			continue;
+		}
+		n = cwdlength;
+		if (n < size)
+			memcpy (out, cwdpath, n);
+		current = refreshed || (cwddev == st.st_dev && cwdino == st.st_ino);
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (cwdseq != seq)
+			continue;
+		if (current)
+			return n;
+		_refreshcurrentdirectory ();
+		refreshed = true;
 	}
+}
 
-	strncpy (buffer, res_path, pathlen); buffer[pathlen] = '\0';
+void _flushfullpathnamecache( void )
+{
+	__sync_fetch_and_add (&pathcachegeneration, 1);
+}
+
+bool _setdriveroot( char drive, const char *root )
+{
+	size_t length;
+	char *copy = NULL;
+
+	if ((unsigned)((drive | 0x20) - 'a') >= 26u || (root && root[0] != '/')) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+	if (root) {
+		length = strlen (root);
+		while (length > 1 && root[length-1] == '/')
+			length--;
+		if (length >= PATH_MAX) {
+			_setlasterror( ERROR_FILENAME_EXCED_RANGE );
+			return false;
+		}
+		copy = (char*) malloc (length + 1);
+		if (!copy) {
+			_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+			return false;
+		}
+		memcpy (copy, root, length);
+		copy[length] = '\0';
+	}
+	driveroots[(drive | 0x20) - 'a'] = copy;		//NULL unmaps the drive
+	__sync_synchronize ();
+	_flushfullpathnamecache ();
+	return true;
+}
+
+void _setpathnametranslation( unsigned flags )
+{
+	pathnametranslation = flags;
+}
+
+static
+size_t getcachedpath (const char *key, size_t keylength, unsigned hash, char *out)
+{
+	PATHCACHEENTRY *entry;
+	size_t n = 0;
 
-	if (lastpart) {
-		if ( _getfileattributes( buffer ) & FILE_ATTRIBUTE_DIRECTORY ) {
-			path = NULL;
+	pthread_mutex_lock (&pathcachelock);
+	entry = pathcache[hash & (PATHCACHESIZE - 1)];
+	if (entry && entry->hash == hash && entry->keylength == keylength &&
+		entry->generation == pathcachegeneration && pathcacheclock () - entry->stamp < PATHCACHETTL &&
+		!memcmp (entry->data, key, keylength))
+	{
+		n = entry->length;
+		memcpy (out, entry->data + keylength, n + 1);
+	}
+	pthread_mutex_unlock (&pathcachelock);
+	return n;
+}
+
+static
+void putcachedpath (const char *key, size_t keylength, unsigned hash, const char *path, size_t length, unsigned generation)
+{
+	PATHCACHEENTRY *entry, *old;
+
+	entry = (PATHCACHEENTRY*) malloc (sizeof(PATHCACHEENTRY) + keylength + length + 1);
+	if (!entry)
+		return;
+	entry->hash       = hash;
+	entry->generation = generation;
+	entry->stamp      = pathcacheclock ();
+	entry->keylength  = (unsigned)keylength;
+	entry->length     = (unsigned)length;
+	memcpy (entry->data, key, keylength);
+	memcpy (entry->data + keylength, path, length + 1);
+
+	pthread_mutex_lock (&pathcachelock);
+	old = pathcache[hash & (PATHCACHESIZE - 1)];
+	pathcache[hash & (PATHCACHESIZE - 1)] = entry;
+	pthread_mutex_unlock (&pathcachelock);
+	free (old);
+}
+
+/*
+ * Joins the name to the root of its drive, or to the current directory, and
+ * normalises it into out. With keepdotdot the ".." components stay for the
+ * resolution of the links. The result has no trailing separator, the root
+ * excepted. start receives the length of the part taken as it is, the drive
+ * root or the current directory. Returns the length, or SIZE_MAX when it does
+ * not fit into size bytes.
+ */
+static
+size_t joinpath (char *out, size_t size, const char *name, const char *root, bool keepdotdot, size_t *start)
+{
+	const char *p = name, *q;
+	size_t n, clength, bottom = 1;
+
+	if (root) {
+		n = strlen (root);
+		if (n >= size)
+			return SIZE_MAX;
+		memcpy (out, root, n);
+		*start = n;
+		bottom = n;		//".." does not leave the drive
+	} else if (isseparator (*p)) {
+		if (size < 2)
+			return SIZE_MAX;
+		out[0] = '/';
+		n = 1;
+		*start = 0;
+	} else {
+		n = copycurrentdirectory (out, size);
+		if (!n || n >= size)
+			return SIZE_MAX;
+		*start = n;
+	}
+
+	for (;;) {
+		while (isseparator (*p))
+			p++;
+		if (!*p)
+			break;
+		q = nextseparator (p);
+		clength = q - p;
+
+		if (p[0] == '.' && clength == 1)
+			;
+		else if (p[0] == '.' && p[1] == '.' && clength == 2 && !keepdotdot) {
+			while (n > bottom && out[n-1] != '/')
+				n--;
+			if (n > bottom)
+				n--;
+			if (n < *start)
+				*start = n;
 		} else {
-			path = rindex (buffer, '/');
-			if (path) path++;
+			if (n + 1 + clength >= size)
+				return SIZE_MAX;
+			if (out[n-1] != '/')
+				out[n++] = '/';
+			memcpy (out + n, p, clength);
+			n += clength;
 		}
-		*lastpart = path;
+		p = q;
 	}
+	out[n] = '\0';
+	return n;
+}
+
+/*
+ * Resolves the components of path onto the resolved directory in out of length
+ * n, as realpath does. Once a component is missing, the rest is joined
+ * lexically. Returns the new length, or SIZE_MAX with the last error set.
+ */
+static
+size_t resolvecomponents (char *out, size_t n, const char *path, size_t length, unsigned *links, bool *missing)
+{
+	char pending[PATH_MAX], target[PATH_MAX];
+	const char *p, *q;
+	size_t clength, rest;
+	ssize_t tlength;
+
+	memcpy (pending, path, length);
+	pending[length] = '\0';
+	p = pending;
+
+	for (;;) {
+		while (*p == '/')
+			p++;
+		if (!*p)
+			break;
+		q = nextseparator (p);
+		clength = q - p;
+
+		if (p[0] == '.' && clength == 1) {
+			p = q;
+			continue;
+		}
+		if (p[0] == '.' && p[1] == '.' && clength == 2) {
+			while (n > 1 && out[n-1] != '/')
+				n--;
+			if (n > 1)
+				n--;
+			out[n] = '\0';
+			p = q;
+			continue;
+		}
+
+		if (n + 1 + clength >= PATH_MAX) {
+			_setlasterror( ERROR_FILENAME_EXCED_RANGE );
+			return SIZE_MAX;
+		}
+		if (out[n-1] != '/')
+			out[n++] = '/';
+		memcpy (out + n, p, clength);
+		n += clength;
+		out[n] = '\0';
+		p = q;
+		if (*missing)
+			continue;
 
-	return (unsigned)pathlen;
+		tlength = readlink (out, target, sizeof(target) - 1);
+		if (tlength < 0) {
+			if (errno != EINVAL)
+				*missing = true;		//not there or not searchable, the rest is lexical
+			continue;
+		}
+		if (++*links > PATHMAXSYMLINKS) {
+			_setlasterror( ERROR_CANT_RESOLVE_FILENAME );
+			return SIZE_MAX;
+		}
+
+		// the link is replaced by its target, followed by the rest of the path
+		rest = strlen (p);
+		if ((size_t)tlength + rest >= sizeof(pending)) {
+			_setlasterror( ERROR_FILENAME_EXCED_RANGE );
+			return SIZE_MAX;
+		}
+		memmove (pending + tlength, p, rest + 1);
+		memcpy (pending, target, tlength);
+		p = pending;
+
+		if (target[0] == '/')
+			n = 1;
+		else {
+			n -= clength;
+			if (n > 1)
+				n--;
+		}
+		out[n] = '\0';
+	}
+	return n;
 }
 
-unsigned _getlongpathname( const char* shortpath, char* longpath, unsigned longlen )
+static
+size_t resolvepath (const char *path, size_t length, char *out)
+{
+	const char *last;
+	size_t dirlength, n;
+	unsigned hash, generation, links = 0;
+	bool missing = false;
+
+	// the directory part is looked up in the cache, a final ".." belongs to it
+	last = path + length;
+	while (last > path && last[-1] != '/')
+		last--;
+	if (last[0] == '.' && last[1] == '.' && last[2] == '\0')
+		last = path + length;
+	dirlength = last - path;
+	if (dirlength > 1 && path[dirlength-1] == '/')
+		dirlength--;
+
+	out[0] = '/';
+	out[1] = '\0';
+	n = 1;
+	if (dirlength > 1) {
+		hash = hashpathname (path, dirlength);
+		n = getcachedpath (path, dirlength, hash, out);
+		if (!n) {
+			generation = pathcachegeneration;
+			n = resolvecomponents (out, 1, path, dirlength, &links, &missing);
+			if (n == SIZE_MAX)
+				return SIZE_MAX;
+			if (!missing)
+				putcachedpath (path, dirlength, hash, out, n, generation);
+		}
+	}
+	if (last < path + length)
+		n = resolvecomponents (out, n, last, path + length - last, &links, &missing);
+	return n;
+}
+
+unsigned _getfullpathnameex( const char *name, unsigned len, char *buffer, char **lastpart, unsigned flags )
 {
-	//note: implement for Windows like file systems
+	char path[PATH_MAX], resolved[PATH_MAX];
+	char *out = buffer, *heap = NULL;
+	const char *root = NULL;
+	size_t n, namelength, size = len, start;
+	unsigned translation = pathnametranslation;
+	bool trailing, matchcase;
 
-	if (!shortpath || !longpath) {
+	if (!name || (len && !buffer)) {
 		_setlasterror( ERROR_INVALID_PARAMETER );
 		return 0;
 	}
-
-	size_t len = strlen (shortpath);
-	if (!len) {
+	namelength = strlen (name);
+	if (!namelength) {
 		_setlasterror( ERROR_PATH_NOT_FOUND );
 		return 0;
 	}
-	if (len >= longlen) {
-		_setlasterror( get_win_error(ERANGE) );
-		return (unsigned)(len+1);
+	// a trailing separator stays, as with GetFullPathName
+	trailing = isseparator (name[namelength-1]);
+
+	matchcase = (translation & PATH_NAME_TRANSLATE_ALL) ||
+				((translation & PATH_NAME_TRANSLATE_WINDOWS) && iswindowsname (name));
+	// without translation the names are POSIX ones, "c:" is a plain file name
+	if (translation != PATH_NAME_TRANSLATE_NONE && hasdriveletter (name)) {
+		root = driveroots[(name[0] | 0x20) - 'a'];
+		if (!root) {
+			_setlasterror( ERROR_PATH_NOT_FOUND );
+			return 0;
+		}
+		name += 2;
+		namelength -= 2;
+	}
+
+	if (flags & FULL_PATH_NAME_RESOLVE_LINKS) {
+		n = joinpath (path, sizeof(path), name, root, true, &start);
+		if (n == SIZE_MAX) {
+			_setlasterror( ERROR_FILENAME_EXCED_RANGE );
+			return 0;
+		}
+		if (matchcase)
+			_matchpathcase (path, n, start);
+		n = resolvepath (path, n, resolved);
+		if (n == SIZE_MAX)
+			return 0;
+		out = resolved;
+		size = sizeof(resolved);
+	} else {
+		// straight into the buffer of the caller, the stack and the heap are spares
+		n = size > 1 ? joinpath (out, size - 1, name, root, false, &start) : SIZE_MAX;
+		if (n == SIZE_MAX) {
+			out = path;
+			size = sizeof(path);
+			n = joinpath (out, size - 1, name, root, false, &start);
+		}
+		if (n == SIZE_MAX) {
+			size = PATH_MAX + namelength + 2;
+			out = heap = (char*) malloc (size);
+			if (!out) {
+				_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+				return 0;
+			}
+			n = joinpath (out, size - 1, name, root, false, &start);
+			if (n == SIZE_MAX) {
+				free (heap);
+				_setlasterror( ERROR_FILENAME_EXCED_RANGE );
+				return 0;
+			}
+		}
+		if (matchcase)
+			_matchpathcase (out, n, start);
+	}
+	if (trailing && out[n-1] != '/') {
+		out[n++] = '/';
+		out[n] = '\0';
+	}
+
+	if (n >= len) {
+		free (heap);
+		_setlasterror( get_win_error (ERANGE) );
+		return (unsigned)(n+1);
+	}
+	if (out != buffer)
+		memcpy (buffer, out, n + 1);
+	free (heap);
+
+	if (lastpart)
+		*lastpart = buffer[n-1] == '/' ? NULL : strrchr (buffer, '/') + 1;
+
+	return (unsigned)n;
+}
+
+unsigned _getfullpathname( const char *name, unsigned len, char *buffer, char **lastpart )
+{
+	return _getfullpathnameex (name, len, buffer, lastpart, FULL_PATH_NAME_LEXICAL);
+}
+
+// the POSIX name of a file, name itself when there is nothing to translate
+const char* _translatepathname( const char *name, char *buffer, unsigned size )
+{
+	unsigned translation = pathnametranslation;
+	unsigned len;
+
+	if (!name) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return NULL;
+	}
+	if (!(translation & PATH_NAME_TRANSLATE_ALL) &&
+		!((translation & PATH_NAME_TRANSLATE_WINDOWS) && iswindowsname (name)))
+		return name;
+
+	len = _getfullpathnameex (name, size, buffer, NULL, FULL_PATH_NAME_LEXICAL);
+	if (!len)
+		return NULL;
+	if (len >= size) {
+		_setlasterror( ERROR_FILENAME_EXCED_RANGE );
+		return NULL;
+	}
+	return buffer;
+}
+
+/*
+ * The short and the long forms of a path take each component in turn, the
+ * names come from the index of its directory kept by shortname.c. As the
+ * other path functions, they return full POSIX paths.
+ */
+unsigned _getlongpathname( const char* shortpath, char* longpath, unsigned longlen )
+{
+	char path[PATH_MAX], result[PATH_MAX], name[NAME_MAX + 1];
+	const char *p, *q;
+	size_t n, length = 1, clength;
+	unsigned len;
+
+	if (!shortpath || (longlen && !longpath)) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return 0;
+	}
+	len = _getfullpathnameex (shortpath, sizeof(path), path, NULL, FULL_PATH_NAME_LEXICAL);
+	if (!len)
+		return 0;
+	if (len >= sizeof(path)) {
+		_setlasterror( ERROR_FILENAME_EXCED_RANGE );
+		return 0;
 	}
 
-	//TODO: add file exists check
+	result[0] = '/';
+	result[1] = '\0';
+	for (p = path + 1; *p; p = *q ? q + 1 : q) {
+		q = nextseparator (p);
+		clength = q - p;
+		if (!clength)
+			continue;
+		// the long name of a made up one, or the name itself in the case of its entry
+		n = _getlongname (result, length, p, clength, name, sizeof(name));
+		if (!n || n >= sizeof(name)) {
+			memcpy (name, p, clength);
+			n = clength;
+		}
+		if (length + 1 + n >= sizeof(result)) {
+			_setlasterror( ERROR_FILENAME_EXCED_RANGE );
+			return 0;
+		}
+		if (length > 1)
+			result[length++] = '/';
+		memcpy (result + length, name, n);
+		n += length;
+		result[n] = '\0';
+		if (_matchpathcase (result, n, length > 1 ? length - 1 : 0) != n) {
+			_setlasterror( *q ? ERROR_PATH_NOT_FOUND : ERROR_FILE_NOT_FOUND );
+			return 0;
+		}
+		length = n;
+	}
+	if (path[len-1] == '/' && length > 1)
+		result[length++] = '/';
 
-	strncpy (longpath, shortpath, len); longpath[len] = '\0';
-	return (unsigned)len;
+	if (length >= longlen) {
+		_setlasterror( get_win_error(ERANGE) );
+		return (unsigned)(length+1);
+	}
+	memcpy (longpath, result, length);
+	longpath[length] = '\0';
+	return (unsigned)length;
 }
 
 unsigned _getshortpathname( const char* longpath, char* shortpath, unsigned shortlen )
 {
-	//note: only for Windows like file systems
+	char path[PATH_MAX], result[PATH_MAX];
+	char *p, *q, saved;
+	size_t n, length = 0, dirlength;
+	unsigned len;
 
-	_setlasterror (ERROR_CALL_NOT_IMPLEMENTED);
-	return 0;
+	if (!longpath || (shortlen && !shortpath)) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return 0;
+	}
+	len = _getfullpathnameex (longpath, sizeof(path), path, NULL, FULL_PATH_NAME_LEXICAL);
+	if (!len)
+		return 0;
+	if (len >= sizeof(path)) {
+		_setlasterror( ERROR_FILENAME_EXCED_RANGE );
+		return 0;
+	}
+	// the file has to exist, in the case of its entries
+	n = _matchpathcase (path, len, 0);
+	if (n != len) {
+		_setlasterror( memchr (path + n + 1, '/', len - n - 1) ? ERROR_PATH_NOT_FOUND : ERROR_FILE_NOT_FOUND );
+		return 0;
+	}
+
+	result[length++] = '/';
+	for (p = path + 1; *p; p = *q ? q + 1 : q) {
+		q = (char*)nextseparator (p);
+		if (q == p)
+			continue;
+		if (length + SHORTNAMESIZE + (q - p) + 1 >= sizeof(result)) {
+			_setlasterror( ERROR_FILENAME_EXCED_RANGE );
+			return 0;
+		}
+		if (p - path > 1) {
+			dirlength = p - path - 1;
+			saved = path[dirlength];
+			path[dirlength] = '\0';
+			n = _getshortname (path, dirlength, p, q - p, result + length);
+			path[dirlength] = saved;
+		} else
+			n = _getshortname ("/", 1, p, q - p, result + length);
+		if (!n)
+			return 0;
+		length += n;
+		if (*q)
+			result[length++] = '/';
+	}
+
+	if (length >= shortlen) {
+		_setlasterror( get_win_error(ERANGE) );
+		return (unsigned)(length+1);
+	}
+	memcpy (shortpath, result, length);
+	shortpath[length] = '\0';
+	return (unsigned)length;
 }
 
 bool _checknamelegaldos8dot3( const char* lpName, char *lpOemName, unsigned dwOemNameSize,
                               bool* pbNameContainsSpaces, bool* pbNameLegal )
 {
-	register char *lptr;
-	int c, n, lastdot = 0;
-	bool legal = true, hasspace = false;
-	bool isdir;
+	const char *name;
+	unsigned classes;
+	size_t i, length;
+	bool legal;
 
 	if (!lpName) {
 		if (pbNameContainsSpaces) *pbNameContainsSpaces = false;
@@ -113,62 +754,27 @@ bool _checknamelegaldos8dot3( const char* lpName, char *lpOemName, unsigned dwOe
 		return false;
 	}
 
-	isdir = (_getfileattributes( lpName ) & FILE_ATTRIBUTE_DIRECTORY);
-	c = 0;
-	lptr = strrchr (lpName, '/');
-	if (!lptr) lptr = (char*)lpName;
-	else lptr++;
-
-	while (*lptr)
-	{
-		if (legal)
-		{
-			c++;
-
-			if (*lptr == '.') lastdot = c;
-			else {
-				//check illegal characters
-				if (strchr ("<>:\"/\\|?*", *lptr) != NULL)
-					legal = false;
-			}
-
-			if (!pbNameContainsSpaces)
-				if (c > (isdir ? 8 : 12)) legal = false;
-		}
-
-		if (pbNameContainsSpaces) {
-			if (!hasspace && *lptr == ' ') hasspace = true;
-		} else {
-			if (!legal) break;
-		}
-
-		lptr++;
-	}
-	n = c;
-	if (!isdir && lastdot)
-		c = lastdot - 1;
-	if (!c || lpName[c-1] == ' ')	//no filename or illegal space
-		legal = false;
+	// the last component only, the file system is not asked
+	for (name = lpName; *lpName; lpName++)
+		if (isseparator (*lpName))
+			name = lpName + 1;
+	classes = _classifyfilename (name, SIZE_MAX, pbNameContainsSpaces ? CHECK_NAME_ALLOW_SPACES : 0, &length);
+	legal = (classes & NAME_LEGAL_DOS8DOT3) != 0;
 
-	if (legal) {
-		if (isdir) {
-			if ((c > 0 && c <= 8) &&
-			    !lastdot)
-				;
-			else
-				legal = false;
+	if (legal && lpOemName) {
+		if (length >= dwOemNameSize) {
+			_setlasterror( ERROR_INSUFFICIENT_BUFFER );
+			legal = false;
 		} else {
-			if ((c > 0 && c <= 8) &&
-			    (lastdot && (n-lastdot > 0 && n-lastdot < 4)))
-				;
-			else
-				legal = false;
+			for (i = 0; i < length; i++)
+				lpOemName[i] = (unsigned)(name[i] - 'a') < 26u ? name[i] - 0x20 : name[i];
+			lpOemName[length] = '\0';
 		}
 	}
 
-	if (pbNameContainsSpaces) *pbNameContainsSpaces = (hasspace == true);
-	if (pbNameLegal) *pbNameLegal = (legal == true);
-	return (legal == true);
+	if (pbNameContainsSpaces) *pbNameContainsSpaces = (classes & NAME_CONTAINS_SPACES) != 0;
+	if (pbNameLegal) *pbNameLegal = legal;
+	return legal;
 }
 
 #ifdef __cplusplus
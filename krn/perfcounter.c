@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * perfcounter.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#ifdef __MACH__
+# include <mach/mach_time.h>
+#endif
+#if defined __x86_64__ || defined __i386__
+# include <cpuid.h>
+#endif
+
+#include "windows.h"
+#include "timedef.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+
+#define NSECPERSEC			1000000000LL
+#define TSCCALIBRATIONNS	5000000LL		//calibration window against CLOCK_MONOTONIC_RAW
+
+#ifndef CLOCK_MONOTONIC_RAW
+# define CLOCK_MONOTONIC_RAW	CLOCK_MONOTONIC
+#endif
+#ifndef CLOCK_MONOTONIC_COARSE
+# define CLOCK_MONOTONIC_COARSE	CLOCK_MONOTONIC
+#endif
+
+static pthread_once_t counteronce = PTHREAD_ONCE_INIT;
+static bool usetsc = false;
+static int64_t counterfrequency = NSECPERSEC;
+#ifdef __MACH__
+static mach_timebase_info_data_t machtimebase;
+#endif
+
+
+static inline
+int64_t clocknanoseconds (clockid_t clk)
+{
+	struct timespec ts;
+
+	// vDSO, no system call
+	clock_gettime (clk, &ts);
+	return (int64_t)ts.tv_sec * NSECPERSEC + ts.tv_nsec;
+}
+
+#if defined __x86_64__ || defined __i386__
+static inline
+uint64_t readtsc (void)
+{
+	uint32_t lo, hi;
+
+	// lfence keeps the read behind the preceding loads
+	__asm__ __volatile__ ("lfence\n\trdtsc" : "=a" (lo), "=d" (hi) :: "memory");
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static
+bool hasinvarianttsc (void)
+{
+	unsigned eax, ebx, ecx, edx;
+	char clocksource[32] = "";
+	FILE *f;
+
+	if (!__get_cpuid (0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+		return false;
+
+	// the kernel stops using a TSC it found unsynchronised between sockets
+	f = fopen ("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+	if (f) {
+		if (!fgets (clocksource, sizeof(clocksource), f))
+			clocksource[0] = '\0';
+		fclose (f);
+		return (strncmp (clocksource, "tsc", 3) == 0);
+	}
+
+	return true;
+}
+
+static
+int64_t calibratetsc (void)
+{
+	unsigned eax, ebx, ecx, edx;
+	int64_t t0, t1;
+	uint64_t c0, c1;
+
+	// the exact ratio when the processor reports its crystal clock
+	if (__get_cpuid_max (0, NULL) >= 0x15) {
+		__cpuid (0x15, eax, ebx, ecx, edx);
+		if (eax && ebx && ecx)
+			return (int64_t)((uint64_t)ecx * ebx / eax);
+	}
+
+	t0 = clocknanoseconds (CLOCK_MONOTONIC_RAW);
+	c0 = readtsc ();
+	do {
+		t1 = clocknanoseconds (CLOCK_MONOTONIC_RAW);
+		c1 = readtsc ();
+	} while (t1 - t0 < TSCCALIBRATIONNS);
+
+	return (int64_t)((double)(c1 - c0) * NSECPERSEC / (double)(t1 - t0));
+}
+#endif
+
+static
+void counterinit (void)
+{
+#if defined __x86_64__ || defined __i386__
+	if (hasinvarianttsc ()) {
+		counterfrequency = calibratetsc ();
+		usetsc = (counterfrequency > 0);
+	}
+#endif
+#ifdef __MACH__
+	mach_timebase_info (&machtimebase);
+#endif
+	if (!usetsc)
+		counterfrequency = NSECPERSEC;
+}
+
+static inline
+int64_t readcounter (void)
+{
+#if defined __x86_64__ || defined __i386__
+	if (usetsc)
+		return (int64_t)readtsc ();
+#endif
+#ifdef __MACH__
+	return (int64_t)(mach_absolute_time () * machtimebase.numer / machtimebase.denom);
+#else
+	return clocknanoseconds (CLOCK_MONOTONIC);
+#endif
+}
+
+
+bool _queryperformancefrequency( int64_t *frequency )
+{
+	if ( !frequency ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	pthread_once (&counteronce, counterinit);
+	*frequency = counterfrequency;
+	return true;
+}
+
+bool _queryperformancecounter( int64_t *count )
+{
+	if ( !count ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	pthread_once (&counteronce, counterinit);
+	*count = readcounter ();
+	return true;
+}
+
+uint64_t _gettickcount64( void )
+{
+	// the resolution of a scheduler tick is the resolution of GetTickCount
+	return (uint64_t)(clocknanoseconds (CLOCK_MONOTONIC_COARSE) / 1000000);
+}
+
+unsigned _gettickcount( void )
+{
+	return (unsigned)_gettickcount64( );
+}
+
+// absolute CLOCK_MONOTONIC time for the timed waits of the library
+void _getmonotonicdeadline( unsigned milliseconds, struct timespec *abstime )
+{
+	clock_gettime (CLOCK_MONOTONIC, abstime);
+
+	abstime->tv_sec += (milliseconds / 1000);
+	abstime->tv_nsec += (milliseconds % 1000) * 1000000;
+	if (abstime->tv_nsec >= NSECPERSEC) {
+		abstime->tv_sec++;
+		abstime->tv_nsec -= NSECPERSEC;
+	}
+}
+
+// relative time left to an absolute CLOCK_MONOTONIC deadline, false when it passed
+bool _getmonotonictimeout( const struct timespec *abstime, struct timespec *timeout )
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	timeout->tv_sec = abstime->tv_sec - now.tv_sec;
+	timeout->tv_nsec = abstime->tv_nsec - now.tv_nsec;
+	if (timeout->tv_nsec < 0) {
+		timeout->tv_sec--;
+		timeout->tv_nsec += NSECPERSEC;
+	}
+
+	return (timeout->tv_sec >= 0);
+}
+
+// wall clock time stamps of the library objects
+void _getcurrentfiletime( FILETIME *ft )
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_REALTIME, &ts);
+	timespec_to_FILETIME( &ts, ft );
+}
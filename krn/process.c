@@ -0,0 +1,924 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * process.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#if defined __linux__ && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+//#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+//#endif	//HAVE_UNISTD_H
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+#endif
+
+#include "windows.h"
+#include "object.h"
+#include "processthreads.h"
+#include "waitpool.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern unsigned get_win_error( int err );
+extern uintptr_t _getcurrentprocess( );
+extern int _gethandlefd( uintptr_t hndl );
+extern void _getmonotonicdeadline( unsigned milliseconds, struct timespec *abstime );
+extern bool _getmonotonictimeout( const struct timespec *abstime, struct timespec *timeout );
+extern void _signalwaitobject( void *key );
+
+extern char **environ;
+
+
+#define PROCESSOBJID		2
+
+// posix_spawn of glibc uses clone(CLONE_VM|CLONE_VFORK) and has chdir and closefrom actions since 2.34
+#if defined __GLIBC__ && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+# define HAVE_FAST_SPAWN	1
+#endif
+
+#if defined __linux__ && defined SYS_pidfd_open
+# define HAVE_PIDFD			1
+# ifndef P_PIDFD
+#  define P_PIDFD			3
+# endif
+#endif
+
+// a process killed by a signal gets the exit code of a shell
+#define SIGNALEXITCODE(sig)	(128 + (sig))
+
+#define REAPPOLLMIN			1		//ms, the polling without pidfd
+#define REAPPOLLMAX			50
+
+#define NOTIFIEREVENTS		32
+
+static bool _closeprocesshandle( uintptr_t hndl );
+unsigned _waitforsingleprocessobject( uintptr_t hndl, unsigned milliseconds );
+
+static TYPEOBJITEM processkrnlobj =
+{
+	PROCESSOBJID, true,
+	_closeprocesshandle,
+	NULL,   //_duplicateprocesshandle,
+	NULL,   //_gethandleinformation,
+	NULL,   //_sethandleinformation,
+	_waitforsingleprocessobject
+};
+
+typedef struct PROCESSOBJDATA_ {
+	pid_t pid;
+	int pidfd;				//-1 without pidfd support
+	bool child;				//can be reaped
+	volatile int exited;
+	volatile int terminated;	//by _terminateprocess
+	unsigned terminatecode;
+	unsigned exitcode;
+	pthread_mutex_t reaplock;
+
+	// the exit notifier reaps the process and signals the wait pool, see exitnotifier
+	volatile int refcount;	//the handle, the exit notifier and a pending close
+	bool watched;			//in the notifier epoll set, guarded by notifierlock
+	struct PROCESSOBJDATA_ *closenext;
+} PROCESSOBJDATA;
+
+#ifdef HAVE_PIDFD
+static pthread_once_t notifieronce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t notifierlock = PTHREAD_MUTEX_INITIALIZER;
+static int notifierepoll = -1;
+static int notifierevent = -1;		//eventfd, wakes the notifier for the closed handles
+static PROCESSOBJDATA *closedprocesses;
+#endif
+
+
+static inline
+PROCESSOBJDATA* getprocessdata (uintptr_t hndl)
+{
+	if ( _gethandletypeid( hndl ) != PROCESSOBJID ) {
+		_setlasterror( ERROR_INVALID_HANDLE );
+		return NULL;
+	}
+	return *(PROCESSOBJDATA**)hndl;
+}
+
+static
+int openpidfd (pid_t pid)
+{
+#ifdef HAVE_PIDFD
+	return (int) syscall (SYS_pidfd_open, pid, 0);		//always close-on-exec
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static
+void setexitstatus (PROCESSOBJDATA *data, int code, bool signaled)
+{
+	if (signaled)
+		data->exitcode = ((code == SIGKILL && data->terminated) ? data->terminatecode : SIGNALEXITCODE(code));
+	else
+		data->exitcode = (unsigned)code;
+	__sync_synchronize ();	//publish the exit code
+	data->exited = 1;
+	_signalwaitobject( data );
+}
+
+// collects the exit status if the process has finished, returns true then
+static
+bool reapprocess (PROCESSOBJDATA *data)
+{
+	int rc;
+
+	if (data->exited)
+		return true;
+
+	pthread_mutex_lock (&data->reaplock);
+	if (!data->exited) {
+		if (!data->child) {
+			// the exit code of a foreign process is not available, its pidfd
+			// is readable once it exits, even while its parent keeps a zombie
+#ifdef HAVE_PIDFD
+			if (data->pidfd != -1) {
+				struct pollfd pfd = { data->pidfd, POLLIN, 0 };
+				if (poll (&pfd, 1, 0) == 1)
+					setexitstatus (data, 0, false);
+			} else
+#endif
+			if (kill (data->pid, 0) == -1 && errno == ESRCH)
+				setexitstatus (data, 0, false);
+		} else {
+#ifdef HAVE_PIDFD
+			if (data->pidfd != -1) {
+				siginfo_t si;
+				memset (&si, 0, sizeof(si));
+				rc = waitid ((idtype_t)P_PIDFD, (id_t)data->pidfd, &si, WEXITED | WNOHANG);
+				if (rc == 0 && si.si_pid != 0)
+					setexitstatus (data, si.si_status, (si.si_code != CLD_EXITED));
+				else if (rc == -1 && errno == ECHILD)	//reaped by someone else
+					setexitstatus (data, 0, false);
+			} else
+#endif
+			{
+				int status;
+				rc = waitpid (data->pid, &status, WNOHANG);
+				if (rc == data->pid)
+					setexitstatus (data, (WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status)), WIFSIGNALED(status));
+				else if (rc == -1 && errno == ECHILD)
+					setexitstatus (data, 0, false);
+			}
+		}
+	}
+	pthread_mutex_unlock (&data->reaplock);
+
+	return data->exited;
+}
+
+static
+bool ischildprocess (pid_t pid)
+{
+	siginfo_t si;
+
+	return (waitid (P_PID, (id_t)pid, &si, WEXITED | WNOHANG | WNOWAIT) == 0);
+}
+
+static
+void releaseprocessdata (PROCESSOBJDATA *data)
+{
+	if (__sync_sub_and_fetch (&data->refcount, 1) != 0)
+		return;
+
+	if (data->pidfd != -1)
+		close (data->pidfd);
+	pthread_mutex_destroy (&data->reaplock);
+	free (data);
+}
+
+static
+void* reaperthread (void *arg)
+{
+	pid_t pid = (pid_t)(intptr_t)arg;
+	int status;
+
+	while (waitpid (pid, &status, 0) == -1 && errno == EINTR)
+		;
+	return NULL;
+}
+
+// waits for a child without a handle when the exit notifier does not watch it
+static
+void reapdetached (pid_t pid)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize (&attr, PTHREAD_STACK_MIN > 65536 ? PTHREAD_STACK_MIN : 65536);
+	pthread_create (&thread, &attr, reaperthread, (void*)(intptr_t)pid);
+	pthread_attr_destroy (&attr);
+}
+
+#ifdef HAVE_PIDFD
+/*
+ * One thread waits for the exits of all the processes with a handle, so that
+ * the registered waits fire without anybody waiting on the process itself.
+ * Only the notifier removes a pidfd from its epoll set: an exit returned with
+ * others keeps its reference until the whole batch is handled, the closed
+ * handles are handed over through closedprocesses. A child still running
+ * when its last handle is closed stays watched until it exits and is reaped.
+ */
+static
+void* exitnotifier (void *arg)
+{
+	struct epoll_event events[NOTIFIEREVENTS];
+	PROCESSOBJDATA *data, *closed;
+	uint64_t count;
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait (notifierepoll, events, NOTIFIEREVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return NULL;
+		}
+
+		for (i = 0; i < n; i++) {
+			data = (PROCESSOBJDATA*)events[i].data.ptr;
+			if (!data)
+				continue;		//the eventfd
+
+			pthread_mutex_lock (&notifierlock);
+			if (!data->watched) {
+				pthread_mutex_unlock (&notifierlock);
+				continue;
+			}
+			epoll_ctl (notifierepoll, EPOLL_CTL_DEL, data->pidfd, NULL);
+			data->watched = false;
+			pthread_mutex_unlock (&notifierlock);
+
+			reapprocess (data);		//signals the wait pool
+			releaseprocessdata (data);
+		}
+
+		pthread_mutex_lock (&notifierlock);
+		closed = closedprocesses;
+		closedprocesses = NULL;
+		while (read (notifierevent, &count, sizeof(count)) == -1 && errno == EINTR)
+			;
+		for (data = closed; data; data = closed) {
+			closed = data->closenext;
+			if (data->watched) {
+				epoll_ctl (notifierepoll, EPOLL_CTL_DEL, data->pidfd, NULL);
+				data->watched = false;
+				releaseprocessdata (data);		//the notifier's reference
+			}
+			releaseprocessdata (data);			//the closed handle's one
+		}
+		pthread_mutex_unlock (&notifierlock);
+	}
+}
+
+static
+void exitnotifierinit (void)
+{
+	struct epoll_event ev;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int rc;
+
+	notifierepoll = epoll_create1 (EPOLL_CLOEXEC);
+	notifierevent = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (notifierepoll != -1 && notifierevent != -1) {
+		memset (&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl (notifierepoll, EPOLL_CTL_ADD, notifierevent, &ev) == 0) {
+			pthread_attr_init (&attr);
+			pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+			rc = pthread_create (&thread, &attr, exitnotifier, NULL);
+			pthread_attr_destroy (&attr);
+			if (rc == 0)
+				return;
+		}
+	}
+
+	// the registered waits on processes then fire only on a timeout
+	if (notifierepoll != -1) close (notifierepoll);
+	if (notifierevent != -1) close (notifierevent);
+	notifierepoll = notifierevent = -1;
+}
+
+static
+void watchprocess (PROCESSOBJDATA *data)
+{
+	struct epoll_event ev;
+
+	pthread_once (&notifieronce, exitnotifierinit);
+	if (notifierepoll == -1)
+		return;
+
+	memset (&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = data;
+	pthread_mutex_lock (&notifierlock);
+	__sync_add_and_fetch (&data->refcount, 1);
+	if (epoll_ctl (notifierepoll, EPOLL_CTL_ADD, data->pidfd, &ev) == 0)
+		data->watched = true;
+	else
+		__sync_sub_and_fetch (&data->refcount, 1);
+	pthread_mutex_unlock (&notifierlock);
+}
+
+static
+bool iswatched (PROCESSOBJDATA *data)
+{
+	bool watched;
+
+	pthread_mutex_lock (&notifierlock);
+	watched = data->watched;
+	pthread_mutex_unlock (&notifierlock);
+	return watched;
+}
+
+// hands the reference of a closed handle to the notifier, returns false when it is not watched
+static
+bool unwatchprocess (PROCESSOBJDATA *data)
+{
+	uint64_t one = 1;
+	bool watched;
+
+	pthread_mutex_lock (&notifierlock);
+	watched = data->watched;
+	if (watched) {
+		data->closenext = closedprocesses;
+		closedprocesses = data;
+		while (write (notifierevent, &one, sizeof(one)) == -1 && errno == EINTR)
+			;
+	}
+	pthread_mutex_unlock (&notifierlock);
+	return watched;
+}
+#endif
+
+static
+uintptr_t createprocesshandle (pid_t pid, int pidfd, bool child)
+{
+	PROCESSOBJDATA *data;
+	uintptr_t hndl;
+
+	data = (PROCESSOBJDATA*) calloc (1, sizeof(PROCESSOBJDATA));
+	if (!data) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return (uintptr_t)NULL;
+	}
+	data->pid   = pid;
+	data->pidfd = pidfd;
+	data->child = child;
+	data->refcount = 1;
+	pthread_mutex_init (&data->reaplock, NULL);
+
+	hndl = _createhandle (-1, 0, &processkrnlobj, (void*)&data, sizeof(data), NULL, 0);
+	if ( !hndl ) {
+		_setlasterror( get_win_error (errno) );
+		pthread_mutex_destroy (&data->reaplock);
+		free (data);
+		return (uintptr_t)NULL;
+	}
+
+#ifdef HAVE_PIDFD
+	if ( pidfd != -1 )
+		watchprocess (data);
+#endif
+
+	return hndl;
+}
+
+// splits a command line the way the Windows C runtime does
+static
+char** parsecommandline (const char *cmdline)
+{
+	size_t len, nargs;
+	char **argv, *buf, *out;
+	const char *p;
+	unsigned backslashes;
+	bool quoted;
+
+	len = strlen (cmdline);
+	nargs = len / 2 + 2;
+	argv = (char**) malloc (nargs * sizeof(char*) + len + 1);
+	if (!argv)
+		return NULL;
+	buf = (char*)(argv + nargs);
+
+	nargs = 0;
+	out = buf;
+	p = cmdline;
+	for (;;) {
+		while (*p == ' ' || *p == '\t') p++;
+		if (!*p)
+			break;
+
+		argv[nargs++] = out;
+		quoted = false;
+		for (; *p && (quoted || (*p != ' ' && *p != '\t')); p++) {
+			for (backslashes = 0; *p == '\\'; p++)
+				backslashes++;
+
+			if (*p == '"') {
+				// 2n backslashes give n and a quote toggle, 2n+1 give n and a quote
+				for (; backslashes >= 2; backslashes -= 2)
+					*out++ = '\\';
+				if (backslashes) {
+					*out++ = '"';
+				} else if (quoted && p[1] == '"') {
+					*out++ = '"';
+					p++;
+				} else
+					quoted = !quoted;
+				continue;
+			}
+
+			for (; backslashes; backslashes--)
+				*out++ = '\\';
+			if (!*p || (!quoted && (*p == ' ' || *p == '\t')))
+				break;
+			*out++ = *p;
+		}
+		*out++ = '\0';
+		if (!*p)
+			break;
+	}
+	argv[nargs] = NULL;
+
+	return argv;
+}
+
+// converts a block of "name=value\0...\0\0" strings to envp
+static
+char** parseenvironment (const char *block)
+{
+	const char *p;
+	size_t count = 0;
+	char **envp;
+
+	for (p = block; *p; p += strlen (p) + 1)
+		count++;
+
+	envp = (char**) malloc ((count + 1) * sizeof(char*));
+	if (!envp)
+		return NULL;
+
+	count = 0;
+	for (p = block; *p; p += strlen (p) + 1)
+		envp[count++] = (char*)p;
+	envp[count] = NULL;
+
+	return envp;
+}
+
+#ifdef HAVE_FAST_SPAWN
+static
+int spawnprocess (const char *path, bool searchpath, char **argv, char **envp, const char *curdir,
+                  const int stdfds[3], bool inherit, unsigned flags, pid_t *pid)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	short spawnflags;
+	int i, rc;
+
+	posix_spawn_file_actions_init (&actions);
+	posix_spawnattr_init (&attr);
+
+	for (i = 0; i < 3; i++)
+		if (stdfds[i] != -1)
+			posix_spawn_file_actions_adddup2 (&actions, stdfds[i], i);
+	if (curdir)
+		posix_spawn_file_actions_addchdir_np (&actions, curdir);
+	if (!inherit)
+		posix_spawn_file_actions_addclosefrom_np (&actions, 3);
+
+	// the child starts with the default dispositions and no blocked signals
+	spawnflags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	sigemptyset (&mask);
+	posix_spawnattr_setsigmask (&attr, &mask);
+	sigfillset (&mask);
+	posix_spawnattr_setsigdefault (&attr, &mask);
+
+	if (flags & DETACHED_PROCESS)
+		spawnflags |= POSIX_SPAWN_SETSID;
+	else if (flags & CREATE_NEW_PROCESS_GROUP) {
+		spawnflags |= POSIX_SPAWN_SETPGROUP;
+		posix_spawnattr_setpgroup (&attr, 0);
+	}
+	posix_spawnattr_setflags (&attr, spawnflags);
+
+	if (searchpath)
+		rc = posix_spawnp (pid, path, &actions, &attr, argv, envp);
+	else
+		rc = posix_spawn (pid, path, &actions, &attr, argv, envp);
+
+	posix_spawnattr_destroy (&attr);
+	posix_spawn_file_actions_destroy (&actions);
+
+	return rc;
+}
+#else
+static
+int spawnprocess (const char *path, bool searchpath, char **argv, char **envp, const char *curdir,
+                  const int stdfds[3], bool inherit, unsigned flags, pid_t *pid)
+{
+	int i, fd, rc, err, errpipe[2];
+	sigset_t mask, oldmask;
+	ssize_t cnt;
+
+	// the child reports a failed exec through a close-on-exec pipe
+	if (pipe (errpipe) == -1)
+		return errno;
+	fcntl (errpipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl (errpipe[1], F_SETFD, FD_CLOEXEC);
+
+	sigfillset (&mask);
+	pthread_sigmask (SIG_SETMASK, &mask, &oldmask);
+
+	*pid = fork ();
+	if (*pid == 0) {
+		for (i = 1; i < NSIG; i++)
+			signal (i, SIG_DFL);
+		sigemptyset (&mask);
+		pthread_sigmask (SIG_SETMASK, &mask, NULL);
+
+		if (flags & DETACHED_PROCESS)
+			setsid ();
+		else if (flags & CREATE_NEW_PROCESS_GROUP)
+			setpgid (0, 0);
+		for (i = 0; i < 3; i++)
+			if (stdfds[i] != -1 && dup2 (stdfds[i], i) == -1)
+				goto failed;
+		if (curdir && chdir (curdir) == -1)
+			goto failed;
+		if (!inherit) {
+			for (fd = (int)sysconf (_SC_OPEN_MAX) - 1; fd > 2; fd--)
+				if (fd != errpipe[1])
+					close (fd);
+		}
+
+		environ = envp;
+		if (searchpath)
+			execvp (path, argv);
+		else
+			execv (path, argv);
+failed:
+		err = errno;
+		cnt = write (errpipe[1], &err, sizeof(err));
+		(void)cnt;
+		_exit (127);
+	}
+	err = errno;
+	pthread_sigmask (SIG_SETMASK, &oldmask, NULL);
+	close (errpipe[1]);
+
+	if (*pid == -1) {
+		close (errpipe[0]);
+		return err;
+	}
+
+	do
+		cnt = read (errpipe[0], &rc, sizeof(rc));
+	while (cnt == -1 && errno == EINTR);
+	close (errpipe[0]);
+
+	if (cnt == sizeof(rc)) {
+		waitpid (*pid, NULL, 0);
+		return rc;
+	}
+	return 0;
+}
+#endif
+
+bool _createprocess( const char *application, char *commandline,
+                     SECURITY_ATTRIBUTES *psa, SECURITY_ATTRIBUTES *tsa,
+                     bool inherithandles, unsigned flags, void *environment,
+                     const char *curdir, STARTUPINFOA *si, PROCESS_INFORMATION *pi )
+{
+	char **argv, **envp;
+	const char *path;
+	int stdfds[3] = { -1, -1, -1 };
+	pid_t pid;
+	int rc, pidfd;
+	uintptr_t hndl;
+
+	//TODO: CREATE_SUSPENDED, the debug flags and security attributes
+	if ( !pi || (!application && !commandline) || (flags & CREATE_UNICODE_ENVIRONMENT) ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	argv = parsecommandline (commandline ? commandline : application);
+	if ( !argv ) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return false;
+	}
+	if ( !argv[0] ) {
+		free (argv);
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	envp = environ;
+	if ( environment ) {
+		envp = parseenvironment ((const char*)environment);
+		if ( !envp ) {
+			free (argv);
+			_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+			return false;
+		}
+	}
+
+	// the standard handles are inherited regardless of bInheritHandles
+	if ( si && (si->dwFlags & STARTF_USESTDHANDLES) ) {
+		stdfds[0] = (si->hStdInput  ? _gethandlefd( si->hStdInput )  : -1);
+		stdfds[1] = (si->hStdOutput ? _gethandlefd( si->hStdOutput ) : -1);
+		stdfds[2] = (si->hStdError  ? _gethandlefd( si->hStdError )  : -1);
+	}
+
+	// without an application name the first token is searched in PATH
+	path = (application ? application : argv[0]);
+	rc = spawnprocess (path, !application, argv, envp, curdir, stdfds, inherithandles, flags, &pid);
+
+	if (envp != environ)
+		free (envp);
+	free (argv);
+
+	if ( rc != 0 ) {
+		_setlasterror( rc == ENOENT ? ERROR_FILE_NOT_FOUND : get_win_error (rc) );
+		return false;
+	}
+
+	// the pid cannot be reused before we reap it
+	pidfd = openpidfd (pid);
+
+	hndl = createprocesshandle (pid, pidfd, true);
+	if ( !hndl ) {
+		if (pidfd != -1) close (pidfd);
+		return false;
+	}
+
+	pi->hProcess    = hndl;
+	pi->hThread     = (uintptr_t)NULL;		//threads of other processes have no objects
+	pi->dwProcessId = (unsigned)pid;
+	pi->dwThreadId  = (unsigned)pid;		//the main thread
+	return true;
+}
+
+uintptr_t _openprocess( unsigned access, bool inherit, unsigned pid )
+{
+	int pidfd;
+	uintptr_t hndl;
+
+	//TODO: access rights and handle inheritance
+	if ( pid == 0 ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return (uintptr_t)NULL;
+	}
+
+	pidfd = openpidfd ((pid_t)pid);
+	if ( pidfd == -1 ) {
+		if ( errno != ENOSYS ) {
+			_setlasterror( errno == ESRCH ? ERROR_INVALID_PARAMETER : get_win_error (errno) );
+			return (uintptr_t)NULL;
+		}
+		if ( kill ((pid_t)pid, 0) == -1 && errno == ESRCH ) {
+			_setlasterror( ERROR_INVALID_PARAMETER );
+			return (uintptr_t)NULL;
+		}
+	}
+
+	// the exit status of our own children stays collectable
+	hndl = createprocesshandle ((pid_t)pid, pidfd, ischildprocess ((pid_t)pid));
+	if ( !hndl && pidfd != -1 )
+		close (pidfd);
+	return hndl;
+}
+
+unsigned _getprocessid( uintptr_t hndl )
+{
+	PROCESSOBJDATA *data;
+
+	if ( hndl == _getcurrentprocess( ) )
+		return (unsigned)getpid ();
+
+	data = getprocessdata( hndl );
+	return (data ? (unsigned)data->pid : 0);
+}
+
+bool _getexitcodeprocess( uintptr_t hndl, unsigned *exitcode )
+{
+	PROCESSOBJDATA *data;
+
+	data = getprocessdata( hndl );
+	if ( !data )
+		return false;
+
+	if ( exitcode ) *exitcode = (reapprocess (data) ? data->exitcode : STILL_ACTIVE);
+	return true;
+}
+
+bool _terminateprocess( uintptr_t hndl, unsigned exitcode )
+{
+	PROCESSOBJDATA *data;
+	int rc;
+
+	if ( hndl == _getcurrentprocess( ) )
+		_exit ((int)exitcode);
+
+	data = getprocessdata( hndl );
+	if ( !data )
+		return false;
+
+	if ( reapprocess (data) ) {
+		_setlasterror( ERROR_ACCESS_DENIED );	//as Windows does for a finished process
+		return false;
+	}
+
+	data->terminatecode = exitcode;
+	data->terminated = 1;
+#if defined HAVE_PIDFD && defined SYS_pidfd_send_signal
+	if (data->pidfd != -1)
+		rc = (int) syscall (SYS_pidfd_send_signal, data->pidfd, SIGKILL, NULL, 0);
+	else
+#endif
+		rc = kill (data->pid, SIGKILL);
+
+	if ( rc == -1 ) {
+		data->terminated = 0;
+		_setlasterror( get_win_error (errno) );
+		return false;
+	}
+
+	return true;
+}
+
+unsigned _waitforsingleprocessobject( uintptr_t hndl, unsigned milliseconds )
+{
+	PROCESSOBJDATA *data;
+	struct timespec deadline, timeout;
+	int rc, pollms = REAPPOLLMIN;
+
+	data = *(PROCESSOBJDATA**)hndl;
+
+	if ( reapprocess (data) )
+		return WAIT_OBJECT_0;
+	if ( milliseconds == 0 )
+		return WAIT_TIMEOUT;
+
+	if ( milliseconds != INFINITE )
+		_getmonotonicdeadline( milliseconds, &deadline );
+
+	for (;;) {
+		if ( milliseconds != INFINITE && !_getmonotonictimeout( &deadline, &timeout ) )
+			return (reapprocess (data) ? WAIT_OBJECT_0 : WAIT_TIMEOUT);
+
+		if ( data->pidfd != -1 ) {
+			// a pidfd becomes readable when the process exits, no SIGCHLD is needed
+			struct pollfd pfd = { data->pidfd, POLLIN, 0 };
+			rc = poll (&pfd, 1, (milliseconds == INFINITE ? -1 : (int)(timeout.tv_sec * 1000 + (timeout.tv_nsec + 999999) / 1000000)));
+			if ( rc == -1 && errno != EINTR ) {
+				_setlasterror( get_win_error (errno) );
+				return WAIT_FAILED;
+			}
+		} else {
+			struct timespec ts = { pollms / 1000, (pollms % 1000) * 1000000 };
+			if ( milliseconds != INFINITE && (timeout.tv_sec < ts.tv_sec ||
+			     (timeout.tv_sec == ts.tv_sec && timeout.tv_nsec < ts.tv_nsec)) )
+				ts = timeout;
+			nanosleep (&ts, NULL);
+			if (pollms < REAPPOLLMAX) pollms *= 2;
+		}
+
+		if ( reapprocess (data) )
+			return WAIT_OBJECT_0;
+	}
+}
+
+/*
+ * Waits for one or all of count processes, the pidfds are polled together.
+ * The general multi-object wait is not available, the other objects have no
+ * pollable descriptor.
+ */
+unsigned _waitformultipleprocessobjects( unsigned count, const uintptr_t *handles, bool waitall, unsigned milliseconds )
+{
+	PROCESSOBJDATA *datas[MAXIMUM_WAIT_OBJECTS];
+	struct pollfd pfds[MAXIMUM_WAIT_OBJECTS];
+	struct timespec deadline, timeout;
+	unsigned i, nfds, done;
+	int rc, ms, pollms = REAPPOLLMIN;
+	bool polling;
+
+	if ( count == 0 || count > MAXIMUM_WAIT_OBJECTS || !handles ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return WAIT_FAILED;
+	}
+	for (i = 0; i < count; i++) {
+		datas[i] = getprocessdata( handles[i] );
+		if ( !datas[i] )
+			return WAIT_FAILED;
+	}
+
+	if ( milliseconds != INFINITE )
+		_getmonotonicdeadline( milliseconds, &deadline );
+
+	for (;;) {
+		nfds = done = 0;
+		polling = false;
+		for (i = 0; i < count; i++) {
+			if ( reapprocess (datas[i]) ) {
+				if ( !waitall )
+					return WAIT_OBJECT_0 + i;
+				done++;
+			} else if ( datas[i]->pidfd != -1 ) {
+				pfds[nfds].fd = datas[i]->pidfd;
+				pfds[nfds].events = POLLIN;
+				pfds[nfds++].revents = 0;
+			} else
+				polling = true;
+		}
+		if ( done == count )
+			return WAIT_OBJECT_0;
+
+		ms = -1;
+		if ( milliseconds != INFINITE ) {
+			if ( !_getmonotonictimeout( &deadline, &timeout ) )
+				return WAIT_TIMEOUT;
+			ms = (int)(timeout.tv_sec * 1000 + (timeout.tv_nsec + 999999) / 1000000);
+		}
+		if ( polling ) {
+			if ( ms == -1 || ms > pollms )
+				ms = pollms;
+			if ( pollms < REAPPOLLMAX ) pollms *= 2;
+		}
+
+		if ( nfds ) {
+			rc = poll (pfds, nfds, ms);
+			if ( rc == -1 && errno != EINTR ) {
+				_setlasterror( get_win_error (errno) );
+				return WAIT_FAILED;
+			}
+		} else {
+			struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+			nanosleep (&ts, NULL);
+		}
+	}
+}
+
+static
+bool _closeprocesshandle( uintptr_t hndl )
+{
+	PROCESSOBJDATA *data;
+	unsigned int *refcount;
+
+	_gethandledata (hndl, &refcount);
+	if (*refcount <= 1) {
+		data = *(PROCESSOBJDATA**)hndl;
+
+		// a running child is reaped when it exits, it does not stay a zombie
+		if (!reapprocess (data) && data->child) {
+#ifdef HAVE_PIDFD
+			if (!iswatched (data))
+#endif
+				reapdetached (data->pid);
+			releaseprocessdata (data);		//the notifier keeps its reference
+			return true;
+		}
+#ifdef HAVE_PIDFD
+		if (unwatchprocess (data))
+			return true;
+#endif
+		releaseprocessdata (data);
+	}
+
+	return true;
+}
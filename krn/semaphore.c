@@ -17,26 +17,31 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 #ifdef __MACH__
 #include <mach/mach_time.h>
 #endif
 
 #include "windows.h"
 #include "object.h"
+#include "futex.h"
 
 
 // depends on these functions:
 extern void _setlasterror( unsigned err );
 extern unsigned get_win_error( int err );
+extern void _getmonotonicdeadline( unsigned milliseconds, struct timespec *abstime );
+extern bool _getmonotonictimeout( const struct timespec *abstime, struct timespec *timeout );
+extern void _signalwaitobject( void *key );
 
 
 #define SEMAPHOREOBJID		6
 
-bool _closesemaphorehandle( uintptr_t hndl );
+static bool _closesemaphorehandle( uintptr_t hndl );
 static bool _duplicatesemaphorehandle( uintptr_t srchndl, uintptr_t *targethndl, unsigned access, bool inherit, unsigned options );
 /* bool _gethandleinformation( uintptr_t hndl, unsigned *flags );
 bool _sethandleinformation( uintptr_t hndl, unsigned mask, unsigned flags );*/
-static unsigned _waitforsinglesemaphoreobject( uintptr_t hndl, unsigned milliseconds );
+unsigned _waitforsinglesemaphoreobject( uintptr_t hndl, unsigned milliseconds );
 
 static TYPEOBJITEM semaphorekrnlobj =
 {
@@ -54,11 +59,15 @@ typedef struct SEMAPHOREOBJDATA_{
 } SEMAPHOREOBJDATA;
 
 
+// a named semaphore lives in shared memory, its futex is not process private
 typedef struct mysem_t_ {
-	pthread_mutex_t mx;
-	pthread_cond_t cv;
-	unsigned value;
+	volatile int value;		//futex
+	volatile int waiters;	//threads sleeping on value
+	volatile int reserved;	//threads registered by _reservesemaphore
+	volatile int granted;	//units released to the registered threads
+	volatile int grantseq;	//futex of the registered threads
 	unsigned maxvalue;
+	int shared;
 } mysem_t;
 
 
@@ -146,37 +155,13 @@ uintptr_t _createsemaphoreex( SECURITY_ATTRIBUTES *sa, LONG initial, LONG max, c
 
 	if (!opened) {
 	// initialize semaphore
-	pthread_mutexattr_t pmxattr;
-	pthread_mutexattr_init (&pmxattr);
-	if (name && *name)
-		pthread_mutexattr_setpshared (&pmxattr, PTHREAD_PROCESS_SHARED);
-	rc = pthread_mutex_init (&ps->mx, &pmxattr);
-	pthread_mutexattr_destroy (&pmxattr);
-	if (rc == 0) {
-		pthread_condattr_t pcvattr;
-		pthread_condattr_init (&pcvattr);
-		if (name && *name)
-			pthread_condattr_setpshared (&pcvattr, PTHREAD_PROCESS_SHARED);
-		rc = pthread_cond_init (&ps->cv, &pcvattr);
-		pthread_condattr_destroy (&pcvattr);
-		if (rc != 0)
-			pthread_mutex_destroy (&ps->mx);
-	}
-	if (rc == 0) {
-		ps->value    = initial;
-		ps->maxvalue = max;
-	}
-
-	if ( rc != 0 ) {
-		_setlasterror( get_win_error (rc) );
-		if ( name && *name ) {
-			munmap ((void*)ps, sizeof(mysem_t));
-			close (fd_semaphore);
-			shm_unlink (shmname);
-		} else
-			free (ps);
-		return (uintptr_t)NULL;
-	}
+	ps->value    = initial;
+	ps->waiters  = 0;
+	ps->reserved = 0;
+	ps->granted  = 0;
+	ps->grantseq = 0;
+	ps->maxvalue = max;
+	ps->shared   = (name && *name);
 	}
 
 	size_t datalen = sizeof(SEMAPHOREOBJDATA) + (name ? namelen+2 : 0);
@@ -200,8 +185,6 @@ uintptr_t _createsemaphoreex( SECURITY_ATTRIBUTES *sa, LONG initial, LONG max, c
 	if ( !hndl ) {
 		_setlasterror( get_win_error (errno) );
 		//destroy created semaphore
-		pthread_mutex_destroy (&ps->mx);
-		pthread_cond_destroy (&ps->cv);
 		if ( name && *name ) {
 			munmap ((void*)ps, sizeof(mysem_t));
 			if (!opened) shm_unlink (shmname);
@@ -294,101 +277,235 @@ uintptr_t _opensemaphore( unsigned access, bool inherit, const char *name )
 	return hndl;
 }
 
-static
-unsigned _waitforsinglesemaphoreobject( uintptr_t hndl, unsigned milliseconds )
+static inline
+int semfutexwait (mysem_t *sm, const struct timespec *timeout)
 {
-	int rc;
+	return (sm->shared ? futex_wait_shared (&sm->value, 0, timeout) : futex_wait (&sm->value, 0, timeout));
+}
+
+static inline
+void semfutexwake (mysem_t *sm, int count)
+{
+	if (sm->shared) futex_wake_shared (&sm->value, count);
+	else futex_wake (&sm->value, count);
+}
+
+// waits for the semaphore, polls it spin times before sleeping
+unsigned _waitforsinglesemaphoreobjectex( uintptr_t hndl, unsigned milliseconds, unsigned spin )
+{
+	int rc, value;
 	mysem_t *sm;
+	struct timespec deadline, timeout;
 
 	sm = *(mysem_t**)hndl;
 
-	rc = pthread_mutex_lock (&sm->mx);
-	if ( rc == -1 ) {
-		_setlasterror( get_win_error (errno) );
-		return false;
-	}
+	if ( milliseconds != INFINITE )
+		_getmonotonicdeadline( milliseconds, &deadline );
 
-	if ( milliseconds != INFINITE ) {
-		struct timespec abstime;
+	for (;;) {
+		value = sm->value;
+		if ( value > 0 ) {
+			if ( __sync_bool_compare_and_swap (&sm->value, value, value - 1) )
+				return WAIT_OBJECT_0;
+			continue;
+		}
 
-#ifdef __MACH__
-		clock_serv_t cclock;
-		mach_timespec_t mts;
-
-		host_get_clock_service (mach_host_self(), CALENDAR_CLOCK, &cclock);
-		clock_get_time (cclock, &mts);
-		mach_port_deallocate (mach_task_self(), cclock);
-		abstime.tv_sec = mts.tv_sec;
-		abstime.tv_nsec = mts.tv_nsec;
-#else
-		clock_gettime (CLOCK_REALTIME, &abstime);
-#endif
-		abstime.tv_sec += (milliseconds / 1000);
-		abstime.tv_nsec += (milliseconds % 1000) * 1000000;
-
-		while (sm->value == 0 && rc == 0)
-			rc = pthread_cond_timedwait (&sm->cv, &sm->mx, &abstime);
-	} else {
-		while (sm->value == 0 && rc == 0)
-			rc = pthread_cond_wait (&sm->cv, &sm->mx);
-	}
+		if ( spin ) {
+			spin--;
+			cpu_relax ();
+			continue;
+		}
+
+		if ( milliseconds != INFINITE && !_getmonotonictimeout( &deadline, &timeout ) )
+			return WAIT_TIMEOUT;
+
+		// a releaser reads waiters after it has changed value
+		__sync_add_and_fetch (&sm->waiters, 1);
+		rc = semfutexwait (sm, (milliseconds != INFINITE ? &timeout : NULL));
+		__sync_sub_and_fetch (&sm->waiters, 1);
 
-	if ( rc != 0 ) {
-		pthread_mutex_unlock (&sm->mx);
-		_setlasterror( get_win_error (rc) );
-		return (errno == ETIMEDOUT ? WAIT_TIMEOUT : WAIT_FAILED);
+		if ( rc == -1 && errno != ETIMEDOUT && errno != EAGAIN && errno != EINTR ) {
+			_setlasterror( get_win_error (errno) );
+			return WAIT_FAILED;
+		}
 	}
+}
 
-	sm->value--;
+unsigned _waitforsinglesemaphoreobject( uintptr_t hndl, unsigned milliseconds )
+{
+	return _waitforsinglesemaphoreobjectex( hndl, milliseconds, 0 );
+}
 
-	pthread_mutex_unlock (&sm->mx);
+static inline
+int grantfutexwait (mysem_t *sm, int seq, const struct timespec *timeout)
+{
+	return (sm->shared ? futex_wait_shared (&sm->grantseq, seq, timeout) : futex_wait (&sm->grantseq, seq, timeout));
+}
 
-	return WAIT_OBJECT_0;
+static inline
+void grantfutexwake (mysem_t *sm)
+{
+	__sync_add_and_fetch (&sm->grantseq, 1);
+	if (sm->shared) futex_wake_shared (&sm->grantseq, INT_MAX);
+	else futex_wake (&sm->grantseq, INT_MAX);
 }
 
-bool _releasesemaphore( uintptr_t hndl, LONG count, LONG *previous )
+static
+bool takegrant (mysem_t *sm)
 {
-	int rc = 0;
-	int prev;
-	mysem_t *sm;
+	int granted;
 
-	if (count <= 0) {
-		_setlasterror( ERROR_BAD_ARGUMENTS );
-		return false;
+	while ( (granted = sm->granted) > 0 )
+		if ( __sync_bool_compare_and_swap (&sm->granted, granted, granted - 1) )
+			return true;
+	return false;
+}
+
+// fails when a release has already turned the registration into a grant
+static
+bool withdrawreservation (mysem_t *sm)
+{
+	int reserved;
+
+	while ( (reserved = sm->reserved) > 0 )
+		if ( __sync_bool_compare_and_swap (&sm->reserved, reserved, reserved - 1) )
+			return true;
+	return false;
+}
+
+// waits for the grant of a registration that could not be withdrawn, its releaser is
+// between taking the registration and publishing the grant
+static
+void waitgrant (mysem_t *sm)
+{
+	int seq;
+
+	for (;;) {
+		seq = sm->grantseq;
+		if ( takegrant (sm) )
+			return;
+		grantfutexwait (sm, seq, NULL);
 	}
+}
 
-	sm = *(mysem_t **)hndl;
+static
+bool releaseunits (mysem_t *sm, LONG count, LONG *previous)
+{
+	int prev, add, reserved, granted = 0;
 
-	rc = pthread_mutex_lock (&sm->mx);
-	if ( rc != 0 ) {
-		_setlasterror( get_win_error (rc) );
+	if ( (unsigned)sm->value + count > sm->maxvalue ) {	//incremented too much
+		_setlasterror( ERROR_BAD_ARGUMENTS );
 		return false;
 	}
 
-	if ( sm->value + count > sm->maxvalue ) {	//incremented too much
-		pthread_mutex_unlock (&sm->mx);
+	// the threads registered before the release get the units first
+	while ( granted < count && (reserved = sm->reserved) > 0 )
+		if ( __sync_bool_compare_and_swap (&sm->reserved, reserved, reserved - 1) )
+			granted++;
+
+	// the granted units cannot be taken back, a concurrent release only clips at maxvalue
+	do {
+		prev = sm->value;
+		add = count - granted;
+		if ( (unsigned)prev + add > sm->maxvalue )
+			add = (prev < (int)sm->maxvalue ? (int)sm->maxvalue - prev : 0);
+	} while ( add && !__sync_bool_compare_and_swap (&sm->value, prev, prev + add) );
+
+	if ( granted )
+		__sync_add_and_fetch (&sm->granted, granted);
+
+	// a thread registered after the reservations were read wakes to look at value
+	if ( granted || sm->reserved )
+		grantfutexwake (sm);
+	if ( add && sm->waiters )
+		semfutexwake (sm, add);
+	_signalwaitobject( sm );
+
+	if (previous) *previous = prev;
+	return true;
+}
+
+bool _releasesemaphore( uintptr_t hndl, LONG count, LONG *previous )
+{
+	if (count <= 0) {
 		_setlasterror( ERROR_BAD_ARGUMENTS );
 		return false;
 	}
 
-	prev = sm->value;
+	return releaseunits (*(mysem_t **)hndl, count, previous);
+}
+
+// registers the caller for the next release, _signalobjectandwait makes it before
+// signalling so that the thread it wakes cannot take the unit meant for the caller
+void _reservesemaphore( uintptr_t hndl )
+{
+	mysem_t *sm;
+
+	sm = *(mysem_t**)hndl;
+	__sync_add_and_fetch (&sm->reserved, 1);
+}
+
+// cancels a registration that is not going to be waited for
+void _unreservesemaphore( uintptr_t hndl )
+{
+	mysem_t *sm;
+
+	sm = *(mysem_t**)hndl;
+	if ( !withdrawreservation (sm) ) {
+		waitgrant (sm);
+		releaseunits (sm, 1, NULL);
+	}
+}
+
+// waits for the semaphore with a registration made by _reservesemaphore
+unsigned _waitforreservedsemaphoreobject( uintptr_t hndl, unsigned milliseconds, unsigned spin )
+{
+	int rc, seq, value;
+	mysem_t *sm;
+	struct timespec deadline, timeout;
+
+	sm = *(mysem_t**)hndl;
 
-	while (count-- && rc == 0) {
-		if (sm->value == 0) {
-			rc = pthread_cond_signal (&sm->cv);
-			if (rc != 0) {	//can't signal condition variable
-				pthread_mutex_unlock (&sm->mx);
-				_setlasterror( get_win_error (rc) );
-				return false;
+	if ( milliseconds != INFINITE )
+		_getmonotonicdeadline( milliseconds, &deadline );
+
+	for (;;) {
+		seq = sm->grantseq;
+		if ( takegrant (sm) )
+			return WAIT_OBJECT_0;
+
+		// a unit released before the registration, the registration still has to go
+		value = sm->value;
+		if ( value > 0 ) {
+			if ( !__sync_bool_compare_and_swap (&sm->value, value, value - 1) )
+				continue;
+			if ( !withdrawreservation (sm) ) {
+				waitgrant (sm);
+				releaseunits (sm, 1, NULL);
 			}
+			return WAIT_OBJECT_0;
 		}
-		sm->value++;
-	}
 
-	pthread_mutex_unlock (&sm->mx);
+		if ( spin ) {
+			spin--;
+			cpu_relax ();
+			continue;
+		}
 
-	if (previous) *previous = prev;
-	return true;
+		if ( milliseconds != INFINITE && !_getmonotonictimeout( &deadline, &timeout ) ) {
+			if ( withdrawreservation (sm) )
+				return WAIT_TIMEOUT;
+			waitgrant (sm);
+			return WAIT_OBJECT_0;
+		}
+
+		rc = grantfutexwait (sm, seq, (milliseconds != INFINITE ? &timeout : NULL));
+		if ( rc == -1 && errno != ETIMEDOUT && errno != EAGAIN && errno != EINTR ) {
+			_setlasterror( get_win_error (errno) );
+			_unreservesemaphore( hndl );
+			return WAIT_FAILED;
+		}
+	}
 }
 
 static
@@ -426,21 +543,13 @@ bool _closesemaphorehandle( uintptr_t hndl )
 
 			fl.l_type   = F_WRLCK;
 			rc = fcntl (fdsemaphore, F_GETLK, &fl);
-			if (rc == 0 && fl.l_type == F_UNLCK && fl.l_pid == getpid ()) {
+			if (rc == 0 && fl.l_type == F_UNLCK && fl.l_pid == getpid ())
 				shm_unlink (name);	//unlink created SHM
 
-				pthread_mutex_destroy (&ps->mx);
-				pthread_cond_destroy (&ps->cv);
-			}
-
 			munmap ((void*)ps, sizeof(mysem_t));
 			close (fdsemaphore);
-		} else {
-			pthread_mutex_destroy (&ps->mx);
-			pthread_cond_destroy (&ps->cv);
-
+		} else
 			free (ps);
-		}
 	}
 
 	return true;
@@ -0,0 +1,729 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * shortname.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "windows.h"
+#include "pathname.h"
+#include "filestat.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern unsigned get_win_error( int err );
+extern unsigned _classifyfilename( const char *name, size_t limit, unsigned flags, size_t *length );
+extern bool _direntryexists( const char *dir, size_t dirlength, const char *name, size_t length );
+extern char* _readdirectorynames( const char *dir, size_t dirlength, unsigned *count, size_t *size );
+
+
+/*
+ * The file systems we run on have no 8.3 names, so they are made up as FAT and
+ * NTFS do: the upper-cased name without spaces and extra dots, the characters
+ * 8.3 does not take replaced by '_', cut to six characters and ~1 to ~4 added,
+ * then two characters, four hex digits of a hash of the long name and ~1 to ~9.
+ * A name that is a valid 8.3 one is its own short name. The names given in a
+ * directory are kept in an index file mapped by every process, under the cache
+ * directory and named by the device and inode of the directory, so they stay
+ * the same for the life of the file. The index has a hash of the long names
+ * and one of the folded short names, both directions take one lookup. When
+ * the index is made, the entries of the directory are named in sorted order;
+ * the files created later are named when first asked for, the short name of
+ * an unknown one brings the index up to date with the directory.
+ * Records are only appended, each one is complete before the heads of its
+ * buckets point to it, so the readers take no file lock. A full index is
+ * copied into a larger file renamed over it, the old one is marked replaced
+ * and the processes still mapping it map the new one.
+ */
+
+#define SHORTINDEXMAGIC		0x33384E34u		//"4N83"
+#define SHORTINDEXVERSION	1
+#define SHORTINDEXSLOTS		256				//power of two
+#define SHORTINDEXMINIMUM	1024			//records, power of two
+#define SHORTNAMESIZE		12				//8.3 without the terminating zero
+#define SHORTINDEXEND		0xFFFFFFFFu
+#define SHORTNAMEATTEMPTS	(4 + 9 * 64)
+
+typedef struct SHORTINDEXHEADER_ {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t dev;				//of the directory
+	uint64_t ino;
+	volatile uint32_t replaced;	//a larger index took its place
+	volatile uint32_t count;
+	uint32_t capacity;			//the records, and the buckets of each hash
+	volatile uint32_t poolsize;
+	uint32_t poolcapacity;
+	uint32_t reserved;
+} SHORTINDEXHEADER;
+
+typedef struct SHORTRECORD_ {
+	uint32_t longhash;
+	uint32_t shorthash;			//of the folded short name
+	uint32_t nextlong;
+	uint32_t nextshort;
+	uint32_t name;				//offset of the long name in the pool
+	uint32_t length;
+	char shortname[SHORTNAMESIZE];	//zero padded
+} SHORTRECORD;
+
+typedef struct SHORTINDEX_ {
+	struct SHORTINDEX_ *next;	//in the slot
+	unsigned hash;
+	int fd;
+	void *view;
+	size_t viewsize;
+	SHORTINDEXHEADER *header;
+	uint32_t *longbuckets;
+	uint32_t *shortbuckets;
+	SHORTRECORD *records;
+	char *pool;
+	struct timespec synced;		//the directory mtime when named last
+	char indexpath[PATH_MAX];
+	size_t length;
+	char path[];				//of the directory
+} SHORTINDEX;
+
+static SHORTINDEX *shortindexes[SHORTINDEXSLOTS];
+static pthread_rwlock_t shortindexlock = PTHREAD_RWLOCK_INITIALIZER;	//the table and the mappings
+static pthread_mutex_t shortwritelock = PTHREAD_MUTEX_INITIALIZER;		//the writers of this process
+
+
+static inline
+unsigned char upperchar (unsigned char c)
+{
+	return (unsigned)(c - 'a') < 26u ? c - ('a' - 'A') : c;
+}
+
+static inline
+unsigned hashname (const char *s, size_t length)
+{
+	unsigned h = 2166136261u;		//FNV-1a
+
+	while (length--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static inline
+unsigned hashshortname (const char *s, size_t length)
+{
+	unsigned h = 2166136261u;
+
+	while (length--)
+		h = (h ^ upperchar ((unsigned char)*s++)) * 16777619u;
+	return h;
+}
+
+static inline
+size_t shortnamelength (const char *shortname)
+{
+	return strnlen (shortname, SHORTNAMESIZE);
+}
+
+// the characters of a short name besides letters and digits
+static inline
+bool isshortnamechar (unsigned char c)
+{
+	return (unsigned)((c | 0x20) - 'a') < 26u || (unsigned)(c - '0') < 10u ||
+		   (c && strchr ("!#$%&'()-@^_`{}~", c) != NULL);
+}
+
+static inline
+bool isshortname (const char *name, size_t length)
+{
+	return (_classifyfilename (name, length, 0, NULL) & NAME_LEGAL_DOS8DOT3) != 0;
+}
+
+// the short name tried at an attempt, zero padded
+static
+void makeshortname (const char *name, size_t length, unsigned attempt, char *shortname)
+{
+	char base[8], extension[3], tail[12];
+	size_t i, lastdot, nbase = 0, nextension = 0, taillength, keep;
+	unsigned char c;
+	unsigned hash;
+
+	// the leading dots do not count, the last one of the rest starts the extension
+	for (i = 0; i < length && name[i] == '.'; i++)
+		;
+	for (lastdot = length; lastdot > i && name[lastdot-1] != '.'; lastdot--)
+		;
+	lastdot = lastdot > i ? lastdot - 1 : length;
+
+	for (; i < length; i++) {
+		c = (unsigned char)name[i];
+		if (c == ' ' || (c == '.' && i != lastdot))
+			continue;
+		if (c >= 0x80 && c < 0xC0)
+			continue;		//a UTF-8 character makes one '_'
+		if (i == lastdot) {
+			nextension = 0;
+			continue;
+		}
+		c = isshortnamechar (c) ? upperchar (c) : '_';
+		if (i < lastdot) {
+			if (nbase < sizeof(base))
+				base[nbase++] = c;
+		} else if (nextension < sizeof(extension))
+			extension[nextension++] = c;
+	}
+
+	if (attempt < 4 && nbase) {
+		taillength = sprintf (tail, "~%u", attempt + 1);
+		keep = nbase < 8 - taillength ? nbase : 8 - taillength;
+		if (keep > 6)
+			keep = 6;
+	} else {
+		// the hash of the long name, another one every nine attempts
+		attempt = attempt < 4 ? 0 : attempt - 4;
+		hash = hashname (name, length) + (attempt / 9) * 0x9E3779B1u;
+		hash = (hash ^ (hash >> 16)) & 0xFFFF;
+		keep = nbase < 2 ? nbase : 2;
+		taillength = sprintf (tail, "%04X~%u", hash, attempt % 9 + 1);
+	}
+
+	memset (shortname, 0, SHORTNAMESIZE);
+	memcpy (shortname, base, keep);
+	memcpy (shortname + keep, tail, taillength);
+	if (nextension) {
+		shortname[keep + taillength] = '.';
+		memcpy (shortname + keep + taillength + 1, extension, nextension);
+	}
+}
+
+static
+bool getshortindexpath (const struct stat *st, char *path, size_t pathlen)
+{
+	const char *dir;
+	int n;
+
+	if ((dir = getenv ("XDG_CACHE_HOME")) && *dir)
+		n = snprintf (path, pathlen, "%s/4nix", dir);
+	else if ((dir = getenv ("HOME")) && *dir)
+		n = snprintf (path, pathlen, "%s/.cache/4nix", dir);
+	else
+		return false;
+	if (n + 64 >= (int)pathlen)
+		return false;
+	sprintf (path + n, "/8dot3/%llx-%llx.idx", (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+	return true;
+}
+
+static inline
+size_t shortindexsize (uint32_t capacity, uint32_t poolcapacity)
+{
+	return sizeof(SHORTINDEXHEADER) + 2 * capacity * sizeof(uint32_t) + capacity * sizeof(SHORTRECORD) + poolcapacity;
+}
+
+static
+void layoutshortindex (SHORTINDEX *ix, void *view, size_t viewsize)
+{
+	ix->view         = view;
+	ix->viewsize     = viewsize;
+	ix->header       = (SHORTINDEXHEADER*)view;
+	ix->longbuckets  = (uint32_t*)(ix->header + 1);
+	ix->shortbuckets = ix->longbuckets + ix->header->capacity;
+	ix->records      = (SHORTRECORD*)(ix->shortbuckets + ix->header->capacity);
+	ix->pool         = (char*)(ix->records + ix->header->capacity);
+}
+
+static
+const SHORTRECORD* findlongrecord (const SHORTINDEX *ix, const char *name, size_t length, unsigned hash)
+{
+	const SHORTRECORD *r;
+	uint32_t i, limit = ix->header->capacity;
+
+	// a chain only leads to older records, anything else is a torn or damaged file
+	for (i = ix->longbuckets[hash & (limit - 1)]; i < limit; limit = i, i = r->nextlong) {
+		r = &ix->records[i];
+		if (r->longhash == hash && r->length == length && !memcmp (ix->pool + r->name, name, length))
+			return r;
+	}
+	return NULL;
+}
+
+static
+const SHORTRECORD* findshortrecord (const SHORTINDEX *ix, const char *shortname, size_t length, unsigned hash)
+{
+	const SHORTRECORD *r;
+	uint32_t i, limit = ix->header->capacity;
+
+	// a chain only leads to older records, anything else is a torn or damaged file
+	for (i = ix->shortbuckets[hash & (limit - 1)]; i < limit; limit = i, i = r->nextshort) {
+		r = &ix->records[i];
+		if (r->shorthash == hash && shortnamelength (r->shortname) == length &&
+			!strncasecmp (r->shortname, shortname, length))
+			return r;
+	}
+	return NULL;
+}
+
+// false when the records or the pool are full
+static
+bool appendrecord (SHORTINDEX *ix, const char *name, size_t length, unsigned longhash, const char *shortname)
+{
+	SHORTINDEXHEADER *h = ix->header;
+	SHORTRECORD *r;
+	uint32_t i, mask = h->capacity - 1;
+
+	if (h->count >= h->capacity || h->poolsize + length + 1 > h->poolcapacity)
+		return false;
+
+	i = h->count;
+	r = &ix->records[i];
+	memcpy (ix->pool + h->poolsize, name, length);
+	ix->pool[h->poolsize + length] = '\0';
+	r->longhash  = longhash;
+	r->shorthash = hashshortname (shortname, shortnamelength (shortname));
+	r->name      = h->poolsize;
+	r->length    = (uint32_t)length;
+	memcpy (r->shortname, shortname, SHORTNAMESIZE);
+	r->nextlong  = ix->longbuckets[longhash & mask];
+	r->nextshort = ix->shortbuckets[r->shorthash & mask];
+	// the file is shared, the record is counted and complete before it is reachable
+	h->poolsize += (uint32_t)length + 1;
+	h->count = i + 1;
+	__sync_synchronize ();
+	ix->longbuckets[longhash & mask]       = i;
+	ix->shortbuckets[r->shorthash & mask] = i;
+	return true;
+}
+
+// a short name free in the index and in the directory
+static
+bool generateshortname (const SHORTINDEX *ix, const char *dir, size_t dirlength,
+						const char *name, size_t length, char *shortname)
+{
+	unsigned attempt;
+	size_t n;
+
+	for (attempt = 0; attempt < SHORTNAMEATTEMPTS; attempt++) {
+		makeshortname (name, length, attempt, shortname);
+		n = shortnamelength (shortname);
+		if (!findshortrecord (ix, shortname, n, hashshortname (shortname, n)) &&
+			!_direntryexists (dir, dirlength, shortname, n))
+			return true;
+	}
+	return false;
+}
+
+static
+int comparenames (const void *a, const void *b)
+{
+	return strcmp (*(const char * const*)a, *(const char * const*)b);
+}
+
+/*
+ * Writes an index into a new file renamed to the index path. Its records are
+ * those of old, when there is one, or the short names of the directory entries
+ * given in names.
+ */
+static
+bool createshortindex (const char *indexpath, const struct stat *st, uint32_t capacity, uint32_t poolcapacity,
+					   const SHORTINDEX *old, const char *dir, size_t dirlength, char *names, unsigned count)
+{
+	char tmp[PATH_MAX + 32], shortname[SHORTNAMESIZE], **sorted = NULL, *p;
+	SHORTINDEX ix;
+	const SHORTRECORD *r;
+	size_t size = shortindexsize (capacity, poolcapacity), length;
+	void *view;
+	unsigned i;
+	bool ok = false;
+	int fd;
+
+	snprintf (tmp, sizeof(tmp), "%s.%d", indexpath, (int)getpid ());
+	fd = open (tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return false;
+	if (ftruncate (fd, size) != 0 ||
+		(view = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close (fd);
+		unlink (tmp);
+		return false;
+	}
+
+	ix.header = (SHORTINDEXHEADER*)view;
+	ix.header->magic        = SHORTINDEXMAGIC;
+	ix.header->version      = SHORTINDEXVERSION;
+	ix.header->dev          = st->st_dev;
+	ix.header->ino          = st->st_ino;
+	ix.header->capacity     = capacity;
+	ix.header->poolcapacity = poolcapacity;
+	layoutshortindex (&ix, view, size);
+	memset (ix.longbuckets, 0xFF, 2 * capacity * sizeof(uint32_t));
+
+	if (old) {
+		for (i = 0; i < old->header->count; i++) {
+			r = &old->records[i];
+			appendrecord (&ix, old->pool + r->name, r->length, r->longhash, r->shortname);
+		}
+		ok = true;
+	} else if ((sorted = (char**) malloc ((count ? count : 1) * sizeof(char*))) != NULL) {
+		// named in sorted order, the same entries get the same names
+		for (i = 0, p = names; i < count; i++, p += strlen (p) + 1)
+			sorted[i] = p;
+		qsort (sorted, count, sizeof(char*), comparenames);
+		ok = true;
+		for (i = 0; i < count && ok; i++) {
+			length = strlen (sorted[i]);
+			if (isshortname (sorted[i], length))
+				continue;
+			ok = generateshortname (&ix, dir, dirlength, sorted[i], length, shortname) &&
+				 appendrecord (&ix, sorted[i], length, hashname (sorted[i], length), shortname);
+		}
+		free (sorted);
+	}
+
+	munmap (view, size);
+	if (close (fd) != 0)
+		ok = false;
+	if (ok && rename (tmp, indexpath) == 0)
+		return true;
+	unlink (tmp);
+	return false;
+}
+
+// maps the index file of ix, false when it is missing or not the one of st
+static
+bool mapshortindex (SHORTINDEX *ix, const struct stat *st, bool locked)
+{
+	SHORTINDEXHEADER header;
+	struct stat fst;
+	void *view;
+	int fd;
+
+	fd = open (ix->indexpath, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (fstat (fd, &fst) != 0 || fst.st_size < (off_t)sizeof(header) ||
+		pread (fd, &header, sizeof(header), 0) != sizeof(header) ||
+		header.magic != SHORTINDEXMAGIC || header.version != SHORTINDEXVERSION ||
+		header.dev != (uint64_t)st->st_dev || header.ino != (uint64_t)st->st_ino ||
+		(header.capacity & (header.capacity - 1)) || header.replaced ||
+		(size_t)fst.st_size != shortindexsize (header.capacity, header.poolcapacity) ||
+		(view = mmap (NULL, fst.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close (fd);
+		return false;
+	}
+	// a writer takes the new file before it lets the old one go
+	if (locked)
+		flock (fd, LOCK_EX);
+	if (ix->view) {
+		munmap (ix->view, ix->viewsize);
+		close (ix->fd);
+	}
+	ix->fd = fd;
+	layoutshortindex (ix, view, fst.st_size);
+	return true;
+}
+
+/*
+ * Locks the directory of the index files against the other processes, so
+ * that two of them indexing a directory for the first time do not each map
+ * a file of their own. Creates the directory and its parent on the first use.
+ */
+static
+int lockshortindexes (const char *indexpath)
+{
+	char path[PATH_MAX], *sep, *parent;
+	int fd;
+
+	snprintf (path, sizeof(path), "%s", indexpath);
+	sep = strrchr (path, '/');
+	*sep = '\0';
+	fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT) {
+		parent = strrchr (path, '/');
+		*parent = '\0';
+		mkdir (path, 0700);
+		*parent = '/';
+		mkdir (path, 0700);
+		fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	if (fd >= 0)
+		flock (fd, LOCK_EX);
+	return fd;
+}
+
+static
+SHORTINDEX* openshortindex (const char *dir, size_t dirlength, unsigned hash)
+{
+	SHORTINDEX *ix;
+	struct stat st;
+	char *names;
+	size_t size = 0;
+	unsigned count = 0;
+	uint32_t capacity, poolcapacity;
+	int lockfd = -1;
+
+	if (stat (dir, &st) != 0)
+		return NULL;
+	ix = (SHORTINDEX*) calloc (1, sizeof(SHORTINDEX) + dirlength + 1);
+	if (!ix)
+		return NULL;
+	if (!getshortindexpath (&st, ix->indexpath, sizeof(ix->indexpath)))
+		goto failed;
+	ix->hash   = hash;
+	ix->fd     = -1;
+	ix->length = dirlength;
+	memcpy (ix->path, dir, dirlength + 1);
+	if (mapshortindex (ix, &st, false))
+		return ix;
+
+	// made by another process meanwhile, or replaced by a grown one
+	lockfd = lockshortindexes (ix->indexpath);
+	if (lockfd < 0)
+		goto failed;
+	if (mapshortindex (ix, &st, false)) {
+		close (lockfd);
+		return ix;
+	}
+
+	names = _readdirectorynames (dir, dirlength, &count, &size);
+	if (!names)
+		goto failed;
+	for (capacity = SHORTINDEXMINIMUM; capacity < count * 2; capacity *= 2)
+		;
+	poolcapacity = (uint32_t)(size * 2 + 65536);
+	ix->synced = _getstatmtime (&st);
+	if (!createshortindex (ix->indexpath, &st, capacity, poolcapacity, NULL, dir, dirlength, names, count) ||
+		!mapshortindex (ix, &st, false)) {
+		free (names);
+		goto failed;
+	}
+	free (names);
+	close (lockfd);
+	return ix;
+
+failed:
+	if (lockfd >= 0)
+		close (lockfd);
+	free (ix);
+	return NULL;
+}
+
+// called with the read lock, returns holding it
+static
+SHORTINDEX* getshortindex (const char *dir, size_t dirlength)
+{
+	SHORTINDEX *ix, *created;
+	unsigned hash = hashname (dir, dirlength), slot = hash & (SHORTINDEXSLOTS - 1);
+	struct stat st;
+
+	for (ix = shortindexes[slot]; ix; ix = ix->next)
+		if (ix->hash == hash && ix->length == dirlength && !memcmp (ix->path, dir, dirlength))
+			break;
+	if (ix && !ix->header->replaced)
+		return ix;
+	pthread_rwlock_unlock (&shortindexlock);
+
+	pthread_mutex_lock (&shortwritelock);
+	if (!ix) {
+		// another thread may have opened it, the list only grows under this lock
+		for (ix = shortindexes[slot]; ix; ix = ix->next)
+			if (ix->hash == hash && ix->length == dirlength && !memcmp (ix->path, dir, dirlength))
+				break;
+	}
+	created = ix ? NULL : openshortindex (dir, dirlength, hash);
+	pthread_rwlock_wrlock (&shortindexlock);
+	if (ix) {
+		// another process grew it
+		if (ix->header->replaced && stat (dir, &st) == 0)
+			mapshortindex (ix, &st, false);
+	} else if (created) {
+		created->next = shortindexes[slot];
+		shortindexes[slot] = ix = created;
+	}
+	pthread_rwlock_unlock (&shortindexlock);
+	pthread_mutex_unlock (&shortwritelock);
+
+	pthread_rwlock_rdlock (&shortindexlock);
+	return ix;
+}
+
+// with the write locks, copies a full index into a larger one
+static
+bool growshortindex (SHORTINDEX *ix, size_t length)
+{
+	struct stat st;
+	uint32_t capacity = ix->header->capacity, poolcapacity = ix->header->poolcapacity;
+	bool ok;
+
+	if (ix->header->count >= capacity)
+		capacity *= 2;
+	while (ix->header->poolsize + length + 1 > poolcapacity)
+		poolcapacity *= 2;
+	if (stat (ix->path, &st) != 0)
+		return false;
+
+	pthread_rwlock_wrlock (&shortindexlock);
+	ok = createshortindex (ix->indexpath, &st, capacity, poolcapacity, ix, NULL, 0, NULL, 0);
+	if (ok) {
+		ix->header->replaced = 1;
+		ok = mapshortindex (ix, &st, true);
+	}
+	pthread_rwlock_unlock (&shortindexlock);
+	return ok;
+}
+
+/*
+ * Names the entries of the directory that have no short name yet, or the
+ * one given. Takes the write locks, the index is mapped again when another
+ * process replaced it meanwhile.
+ */
+static
+bool nameentries (SHORTINDEX *ix, const char *name, size_t length, char *shortname)
+{
+	char generated[SHORTNAMESIZE], *names = NULL, *p;
+	const SHORTRECORD *r;
+	struct stat st;
+	size_t size, n;
+	unsigned count = 0, i, hash;
+	bool ok = true;
+
+	pthread_mutex_lock (&shortwritelock);
+	for (;;) {
+		flock (ix->fd, LOCK_EX);
+		if (!ix->header->replaced)
+			break;
+		// another process grew it while we waited
+		flock (ix->fd, LOCK_UN);
+		pthread_rwlock_wrlock (&shortindexlock);
+		ok = stat (ix->path, &st) == 0 && mapshortindex (ix, &st, false);
+		pthread_rwlock_unlock (&shortindexlock);
+		if (!ok) {
+			pthread_mutex_unlock (&shortwritelock);
+			return false;
+		}
+	}
+
+	if (!name) {
+		if (stat (ix->path, &st) != 0 ||
+			_samestatmtime (&st, &ix->synced) ||
+			!(names = _readdirectorynames (ix->path, ix->length, &count, &size)))
+			count = 0;
+		else
+			ix->synced = _getstatmtime (&st);
+	}
+
+	for (i = 0, p = names; ok && i < (name ? 1 : count); i++) {
+		if (!name) {
+			n = strlen (p);
+			if (isshortname (p, n)) {
+				p += n + 1;
+				continue;
+			}
+		} else {
+			p = (char*)name;
+			n = length;
+		}
+		hash = hashname (p, n);
+		r = findlongrecord (ix, p, n, hash);
+		if (r)
+			memcpy (generated, r->shortname, SHORTNAMESIZE);
+		else {
+			ok = generateshortname (ix, ix->path, ix->length, p, n, generated);
+			if (ok && !appendrecord (ix, p, n, hash, generated))
+				ok = growshortindex (ix, n) && appendrecord (ix, p, n, hash, generated);
+		}
+		if (name && ok)
+			memcpy (shortname, generated, SHORTNAMESIZE);
+		p += n + 1;
+	}
+
+	flock (ix->fd, LOCK_UN);
+	pthread_mutex_unlock (&shortwritelock);
+	free (names);
+	return ok;
+}
+
+/*
+ * The short name of an entry of a zero terminated absolute directory, the
+ * name itself when it is a valid 8.3 one. shortname receives at most
+ * SHORTNAMESIZE characters, the length is returned, 0 on failure.
+ */
+size_t _getshortname( const char *dir, size_t dirlength, const char *name, size_t length, char *shortname )
+{
+	const SHORTRECORD *r;
+	SHORTINDEX *ix;
+	bool found = false;
+
+	if (isshortname (name, length)) {
+		memcpy (shortname, name, length);
+		return length;
+	}
+
+	pthread_rwlock_rdlock (&shortindexlock);
+	ix = getshortindex (dir, dirlength);
+	if (ix && (r = findlongrecord (ix, name, length, hashname (name, length))) != NULL) {
+		memcpy (shortname, r->shortname, SHORTNAMESIZE);
+		found = true;
+	}
+	pthread_rwlock_unlock (&shortindexlock);
+
+	if (!ix) {
+		_setlasterror( ERROR_PATH_NOT_FOUND );
+		return 0;
+	}
+	if (!found && !nameentries (ix, name, length, shortname)) {
+		_setlasterror( ERROR_FILE_NOT_FOUND );
+		return 0;
+	}
+	return shortnamelength (shortname);
+}
+
+/*
+ * The long name of a short one given in a zero terminated absolute directory,
+ * 0 when it has none, as with a name that is its own short name.
+ */
+size_t _getlongname( const char *dir, size_t dirlength, const char *shortname, size_t length, char *name, size_t size )
+{
+	const SHORTRECORD *r;
+	SHORTINDEX *ix;
+	unsigned hash;
+	size_t n = 0;
+	int pass;
+
+	// only the made up names have a tilde
+	if (length > SHORTNAMESIZE || !memchr (shortname, '~', length))
+		return 0;
+	hash = hashshortname (shortname, length);
+
+	for (pass = 0; pass < 2; pass++) {
+		pthread_rwlock_rdlock (&shortindexlock);
+		ix = getshortindex (dir, dirlength);
+		if (ix && (r = findshortrecord (ix, shortname, length, hash)) != NULL) {
+			n = r->length;
+			if (n < size)
+				memcpy (name, ix->pool + r->name, n + 1);
+		}
+		pthread_rwlock_unlock (&shortindexlock);
+		if (n || !ix || pass)
+			break;
+		// the directory may have entries not named yet
+		if (!nameentries (ix, NULL, 0, NULL))
+			break;
+	}
+	return n;
+}
@@ -0,0 +1,505 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * symbols.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#if (defined __linux__ || defined __CYGWIN__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <link.h>
+#include <elf.h>
+
+#include "windows.h"
+#include "libloader.h"
+#include "symbols.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern uintptr_t _getcurrentprocess( );
+extern bool _getmodulehandleex( unsigned flags, const char* name, uintptr_t *module );
+extern unsigned _getmodulefilenameex( uintptr_t hProcess, uintptr_t hModule, char* filename, unsigned size );
+extern bool _enumprocessmodulesex( uintptr_t hProcess, uintptr_t* lphModule, unsigned cb, unsigned *lpcbNeeded, unsigned dwFilterFlag );
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The functions of a module are read once from the .symtab of its file, or from
+ * the .dynsym of a stripped one, through a mapping of the whole file, and kept
+ * sorted by address for a binary search. The module of an address comes from
+ * the module registry. Recent addresses are kept in a direct mapped cache, its
+ * entries are written under a sequence number so the readers take no lock.
+ * As with the module list of DbgHelp, the modules unloaded since are forgotten
+ * by _symrefreshmodulelist, their tables are freed once no lookup runs.
+ */
+
+#define SYMMODULESLOTS		1024		//power of two
+#define SYMCACHESIZE		4096		//power of two
+#define SYMNOTFOUND			0xFFFFFFFFu
+
+typedef struct SYMENTRY_ {
+	uintptr_t addr;
+	uint32_t size;
+	uint32_t name;				//offset in the string table
+} SYMENTRY;
+
+typedef struct SYMMODULE_ {
+	uintptr_t handle;
+	uintptr_t base;				//the lowest mapped address
+	const char *basename;
+	const char *strtab;
+	SYMENTRY *symbols;
+	unsigned count;
+	void *view;
+	size_t viewsize;
+	struct SYMMODULE_ *nextfree;	//retired
+	char path[];
+} SYMMODULE;
+
+typedef struct SYMCACHEENTRY_ {
+	volatile unsigned seq;		//odd while written
+	unsigned generation;		//of the module list
+	unsigned symbol;
+	uintptr_t addr;
+	SYMMODULE *module;
+} SYMCACHEENTRY;
+
+static SYMMODULE * volatile symmodules[SYMMODULESLOTS];
+static SYMCACHEENTRY symcache[SYMCACHESIZE];
+static pthread_mutex_t symmodulelock = PTHREAD_MUTEX_INITIALIZER;
+static SYMMODULE *retiredsymmodules = NULL;		//under symmodulelock
+static volatile int symreaders = 0;
+static volatile unsigned symgeneration = 0;		//bumped by a refresh
+
+
+static inline
+unsigned hashsymhandle (uintptr_t handle)
+{
+	return (unsigned)((handle >> 2) * 0x9E3779B1u) >> 22 & (SYMMODULESLOTS - 1);
+}
+
+static inline
+unsigned hashsymaddress (uintptr_t addr)
+{
+	// the return addresses of one module differ in few bits, they are mixed well
+	uint64_t h = addr;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return (unsigned)h & (SYMCACHESIZE - 1);
+}
+
+static
+int comparesymentries (const void *a, const void *b)
+{
+	const SYMENTRY *x = (const SYMENTRY*)a, *y = (const SYMENTRY*)b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	return x->size > y->size ? -1 : x->size < y->size;		//the sized one first
+}
+
+// reads the function symbols of a mapped elf file
+static
+bool loadsymbols (SYMMODULE *sm, uintptr_t bias)
+{
+	const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr)*)sm->view;
+	const ElfW(Shdr) *shdr, *table = NULL;
+	const ElfW(Phdr) *phdr;
+	const ElfW(Sym) *sym;
+	uintptr_t lowest = UINTPTR_MAX;
+	size_t i, n, count;
+
+	if (sm->viewsize < sizeof(ElfW(Ehdr)) || memcmp (ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+		ehdr->e_ident[EI_CLASS] != (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32) ||
+		ehdr->e_phoff + (size_t)ehdr->e_phnum * sizeof(ElfW(Phdr)) > sm->viewsize ||
+		ehdr->e_shoff + (size_t)ehdr->e_shnum * sizeof(ElfW(Shdr)) > sm->viewsize)
+		return false;
+
+	phdr = (const ElfW(Phdr)*)((const char*)sm->view + ehdr->e_phoff);
+	for (i = 0; i < ehdr->e_phnum; i++)
+		if (phdr[i].p_type == PT_LOAD && phdr[i].p_vaddr < lowest)
+			lowest = phdr[i].p_vaddr;
+	if (lowest != UINTPTR_MAX)
+		sm->base = bias + (lowest & ~(uintptr_t)(getpagesize () - 1));
+
+	// the full table when the file is not stripped
+	shdr = (const ElfW(Shdr)*)((const char*)sm->view + ehdr->e_shoff);
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		if (shdr[i].sh_type == SHT_SYMTAB) {
+			table = &shdr[i];
+			break;
+		}
+		if (shdr[i].sh_type == SHT_DYNSYM)
+			table = &shdr[i];
+	}
+	if (!table || table->sh_link >= ehdr->e_shnum || table->sh_offset + table->sh_size > sm->viewsize ||
+		shdr[table->sh_link].sh_offset + shdr[table->sh_link].sh_size > sm->viewsize)
+		return true;		//a module with no symbols
+
+	sym = (const ElfW(Sym)*)((const char*)sm->view + table->sh_offset);
+	n = table->sh_size / sizeof(ElfW(Sym));
+	sm->strtab = (const char*)sm->view + shdr[table->sh_link].sh_offset;
+
+	for (i = 0, count = 0; i < n; i++)
+		if ((ELF32_ST_TYPE(sym[i].st_info) == STT_FUNC || ELF32_ST_TYPE(sym[i].st_info) == STT_GNU_IFUNC) &&
+			sym[i].st_shndx != SHN_UNDEF && sym[i].st_value)
+			count++;
+	if (!count)
+		return true;
+
+	sm->symbols = (SYMENTRY*) malloc (count * sizeof(SYMENTRY));
+	if (!sm->symbols)
+		return false;
+	for (i = 0; i < n; i++)
+		if ((ELF32_ST_TYPE(sym[i].st_info) == STT_FUNC || ELF32_ST_TYPE(sym[i].st_info) == STT_GNU_IFUNC) &&
+			sym[i].st_shndx != SHN_UNDEF && sym[i].st_value) {
+			sm->symbols[sm->count].addr = bias + sym[i].st_value;
+			sm->symbols[sm->count].size = sym[i].st_size > UINT32_MAX ? UINT32_MAX : (uint32_t)sym[i].st_size;
+			sm->symbols[sm->count].name = sym[i].st_name;
+			sm->count++;
+		}
+	qsort (sm->symbols, sm->count, sizeof(SYMENTRY), comparesymentries);
+
+	// the aliases of an address are dropped
+	for (i = 1, n = 1; i < sm->count; i++)
+		if (sm->symbols[i].addr != sm->symbols[n - 1].addr)
+			sm->symbols[n++] = sm->symbols[i];
+	sm->count = n;
+	return true;
+}
+
+// builds the table of a module found by an address in it
+static
+SYMMODULE* createsymmodule (uintptr_t hModule, uintptr_t addr)
+{
+	SYMMODULE *sm;
+	struct link_map *map = NULL;
+	struct stat st;
+	char path[PATH_MAX];
+	Dl_info info;
+	unsigned len;
+	int fd;
+
+	if (!dladdr1 ((void*)addr, &info, (void**)&map, RTLD_DL_LINKMAP) || !map)
+		return NULL;
+	len = _getmodulefilenameex (_getcurrentprocess (), hModule, path, sizeof(path));
+	if (!len || len >= sizeof(path))
+		return NULL;
+
+	sm = (SYMMODULE*) calloc (1, sizeof(SYMMODULE) + len + 1);
+	if (!sm)
+		return NULL;
+	sm->handle = hModule;
+	sm->base = map->l_addr;
+	memcpy (sm->path, path, len + 1);
+	sm->basename = strrchr (sm->path, '/') ? strrchr (sm->path, '/') + 1 : sm->path;
+
+	// the vdso and the deleted files have no symbols to read
+	fd = open (sm->path, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		if (fstat (fd, &st) == 0 && st.st_size > 0) {
+			sm->view = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (sm->view == MAP_FAILED)
+				sm->view = NULL;
+			else
+				sm->viewsize = st.st_size;
+		}
+		close (fd);
+	}
+	if (sm->view && !loadsymbols (sm, map->l_addr)) {
+		free (sm->symbols);
+		sm->symbols = NULL;
+		sm->count = 0;
+	}
+	return sm;
+}
+
+static
+void freesymmodule (SYMMODULE *sm)
+{
+	if (sm->view)
+		munmap (sm->view, sm->viewsize);
+	free (sm->symbols);
+	free (sm);
+}
+
+// frees the tables lookups could still see, called under symmodulelock
+static
+void freeretiredsymmodules (void)
+{
+	SYMMODULE *sm;
+
+	// the stores unpublishing the modules must not pass the load of the readers
+	__sync_synchronize ();
+	if (symreaders != 0)
+		return;
+
+	while ((sm = retiredsymmodules) != NULL) {
+		retiredsymmodules = sm->nextfree;
+		freesymmodule (sm);
+	}
+}
+
+static
+SYMMODULE* getsymmodule (uintptr_t hModule, uintptr_t addr)
+{
+	SYMMODULE *sm;
+	unsigned i, slot;
+
+	slot = hashsymhandle (hModule);
+	for (i = 0; i < SYMMODULESLOTS; i++) {
+		sm = symmodules[(slot + i) & (SYMMODULESLOTS - 1)];
+		if (!sm)
+			break;
+		if (sm->handle == hModule)
+			return sm;
+	}
+
+	// built once, the writers are serialized
+	pthread_mutex_lock (&symmodulelock);
+	for (i = 0; i < SYMMODULESLOTS; i++) {
+		sm = symmodules[(slot + i) & (SYMMODULESLOTS - 1)];
+		if (!sm) {
+			sm = createsymmodule (hModule, addr);
+			if (sm) {
+				__sync_synchronize ();
+				symmodules[(slot + i) & (SYMMODULESLOTS - 1)] = sm;
+			}
+			break;
+		}
+		if (sm->handle == hModule)
+			break;
+	}
+	if (i == SYMMODULESLOTS)
+		sm = NULL;
+	pthread_mutex_unlock (&symmodulelock);
+	return sm;
+}
+
+// the last symbol at or below the address that covers it
+static inline
+unsigned findsymbol (SYMMODULE *sm, uintptr_t addr)
+{
+	unsigned lo = 0, hi = sm->count, mid;
+	const SYMENTRY *sym;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (sm->symbols[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return SYMNOTFOUND;
+	sym = &sm->symbols[lo - 1];
+	if (sym->size && addr - sym->addr >= sym->size)
+		return SYMNOTFOUND;		//padding or code without a symbol
+	return lo - 1;
+}
+
+// called as a reader, the module stays until symreaders drops
+static
+bool resolveaddress (uintptr_t addr, SYMBOL_ADDRESS *result)
+{
+	SYMCACHEENTRY *entry = &symcache[hashsymaddress (addr)];
+	SYMMODULE *sm;
+	uintptr_t hModule;
+	unsigned seq, symbol, generation;
+
+	// an entry written before a refresh may name a forgotten module
+	generation = __atomic_load_n (&symgeneration, __ATOMIC_ACQUIRE);
+
+	// acquire ordering only, a hit costs no barrier past the reader count
+	seq = __atomic_load_n (&entry->seq, __ATOMIC_ACQUIRE);
+	sm = entry->module;
+	symbol = entry->symbol;
+	if (entry->addr != addr || !sm || (seq & 1) || entry->generation != generation) {
+		sm = NULL;
+	} else {
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (entry->seq != seq)
+			sm = NULL;
+	}
+
+	if (!sm) {
+		if (!_getmodulehandleex (GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+								 (const char*)addr, &hModule))
+			return false;
+		sm = getsymmodule (hModule, addr);
+		if (!sm) {
+			_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+			return false;
+		}
+		symbol = sm->count ? findsymbol (sm, addr) : SYMNOTFOUND;
+
+		// an entry written by another thread is left alone
+		seq = entry->seq;
+		if (!(seq & 1) && __sync_bool_compare_and_swap (&entry->seq, seq, seq + 1)) {
+			entry->addr       = addr;
+			entry->module     = sm;
+			entry->symbol     = symbol;
+			entry->generation = generation;
+			__sync_synchronize ();
+			entry->seq = seq + 2;
+		}
+	}
+
+	result->hModule    = sm->handle;
+	result->ModuleName = sm->basename;
+	if (symbol != SYMNOTFOUND) {
+		result->SymbolName    = sm->strtab + sm->symbols[symbol].name;
+		result->SymbolAddress = sm->symbols[symbol].addr;
+		result->Offset        = addr - sm->symbols[symbol].addr;
+	} else {
+		result->SymbolName    = NULL;
+		result->SymbolAddress = 0;
+		result->Offset        = addr - sm->base;
+	}
+	return true;
+}
+
+bool _symresolveaddress( uintptr_t address, SYMBOL_ADDRESS *result )
+{
+	// the module and the symbol of a code address, the names are not copied
+	// and stay valid until the module is forgotten by _symrefreshmodulelist
+	bool rc;
+
+	if ( !result ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+	__sync_add_and_fetch (&symreaders, 1);
+	rc = resolveaddress (address, result);
+	__sync_sub_and_fetch (&symreaders, 1);
+	return rc;
+}
+
+bool _symfromaddr( uintptr_t hProcess, uint64_t Address, uint64_t *Displacement, SYMBOL_INFO *Symbol )
+{
+	SYMBOL_ADDRESS result;
+	size_t len;
+	bool rc = false;
+
+	if ( !Symbol || Symbol->SizeOfStruct < sizeof(SYMBOL_INFO) ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+	if ( hProcess != _getcurrentprocess( ) ) {
+		_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
+		return false;
+	}
+
+	// the name is copied before a refresh may free it
+	__sync_add_and_fetch (&symreaders, 1);
+	if ( !resolveaddress ((uintptr_t)Address, &result) )
+		goto done;
+	if ( !result.SymbolName ) {
+		_setlasterror( ERROR_MOD_NOT_FOUND );
+		goto done;
+	}
+
+	len = strlen (result.SymbolName);
+	Symbol->NameLen = (unsigned)len;
+	if ( Symbol->MaxNameLen ) {
+		if ( len >= Symbol->MaxNameLen )
+			len = Symbol->MaxNameLen - 1;
+		memcpy (Symbol->Name, result.SymbolName, len);
+		Symbol->Name[len] = '\0';
+	}
+	Symbol->ModBase = result.hModule;
+	Symbol->Address = result.SymbolAddress;
+	Symbol->Size    = 0;
+	Symbol->Tag     = SymTagFunction;
+	Symbol->Flags   = 0;
+	if ( Displacement )
+		*Displacement = result.Offset;
+	rc = true;
+
+done:
+	__sync_sub_and_fetch (&symreaders, 1);
+	return rc;
+}
+
+bool _symrefreshmodulelist( uintptr_t hProcess )
+{
+	// forgets the modules unloaded since their symbols were read
+	SYMMODULE *sm, *live[SYMMODULESLOTS];
+	uintptr_t *handles;
+	unsigned needed = 0, count, i, j, nlive = 0;
+
+	if ( hProcess != _getcurrentprocess( ) ) {
+		_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
+		return false;
+	}
+	if ( !_enumprocessmodulesex (hProcess, NULL, 0, &needed, LIST_MODULES_ALL) )
+		return false;
+	handles = (uintptr_t*) malloc (needed + 64 * sizeof(uintptr_t));
+	if ( !handles ) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return false;
+	}
+	if ( !_enumprocessmodulesex (hProcess, handles, needed + 64 * sizeof(uintptr_t), &needed, LIST_MODULES_ALL) ) {
+		free (handles);
+		return false;
+	}
+	count = needed / sizeof(uintptr_t);
+
+	pthread_mutex_lock (&symmodulelock);
+	for (i = 0; i < SYMMODULESLOTS; i++) {
+		sm = symmodules[i];
+		if (!sm)
+			continue;
+		for (j = 0; j < count && handles[j] != sm->handle; j++) ;
+		if (j < count)
+			live[nlive++] = sm;
+		else {
+			sm->nextfree = retiredsymmodules;
+			retiredsymmodules = sm;
+		}
+		symmodules[i] = NULL;
+	}
+
+	// the live modules are hashed again, the probe sequences stay short
+	for (i = 0; i < nlive; i++) {
+		unsigned slot = hashsymhandle (live[i]->handle);
+		while (symmodules[slot])
+			slot = (slot + 1) & (SYMMODULESLOTS - 1);
+		symmodules[slot] = live[i];
+	}
+	// the cached entries are dropped at once, also the ones being written now
+	__atomic_add_fetch (&symgeneration, 1, __ATOMIC_RELEASE);
+
+	// a lookup may still read a forgotten module, it is freed by a later refresh then
+	freeretiredsymmodules ();
+	pthread_mutex_unlock (&symmodulelock);
+
+	free (handles);
+	return true;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -15,6 +15,9 @@
 
 #include <sched.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
 //#ifdef HAVE_UNISTD_H
 # include <unistd.h>
 //#endif	//HAVE_UNISTD_H
@@ -22,7 +25,9 @@
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 #include <pthread.h>
+#include <signal.h>
 
 #ifdef __MACH__
 # include <mach/mach.h>
@@ -36,11 +41,25 @@
 #include "windows.h"
 #include "timedef.h"
 #include "object.h"
+#include "numa.h"
+#include "futex.h"
 
 
 // depends on these functions
 extern void _setlasterror( unsigned err );
 extern unsigned get_win_error( int err );
+#ifdef __linux__
+extern cpu_set_t* _getnumanodecpuset( unsigned node, size_t *setsize );
+#endif
+extern bool _numaplacethread( unsigned node );
+extern unsigned _getcputopologycount( void );
+extern bool _getcpugroup( unsigned cpu, unsigned short *group, unsigned char *bit );
+extern int _getgroupcpu( unsigned short group, unsigned char bit );
+extern unsigned short _getactiveprocessorgroupcount( void );
+extern void _getmonotonicdeadline( unsigned milliseconds, struct timespec *abstime );
+extern bool _getmonotonictimeout( const struct timespec *abstime, struct timespec *timeout );
+extern void _getcurrentfiletime( FILETIME *ft );
+extern void _signalwaitobject( void *key );
 
 
 #define THREADOBJID		4
@@ -50,7 +69,7 @@ static bool _closethreadhandle( uintptr_t hndl );
                                     unsigned access, bool inherit, unsigned options );
 static bool _gethandleinformation( uintptr_t hndl, unsigned *flags );
 static bool _sethandleinformation( uintptr_t hndl, unsigned mask, unsigned flags );*/
-static unsigned _waitforsinglethreadobject( uintptr_t hndl, unsigned milliseconds );
+unsigned _waitforsinglethreadobject( uintptr_t hndl, unsigned milliseconds );
 
 static TYPEOBJITEM threadkrnlobj =
 {
@@ -63,16 +82,76 @@ static TYPEOBJITEM threadkrnlobj =
 };
 
 
+#define THREADPOOLMAXPARKED		64			//exited threads kept for reuse
+#define THREADPOOLIDLETIMEOUT	30			//seconds a parked thread waits for a new start routine
+#define THREADSTACKPREFAULT		(64*1024)	//stack faulted in when a pooled thread starts
+
+#ifndef ERROR_THREAD_MODE_ALREADY_BACKGROUND
+#define ERROR_THREAD_MODE_ALREADY_BACKGROUND	400
+#define ERROR_THREAD_MODE_NOT_BACKGROUND		401
+#endif
+
+// I/O priority of a thread, see ioprio_set(2)
+#define IOPRIO_CLASS_SHIFT		13
+#define IOPRIO_CLASS_IDLE		3
+#define IOPRIO_WHO_PROCESS		1
+#define IOPRIO_PRIO_VALUE(class, data)	(((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+#ifndef MAXIMUM_SUSPEND_COUNT
+#define MAXIMUM_SUSPEND_COUNT	127
+#endif
+#ifndef ERROR_SIGNAL_REFCOUNT_EXCEEDED
+#define ERROR_SIGNAL_REFCOUNT_EXCEEDED	156
+#endif
+
+// parks the receiving thread while its suspend count is not zero
+#ifdef SIGRTMIN
+#define THREADSUSPENDSIGNAL		(SIGRTMIN+2)
+#else
+#define THREADSUSPENDSIGNAL		SIGUSR2
+#endif
+
+
+// a thread object, shared by its handle and the running thread
 typedef struct THREADOBJDATA_ {
-	pid_t tid;
-	pthread_mutex_t *firstresumesync;
-	int pipefd;
+	volatile int refcount;		//the handle and the running thread
+	volatile int tid;			//futex, published by the thread when it starts
+	volatile int suspendcount;	//futex, the thread runs while it is zero
+	volatile int suspendack;	//futex, incremented when the thread parks
+	volatile int exited;		//futex, set when the start routine has finished
+	volatile int exitcodeset;	//exit code given by _exitthread or _terminatethread
+	pthread_t thread;
+
+	// the OS thread is signalled or cancelled only while it runs this object,
+	// a pooled thread runs another one after exited is set
+	pthread_mutex_t signallock;
+	bool cancelled;
+	volatile int abandoned;		//no handle was made, the start routine is not run
+
+	// running library threads, see _suspendallthreads
+	struct THREADOBJDATA_ *next, *prev;
+	bool listed;
+	struct THREADOBJDATA_ *retired;	//freed when no index lookup runs
+	bool unindexed;				//under indexlock, the thread has finished
+	bool stopped;				//suspended by _suspendallthreads
+	int stopack;
+
+	// scheduling state saved by THREAD_MODE_BACKGROUND_BEGIN
+	bool background;
+	int bgpolicy;
+	int bgioprio;
+	struct sched_param bgparam;
 
 	FILETIME creationtime;
 	FILETIME exittime;
-	//FILETIME kerneltime;
+	FILETIME kerneltime;	//set at exit
 	FILETIME usertime;
 	DWORD exitcode;
+
+	// CPU times of the OS thread when the thread object started, a pooled
+	// thread has run other thread objects before
+	struct timeval startutime;
+	struct timeval startstime;
 } THREADOBJDATA;
 
 
@@ -80,27 +159,662 @@ typedef struct THREADOBJDATA_ {
 //DWORD WINAPI ThreadProc( LPVOID lpParameter );
 
 
-//wrapped thread function
-typedef struct THREADSPRMS_WRAP {
-	//unsigned ( __stdcall *origfunc)(void*);
-	LPTHREAD_START_ROUTINE origstart;
-	LPVOID origprms;
-	pthread_mutex_t *firstresumesync;
-	int pipefd;
-} THREADPRMS_WRAP;
+// an OS thread running start routines of thread objects, parked between them
+//NOTE: __thread variables and pthread keys are not reset when a parked thread is reused
+typedef struct THREADWORKER_ {
+	struct THREADWORKER_ *next;		//parked threads
+	volatile int wakeup;			//futex, set when a parked thread gets a new start routine
+	size_t stacksize;				//requested stack size, 0 for the default
+	bool reusable;
+	pthread_t thread;
+
+	// scheduling state restored before the thread is parked
+	int tid;
+	int policy;
+	int nice;
+	int ioprio;
+	struct sched_param schedparam;
+#ifdef __linux__
+	cpu_set_t *affinity;
+	size_t affinitysize;
+#endif
 
-static void pthreadcleanup (void *arg);
+	// start routine of the current thread object
+	THREADOBJDATA *data;
+	LPTHREAD_START_ROUTINE start;
+	LPVOID param;
+	unsigned node;		//preferred NUMA node
+} THREADWORKER;
+
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static THREADWORKER *parkedworkers = NULL;
+static unsigned parkedcount = 0;
+
+static pthread_mutex_t threadlistlock = PTHREAD_MUTEX_INITIALIZER;
+static THREADOBJDATA *threadlist = NULL;
+static pthread_once_t suspendsignalonce = PTHREAD_ONCE_INIT;
+
+static __thread THREADOBJDATA *currentthreaddata = NULL;
+static pthread_key_t foreignthreadkey;
+static pthread_once_t foreignthreadonce = PTHREAD_ONCE_INIT;
+
+
+static
+int gettid_ (void)
+{
+#ifdef __MACH__
+	unsigned long long myid;
+	pthread_threadid_np (pthread_self (), &myid);
+	return (int)myid;
+#else
+	return (int) syscall (SYS_gettid);
+#endif
+}
 
 static
-unsigned prethreadfunc (void *arg)
+THREADOBJDATA* getthreaddata (uintptr_t hndl)
 {
-	THREADPRMS_WRAP *pre_prms;
+	return *(THREADOBJDATA**)hndl;
+}
+
+// tid -> thread object index, open addressing; lookups take no lock,
+// a table replaced by a bigger one and released thread objects are freed
+// only when no lookup is in progress
+typedef struct THREADINDEX_ {
+	unsigned size;		//power of two
+	unsigned used;		//live and deleted slots
+	unsigned live;
+	struct THREADINDEX_ *retired;
+	THREADOBJDATA * volatile slots[];
+} THREADINDEX;
+
+#define THREADINDEXMINSIZE	64
+#define THREADINDEXDELETED	((THREADOBJDATA*)1)
+
+static pthread_mutex_t indexlock = PTHREAD_MUTEX_INITIALIZER;
+static THREADINDEX * volatile threadindex = NULL;
+static THREADINDEX *retiredindexes = NULL;			//under indexlock
+static THREADOBJDATA *retiredthreaddata = NULL;		//under indexlock
+static volatile int indexreaders = 0;
+
+static inline
+unsigned hashtid (int tid, unsigned size)
+{
+	return ((unsigned)tid * 2654435761u) & (size - 1);
+}
+
+// frees what lookups could still see, called under indexlock
+static
+void freeretired (void)
+{
+	THREADINDEX *index;
+	THREADOBJDATA *data;
+
+	// the store publishing the table must not pass the load of the readers
+	__sync_synchronize ();
+	if (indexreaders != 0)
+		return;
+
+	while ((index = retiredindexes) != NULL) {
+		retiredindexes = index->retired;
+		free (index);
+	}
+	while ((data = retiredthreaddata) != NULL) {
+		retiredthreaddata = data->retired;
+		free (data);
+	}
+}
+
+static
+THREADINDEX* newthreadindex (unsigned size)
+{
+	THREADINDEX *index;
+
+	index = (THREADINDEX*) calloc (1, sizeof(THREADINDEX) + size * sizeof(THREADOBJDATA*));
+	if (index)
+		index->size = size;
+	return index;
+}
+
+static
+void insertslot (THREADINDEX *index, THREADOBJDATA *data)
+{
+	unsigned i = hashtid (data->tid, index->size);
+
+	while (index->slots[i] && index->slots[i] != THREADINDEXDELETED)
+		i = (i + 1) & (index->size - 1);
+
+	if (!index->slots[i]) index->used++;
+	index->live++;
+	index->slots[i] = data;
+}
+
+static
+bool indexthread (THREADOBJDATA *data)
+{
+	THREADINDEX *index, *bigger;
+	unsigned i, size;
+
+	pthread_mutex_lock (&indexlock);
+
+	// the creator indexes the thread, it may have finished already
+	if (data->unindexed) {
+		pthread_mutex_unlock (&indexlock);
+		return true;
+	}
+
+	index = threadindex;
+	if (!index || 4 * (index->used + 1) > 3 * index->size) {
+		// rehash, also drops the deleted slots
+		size = THREADINDEXMINSIZE;
+		while (index && 2 * (index->live + 1) > size)
+			size *= 2;
+
+		bigger = newthreadindex (size);
+		if (!bigger) {
+			pthread_mutex_unlock (&indexlock);
+			return false;
+		}
+		for (i = 0; index && i < index->size; i++) {
+			if (index->slots[i] && index->slots[i] != THREADINDEXDELETED)
+				insertslot (bigger, index->slots[i]);
+		}
+
+		__sync_synchronize ();	//the table is filled before it is published
+		threadindex = bigger;
+		if (index) {
+			index->retired = retiredindexes;
+			retiredindexes = index;
+		}
+		index = bigger;
+	}
 
-	unsigned long res;
-	unsigned (__stdcall *start)( void * );
-	LPVOID prms;
-	pthread_mutex_t *pm;
-	int pipefd;
+	insertslot (index, data);
+	freeretired ();
+
+	pthread_mutex_unlock (&indexlock);
+	return true;
+}
+
+static
+void unindexthread (THREADOBJDATA *data)
+{
+	THREADINDEX *index;
+	unsigned i;
+
+	pthread_mutex_lock (&indexlock);
+
+	data->unindexed = true;
+	index = threadindex;
+	if (index) {
+		for (i = hashtid (data->tid, index->size); index->slots[i]; i = (i + 1) & (index->size - 1)) {
+			if (index->slots[i] == data) {
+				index->slots[i] = THREADINDEXDELETED;
+				index->live--;
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock (&indexlock);
+}
+
+// returns a referenced thread object of a running thread
+static
+THREADOBJDATA* lookupthread (int tid)
+{
+	THREADINDEX *index;
+	THREADOBJDATA *data, *found = NULL;
+	unsigned i;
+	int refcount;
+
+	__sync_add_and_fetch (&indexreaders, 1);
+
+	index = threadindex;
+	if (index) {
+		for (i = hashtid (tid, index->size); (data = index->slots[i]) != NULL; i = (i + 1) & (index->size - 1)) {
+			if (data == THREADINDEXDELETED || data->tid != tid || data->exited)
+				continue;
+
+			// the object may be just released by its last owner
+			do {
+				refcount = data->refcount;
+				if (refcount == 0)
+					break;
+			} while (!__sync_bool_compare_and_swap (&data->refcount, refcount, refcount + 1));
+
+			if (refcount != 0)
+				found = data;
+			break;
+		}
+	}
+
+	__sync_sub_and_fetch (&indexreaders, 1);
+	return found;
+}
+
+static
+void releasethreaddata (THREADOBJDATA *data)
+{
+	if (__sync_sub_and_fetch (&data->refcount, 1) != 0)
+		return;
+
+	// a concurrent lookup may still read the object
+	pthread_mutex_lock (&indexlock);
+	data->retired = retiredthreaddata;
+	retiredthreaddata = data;
+	freeretired ();
+	pthread_mutex_unlock (&indexlock);
+}
+
+// fills tids of the running thread objects, returns their count
+unsigned _getthreadindexids( unsigned *tids, unsigned count )
+{
+	THREADINDEX *index;
+	THREADOBJDATA *data;
+	unsigned i, n = 0;
+
+	pthread_mutex_lock (&indexlock);
+
+	index = threadindex;
+	for (i = 0; index && i < index->size; i++) {
+		data = index->slots[i];
+		if (!data || data == THREADINDEXDELETED || data->exited)
+			continue;
+		if (n < count)
+			tids[n] = (unsigned)data->tid;
+		n++;
+	}
+
+	pthread_mutex_unlock (&indexlock);
+	return n;
+}
+
+static
+void listthread (THREADOBJDATA *data)
+{
+	// blocks while _suspendallthreads holds the world stopped
+	pthread_mutex_lock (&threadlistlock);
+	if (!data->listed) {
+		data->prev = NULL;
+		data->next = threadlist;
+		if (threadlist) threadlist->prev = data;
+		threadlist = data;
+		data->listed = true;
+	}
+	pthread_mutex_unlock (&threadlistlock);
+}
+
+static
+void unlistthread (THREADOBJDATA *data)
+{
+	pthread_mutex_lock (&threadlistlock);
+	if (data->listed) {
+		if (data->prev) data->prev->next = data->next;
+		else threadlist = data->next;
+		if (data->next) data->next->prev = data->prev;
+		data->listed = false;
+	}
+	pthread_mutex_unlock (&threadlistlock);
+}
+
+static
+void parksuspendedthread (THREADOBJDATA *data)
+{
+	int count;
+
+	// acknowledge on every pass, a thread resumed and suspended again before it
+	// left the loop has its signal still blocked and is acknowledged here
+	do {
+		__sync_add_and_fetch (&data->suspendack, 1);
+		futex_wake (&data->suspendack, INT32_MAX);
+
+		count = data->suspendcount;
+		if (count > 0)
+			futex_wait (&data->suspendcount, count, NULL);
+	} while (count > 0 && !data->abandoned);
+}
+
+static
+void suspendsignalhandler (int sig)
+{
+	int saved = errno;
+	THREADOBJDATA *data = currentthreaddata;
+
+	// a pooled thread between two thread objects checks the count before it starts
+	if (data)
+		parksuspendedthread (data);
+
+	errno = saved;
+}
+
+static
+void suspendsignalinit (void)
+{
+	struct sigaction sa;
+
+	memset (&sa, 0, sizeof(sa));
+	sa.sa_handler = suspendsignalhandler;
+	sa.sa_flags = SA_RESTART;
+	sigfillset (&sa.sa_mask);
+	sigaction (THREADSUSPENDSIGNAL, &sa, NULL);
+}
+
+// increments the suspend count, returns the previous count or -1
+static
+int addsuspendcount (THREADOBJDATA *data)
+{
+	int count;
+
+	do {
+		count = data->suspendcount;
+		if (count >= MAXIMUM_SUSPEND_COUNT)
+			return -1;
+	} while (!__sync_bool_compare_and_swap (&data->suspendcount, count, count + 1));
+
+	return count;
+}
+
+static
+int signalsuspend (THREADOBJDATA *data)
+{
+	int rc = 0;
+
+	pthread_once (&suspendsignalonce, suspendsignalinit);
+
+	// an exited thread is not waited for, see waitsuspendack
+	pthread_mutex_lock (&data->signallock);
+	if (!data->exited)
+		rc = pthread_kill (data->thread, THREADSUSPENDSIGNAL);
+	pthread_mutex_unlock (&data->signallock);
+	return rc;
+}
+
+static
+int cancelthread (THREADOBJDATA *data)
+{
+	int rc = 0;
+
+	pthread_mutex_lock (&data->signallock);
+	if (!data->exited) {
+		data->cancelled = true;
+		rc = pthread_cancel (data->thread);
+	}
+	pthread_mutex_unlock (&data->signallock);
+	return rc;
+}
+
+static
+void waitsuspendack (THREADOBJDATA *data, int ack)
+{
+	while (data->suspendack == ack && !data->exited)
+		futex_wait (&data->suspendack, ack, NULL);
+}
+
+// CPU times of the calling thread
+static
+void getthreadcputimes (struct timeval *utime, struct timeval *stime)
+{
+#ifdef RUSAGE_THREAD
+	struct rusage ru;
+
+	if (getrusage (RUSAGE_THREAD, &ru) == 0) {
+		*utime = ru.ru_utime;
+		*stime = ru.ru_stime;
+		return;
+	}
+#endif
+	timerclear (utime);
+	timerclear (stime);
+}
+
+// called by the thread itself when its start routine has finished, returns
+// true when a cancellation is pending and the thread must not be reused
+static
+bool finishthreadobject (THREADOBJDATA *data, DWORD exitcode)
+{
+	struct timeval utime, stime;
+	sigset_t pending;
+	bool cancelled;
+
+	unlistthread (data);
+	unindexthread (data);
+
+	_getcurrentfiletime( &data->exittime );
+
+	getthreadcputimes (&utime, &stime);
+	timersub (&utime, &data->startutime, &utime);
+	timersub (&stime, &data->startstime, &stime);
+	timeval_to_FILETIME( &utime, &data->usertime );
+	timeval_to_FILETIME( &stime, &data->kerneltime );
+
+	if (__sync_bool_compare_and_swap (&data->exitcodeset, 0, 1))
+		data->exitcode = exitcode;
+
+	// publish the exit code and times before waking the waiters
+	__sync_synchronize ();
+	pthread_mutex_lock (&data->signallock);
+	data->exited = 1;
+	cancelled = data->cancelled;
+	pthread_mutex_unlock (&data->signallock);
+	futex_wake (&data->exited, INT32_MAX);
+	_signalwaitobject( data );
+
+	if (currentthreaddata == data)
+		currentthreaddata = NULL;
+
+	// a suspend signal sent before exited was set is delivered on the return
+	// from a system call, take it here and not in the next thread object
+	sigpending (&pending);
+
+	releasethreaddata (data);
+	return cancelled;
+}
+
+static
+void foreignthreadexit (void *arg)
+{
+	finishthreadobject ((THREADOBJDATA*)arg, 0);
+}
+
+static
+void foreignthreadinit (void)
+{
+	pthread_key_create (&foreignthreadkey, foreignthreadexit);
+}
+
+static
+THREADOBJDATA* getcurrentthreaddata (void)
+{
+	THREADOBJDATA *data = currentthreaddata;
+
+	if (!data) {
+		// a thread not created by _createthread, e.g. the main thread
+		data = (THREADOBJDATA*) calloc (1, sizeof(THREADOBJDATA));
+		if (!data)
+			return NULL;
+
+		data->refcount = 1;		//released when the thread exits
+		pthread_mutex_init (&data->signallock, NULL);
+		data->tid      = gettid_ ();
+		data->thread   = pthread_self ();
+		data->exitcode = STILL_ACTIVE;
+		_getcurrentfiletime( &data->creationtime );
+
+		pthread_once (&foreignthreadonce, foreignthreadinit);
+		pthread_setspecific (foreignthreadkey, data);
+		currentthreaddata = data;
+		listthread (data);
+		indexthread (data);
+	}
+
+	return data;
+}
+
+static
+void prefaultstack (void)
+{
+	// fault in the top of the stack once, the parked thread keeps it for its next runs
+#ifdef __linux__
+	pthread_attr_t attr;
+	void *addr;
+	size_t size, pagesize = getpagesize ();
+	char *low, *high, *p;
+
+	if (pthread_getattr_np (pthread_self (), &attr) != 0)
+		return;
+
+	if (pthread_attr_getstack (&attr, &addr, &size) == 0) {
+		high = (char*)((uintptr_t)__builtin_frame_address (0) & ~(uintptr_t)(pagesize - 1));
+		low = high - THREADSTACKPREFAULT;
+		if (low < (char*)addr + pagesize) low = (char*)addr + pagesize;
+
+		if (low < high) {
+#ifdef MADV_POPULATE_WRITE
+			if (madvise (low, high - low, MADV_POPULATE_WRITE) != 0)
+#endif
+			for (p = high - pagesize; p >= low; p -= pagesize)
+				*(volatile char*)p = 0;
+		}
+	}
+	pthread_attr_destroy (&attr);
+#endif
+}
+
+static
+int getioprio (int tid)
+{
+#if defined __linux__ && defined SYS_ioprio_get
+	return (int) syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, tid);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static
+int setioprio (int tid, int ioprio)
+{
+#if defined __linux__ && defined SYS_ioprio_set
+	return (int) syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, ioprio);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static
+void saveworkerstate (THREADWORKER *w)
+{
+	w->thread = pthread_self ();
+	w->tid = gettid_ ();
+	pthread_getschedparam (pthread_self (), &w->policy, &w->schedparam);
+	errno = 0;
+	w->nice = getpriority (PRIO_PROCESS, w->tid);
+	if (errno) w->nice = 0;
+	w->ioprio = getioprio (w->tid);
+#ifdef __linux__
+	unsigned ncpus = _getcputopologycount( );
+
+	w->affinity = (ncpus ? CPU_ALLOC (ncpus) : NULL);
+	if (w->affinity) {
+		w->affinitysize = CPU_ALLOC_SIZE (ncpus);
+		if (pthread_getaffinity_np (pthread_self (), w->affinitysize, w->affinity) != 0) {
+			CPU_FREE (w->affinity);
+			w->affinity = NULL;
+		}
+	}
+#endif
+}
+
+static
+void restoreworkerstate (THREADWORKER *w)
+{
+	// the next thread object starts with the scheduling state of a new thread
+	pthread_setschedparam (pthread_self (), w->policy, &w->schedparam);
+	setpriority (PRIO_PROCESS, w->tid, w->nice);
+	if (w->ioprio != -1)
+		setioprio (w->tid, w->ioprio);
+#ifdef __linux__
+	if (w->affinity)
+		pthread_setaffinity_np (pthread_self (), w->affinitysize, w->affinity);
+#endif
+}
+
+static
+void freeworker (THREADWORKER *w)
+{
+#ifdef __linux__
+	if (w->affinity) CPU_FREE (w->affinity);
+#endif
+	free (w);
+}
+
+static
+bool parkworker (THREADWORKER *w)
+{
+	THREADWORKER **pw;
+	struct timespec timeout;
+	bool claimed = false;
+
+	if (!w->reusable)
+		return false;
+
+	restoreworkerstate (w);
+
+	pthread_mutex_lock (&poollock);
+	if (parkedcount >= THREADPOOLMAXPARKED) {
+		pthread_mutex_unlock (&poollock);
+		return false;
+	}
+	w->wakeup = 0;
+	w->next = parkedworkers;
+	parkedworkers = w;
+	parkedcount++;
+	pthread_mutex_unlock (&poollock);
+
+	timeout.tv_sec = THREADPOOLIDLETIMEOUT;
+	timeout.tv_nsec = 0;
+
+	while (!w->wakeup) {
+		if (futex_wait (&w->wakeup, 0, claimed ? NULL : &timeout) == -1 && errno == ETIMEDOUT) {
+			pthread_mutex_lock (&poollock);
+			for (pw = &parkedworkers; *pw && *pw != w; pw = &(*pw)->next)
+				;
+			if (*pw) {
+				// nobody needed the thread, leave the pool
+				*pw = w->next;
+				parkedcount--;
+				pthread_mutex_unlock (&poollock);
+				return false;
+			}
+			// taken by _createthreadex, which sets the start routine unlocked
+			claimed = true;
+			pthread_mutex_unlock (&poollock);
+		}
+	}
+
+	__sync_synchronize ();	//the new start routine is visible
+	return true;
+}
+
+static
+void workercleanup (void *arg)     //cleanup function
+{
+	// the thread leaves through pthread_exit or cancellation, the exit code was already set
+	THREADWORKER *w = (THREADWORKER*)arg;
+
+	if (w->data)
+		finishthreadobject (w->data, 0);
+	freeworker (w);
+}
+
+static
+void* workerfunc (void *arg)
+{
+	THREADWORKER *w = (THREADWORKER*)arg;
+	THREADOBJDATA *data;
+	DWORD res;
 
 	//block some signals
 	//sigemptyset (&signal_mask);
@@ -109,59 +823,47 @@ unsigned prethreadfunc (void *arg)
 	//sigaddset (&signal_mask, SIGKILL);
 	//pthread_sigmask (SIG_BLOCK, &signal_mask, NULL);
 
-	pre_prms = (THREADPRMS_WRAP*)arg;
-	start = pre_prms->origstart;
-	prms = pre_prms->origprms;
-	pm = pre_prms->firstresumesync;
-	pipefd = pre_prms->pipefd;
+	saveworkerstate (w);
+	if (w->reusable)
+		prefaultstack ();
 
-	free (pre_prms);
+	pthread_cleanup_push (workercleanup, w);
 
-	// close the pipe
-	pthread_cleanup_push (pthreadcleanup, (void*)&pipefd);
+	for (;;) {
+		data = w->data;
+		currentthreaddata = data;
 
-#ifndef __MACH__
-	pid_t tid;
-	tid = syscall (SYS_gettid);
-
-	ssize_t rc;
-	rc = write (pipefd, &tid, sizeof(tid));
-	if (rc == -1)
-		res = -1;
-	else
-#endif
-	{
-		if (pm)
-			pthread_mutex_lock (pm);	// suspend a new thread
+		if (data->tid == 0) {	//a new thread, the creator waits for its id
+			data->thread = pthread_self ();
+			data->tid = w->tid;
+			futex_wake (&data->tid, 1);
+		}
 
-		//start the original function
-		res = (unsigned) start( prms );
-	}
+		// the thread already runs on the node, keep its stack and first-touch memory local
+		if (w->node != NUMA_NO_PREFERRED_NODE)
+			_numaplacethread( w->node );
 
-	pthread_cleanup_pop (1);
+		listthread (data);
+		if (data->suspendcount)		// suspended new thread
+			parksuspendedthread (data);
 
-	pthread_exit ((void*)res);
-	return res;
-}
+		//start the original function, unless _createthreadex failed before it could
+		getthreadcputimes (&data->startutime, &data->startstime);
+		__sync_synchronize ();
+		res = (data->abandoned ? 0 : w->start( w->param ));
 
-static
-void pthreadcleanup (void *arg)     //cleanup function
-{
-	if (!arg) return;
+		w->data = NULL;
+		if (finishthreadobject (data, res))
+			break;		//_terminatethread came too late to act, never reuse the thread
 
-	//TODO: set exit code - 0 jako defaultni hodnota
-	// set exit and user time
+		if (!parkworker (w))
+			break;
+	}
 
-	//HANDLE hThread;
-	//hThread = GetCurrentThread( );
-	//THREADHANDLE* hndl = (THREADHANDLE*)hThread;
-	//hndl->exittime = ;
-	//hndl->usertime = ;
-	//hndl->exitcode = ;
+	pthread_cleanup_pop (0);
 
-	int *pipefd = (int*)arg;
-	if (pipefd && *pipefd != -1)
-		close (*pipefd);
+	freeworker (w);
+	return NULL;
 }
 
 static
@@ -175,27 +877,36 @@ uintptr_t getcurrentthreadrealhandle ()
 {
 	//TODO: update this code
 	uintptr_t hndl;
-	pthread_t thr = pthread_self ();
+	THREADOBJDATA *data = getcurrentthreaddata ();
+
+	if (!data)
+		return (uintptr_t)NULL;
 
-	hndl = _getrealhandle ((uintptr_t)CURRENT_THREAD_HANDLE, THREADOBJID, (void*)&thr, sizeof(thr));
+	hndl = _getrealhandle ((uintptr_t)CURRENT_THREAD_HANDLE, THREADOBJID, (void*)&data, sizeof(data));
 	return hndl;
 }
 
 
-uintptr_t _createthread( SECURITY_ATTRIBUTES *sa, size_t stack,
-                         LPTHREAD_START_ROUTINE start, void *param,
-                         unsigned flags, unsigned *id )
+uintptr_t _createthreadex( SECURITY_ATTRIBUTES *sa, size_t stack,
+                           LPTHREAD_START_ROUTINE start, void *param,
+                           unsigned flags, unsigned node, unsigned *id )
 {
 	int rc;
-	pthread_t thr_id;
 	pthread_attr_t thr_attr;
+	THREADOBJDATA *data;
+	THREADWORKER *w = NULL, **pw;
+	uintptr_t hndl;
 
-	struct timeval tv;
-	FILETIME ct, nulltime = { 0, 0 };
-	THREADPRMS_WRAP *pre_prms;
-	pthread_mutex_t *pm = NULL;
+#ifdef __linux__
+	cpu_set_t *nodecpus = NULL;
+	size_t nodecpussize = 0;
 
-	uintptr_t hndl;
+	if ( node != NUMA_NO_PREFERRED_NODE ) {
+		nodecpus = _getnumanodecpuset( node, &nodecpussize );
+		if ( !nodecpus )
+			return (uintptr_t)NULL;
+	}
+#endif
 
 	SIZE_T stacksize = stack;
 	if ( stacksize > 0 ) {
@@ -209,137 +920,150 @@ uintptr_t _createthread( SECURITY_ATTRIBUTES *sa, size_t stack,
 		else stacksize = stack - stacksize + pagesize;	//sysinfo.dwPageSize;
 	}
 
-	if ( flags & CREATE_SUSPENDED ) {
-		pm = malloc (sizeof (pthread_mutex_t));
-		if ( !pm ) {
-			SetLastError( get_win_error (errno) );
+	data = (THREADOBJDATA*) calloc (1, sizeof(THREADOBJDATA));
+	if ( !data ) {
+		_setlasterror( get_win_error (errno) );
+#ifdef __linux__
+		if (nodecpus) CPU_FREE (nodecpus);
+#endif
+		return (uintptr_t)NULL;
+	}
+	data->refcount = 2;		//the handle and the thread
+	pthread_mutex_init (&data->signallock, NULL);
+	data->suspendcount = ((flags & CREATE_SUSPENDED) ? 1 : 0);
+	data->exitcode = STILL_ACTIVE;
+	//get thread creation time
+	_getcurrentfiletime( &data->creationtime );
+
+	// reuse a parked thread with the same stack size, NUMA placed threads are not pooled
+	if ( node == NUMA_NO_PREFERRED_NODE ) {
+		pthread_mutex_lock (&poollock);
+		for (pw = &parkedworkers; *pw; pw = &(*pw)->next) {
+			if ( (*pw)->stacksize == stacksize ) {
+				w = *pw;
+				*pw = w->next;
+				parkedcount--;
+				break;
+			}
+		}
+		pthread_mutex_unlock (&poollock);
+	}
+
+	if ( w ) {
+		data->thread = w->thread;
+		data->tid    = w->tid;
+		w->data  = data;
+		w->start = start;
+		w->param = param;
+		w->node  = node;
+
+		__sync_synchronize ();
+		w->wakeup = 1;
+		futex_wake (&w->wakeup, 1);
+	} else {
+		w = (THREADWORKER*) calloc (1, sizeof(THREADWORKER));
+		if ( !w ) {
+			_setlasterror( get_win_error (errno) );
+			free (data);
+#ifdef __linux__
+			if (nodecpus) CPU_FREE (nodecpus);
+#endif
 			return (uintptr_t)NULL;
 		}
-
-		pthread_mutexattr_t mattr;
-		pthread_mutexattr_init (&mattr);
-#ifdef __MACH__
-		pthread_mutexattr_settype (&mattr, PTHREAD_MUTEX_ERRORCHECK);
-#else
-		pthread_mutexattr_settype (&mattr, PTHREAD_MUTEX_ERRORCHECK_NP);
+		w->stacksize = stacksize;
+		w->reusable  = (node == NUMA_NO_PREFERRED_NODE);
+		w->data      = data;
+		w->start     = start;
+		w->param     = param;
+		w->node      = node;
+
+		pthread_t thr_id;
+		pthread_attr_init (&thr_attr);
+		if ( stacksize > 0 )
+			pthread_attr_setstacksize (&thr_attr, stacksize);
+		pthread_attr_setdetachstate (&thr_attr, PTHREAD_CREATE_DETACHED);	//waiters use the thread object
+#ifdef __linux__
+		if ( nodecpus ) {
+			// start on the preferred node, so that the stack is first touched there
+			pthread_attr_setaffinity_np (&thr_attr, nodecpussize, nodecpus);
+			CPU_FREE (nodecpus);
+		}
 #endif
-		rc = pthread_mutex_init (pm, &mattr);
-		pthread_mutexattr_destroy (&mattr);
+		rc = pthread_create (&thr_id, &thr_attr, workerfunc, w);
+		pthread_attr_destroy (&thr_attr);
+
 		if ( rc != 0 ) {
-			free (pm);
 			_setlasterror( get_win_error (rc) );
+			free (w);
+			free (data);
 			return (uintptr_t)NULL;
 		}
 
-		pthread_mutex_lock (pm);
+		//get thread ID
+		while ( data->tid == 0 )
+			futex_wait (&data->tid, 0, NULL);
 	}
 
-	int pipefd[2];
-	rc = pipe (pipefd);	//create pipe to enable WaitForSingleObject
-	if ( rc == -1 ) {
-		_setlasterror( get_win_error (errno) );
-		if (pm) {
-			pthread_mutex_destroy (pm);
-			free (pm);
-		}
-		return (uintptr_t)NULL;
-	}
+	// the thread removes itself at exit, an index after that is skipped
+	indexthread (data);
 
-	pre_prms = malloc (sizeof(THREADPRMS_WRAP));
-	if ( !pre_prms ) {
+	hndl = _createhandle (-1, 0, &threadkrnlobj, (void*)&data, sizeof(data), NULL, 0);
+	if (!hndl) {
 		_setlasterror( get_win_error (errno) );
-		if (pm) {
-			pthread_mutex_destroy (pm);
-			free (pm);
-		}
-		close (pipefd[0]); close (pipefd[1]);		//close pipe
-		return (uintptr_t)NULL;
-	}
 
-	pre_prms->origprms = param;
-	pre_prms->origstart = start;
-	pre_prms->firstresumesync = pm;		//signal suspended thread
-	pre_prms->pipefd = pipefd[1];
-
-	pthread_attr_init (&thr_attr);
-	if ( stacksize > 0 )
-		pthread_attr_setstacksize (&thr_attr, stacksize);
-	pthread_attr_setdetachstate (&thr_attr, PTHREAD_CREATE_JOINABLE);	//PTHREAD_CREATE_DETACHED
-	rc = pthread_create (&thr_id, &thr_attr, (void*(*)(void*))prethreadfunc, pre_prms);
-	//get thread creation time
-	gettimeofday (&tv, NULL);
-	timeval_to_FILETIME( &tv, &ct );
-	pthread_attr_destroy (&thr_attr);
+		// a suspended thread waits on a futex, not at a cancellation point
+		data->abandoned = 1;
+		__sync_synchronize ();
+		data->suspendcount = 0;
+		futex_wake (&data->suspendcount, INT32_MAX);
+		releasethreaddata (data);
 
-	if ( rc != 0 ) {
-		_setlasterror( get_win_error (rc) );
-		if (pm) {
-			pthread_mutex_destroy (pm);
-			free (pm);
-		}
-		close (pipefd[0]); close (pipefd[1]);		//close pipe
 		return (uintptr_t)NULL;
 	}
 
-	//get thread ID
-	pid_t tid;
-#ifdef __MACH__
-	unsigned long long myid;
-	pthread_threadid_np(thr_id, &myid);
-	tid = (pid_t)myid;
-#else
-	ssize_t rcnt;
-	rcnt = read (pipefd[0], &tid, sizeof(pid_t));
-	if ( rcnt == -1) {
-		SetLastError( get_win_error (errno) );
-		if (pm) {
-			pthread_mutex_destroy (pm);
-			free (pm);
-		}
-		close (pipefd[0]); close (pipefd[1]);		//close pipe
-		return (uintptr_t)NULL;
-	}
-#endif
+	if (id) *id = (DWORD)data->tid;
+	return (uintptr_t)hndl;
+}
 
-	THREADOBJDATA data;
-	data.tid             = tid;
-	data.firstresumesync = pm;
-	data.pipefd          = pipefd[0];
-	//thread times
-	data.creationtime    = ct;
-	data.exittime        = nulltime;
-	//data.kerneltime     = nulltime;
-	data.usertime        = nulltime;
-	data.exitcode        = STILL_ACTIVE;
-
-	hndl = _createhandle (-1, 0, &threadkrnlobj, (void*)thr_id, sizeof(thr_id), (void*)&data, sizeof(data));
-	if (!hndl) {
-		SetLastError( get_win_error (errno) );
+uintptr_t _createthread( SECURITY_ATTRIBUTES *sa, size_t stack,
+                         LPTHREAD_START_ROUTINE start, void *param,
+                         unsigned flags, unsigned *id )
+{
+	return _createthreadex( sa, stack, start, param, flags, NUMA_NO_PREFERRED_NODE, id );
+}
 
-		pthread_cancel (thr_id);
+uintptr_t _openthread( unsigned dwDesiredAccess, bool bInheritHandle, unsigned dwThreadId )
+{
+	THREADOBJDATA *data;
+	unsigned int *refcount;
+	uintptr_t hndl;
 
-		pthread_mutex_destroy (pm);
-		free (pm);
-		close (pipefd[0]); close (pipefd[1]);		//close pipe
+	//TODO: access rights and handle inheritance
+	data = lookupthread ((int)dwThreadId);
+	if ( !data ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return (uintptr_t)NULL;
+	}
 
+	hndl = _createhandle (-1, 0, &threadkrnlobj, (void*)&data, sizeof(data), NULL, 0);
+	if ( !hndl ) {
+		_setlasterror( get_win_error (errno) );
+		releasethreaddata (data);
 		return (uintptr_t)NULL;
 	}
 
-	if (id) *id = (DWORD)tid;
-	return (uintptr_t)hndl;
-}
+	// the object of an already opened thread holds its reference
+	_gethandledata (hndl, &refcount);
+	if ( *refcount > 1 )
+		releasethreaddata (data);
 
-uintptr_t _openthread( unsigned dwDesiredAccess, bool bInheritHandle, unsigned dwThreadId )
-{
-	//TODO: implement the call
-	_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
-	return (uintptr_t)NULL;
+	return hndl;
 }
 
 bool _terminatethread( uintptr_t hndl, unsigned exit_code)
 {
 	int rc;
-	pthread_t thr_id;
+	THREADOBJDATA *data;
 
 	if ( hndl == (uintptr_t)CURRENT_THREAD_HANDLE )
 		hndl = getcurrentthreadrealhandle ();
@@ -349,24 +1073,20 @@ bool _terminatethread( uintptr_t hndl, unsigned exit_code)
 		return false;
 	}
 
-	thr_id = *(pthread_t*)hndl;
+	data = getthreaddata( hndl );
+	if ( data->exited )
+		return true;
+
+	if (__sync_bool_compare_and_swap (&data->exitcodeset, 0, 1))
+		data->exitcode = exit_code;
 
-	rc = pthread_cancel (thr_id);
+	// the OS thread may already run another thread object
+	rc = cancelthread (data);
 	if( rc != 0 ) {
 		_setlasterror( get_win_error (rc) );
 		return false;
 	}
 
-	THREADOBJDATA *data;
-	FILETIME et;
-	struct timeval tv;
-	gettimeofday (&tv, NULL);
-	timeval_to_FILETIME( &tv, &et );
-
-	data = (THREADOBJDATA*)_gethandledata (hndl, NULL);
-	data->exitcode = exit_code;
-	data->exittime = et;
-
 	return true;
 }
 
@@ -374,8 +1094,6 @@ DECLSPEC_NORETURN
 void _exitthread( uintptr_t hndl, unsigned code )
 {
 	THREADOBJDATA *data;
-	FILETIME et;
-	struct timeval tv;
 
 	if ( hndl == (uintptr_t)CURRENT_THREAD_HANDLE )
 		hndl = getcurrentthreadrealhandle ();
@@ -385,14 +1103,12 @@ void _exitthread( uintptr_t hndl, unsigned code )
 		return ;
 	}
 
-	gettimeofday (&tv, NULL);
-	timeval_to_FILETIME( &tv, &et );
-
-	data = (THREADOBJDATA*)_gethandledata (hndl, NULL);
-	data->exitcode = code;
-	data->exittime = et;
+	// the exit time is set by the thread cleanup
+	data = getthreaddata( hndl );
+	if (__sync_bool_compare_and_swap (&data->exitcodeset, 0, 1))
+		data->exitcode = code;
 
-	pthread_exit ((void*)code);
+	pthread_exit ((void*)(uintptr_t)code);
 }
 
 bool _getexitcodethread( uintptr_t hndl, unsigned *exitcode )
@@ -407,20 +1123,17 @@ bool _getexitcodethread( uintptr_t hndl, unsigned *exitcode )
 		return false;
 	}
 
-	data = _gethandledata( hndl, NULL );
+	data = getthreaddata( hndl );
 
-	if ( exitcode ) *exitcode = data->exitcode;
+	if ( exitcode ) *exitcode = (data->exited ? data->exitcode : STILL_ACTIVE);
 	return true;
 }
 
-static
 unsigned _waitforsinglethreadobject( uintptr_t hndl, unsigned milliseconds )
 {
-	// TODO: implement retval
-
 	int rc;
-	pthread_t thr_id;
-	void *retval;
+	THREADOBJDATA *data;
+	struct timespec deadline, timeout;
 
 	//TODO: check
 	//if ( !hndl ) {
@@ -428,65 +1141,42 @@ unsigned _waitforsinglethreadobject( uintptr_t hndl, unsigned milliseconds )
 	//	return FALSE;
 	//}
 
-	thr_id = *(pthread_t*)hndl;
-
-#ifdef __linux__
-	struct timespec *timeout, abstime;
-
-	if ( milliseconds != INFINITE ) {
-		clock_gettime (CLOCK_REALTIME, &abstime);
-
-		abstime.tv_sec = (milliseconds / 1000);
-		abstime.tv_nsec = (milliseconds % 1000) * 1000000;
-		timeout = &abstime;
-	} else
-		timeout = NULL;
-
-	if (timeout)
-		rc = pthread_timedjoin_np (thr_id, &retval, timeout);
-	else
-		rc = pthread_join (thr_id, &retval);
-
-	if (rc != 0)
-		return (rc == ETIMEDOUT ? WAIT_TIMEOUT : WAIT_FAILED);
+	data = getthreaddata( hndl );
 
-#else
-	THREADOBJDATA *data;
-	int pipefd;
-	struct timeval *timeout, tv;
-
-	data = (THREADOBJDATA*)_gethandledata(hndl);
-	pipefd = data->pipefd;
-
-	fd_set rset;
-	FD_ZERO (&rset);
-	FD_SET (pipefd, &rset);
+	if ( milliseconds != INFINITE )
+		_getmonotonicdeadline( milliseconds, &deadline );
 
-	if ( milliseconds != INFINITE ) {
-		tv.tv_sec = (milliseconds / 1000);
-		tv.tv_usec = (milliseconds % 1000) * 1000;
-		timeout = &tv;
-	} else
-		timeout = NULL;
-
-	rc = select (pipefd+1, &rset, NULL, NULL, timeout);	//TODO: enable signal handling
+	while ( !data->exited ) {
+		if ( milliseconds == INFINITE )
+			rc = futex_wait (&data->exited, 0, NULL);
+		else {
+			if ( !_getmonotonictimeout( &deadline, &timeout ) )
+				return WAIT_TIMEOUT;
+			rc = futex_wait (&data->exited, 0, &timeout);
+		}
 
-	if (rc == -1) {
-		_setlasterror( get_win_error (errno) );
-		return WAIT_FAILED; }
-	if (rc == 0 )
-		return WAIT_TIMEOUT;
-#endif
+		if (rc == -1 && errno != ETIMEDOUT && errno != EAGAIN && errno != EINTR) {
+			_setlasterror( get_win_error (errno) );
+			return WAIT_FAILED;
+		}
+	}
 
+	__sync_synchronize ();	//the exit code is visible
 	return WAIT_OBJECT_0;
 }
 
 static
 bool _closethreadhandle( uintptr_t hndl )
 {
-	//TODO: implement the CloseHandle function
-	//_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
-	//return false;
+	THREADOBJDATA *data;
+	unsigned int *refcount;
+
+	_gethandledata (hndl, &refcount);
+	if (*refcount <= 1) {
+		// the running thread keeps its own reference
+		data = getthreaddata( hndl );
+		releasethreaddata (data);
+	}
 
 	return true;
 }
@@ -507,8 +1197,8 @@ unsigned _getcurrentthreadid( )
 
 unsigned _suspendthread( uintptr_t hndl )
 {
-	int rc;
-	pthread_t thr_id;
+	int rc, count, ack;
+	THREADOBJDATA *data;
 
 	if ( hndl == (uintptr_t)CURRENT_THREAD_HANDLE )
 		hndl = getcurrentthreadrealhandle ();
@@ -518,23 +1208,43 @@ unsigned _suspendthread( uintptr_t hndl )
 		return ~0U;
 	}
 
-	thr_id = *(pthread_t*)hndl;
+	data = getthreaddata( hndl );
+	if ( data->exited ) {
+		_setlasterror( ERROR_ACCESS_DENIED );
+		return ~0U;
+	}
+
+	ack = data->suspendack;
+	count = addsuspendcount (data);
+	if ( count < 0 ) {
+		_setlasterror( ERROR_SIGNAL_REFCOUNT_EXCEEDED );
+		return ~0U;
+	}
+	if ( count > 0 )	//already parked or about to park
+		return (unsigned)count;
+
+	if ( data == currentthreaddata ) {
+		parksuspendedthread (data);
+		return 0;
+	}
 
-	rc = pthread_kill (thr_id, SIGTSTP);	//SIGSTOP
+	rc = signalsuspend (data);
 	if (rc != 0) {
+		if (__sync_sub_and_fetch (&data->suspendcount, 1) == 0)
+			futex_wake (&data->suspendcount, INT32_MAX);
 		_setlasterror( get_win_error (rc) );
 		return ~0U;	//Failure: 0xFFFFFFFF
 	}
 
+	// the thread is suspended when the call returns
+	waitsuspendack (data, ack);
 	return 0;
 }
 
 unsigned _resumethread( uintptr_t hndl )
 {
-	int rc;
+	int count;
 	THREADOBJDATA *data;
-	pthread_t thr_id;
-	pthread_mutex_t *pm;
 
 	if ( hndl == (uintptr_t)CURRENT_THREAD_HANDLE )
 		hndl = getcurrentthreadrealhandle ();
@@ -544,38 +1254,183 @@ unsigned _resumethread( uintptr_t hndl )
 		return ~0U;
 	}
 
-	thr_id = *(pthread_t*)hndl;
-	data = (THREADOBJDATA*)_gethandledata( hndl, NULL );
-	pm = data->firstresumesync;
+	data = getthreaddata( hndl );
+
+	do {
+		count = data->suspendcount;
+		if ( count == 0 )
+			return 0;
+	} while ( !__sync_bool_compare_and_swap (&data->suspendcount, count, count - 1) );
+
+	if ( count == 1 )
+		futex_wake (&data->suspendcount, INT32_MAX);
+
+	return (unsigned)count;		//previous suspend count
+}
+
+// suspends all other library threads and waits until all of them are parked;
+// no thread starts or exits until _resumeallthreads, returns the number of stopped threads
+unsigned _suspendallthreads( void )
+{
+	THREADOBJDATA *data, *self;
+	unsigned stopped = 0;
+	int count;
+
+	self = getcurrentthreaddata ();
+
+	pthread_mutex_lock (&threadlistlock);
+
+	// signal all threads first, they park in parallel
+	for (data = threadlist; data; data = data->next) {
+		data->stopped = false;
+		if (data == self || data->exited)
+			continue;
+
+		data->stopack = data->suspendack;
+		count = addsuspendcount (data);
+		if (count < 0)
+			continue;
+		data->stopped = true;
+		stopped++;
+
+		if (count > 0)
+			data->stopack = -1;		//already suspended, nothing to wait for
+		else if (signalsuspend (data) != 0) {
+			if (__sync_sub_and_fetch (&data->suspendcount, 1) == 0)
+				futex_wake (&data->suspendcount, INT32_MAX);
+			data->stopped = false;
+			stopped--;
+		}
+	}
+
+	for (data = threadlist; data; data = data->next) {
+		if (data->stopped && data->stopack != -1)
+			waitsuspendack (data, data->stopack);
+	}
+
+	return stopped;
+}
+
+void _resumeallthreads( void )
+{
+	THREADOBJDATA *data;
+
+	for (data = threadlist; data; data = data->next) {
+		if (!data->stopped)
+			continue;
+		data->stopped = false;
+		if (__sync_sub_and_fetch (&data->suspendcount, 1) == 0)
+			futex_wake (&data->suspendcount, INT32_MAX);
+	}
+
+	pthread_mutex_unlock (&threadlistlock);
+}
+
+// nice values of the priority levels of SCHED_OTHER threads
+static const struct {
+	int priority;
+	int nice;
+} nicelevels[] = {
+	{ THREAD_PRIORITY_TIME_CRITICAL, -20 },
+	{ THREAD_PRIORITY_HIGHEST,       -10 },
+	{ THREAD_PRIORITY_ABOVE_NORMAL,   -5 },
+	{ THREAD_PRIORITY_NORMAL,          0 },
+	{ THREAD_PRIORITY_BELOW_NORMAL,    5 },
+	{ THREAD_PRIORITY_LOWEST,         10 },
+	{ THREAD_PRIORITY_IDLE,           19 },
+};
+
+static
+bool prioritytonice (int priority, int *nice)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(nicelevels)/sizeof(nicelevels[0]); i++) {
+		if (nicelevels[i].priority == priority) {
+			*nice = nicelevels[i].nice;
+			return true;
+		}
+	}
+	return false;
+}
+
+static
+int nicetopriority (int nice)
+{
+	unsigned i, best = 0;
+
+	// the nearest level, the nice value may be set outside of the library
+	for (i = 1; i < sizeof(nicelevels)/sizeof(nicelevels[0]); i++) {
+		if (abs (nicelevels[i].nice - nice) < abs (nicelevels[best].nice - nice))
+			best = i;
+	}
+	return nicelevels[best].priority;
+}
+
+static
+bool setbackgroundmode (THREADOBJDATA *data, bool begin)
+{
+#if defined __linux__ && defined SCHED_IDLE
+	int rc;
+	struct sched_param schprm;
+
+	// only the calling thread can change its background mode
+	if ( data != currentthreaddata ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	if ( begin ) {
+		if ( data->background ) {
+			_setlasterror( ERROR_THREAD_MODE_ALREADY_BACKGROUND );
+			return false;
+		}
 
-	if ( pm ) {
-		rc = pthread_mutex_unlock (pm);
+		rc = pthread_getschedparam (data->thread, &data->bgpolicy, &data->bgparam);
 		if ( rc == 0 ) {
-			data->firstresumesync = NULL;
-			pthread_mutex_destroy (pm);
+			memset (&schprm, 0, sizeof(schprm));
+			rc = pthread_setschedparam (data->thread, SCHED_IDLE, &schprm);
 		}
-		if ( rc != 0 && rc != EPERM ) {
+		if ( rc != 0 ) {
 			_setlasterror( get_win_error (rc) );
-			return ~0U;
-		} else if ( rc == 0 )
-			return 0;
-	}
+			return false;
+		}
 
-	rc = pthread_kill (thr_id, SIGCONT);
+		// the I/O of the thread is served when the disk is idle
+		data->bgioprio = getioprio (data->tid);
+		if ( data->bgioprio != -1 )
+			setioprio (data->tid, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
 
-	if (rc != 0) {
-		_setlasterror( get_win_error (rc) );
-		return ~0U;	//Failure: 0xFFFFFFFF
+		data->background = true;
+	} else {
+		if ( !data->background ) {
+			_setlasterror( ERROR_THREAD_MODE_NOT_BACKGROUND );
+			return false;
+		}
+
+		rc = pthread_setschedparam (data->thread, data->bgpolicy, &data->bgparam);
+		if ( rc != 0 ) {
+			_setlasterror( get_win_error (rc) );
+			return false;
+		}
+		if ( data->bgioprio != -1 )
+			setioprio (data->tid, data->bgioprio);
+
+		data->background = false;
 	}
 
-	return 0;
+	return true;
+#else
+	_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
+	return false;
+#endif
 }
 
 int _getthreadpriority( uintptr_t hndl )
 {
-	int rc, priority, policy;
+	int rc, priority = THREAD_PRIORITY_NORMAL, policy;
 	struct sched_param schprm;
-	pthread_t thr_id;
+	THREADOBJDATA *data;
 
 	if ( hndl == (uintptr_t)CURRENT_THREAD_HANDLE )
 		hndl = getcurrentthreadrealhandle ();
@@ -585,12 +1440,12 @@ int _getthreadpriority( uintptr_t hndl )
 		return THREAD_PRIORITY_ERROR_RETURN;
 	}
 
-	thr_id = *(pthread_t*)hndl;
+	data = getthreaddata( hndl );
 
-	rc = pthread_getschedparam( thr_id, &policy, &schprm );
+	rc = pthread_getschedparam( data->thread, &policy, &schprm );
 	if ( rc == 0 ) {
 		if (policy == SCHED_RR || policy == SCHED_FIFO) {
-			int min, max;
+			int min, max, step;
 
 			#ifdef __OpenBSD__
 			min = 0;	//PTHREAD_MIN_PRIORITY
@@ -599,27 +1454,32 @@ int _getthreadpriority( uintptr_t hndl )
 			min = sched_get_priority_min (policy);
 			max = sched_get_priority_max (policy);
 			#endif	//__OpenBSD__
-			//mid = ( max - min ) / 2 + min;
-
-			//TODO: implement this part
-			//case THREAD_PRIORITY_IDLE:          break;	//TODO: implement this
-			//case THREAD_PRIORITY_LOWEST:        prio = min; break;
-			//case THREAD_PRIORITY_BELOW_NORMAL:  prio = mid - ( (max-min)/4 + (((max-min)%4)/2) ); break;
-			//case THREAD_PRIORITY_NORMAL:        prio = mid; break;
-			//case THREAD_PRIORITY_ABOVE_NORMAL:  prio = mid + ( (max-min)/4 + (((max-min)%4)/2) ); break;
-			//case THREAD_PRIORITY_HIGHEST:       prio = min; break;
-			//case THREAD_PRIORITY_TIME_CRITICAL: break;	//TODO: implement this
 
-			/*
-			case THREAD_PRIORITY_TIME_CRITICAL: iRealPriority = max; break;
-			case THREAD_PRIORITY_HIGHEST:       iRealPriority = max - ((max-min)/3 + ((max-min)%3)/2); break;
-			case THREAD_PRIORITY_ABOVE_NORMAL:  iRealPriority = min + ((max-min)/3 + ((max-min)%3)/2); break;
-			case THREAD_PRIORITY_NORMAL:        iRealPriority = min; break;
-			default:                            iRealPriority = min; break; }
-			*/
-
-		} else
+			// inverse of the mapping in _setthreadpriority
+			step = (max-min)/3 + ((max-min)%3)/2;
+			if (schprm.sched_priority >= max)             priority = THREAD_PRIORITY_TIME_CRITICAL;
+			else if (schprm.sched_priority >= max - step) priority = THREAD_PRIORITY_HIGHEST;
+			else if (schprm.sched_priority >= min + step) priority = THREAD_PRIORITY_ABOVE_NORMAL;
+			else                                          priority = THREAD_PRIORITY_NORMAL;
+#ifdef SCHED_IDLE
+		} else if (policy == SCHED_IDLE) {
+			priority = THREAD_PRIORITY_IDLE;
+#endif
+		} else {
+#ifdef __linux__
+			// the nice value is per thread on Linux
+			int nice;
+
+			errno = 0;
+			nice = getpriority (PRIO_PROCESS, data->tid);
+			if (nice == -1 && errno != 0)
+				rc = errno;
+			else
+				priority = nicetopriority (nice);
+#else
 			priority = THREAD_PRIORITY_NORMAL;
+#endif
+		}
 	}
 
 	if ( rc != 0 ) {
@@ -632,7 +1492,8 @@ int _getthreadpriority( uintptr_t hndl )
 
 bool _setthreadpriority( uintptr_t hndl, int priority )
 {
-	int rc;
+	int rc, nice;
+	THREADOBJDATA *data;
 	pthread_t thr_id;
 
 	if ( hndl == (uintptr_t)CURRENT_THREAD_HANDLE )
@@ -643,7 +1504,16 @@ bool _setthreadpriority( uintptr_t hndl, int priority )
 		return false;
 	}
 
-	thr_id = *(pthread_t*)hndl;
+	data = getthreaddata( hndl );
+	thr_id = data->thread;
+
+	if ( priority == THREAD_MODE_BACKGROUND_BEGIN || priority == THREAD_MODE_BACKGROUND_END )
+		return setbackgroundmode (data, priority == THREAD_MODE_BACKGROUND_BEGIN);
+
+	if ( !prioritytonice (priority, &nice) ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
 
 	struct sched_param schprm;
 	int policy, iRealPriority;
@@ -663,21 +1533,6 @@ bool _setthreadpriority( uintptr_t hndl, int priority )
 			//mid = ( max - min ) / 2 + min;
 
 			switch (priority) {
-			//TODO: set proper priorities values bellow (THREAD_PRIORITY_IDLE, THREAD_PRIORITY_TIME_CRITICAL)
-			//TODO: implemnt these two priority flags
-			//THREAD_MODE_BACKGROUND_BEGIN
-			//THREAD_MODE_BACKGROUND_END
-			//case THREAD_PRIORITY_IDLE:          break;	//TODO: implement this
-			//case THREAD_PRIORITY_LOWEST:        prio = min; break;
-			//case THREAD_PRIORITY_BELOW_NORMAL:  prio = mid - ( (max-min)/4 + (((max-min)%4)/2) ); break;
-			//case THREAD_PRIORITY_NORMAL:        prio = mid; break;
-			//case THREAD_PRIORITY_ABOVE_NORMAL:   prio = mid + ( (max-min)/4 + (((max-min)%4)/2) ); break;
-			//case THREAD_PRIORITY_HIGHEST:       prio = min; break;
-			//case THREAD_PRIORITY_TIME_CRITICAL: break;	//TODO: implement this
-			//default:
-			//		_setlasterror( ERROR_INVALID_PARAMETER ); return FALSE;
-			//		break;
-				
 			case THREAD_PRIORITY_TIME_CRITICAL: iRealPriority = max; break;
 			case THREAD_PRIORITY_HIGHEST:       iRealPriority = max - ((max-min)/3 + ((max-min)%3)/2); break;
 			case THREAD_PRIORITY_ABOVE_NORMAL:  iRealPriority = min + ((max-min)/3 + ((max-min)%3)/2); break;
@@ -687,8 +1542,15 @@ bool _setthreadpriority( uintptr_t hndl, int priority )
 			schprm.sched_priority = iRealPriority;
 			rc = pthread_setschedparam (thr_id, policy, &schprm);
 		} else {
+#ifdef __linux__
+			// also for SCHED_IDLE, the nice value applies after THREAD_MODE_BACKGROUND_END;
+			// raising the priority needs CAP_SYS_NICE or RLIMIT_NICE
+			if (setpriority (PRIO_PROCESS, data->tid, nice) == -1)
+				rc = errno;
+#else
 			if (priority != THREAD_PRIORITY_NORMAL)
 				rc = ENOTSUP;
+#endif
 		}
 	}
 	if ( rc != 0 ) {
@@ -699,54 +1561,157 @@ bool _setthreadpriority( uintptr_t hndl, int priority )
 	return true;
 }
 
-DWORD_PTR _setthreadaffinitymask( uintptr_t hndl, DWORD_PTR dwThreadAffinityMask )
+#ifndef __MACH__
+// convert an affinity set to the group of its first processor
+static
+void cpuset_to_groupaffinity (const cpu_set_t *cs, size_t setsize, unsigned ncpus, GROUP_AFFINITY *affinity)
+{
+	unsigned cpu;
+	unsigned short group;
+	unsigned char bit;
+	bool found = false;
+
+	memset (affinity, 0, sizeof(GROUP_AFFINITY));
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		if (!CPU_ISSET_S(cpu, setsize, cs) || !_getcpugroup( cpu, &group, &bit ))
+			continue;
+		if (!found) {
+			affinity->Group = group;
+			found = true;
+		}
+		if (group == affinity->Group)
+			affinity->Mask |= (uintptr_t)1 << bit;
+	}
+}
+#endif  //__MACH__
+
+bool _getthreadgroupaffinity( uintptr_t hndl, GROUP_AFFINITY *affinity )
 {
-	DWORD_PTR affinitymask_prev = 0x0;
 #ifndef __MACH__
-	int rc, i;
-	int logical_cpus;
-	cpu_set_t cs, cs_prev;
+	int rc;
+	unsigned ncpus;
+	size_t setsize;
+	cpu_set_t *cs;
 
 	if ( hndl == (uintptr_t)CURRENT_THREAD_HANDLE )
 		hndl = getcurrentthreadrealhandle ();
 
 	if ( !isvalidthreadhandle( hndl ) ) {
 		_setlasterror( ERROR_INVALID_HANDLE );
-		return 0;
+		return false;
+	}
+	if ( !affinity ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
 	}
 
-	pthread_t thr_id = *(pthread_t*)hndl;
+	pthread_t thr_id = getthreaddata( hndl )->thread;
 
-	logical_cpus = sysconf (_SC_NPROCESSORS_ONLN);		//_CONF
+	ncpus = _getcputopologycount( );
+	cs = CPU_ALLOC (ncpus);
+	if ( !ncpus || !cs ) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return false;
+	}
+	setsize = CPU_ALLOC_SIZE (ncpus);
 
-	rc = pthread_getaffinity_np (thr_id, sizeof(cs_prev), &cs_prev);
+	rc = pthread_getaffinity_np (thr_id, setsize, cs);
 	if (rc != 0) {
+		CPU_FREE (cs);
 		_setlasterror( get_win_error (rc) );
-		return 0;
+		return false;
+	}
+
+	cpuset_to_groupaffinity (cs, setsize, ncpus, affinity);
+	CPU_FREE (cs);
+
+	return true;
+#else
+	_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
+	return false;
+#endif  //__MACH__
+}
+
+bool _setthreadgroupaffinity( uintptr_t hndl, const GROUP_AFFINITY *affinity, GROUP_AFFINITY *previous )
+{
+#ifndef __MACH__
+	int rc, cpu;
+	unsigned i, ncpus;
+	size_t setsize;
+	cpu_set_t *cs;
+
+	if ( hndl == (uintptr_t)CURRENT_THREAD_HANDLE )
+		hndl = getcurrentthreadrealhandle ();
+
+	if ( !isvalidthreadhandle( hndl ) ) {
+		_setlasterror( ERROR_INVALID_HANDLE );
+		return false;
+	}
+	if ( !affinity || !affinity->Mask || affinity->Group >= _getactiveprocessorgroupcount( ) ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	pthread_t thr_id = getthreaddata( hndl )->thread;
+
+	ncpus = _getcputopologycount( );
+	cs = CPU_ALLOC (ncpus);
+	if ( !ncpus || !cs ) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return false;
 	}
+	setsize = CPU_ALLOC_SIZE (ncpus);
 
-	CPU_ZERO(&cs_prev);
-	for (i = 0; i < logical_cpus && i < sizeof(DWORD_PTR); i++)
-	{
-		if (CPU_ISSET(i, &cs))
-			affinitymask_prev |= 0x1 << i;
+	if ( previous ) {
+		rc = pthread_getaffinity_np (thr_id, setsize, cs);
+		if (rc != 0) {
+			CPU_FREE (cs);
+			_setlasterror( get_win_error (rc) );
+			return false;
+		}
+		cpuset_to_groupaffinity (cs, setsize, ncpus, previous);
 	}
 
-	CPU_ZERO(&cs);
-	for (i = 0; i < logical_cpus && i < sizeof(DWORD_PTR); i++)
-	{
-		if (dwThreadAffinityMask >> i & 0x1)
-			CPU_SET(i, &cs);
+	CPU_ZERO_S(setsize, cs);
+	for (i = 0; i < 8*sizeof(affinity->Mask); i++) {
+		if ( !(affinity->Mask >> i & 0x1) )
+			continue;
+		cpu = _getgroupcpu( affinity->Group, (unsigned char)i );
+		if ( cpu < 0 ) {	//no such processor in the group
+			CPU_FREE (cs);
+			_setlasterror( ERROR_INVALID_PARAMETER );
+			return false;
+		}
+		CPU_SET_S(cpu, setsize, cs);
 	}
 
-	rc = pthread_setaffinity_np (thr_id, sizeof(cs), &cs);
+	rc = pthread_setaffinity_np (thr_id, setsize, cs);
+	CPU_FREE (cs);
 	if (rc != 0) {
 		_setlasterror( get_win_error (rc) );
-		return 0;
+		return false;
 	}
+
+	return true;
+#else
+	_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
+	return false;
 #endif  //__MACH__
+}
+
+DWORD_PTR _setthreadaffinitymask( uintptr_t hndl, DWORD_PTR dwThreadAffinityMask )
+{
+	// the legacy mask addresses processor group 0
+	GROUP_AFFINITY affinity, previous;
 
-	return affinitymask_prev;
+	memset (&affinity, 0, sizeof(affinity));
+	affinity.Mask  = dwThreadAffinityMask;
+	affinity.Group = 0;
+
+	if ( !_setthreadgroupaffinity( hndl, &affinity, &previous ) )
+		return 0;
+
+	return (DWORD_PTR)previous.Mask;
 }
 
 bool _getthreadtimes( uintptr_t hndl, LPFILETIME creationtime,
@@ -764,7 +1729,7 @@ bool _getthreadtimes( uintptr_t hndl, LPFILETIME creationtime,
 		return false;
 	}
 
-	thr_id = *(pthread_t*)hndl;
+	thr_id = getthreaddata( hndl )->thread;
 
 #ifdef __MACH__
 	kern_return_t kr;
@@ -788,29 +1753,13 @@ bool _getthreadtimes( uintptr_t hndl, LPFILETIME creationtime,
 	free (thinfo);
 #else
 	THREADOBJDATA *data;
-	data = (THREADOBJDATA*)_gethandledata( hndl, NULL );
+	data = getthreaddata( hndl );
 	ct = data->creationtime;
-	//TODO: finish this part
-	if ( data->exitcode == STILL_ACTIVE ) {
-		int rc;
-		/*clockid_t clk;
-		struct timespec ts;
+	if ( !data->exited ) {
+		struct timeval utime, stime;
 
-		rc = pthread_getcpuclockid (thr_id, &clk);
-		if ( rc == 0 ) {
-			rc = clock_gettime (clk, &ts);
-			if ( rc == 0 )
-				timespec_to_FILETIME( &ts, &ut );
-		}*/
 		if (pthread_equal (pthread_self(), thr_id)) {
-			struct rusage ru;
-
-			//TODO: pouzit i pro aktivni proces
-			rc = getrusage (RUSAGE_THREAD, &ru);
-			if (rc == 0) {
-				timeval_to_FILETIME( &ru.ru_stime, &kt);	//kernel time (seconds + microseconds)
-				timeval_to_FILETIME( &ru.ru_utime, &ut);	//user time (seconds + microseconds)
-			}
+			getthreadcputimes (&utime, &stime);
 		} else {
 			char procFilename[64], buffer[1024];
 			pid_t pid, tid;
@@ -826,8 +1775,12 @@ bool _getthreadtimes( uintptr_t hndl, LPFILETIME creationtime,
 				return false;
 			}
 
-			num_read = read (fd, buffer, sizeof(buffer-1));
+			num_read = read (fd, buffer, sizeof(buffer)-1);
 			close (fd);
+			if (num_read <= 0) {
+				_setlasterror( get_win_error (errno) );
+				return false;
+			}
 			buffer[num_read] = '\0';
 
 			char* ptrUsr = strrchr (buffer, ')') + 1;
@@ -841,11 +1794,22 @@ bool _getthreadtimes( uintptr_t hndl, LPFILETIME creationtime,
 			jiffies_to_timespec (jiffies_user, &ts_usr);
 			jiffies_to_timespec (jiffies_sys, &ts_sys);
 
-			timespec_to_FILETIME (&ts_usr, &ut);
-			timespec_to_FILETIME (&ts_sys, &kt);
+			TIMESPEC_TO_TIMEVAL (&utime, &ts_usr);
+			TIMESPEC_TO_TIMEVAL (&stime, &ts_sys);
 		}
+
+		// only the time of this thread object
+		timersub (&utime, &data->startutime, &utime);
+		timersub (&stime, &data->startstime, &stime);
+		if (utime.tv_sec < 0) timerclear (&utime);
+		if (stime.tv_sec < 0) timerclear (&stime);
+		timeval_to_FILETIME( &utime, &ut );
+		timeval_to_FILETIME( &stime, &kt );
 	} else {
+		__sync_synchronize ();	//the times are set before exited
 		et = data->exittime;
+		ut = data->usertime;
+		kt = data->kerneltime;
 	}
 #endif
 
@@ -867,10 +1831,7 @@ unsigned _getthreadid( uintptr_t hndl )
 		return 0;
 	}
 
-	THREADOBJDATA *data;
-	data = (THREADOBJDATA*)_gethandledata( hndl, NULL );
-
-	return data->tid;
+	return getthreaddata( hndl )->tid;
 }
 
 bool _switchtothread( void )
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * toolhelp.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+//#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+//#endif	//HAVE_UNISTD_H
+#include <sys/types.h>
+
+#include "windows.h"
+#include "object.h"
+#include "toolhelp.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern unsigned get_win_error( int err );
+extern unsigned _getthreadindexids( unsigned *tids, unsigned count );
+
+
+#define SNAPSHOTOBJID		32
+
+#define THREADBASEPRIORITY	8		//THREAD_PRIORITY_NORMAL in NORMAL_PRIORITY_CLASS
+
+static bool _closesnapshothandle( uintptr_t hndl );
+
+static TYPEOBJITEM snapshotkrnlobj =
+{
+	SNAPSHOTOBJID, false,
+	_closesnapshothandle,
+	NULL,   //_duplicatesnapshothandle,
+	NULL,   //_gethandleinformation,
+	NULL,   //_sethandleinformation,
+	NULL    //not waitable
+};
+
+// the state of the system at the time of the snapshot
+typedef struct SNAPSHOT_ {
+	unsigned nthreads;
+	unsigned threadpos;		//next entry of _thread32next
+	unsigned *tids;
+} SNAPSHOT;
+
+
+static
+SNAPSHOT* getsnapshot (uintptr_t hndl)
+{
+	if ( _gethandletypeid( hndl ) != SNAPSHOTOBJID ) {
+		_setlasterror( ERROR_INVALID_HANDLE );
+		return NULL;
+	}
+	return *(SNAPSHOT**)hndl;
+}
+
+static
+void freesnapshot (SNAPSHOT *snapshot)
+{
+	free (snapshot->tids);
+	free (snapshot);
+}
+
+static
+bool snapthreads (SNAPSHOT *snapshot)
+{
+	unsigned count = 0, n;
+
+	// the thread index of the library, threads can start between the two calls
+	do {
+		count = _getthreadindexids( NULL, 0 ) + 16;
+		free (snapshot->tids);
+		snapshot->tids = (unsigned*) malloc (count * sizeof(unsigned));
+		if ( !snapshot->tids ) {
+			_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+			return false;
+		}
+		n = _getthreadindexids( snapshot->tids, count );
+	} while ( n > count );
+
+	snapshot->nthreads = n;
+	return true;
+}
+
+uintptr_t _createtoolhelp32snapshot( unsigned flags, unsigned pid )
+{
+	SNAPSHOT *snapshot;
+	uintptr_t hndl;
+
+	// the thread snapshot ignores pid as on Windows, but only threads of the calling
+	// process are known to the library
+	if ( flags & (TH32CS_SNAPHEAPLIST|TH32CS_SNAPPROCESS|TH32CS_SNAPMODULE|TH32CS_SNAPMODULE32) ) {
+		_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+
+	snapshot = (SNAPSHOT*) calloc (1, sizeof(SNAPSHOT));
+	if ( !snapshot ) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+
+	if ( (flags & TH32CS_SNAPTHREAD) && !snapthreads (snapshot) ) {
+		freesnapshot (snapshot);
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+
+	hndl = _createhandle (-1, 0, &snapshotkrnlobj, &snapshot, sizeof(void*), NULL, 0);
+	if ( !hndl ) {
+		_setlasterror( get_win_error (errno) );
+		freesnapshot (snapshot);
+		return (uintptr_t)INVALID_HANDLE_VALUE;
+	}
+
+	return hndl;
+}
+
+static
+bool _closesnapshothandle( uintptr_t hndl )
+{
+	unsigned int *refcount;
+
+	_gethandledata (hndl, &refcount);
+	if (*refcount <= 1)
+		freesnapshot (*(SNAPSHOT**)hndl);
+
+	return true;
+}
+
+bool _thread32next( uintptr_t hndl, THREADENTRY32 *entry )
+{
+	SNAPSHOT *snapshot;
+
+	if ( !(snapshot = getsnapshot (hndl)) )
+		return false;
+
+	if ( !entry || entry->dwSize < sizeof(THREADENTRY32) ) {
+		_setlasterror( ERROR_BAD_LENGTH );
+		return false;
+	}
+	if ( snapshot->threadpos >= snapshot->nthreads ) {
+		_setlasterror( ERROR_NO_MORE_FILES );
+		return false;
+	}
+
+	entry->cntUsage           = 0;
+	entry->th32ThreadID       = snapshot->tids[snapshot->threadpos++];
+	entry->th32OwnerProcessID = (unsigned)getpid ();
+	entry->tpBasePri          = THREADBASEPRIORITY;
+	entry->tpDeltaPri         = 0;
+	entry->dwFlags            = 0;
+
+	return true;
+}
+
+bool _thread32first( uintptr_t hndl, THREADENTRY32 *entry )
+{
+	SNAPSHOT *snapshot;
+
+	if ( !(snapshot = getsnapshot (hndl)) )
+		return false;
+
+	snapshot->threadpos = 0;
+	return _thread32next( hndl, entry );
+}
@@ -0,0 +1,541 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * virtual.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#if defined __linux__ && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <search.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+//#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+//#endif	//HAVE_UNISTD_H
+
+#include "windows.h"
+#include "virtmem.h"
+#include "numa.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern unsigned get_win_error( int err );
+extern uintptr_t _getcurrentprocess( );
+extern int _numabindmemory( void *addr, size_t len, unsigned node, bool move );
+
+
+#define ALLOCATION_GRANULARITY	0x10000		//reservations start at 64K boundaries as on Windows
+
+#ifndef MAP_NORESERVE
+# define MAP_NORESERVE	0
+#endif
+
+
+// a reserved range of the address space
+typedef struct VMREGION_ {
+	uintptr_t base;
+	size_t size;
+	size_t npages;
+	unsigned allocprotect;
+	unsigned type;				//MEM_LARGE_PAGES
+	unsigned node;				//preferred NUMA node or NUMA_NO_PREFERRED_NODE
+	unsigned short *pagestate;	//protection of every committed page, 0 if the page is reserved only
+} VMREGION;
+
+static void *vmregions = NULL;		//tsearch() tree of VMREGION items ordered by address
+static pthread_rwlock_t vmlock = PTHREAD_RWLOCK_INITIALIZER;
+static size_t vmpagesize = 0;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static
+int cmpregion (const void *a, const void *b)
+{
+	const VMREGION *ra = (const VMREGION*)a;
+	const VMREGION *rb = (const VMREGION*)b;
+
+	if (ra->base + ra->size <= rb->base) return -1;
+	if (rb->base + rb->size <= ra->base) return 1;
+	return 0;	//overlapping ranges are equal, so an address finds its region
+}
+
+static
+VMREGION* findregion (uintptr_t addr)
+{
+	VMREGION key, **prgn;
+
+	key.base = addr;
+	key.size = 1;
+	prgn = (VMREGION**)tfind (&key, &vmregions, cmpregion);
+	return (prgn ? *prgn : NULL);
+}
+
+static __thread uintptr_t walkaddr, walknext;
+
+static
+void findnextregion (const void *node, VISIT which, int depth)
+{
+	const VMREGION *rgn = *(const VMREGION**)node;
+
+	if (which != postorder && which != leaf)
+		return;
+	if (rgn->base > walkaddr && (walknext == 0 || rgn->base < walknext))
+		walknext = rgn->base;
+}
+
+static
+int protect_to_prot (unsigned protect, int *prot)
+{
+	switch (protect & ~(PAGE_GUARD|PAGE_NOCACHE|PAGE_WRITECOMBINE)) {
+	case PAGE_NOACCESS:          *prot = PROT_NONE; break;
+	case PAGE_READONLY:          *prot = PROT_READ; break;
+	case PAGE_READWRITE:
+	case PAGE_WRITECOPY:         *prot = PROT_READ|PROT_WRITE; break;
+	case PAGE_EXECUTE:           *prot = PROT_EXEC; break;
+	case PAGE_EXECUTE_READ:      *prot = PROT_READ|PROT_EXEC; break;
+	case PAGE_EXECUTE_READWRITE:
+	case PAGE_EXECUTE_WRITECOPY: *prot = PROT_READ|PROT_WRITE|PROT_EXEC; break;
+	default: return -1; }
+
+	//NOTE: guard pages are only inaccessible, the one-shot guard exception is not emulated
+	if (protect & PAGE_GUARD) *prot = PROT_NONE;
+	return 0;
+}
+
+size_t _getlargepageminimum( void )
+{
+	static size_t largepage = (size_t)-1;
+
+	if (largepage == (size_t)-1) {
+		size_t size = 0;
+#ifdef __linux__
+		FILE *fp;
+		char line[128];
+		unsigned long kb;
+
+		fp = fopen ("/proc/meminfo", "r");
+		if (fp) {
+			while (fgets (line, sizeof(line), fp)) {
+				if (sscanf (line, "Hugepagesize: %lu kB", &kb) == 1) {
+					size = (size_t)kb * 1024;
+					break;
+				}
+			}
+			fclose (fp);
+		}
+#endif
+		largepage = size;
+	}
+
+	return largepage;
+}
+
+static
+void* mapaligned (void *addr, size_t size, size_t align, int prot, int flags)
+{
+	void *p;
+	uintptr_t start, aligned;
+	size_t extra;
+
+	if (addr) {
+#ifdef MAP_FIXED_NOREPLACE
+		flags |= MAP_FIXED_NOREPLACE;
+#endif
+		p = mmap (addr, size, prot, flags, -1, 0);
+		if (p != MAP_FAILED && p != addr) {
+			munmap (p, size);	//the hint was not honoured
+			errno = EADDRINUSE;
+			return MAP_FAILED;
+		}
+		return p;
+	}
+
+	// map a bit more and trim the unaligned head and tail
+	extra = align - vmpagesize;
+	p = mmap (NULL, size + extra, prot, flags, -1, 0);
+	if (p == MAP_FAILED)
+		return p;
+
+	start = (uintptr_t)p;
+	aligned = (start + align - 1) & ~(uintptr_t)(align - 1);
+	if (aligned > start)
+		munmap (p, aligned - start);
+	if (extra > aligned - start)
+		munmap ((void*)(aligned + size), extra - (aligned - start));
+
+	return (void*)aligned;
+}
+
+static
+int commitpages (VMREGION *rgn, size_t first, size_t count, unsigned protect, int prot)
+{
+	size_t i, j, end = first + count;
+
+	for (i = first; i < end; i = j) {
+		bool committed = (rgn->pagestate[i] != 0);
+		void *p = (void*)(rgn->base + i * vmpagesize);
+
+		for (j = i; j < end && (rgn->pagestate[j] != 0) == committed; j++)
+			;
+
+		if (committed) {
+			if (mprotect (p, (j - i) * vmpagesize, prot) == -1)
+				return -1;
+		} else {
+			// remapping without MAP_NORESERVE charges the pages against the commit limit
+			if (mmap (p, (j - i) * vmpagesize, prot, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) == MAP_FAILED)
+				return -1;
+			// the new mapping has lost the memory policy of the reservation
+			if (rgn->node != NUMA_NO_PREFERRED_NODE)
+				_numabindmemory( p, (j - i) * vmpagesize, rgn->node, false );
+		}
+	}
+
+	for (i = first; i < end; i++)
+		rgn->pagestate[i] = (unsigned short)protect;
+	return 0;
+}
+
+static
+VMREGION* reserveregion (void *addr, size_t size, unsigned type, unsigned protect, int prot, unsigned node)
+{
+	VMREGION *rgn;
+	void *p = MAP_FAILED;
+	int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+	size_t i;
+
+	rgn = (VMREGION*)malloc (sizeof(VMREGION));
+	if (!rgn)
+		return NULL;
+
+	if (type & MEM_LARGE_PAGES) {
+#ifdef MAP_HUGETLB
+		p = mmap (addr, size, prot, flags|MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED && addr && p != addr) {
+			munmap (p, size);
+			p = MAP_FAILED;
+		}
+#endif
+		if (p == MAP_FAILED) {
+			// no reserved huge pages, fall back to transparent huge pages
+			p = mapaligned (addr, size, _getlargepageminimum( ), prot, flags);
+#ifdef MADV_HUGEPAGE
+			if (p != MAP_FAILED)
+				madvise (p, size, MADV_HUGEPAGE);
+#endif
+		}
+	} else if (type & MEM_COMMIT)
+		p = mapaligned (addr, size, ALLOCATION_GRANULARITY, prot, flags);
+	else
+		p = mapaligned (addr, size, ALLOCATION_GRANULARITY, PROT_NONE, flags|MAP_NORESERVE);
+
+	if (p == MAP_FAILED) {
+		free (rgn);
+		return NULL;
+	}
+
+	rgn->base = (uintptr_t)p;
+	rgn->size = size;
+	rgn->npages = size / vmpagesize;
+	rgn->allocprotect = protect;
+	rgn->type = type & MEM_LARGE_PAGES;
+	rgn->node = node;
+
+	// the policy is set before the first touch, a failure leaves the default placement
+	if (node != NUMA_NO_PREFERRED_NODE)
+		_numabindmemory( p, size, node, false );
+
+	// page states are touched lazily, untouched entries cost nothing
+	rgn->pagestate = (unsigned short*)mmap (NULL, rgn->npages * sizeof(unsigned short),
+	                                        PROT_READ|PROT_WRITE, flags|MAP_NORESERVE, -1, 0);
+	if (rgn->pagestate == MAP_FAILED) {
+		munmap (p, size);
+		free (rgn);
+		return NULL;
+	}
+
+	if (type & MEM_COMMIT) {
+		for (i = 0; i < rgn->npages; i++)
+			rgn->pagestate[i] = (unsigned short)protect;
+	}
+
+	if (!tsearch (rgn, &vmregions, cmpregion)) {
+		munmap ((void*)rgn->pagestate, rgn->npages * sizeof(unsigned short));
+		munmap (p, size);
+		free (rgn);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return rgn;
+}
+
+static
+void* virtualalloc (void *addr, size_t size, unsigned type, unsigned protect, unsigned node)
+{
+	int prot;
+	uintptr_t start, end;
+	VMREGION *rgn;
+	void *res = NULL;
+
+	if (!vmpagesize) vmpagesize = getpagesize ();
+
+	if ( size == 0 || protect_to_prot( protect, &prot ) != 0 ||
+	     !(type & (MEM_COMMIT|MEM_RESERVE|MEM_RESET)) ||
+	     ((type & MEM_RESET) && (type & (MEM_COMMIT|MEM_RESERVE))) ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return NULL;
+	}
+
+	// a commit without an address reserves the region too
+	if ( !addr && (type & MEM_COMMIT) )
+		type |= MEM_RESERVE;
+
+	if ( type & MEM_LARGE_PAGES ) {
+		size_t largepage = _getlargepageminimum( );
+
+		//NOTE: large pages must be reserved and committed at once
+		if ( !largepage || (size % largepage) || ((uintptr_t)addr % largepage) ||
+		     (type & (MEM_COMMIT|MEM_RESERVE)) != (MEM_COMMIT|MEM_RESERVE) ) {
+			_setlasterror( ERROR_INVALID_PARAMETER );
+			return NULL;
+		}
+	}
+
+	if ( type & MEM_RESERVE ) {
+		start = (uintptr_t)addr & ~(uintptr_t)(ALLOCATION_GRANULARITY - 1);
+		end = ((uintptr_t)addr + size + vmpagesize - 1) & ~(uintptr_t)(vmpagesize - 1);
+	} else {
+		start = (uintptr_t)addr & ~(uintptr_t)(vmpagesize - 1);
+		end = ((uintptr_t)addr + size + vmpagesize - 1) & ~(uintptr_t)(vmpagesize - 1);
+	}
+
+	pthread_rwlock_wrlock (&vmlock);
+
+	if ( type & MEM_RESERVE ) {
+		rgn = reserveregion ((void*)start, end - start, type, protect, prot, node);
+		if (!rgn)
+			_setlasterror( errno == EEXIST || errno == EADDRINUSE ? ERROR_INVALID_ADDRESS : get_win_error (errno) );
+		else
+			res = (void*)rgn->base;
+	} else {
+		// commit or reset pages inside an existing reservation
+		rgn = (addr ? findregion (start) : NULL);
+		if ( !rgn || end > rgn->base + rgn->size ) {
+			_setlasterror( ERROR_INVALID_ADDRESS );
+		} else if ( type & MEM_RESET ) {
+#ifdef MADV_FREE
+			madvise ((void*)start, end - start, MADV_FREE);
+#else
+			madvise ((void*)start, end - start, MADV_DONTNEED);
+#endif
+			res = addr;
+		} else {
+			size_t first = (start - rgn->base) / vmpagesize;
+
+			if ( commitpages (rgn, first, (end - start) / vmpagesize, protect, prot) != 0 )
+				_setlasterror( errno == ENOMEM ? ERROR_NOT_ENOUGH_MEMORY : get_win_error (errno) );
+			else
+				res = (void*)start;
+		}
+	}
+
+	pthread_rwlock_unlock (&vmlock);
+
+	return res;
+}
+
+void* _virtualalloc( void *addr, size_t size, unsigned type, unsigned protect )
+{
+	return virtualalloc (addr, size, type, protect, NUMA_NO_PREFERRED_NODE);
+}
+
+void* _virtualallocexnuma( uintptr_t hProcess, void *addr, size_t size, unsigned type, unsigned protect, unsigned node )
+{
+	if ( hProcess != _getcurrentprocess( ) ) {
+		_setlasterror( ERROR_CALL_NOT_IMPLEMENTED );
+		return NULL;
+	}
+
+	return virtualalloc (addr, size, type, protect, node);
+}
+
+bool _virtualfree( void *addr, size_t size, unsigned type )
+{
+	VMREGION *rgn;
+	bool res = false;
+
+	if ( !addr || (type != MEM_RELEASE && type != MEM_DECOMMIT) ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	if (!vmpagesize) vmpagesize = getpagesize ();
+
+	pthread_rwlock_wrlock (&vmlock);
+
+	rgn = findregion ((uintptr_t)addr);
+	if ( !rgn ) {
+		_setlasterror( ERROR_INVALID_ADDRESS );
+	} else if ( type == MEM_RELEASE ) {
+		if ( size != 0 || (uintptr_t)addr != rgn->base ) {
+			_setlasterror( ERROR_INVALID_PARAMETER );
+		} else {
+			tdelete (rgn, &vmregions, cmpregion);
+			munmap ((void*)rgn->base, rgn->size);
+			munmap ((void*)rgn->pagestate, rgn->npages * sizeof(unsigned short));
+			free (rgn);
+			res = true;
+		}
+	} else {
+		uintptr_t start, end;
+
+		start = (uintptr_t)addr & ~(uintptr_t)(vmpagesize - 1);
+		if ( size == 0 && start == rgn->base )
+			end = rgn->base + rgn->size;
+		else
+			end = ((uintptr_t)addr + size + vmpagesize - 1) & ~(uintptr_t)(vmpagesize - 1);
+
+		if ( size == 0 && start != rgn->base ) {
+			_setlasterror( ERROR_INVALID_PARAMETER );
+		} else if ( end > rgn->base + rgn->size ) {
+			_setlasterror( ERROR_INVALID_ADDRESS );
+		} else if ( madvise ((void*)start, end - start, MADV_DONTNEED) == -1 ||
+		            mprotect ((void*)start, end - start, PROT_NONE) == -1 ) {
+			_setlasterror( get_win_error (errno) );
+		} else {
+			memset (rgn->pagestate + (start - rgn->base) / vmpagesize, 0,
+			        (end - start) / vmpagesize * sizeof(unsigned short));
+			res = true;
+		}
+	}
+
+	pthread_rwlock_unlock (&vmlock);
+
+	return res;
+}
+
+bool _virtualprotect( void *addr, size_t size, unsigned newprotect, unsigned *oldprotect )
+{
+	int prot;
+	VMREGION *rgn;
+	uintptr_t start, end;
+	size_t i, first, last;
+	bool res = false;
+
+	if ( !addr || size == 0 || !oldprotect || protect_to_prot( newprotect, &prot ) != 0 ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	if (!vmpagesize) vmpagesize = getpagesize ();
+
+	start = (uintptr_t)addr & ~(uintptr_t)(vmpagesize - 1);
+	end = ((uintptr_t)addr + size + vmpagesize - 1) & ~(uintptr_t)(vmpagesize - 1);
+
+	pthread_rwlock_wrlock (&vmlock);
+
+	rgn = findregion (start);
+	if ( !rgn || end > rgn->base + rgn->size ) {
+		_setlasterror( ERROR_INVALID_ADDRESS );
+		goto unlock;
+	}
+
+	first = (start - rgn->base) / vmpagesize;
+	last = (end - rgn->base) / vmpagesize;
+	for (i = first; i < last; i++) {
+		if ( rgn->pagestate[i] == 0 ) {		//all pages must be committed
+			_setlasterror( ERROR_INVALID_ADDRESS );
+			goto unlock;
+		}
+	}
+
+	if ( mprotect ((void*)start, end - start, prot) == -1 ) {
+		_setlasterror( get_win_error (errno) );
+		goto unlock;
+	}
+
+	*oldprotect = rgn->pagestate[first];
+	for (i = first; i < last; i++)
+		rgn->pagestate[i] = (unsigned short)newprotect;
+	res = true;
+
+unlock:
+	pthread_rwlock_unlock (&vmlock);
+	return res;
+}
+
+size_t _virtualquery( const void *addr, MEMORY_BASIC_INFORMATION *info, size_t len )
+{
+	//NOTE: only the memory allocated by _virtualalloc is known, other mappings are reported as free
+
+	VMREGION *rgn;
+	uintptr_t page;
+
+	if ( !info || len < sizeof(MEMORY_BASIC_INFORMATION) ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return 0;
+	}
+
+	if (!vmpagesize) vmpagesize = getpagesize ();
+
+	page = (uintptr_t)addr & ~(uintptr_t)(vmpagesize - 1);
+
+	pthread_rwlock_rdlock (&vmlock);
+
+	rgn = findregion (page);
+	if ( rgn ) {
+		size_t i, j;
+		unsigned short state;
+
+		i = (page - rgn->base) / vmpagesize;
+		state = rgn->pagestate[i];
+		for (j = i + 1; j < rgn->npages && rgn->pagestate[j] == state; j++)
+			;
+
+		info->BaseAddress       = (void*)page;
+		info->AllocationBase    = (void*)rgn->base;
+		info->AllocationProtect = rgn->allocprotect;
+		info->RegionSize        = (j - i) * vmpagesize;
+		info->State             = (state ? MEM_COMMIT : MEM_RESERVE);
+		info->Protect           = state;
+		info->Type              = MEM_PRIVATE;
+	} else {
+		// the free range ends at the next reservation
+		walkaddr = page;
+		walknext = 0;
+		twalk (vmregions, findnextregion);
+
+		info->BaseAddress       = (void*)page;
+		info->AllocationBase    = NULL;
+		info->AllocationProtect = 0;
+		info->RegionSize        = (walknext ? walknext - page : vmpagesize);
+		info->State             = MEM_FREE;
+		info->Protect           = PAGE_NOACCESS;
+		info->Type              = 0;
+	}
+
+	pthread_rwlock_unlock (&vmlock);
+
+	return sizeof(MEMORY_BASIC_INFORMATION);
+}
+
+#ifdef __cplusplus
+}
+#endif
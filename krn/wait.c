@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * wait.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#include <stdlib.h>
+#include <errno.h>
+//#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+//#endif	//HAVE_UNISTD_H
+#include <sys/types.h>
+
+#include "windows.h"
+#include "object.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern bool _releasemutex( uintptr_t hndl );
+extern unsigned _waitforsinglemutexobject( uintptr_t hndl, unsigned milliseconds );
+extern bool _releasesemaphore( uintptr_t hndl, LONG count, LONG *previous );
+extern unsigned _waitforsinglesemaphoreobjectex( uintptr_t hndl, unsigned milliseconds, unsigned spin );
+extern void _reservesemaphore( uintptr_t hndl );
+extern void _unreservesemaphore( uintptr_t hndl );
+extern unsigned _waitforreservedsemaphoreobject( uintptr_t hndl, unsigned milliseconds, unsigned spin );
+extern unsigned _waitforsinglethreadobject( uintptr_t hndl, unsigned milliseconds );
+extern unsigned _waitforsingleprocessobject( uintptr_t hndl, unsigned milliseconds );
+
+
+#define PROCESSOBJID		2
+#define THREADOBJID			4
+#define SEMAPHOREOBJID		6
+#define MUTEXOBJID			8
+
+// polls of the wait semaphore after the signal, the woken thread usually answers
+// within a few microseconds and sleeping in the kernel would cost two context switches
+#define SIGNALANDWAITSPIN	2000
+
+static unsigned handoffspin = (unsigned)-1;
+
+static
+unsigned gethandoffspin (void)
+{
+	if (handoffspin == (unsigned)-1)	//no use to spin on a single cpu
+		handoffspin = (sysconf (_SC_NPROCESSORS_ONLN) > 1 ? SIGNALANDWAITSPIN : 0);
+	return handoffspin;
+}
+
+// waits on a mutex, semaphore, thread or process object
+unsigned _waitforsingleobject( uintptr_t hndl, unsigned milliseconds )
+{
+	switch (_gethandletypeid( hndl )) {
+	case SEMAPHOREOBJID:
+		return _waitforsinglesemaphoreobjectex( hndl, milliseconds, 0 );
+	case MUTEXOBJID:
+		return _waitforsinglemutexobject( hndl, milliseconds );
+	case THREADOBJID:
+		return _waitforsinglethreadobject( hndl, milliseconds );
+	case PROCESSOBJID:
+		return _waitforsingleprocessobject( hndl, milliseconds );
+	}
+
+	_setlasterror( ERROR_INVALID_HANDLE );
+	return WAIT_FAILED;
+}
+
+// alertable waits are not supported, there are no APCs
+// a wait semaphore registers the caller before the signal, the thread woken by the signal
+// cannot take the release the caller waits for; a mutex is a pthread mutex without a queue
+// of its own and a thread or process stays signalled, both are waited for after the signal
+unsigned _signalobjectandwait( uintptr_t signal, uintptr_t wait, unsigned milliseconds, bool alertable )
+{
+	int signaltype, waittype;
+	bool signalled = false;
+
+	signaltype = _gethandletypeid( signal );
+	waittype   = _gethandletypeid( wait );
+
+	if ( (signaltype != MUTEXOBJID && signaltype != SEMAPHOREOBJID) ||
+		 (waittype != MUTEXOBJID && waittype != SEMAPHOREOBJID && waittype != THREADOBJID && waittype != PROCESSOBJID) ) {
+		_setlasterror( ERROR_INVALID_HANDLE );
+		return WAIT_FAILED;
+	}
+
+	if ( waittype == SEMAPHOREOBJID )
+		_reservesemaphore( wait );
+
+	switch (signaltype) {
+	case MUTEXOBJID:
+		signalled = _releasemutex( signal );
+		break;
+	case SEMAPHOREOBJID:
+		signalled = _releasesemaphore( signal, 1, NULL );
+		break;
+	}
+
+	if ( !signalled ) {
+		if ( waittype == SEMAPHOREOBJID )
+			_unreservesemaphore( wait );
+		return WAIT_FAILED;
+	}
+
+	switch (waittype) {
+	case SEMAPHOREOBJID:
+		return _waitforreservedsemaphoreobject( wait, milliseconds, (milliseconds ? gethandoffspin () : 0) );
+	default:
+		return _waitforsingleobject( wait, milliseconds );
+	}
+}
@@ -0,0 +1,437 @@
+/*
+ * Copyright (C) 2015 Frantisek Mensik
+ * waitpool.c is part of the 4nix.org project.
+ *
+ * This file is licensed under the GNU Lesser General Public License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif	//HAVE_CONFIG_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "windows.h"
+#include "object.h"
+#include "futex.h"
+#include "waitpool.h"
+
+
+// depends on these functions:
+extern void _setlasterror( unsigned err );
+extern unsigned get_win_error( int err );
+extern bool _closehandle( uintptr_t hndl );
+extern unsigned _waitforsingleobject( uintptr_t hndl, unsigned milliseconds );
+extern uintptr_t _createthread( SECURITY_ATTRIBUTES *sa, size_t stack,
+                                LPTHREAD_START_ROUTINE start, void *param,
+                                unsigned flags, unsigned *id );
+extern void _getmonotonicdeadline( unsigned milliseconds, struct timespec *abstime );
+extern bool _getmonotonictimeout( const struct timespec *abstime, struct timespec *timeout );
+
+
+/*
+ * Registered waits are multiplexed on wait threads, each one serves up to
+ * MAXIMUM_WAIT_OBJECTS-1 registrations and sleeps on its own futex word.
+ * The objects do not know their waiters, so the release paths of mutexes,
+ * semaphores and threads call _signalwaitobject(key) which looks the key up
+ * in a hash of registrations and wakes the wait threads concerned. A woken
+ * wait thread polls the signalled objects through their TYPEOBJITEM wait
+ * callback with a zero timeout, which also acquires them.
+ */
+
+#define WAITTHREADCAPACITY	(MAXIMUM_WAIT_OBJECTS - 1)
+#define WAITBUCKETS			1024		//power of two
+
+#define WAITREGACTIVE		0
+#define WAITREGDONE			1		//WT_EXECUTEONLYONCE fired
+#define WAITREGCANCELLED	2		//unregistered
+
+typedef struct WAITTHREAD_ WAITTHREAD;
+
+typedef struct WAITREG_ {
+	struct WAITREG_ *bucketnext;
+	WAITTHREAD *waiter;
+	uintptr_t object;
+	void *key;				//what the object's release path signals
+	WAITORTIMERCALLBACK callback;
+	void *context;
+	unsigned milliseconds;
+	unsigned flags;
+	struct timespec deadline;
+	volatile int signaled;
+	volatile int state;
+	volatile int running;	//callbacks in progress, futex
+	volatile int refcount;	//caller, wait thread, callbacks
+	bool inbucket;
+} WAITREG;
+
+struct WAITTHREAD_ {
+	WAITTHREAD *next;
+	volatile int wakeup;	//futex, bumped by signals and changes
+	pthread_mutex_t lock;	//guards regs and count
+	unsigned count;
+	WAITREG *regs[WAITTHREADCAPACITY];
+};
+
+typedef struct WAITBUCKET_ {
+	pthread_mutex_t lock;
+	WAITREG *head;
+} WAITBUCKET;
+
+static pthread_mutex_t waitpoollock = PTHREAD_MUTEX_INITIALIZER;
+static WAITTHREAD *waitthreads;
+static WAITBUCKET waitbuckets[WAITBUCKETS];
+static pthread_once_t waitbucketsonce = PTHREAD_ONCE_INIT;
+static volatile int registeredwaits;
+
+static __thread WAITREG *currentwaitreg;	//the registration whose callback runs here
+
+
+static
+void initwaitbuckets (void)
+{
+	int i;
+
+	for (i = 0; i < WAITBUCKETS; i++)
+		pthread_mutex_init (&waitbuckets[i].lock, NULL);
+}
+
+static inline
+WAITBUCKET* getwaitbucket (void *key)
+{
+	uintptr_t h = (uintptr_t)key;
+
+	h ^= h >> 17;
+	h *= 0x9E3779B1u;
+	return &waitbuckets[(h >> 7) & (WAITBUCKETS - 1)];
+}
+
+static
+void addtobucket (WAITREG *reg)
+{
+	WAITBUCKET *bucket = getwaitbucket (reg->key);
+
+	pthread_mutex_lock (&bucket->lock);
+	reg->bucketnext = bucket->head;
+	bucket->head = reg;
+	reg->inbucket = true;
+	pthread_mutex_unlock (&bucket->lock);
+}
+
+static
+void removefrombucket (WAITREG *reg)
+{
+	WAITREG **link;
+	WAITBUCKET *bucket = getwaitbucket (reg->key);
+
+	pthread_mutex_lock (&bucket->lock);
+	if (reg->inbucket) {
+		for (link = &bucket->head; *link; link = &(*link)->bucketnext)
+			if (*link == reg) {
+				*link = reg->bucketnext;
+				break;
+			}
+		reg->inbucket = false;
+	}
+	pthread_mutex_unlock (&bucket->lock);
+}
+
+static inline
+void wakewaitthread (WAITTHREAD *waiter)
+{
+	__sync_add_and_fetch (&waiter->wakeup, 1);
+	futex_wake (&waiter->wakeup, 1);
+}
+
+static
+void releasewaitreg (WAITREG *reg)
+{
+	if (__sync_sub_and_fetch (&reg->refcount, 1) == 0)
+		free (reg);
+}
+
+// called by the release paths of waitable objects
+void _signalwaitobject( void *key )
+{
+	WAITREG *reg;
+	WAITBUCKET *bucket;
+
+	if (!registeredwaits)
+		return;
+
+	bucket = getwaitbucket (key);
+	pthread_mutex_lock (&bucket->lock);
+	for (reg = bucket->head; reg; reg = reg->bucketnext)
+		if (reg->key == key) {
+			reg->signaled = 1;
+			wakewaitthread (reg->waiter);
+		}
+	pthread_mutex_unlock (&bucket->lock);
+}
+
+static
+void callwaitcallback (WAITREG *reg, bool timedout)
+{
+	WAITREG *saved = currentwaitreg;
+
+	currentwaitreg = reg;
+	reg->callback (reg->context, timedout);
+	currentwaitreg = saved;
+
+	if (__sync_sub_and_fetch (&reg->running, 1) == 0)
+		futex_wake (&reg->running, INT32_MAX);
+	releasewaitreg (reg);
+}
+
+typedef struct WAITCALL_ {
+	WAITREG *reg;
+	bool timedout;
+} WAITCALL;
+
+static
+DWORD waitcallbackworker (void *param)
+{
+	WAITCALL call = *(WAITCALL*)param;
+
+	free (param);
+	callwaitcallback (call.reg, call.timedout);
+	return 0;
+}
+
+// called with the wait thread lock held, returns false when the callback is to be run by the caller
+static
+bool dispatchwait (WAITREG *reg, bool timedout)
+{
+	WAITCALL *call;
+	uintptr_t thread;
+
+	__sync_add_and_fetch (&reg->refcount, 1);
+	__sync_add_and_fetch (&reg->running, 1);
+
+	if (reg->flags & WT_EXECUTEONLYONCE)
+		reg->state = WAITREGDONE;
+
+	if ( !(reg->flags & WT_EXECUTEINWAITTHREAD) ) {
+		// the workers of _createthread are pooled, no thread is created normally
+		call = (WAITCALL*) malloc (sizeof(WAITCALL));
+		if (call) {
+			call->reg = reg;
+			call->timedout = timedout;
+			thread = _createthread( NULL, 0, waitcallbackworker, call, 0, NULL );
+			if (thread) {
+				_closehandle( thread );
+				return true;
+			}
+			free (call);
+		}
+	}
+
+	return false;
+}
+
+static
+DWORD waitthreadfunc (void *param)
+{
+	WAITTHREAD *waiter = (WAITTHREAD*)param;
+	WAITREG *reg;
+	WAITCALL inlinecalls[2 * WAITTHREADCAPACITY];
+	struct timespec now, timeout, *ptimeout;
+	unsigned i, ninline;
+	int wakeup;
+
+	for (;;) {
+		wakeup = waiter->wakeup;
+		ptimeout = NULL;
+		ninline = 0;
+
+		pthread_mutex_lock (&waiter->lock);
+		for (i = 0; i < waiter->count; ) {
+			reg = waiter->regs[i];
+
+			if (reg->state == WAITREGACTIVE && reg->signaled) {
+				reg->signaled = 0;
+				if (_waitforsingleobject( reg->object, 0 ) == WAIT_OBJECT_0) {
+					if (!dispatchwait (reg, false)) {
+						inlinecalls[ninline].reg = reg;
+						inlinecalls[ninline++].timedout = false;
+					}
+					if (reg->milliseconds != INFINITE)
+						_getmonotonicdeadline( reg->milliseconds, &reg->deadline );
+				}
+			}
+
+			if (reg->state == WAITREGACTIVE && reg->milliseconds != INFINITE) {
+				if ( !_getmonotonictimeout( &reg->deadline, &now ) ) {
+					if (!dispatchwait (reg, true)) {
+						inlinecalls[ninline].reg = reg;
+						inlinecalls[ninline++].timedout = true;
+					}
+					_getmonotonicdeadline( reg->milliseconds, &reg->deadline );
+					_getmonotonictimeout( &reg->deadline, &now );
+				}
+				if (reg->state == WAITREGACTIVE &&
+				    (!ptimeout || now.tv_sec < timeout.tv_sec ||
+				     (now.tv_sec == timeout.tv_sec && now.tv_nsec < timeout.tv_nsec))) {
+					timeout = now;
+					ptimeout = &timeout;
+				}
+			}
+
+			if (reg->state != WAITREGACTIVE) {
+				// keep the slots dense, the last one fills the hole
+				removefrombucket (reg);
+				waiter->regs[i] = waiter->regs[--waiter->count];
+				releasewaitreg (reg);
+				continue;
+			}
+			i++;
+		}
+		pthread_mutex_unlock (&waiter->lock);
+
+		// outside of the lock, a callback may unregister its wait
+		for (i = 0; i < ninline; i++)
+			callwaitcallback (inlinecalls[i].reg, inlinecalls[i].timedout);
+
+		futex_wait (&waiter->wakeup, wakeup, ptimeout);
+	}
+
+	return 0;
+}
+
+static
+WAITTHREAD* getwaitthread (void)
+{
+	WAITTHREAD *waiter;
+	uintptr_t thread;
+
+	for (waiter = waitthreads; waiter; waiter = waiter->next)
+		if (waiter->count < WAITTHREADCAPACITY)
+			return waiter;
+
+	waiter = (WAITTHREAD*) calloc (1, sizeof(WAITTHREAD));
+	if (!waiter) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return NULL;
+	}
+	pthread_mutex_init (&waiter->lock, NULL);
+
+	thread = _createthread( NULL, 0, waitthreadfunc, waiter, 0, NULL );
+	if (!thread) {
+		pthread_mutex_destroy (&waiter->lock);
+		free (waiter);
+		return NULL;
+	}
+	_closehandle( thread );
+
+	waiter->next = waitthreads;
+	waitthreads = waiter;
+	return waiter;
+}
+
+bool _registerwaitforsingleobject( uintptr_t *newwait, uintptr_t object,
+                                   WAITORTIMERCALLBACK callback, void *context,
+                                   unsigned milliseconds, unsigned flags )
+{
+	WAITREG *reg;
+	WAITTHREAD *waiter;
+
+	if ( !newwait || !callback || !object || object == (uintptr_t)INVALID_HANDLE_VALUE ) {
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	pthread_once (&waitbucketsonce, initwaitbuckets);
+
+	reg = (WAITREG*) calloc (1, sizeof(WAITREG));
+	if (!reg) {
+		_setlasterror( ERROR_NOT_ENOUGH_MEMORY );
+		return false;
+	}
+	reg->object       = object;
+	reg->key          = *(void**)object;
+	reg->callback     = callback;
+	reg->context      = context;
+	reg->milliseconds = milliseconds;
+	reg->flags        = flags;
+	reg->signaled     = 1;		//the object may already be signalled
+	reg->refcount     = 2;
+	if (milliseconds != INFINITE)
+		_getmonotonicdeadline( milliseconds, &reg->deadline );
+
+	pthread_mutex_lock (&waitpoollock);
+	waiter = getwaitthread ();
+	if (!waiter) {
+		pthread_mutex_unlock (&waitpoollock);
+		free (reg);
+		return false;
+	}
+	reg->waiter = waiter;
+
+	__sync_add_and_fetch (&registeredwaits, 1);
+	addtobucket (reg);
+
+	pthread_mutex_lock (&waiter->lock);
+	waiter->regs[waiter->count++] = reg;
+	pthread_mutex_unlock (&waiter->lock);
+	pthread_mutex_unlock (&waitpoollock);
+
+	wakewaitthread (waiter);
+
+	*newwait = (uintptr_t)reg;
+	return true;
+}
+
+// completion is NULL to return at once, or INVALID_HANDLE_VALUE to wait for the running callbacks
+bool _unregisterwaitex( uintptr_t waithandle, uintptr_t completion )
+{
+	WAITREG *reg = (WAITREG*)waithandle;
+	WAITTHREAD *waiter;
+	int running, self;
+
+	if ( !reg ) {
+		_setlasterror( ERROR_INVALID_HANDLE );
+		return false;
+	}
+	if ( completion && completion != (uintptr_t)INVALID_HANDLE_VALUE ) {
+		//TODO: signal an event object when there are events
+		_setlasterror( ERROR_INVALID_PARAMETER );
+		return false;
+	}
+
+	waiter = reg->waiter;
+
+	// no callback is dispatched after this
+	pthread_mutex_lock (&waiter->lock);
+	reg->state = WAITREGCANCELLED;
+	pthread_mutex_unlock (&waiter->lock);
+	removefrombucket (reg);
+	__sync_sub_and_fetch (&registeredwaits, 1);
+	wakewaitthread (waiter);
+
+	// a callback unregistering its own wait does not wait for itself
+	self = (currentwaitreg == reg);
+	running = reg->running;
+
+	if ( completion == (uintptr_t)INVALID_HANDLE_VALUE ) {
+		while ((running = reg->running) > self)
+			futex_wait (&reg->running, running, NULL);
+	}
+
+	releasewaitreg (reg);
+
+	if ( running > self ) {
+		_setlasterror( ERROR_IO_PENDING );
+		return false;
+	}
+	return true;
+}
+
+bool _unregisterwait( uintptr_t waithandle )
+{
+	return _unregisterwaitex( waithandle, (uintptr_t)NULL );
+}